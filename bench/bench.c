@@ -0,0 +1,1296 @@
+/**
+ * bench.c - Times each phase of a launch, on a POSIX host.
+ *
+ * Builds the launcher as a library on top of the stand-ins in compat.h,
+ * lays out a fake Cygwin install and virtualenv under a temporary folder,
+ * and then times:
+ *
+ *   root_discovery      Finding bin\python.exe, reading the Cygwin root
+ *                       from the registry and building PATH.
+ *   symlink_resolution  Following a 5-hop chain of Cygwin symlinks, mixing
+ *                       absolute and relative targets.
+ *   argv_rewrite/N      Classifying and converting N arguments. Past
+ *                       BATCH_PARALLEL_MIN, on as many threads as we have
+ *                       cores for.
+ *   argv_serial/N       The same, on our own thread only.
+ *   argv_scalar/N       The same, with simd.c's plain C kernels.
+ *   env_rewrite         Converting a long PYTHONPATH, and PYTHONSTARTUP.
+ *   cmdline_build/N     Quoting N converted arguments into a command line.
+ *   simd_length/K       simd.c's kernels, (K being scalar, sse2 or avx2)
+ *   simd_flip/K         run over our long PYTHONPATH.
+ *   utf8_decode/T       The same PYTHONPATH, from a home folder with a
+ *   utf8_encode/T       U+00FC in it, through util.c's transcoder (T being
+ *                       ours) or sized and converted by the CRT's mbstowcs
+ *                       and wcstombs in a UTF-8 locale. (T being crt)
+ *   relay_feed/K        4MB of our interpreter's output through relay.c,
+ *                       K being plain (no paths in it) or paths. (Tracebacks
+ *                       full of /cygdrive/c and /usr/lib paths)
+ *   relay/K             The same, written to a pipe by a fake interpreter,
+ *                       (/bin/cat) relayed by os_handoff to /dev/null.
+ *   pool/K              Running an empty script with a real interpreter,
+ *                       (/usr/bin/python3) K being cold (started by
+ *                       os_handoff, in a child of ours) or warm. (Handed to
+ *                       one of a pool's interpreters by os_pool_handoff)
+ *                       Left out if there's no interpreter to run.
+ *   resolver/K          Converting a launch's worth of paths that our mount
+ *                       table can't do, with our stand-in cygwin1.dll, K
+ *                       being inproc (loaded by our own batch_run) or
+ *                       service. (Sent to a resolver of ours, through a
+ *                       connection of their own, the way a launch would)
+ *   resolver_load/N     The same, with N clients, each in a process of its
+ *                       own, all sending requests to our resolver at once.
+ *                       Its iterations are requests, and it has a p99, and
+ *                       the requests per second it got through.
+ *
+ * Everything each phase allocates is given back between runs, the same
+ * way the launcher gives it back before handing over. Results go to
+ * stdout as JSON, one entry per phase, with times in nanoseconds:
+ *
+ *   { "unit": "ns", "results": [ { "name": .., "iterations": ..,
+ *     "min": .., "median": .., "mean": .., "max": .. }, .. ] }
+ *
+ * Before timing anything, our mount table is checked against conversions
+ * recorded from cygwin1.dll, each of simd.c's kernels against its
+ * plain C version, over every length and alignment up to a few registers'
+ * worth, and our transcoder against the CRT's. Our relay is checked over
+ * every way of splitting some sample output up, our command lines against
+ * how the MSVC runtime splits them back up, and our resolver's answers
+ * against our own.
+ *
+ * Build and run it with `python build.py bench`. An argument, if given,
+ * only runs the phases with that in their name.
+ *
+ * With --train, nothing is checked or timed. Instead, it goes through
+ * BENCH_TRAIN_LAUNCHES launches for a profiling build to learn from, (See
+ * `python build.py pgo`) each one finding its target, following our
+ * symlink chain and converting its arguments, (anything from none to
+ * BENCH_MAX_ARGS of them) with every other one rewriting a long PYTHONPATH
+ * as well.
+ */
+
+#define LAUNCHER_LIBRARY
+// Our cache would make every phase after the first free.
+#define WITHOUT_CACHE
+// We run a pool of our own, for pool/warm, and a resolver, for resolver/service.
+#define POOL_BROKER
+#define RESOLVER_SERVICE
+#include "../src/main.c"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <locale.h>
+#include <signal.h>
+#include <time.h>
+
+/**
+ * Conversions recorded with cygpath (which is cygwin_conv_path underneath)
+ * on a Cygwin install at C:\cygwin64, with sCorpusFstab in its etc\fstab
+ * and sCorpusUserFstab in etc\fstab.d\bench. Each pair converts both
+ * ways unless it says otherwise. (cygpath -u C:\\ keeps the drive's slash
+ * that /cygdrive/c goes without, and -u takes slashes that -w never gives)
+ */
+#define BENCH_BOTH		0
+#define BENCH_TO_POSIX	1
+#define BENCH_TO_WIN	2
+
+typedef struct { const wchar_t* win; const wchar_t* posix; bool islist; int ways; } bench_conversion;
+
+static const char sCorpusFstab[] =
+	"# /etc/fstab\n"
+	"none /cygdrive cygdrive binary,posix=0,user 0 0\n"
+	"C:/Program\\040Files/Common\\040Files /common ntfs binary 0 0\n";
+static const char sCorpusUserFstab[] =
+	"D:/work /work ntfs binary,user 0 0\n";
+
+static const bench_conversion sCorpus[] = {
+	{ L"C:\\cygwin64",								L"/",										false,	BENCH_BOTH },
+	{ L"C:\\cygwin64\\bin",							L"/usr/bin",								false,	BENCH_BOTH },
+	{ L"C:\\cygwin64\\bin\\python2.7.exe",		L"/usr/bin/python2.7.exe",					false,	BENCH_BOTH },
+	{ L"C:\\cygwin64\\lib\\python2.7\\os.py",	L"/usr/lib/python2.7/os.py",				false,	BENCH_BOTH },
+	{ L"C:\\cygwin64\\home\\bench\\.bashrc",	L"/home/bench/.bashrc",						false,	BENCH_BOTH },
+	{ L"C:\\cygwin64\\usr\\share\\doc",			L"/usr/share/doc",							false,	BENCH_BOTH },
+	{ L"C:\\",										L"/cygdrive/c/",							false,	BENCH_BOTH },
+	{ L"C:\\",										L"/cygdrive/c",								false,	BENCH_TO_WIN },
+	{ L"D:\\",										L"/cygdrive/d/",							false,	BENCH_BOTH },
+	{ L"C:\\Users\\bench\\project\\main.py",	L"/cygdrive/c/Users/bench/project/main.py",	false,	BENCH_BOTH },
+	{ L"C:/Users/bench/project/main.py",				L"/cygdrive/c/Users/bench/project/main.py",	false,	BENCH_TO_POSIX },
+	{ L"E:\\data\\..\\input.csv",					L"/cygdrive/e/input.csv",					false,	BENCH_TO_POSIX },
+	{ L"\\\\server\\share\\datasets\\train.json",	L"//server/share/datasets/train.json",	false,	BENCH_BOTH },
+	{ L"C:\\Program Files\\Common Files",			L"/common",									false,	BENCH_BOTH },
+	{ L"C:\\Program Files\\Common Files\\a b.ini",	L"/common/a b.ini",						false,	BENCH_BOTH },
+	{ L"C:\\Program Files\\Python",					L"/cygdrive/c/Program Files/Python",		false,	BENCH_BOTH },
+	{ L"D:\\work",									L"/work",									false,	BENCH_BOTH },
+	{ L"D:\\work\\src\\app.py",					L"/work/src/app.py",						false,	BENCH_BOTH },
+	{ L"D:\\workshop\\a.py",						L"/cygdrive/d/workshop/a.py",				false,	BENCH_BOTH },
+	{ L"C:\\a;D:\\work\\b;C:\\cygwin64\\lib",	L"/cygdrive/c/a:/work/b:/usr/lib",			true,	BENCH_BOTH },
+	{ L"\\\\server\\share;C:\\Program Files\\Common Files\\x",	L"//server/share:/common/x",	true,	BENCH_BOTH },
+	{ NULL, NULL, false, 0 }
+};
+
+/** Workload sizes */
+#define BENCH_PYTHONPATH_ENTRIES	256
+#define BENCH_MAX_ARGS				10000
+#define BENCH_SIMD_MAX				256
+
+#define BENCH_RELAY_SIZE			(4 * 1024 * 1024)
+#define BENCH_POOL_SIZE				4
+#define BENCH_RESOLVER_CLIENTS		64
+#define BENCH_RESOLVER_REQUESTS		100 // Per client.
+
+/** How many launches --train runs, and how many arguments each gets, in turn. */
+#define BENCH_TRAIN_LAUNCHES		1400
+static const int sTrainArgs[] = { 0, 2, 1, 16, 0, 4, 64, 1, 3, 256, 0, 8, 1024, BENCH_MAX_ARGS };
+
+/** Whose UTF-8 conversions utf8_decode/utf8_encode time. */
+#define BENCH_CRT	0
+#define BENCH_OURS	1
+
+/** Our fixture. All of these are Windows paths, on our stand-in C: drive. */
+#define BENCH_CYGROOT		L"C:\\cygwin"
+#define BENCH_VENV			L"C:\\venv"
+#define BENCH_LAUNCHER		BENCH_VENV L"\\Scripts\\python.exe"
+#define BENCH_TARGET		BENCH_VENV L"\\bin\\python.exe"
+#define BENCH_INTERPRETER	BENCH_CYGROOT L"\\bin\\python2.7.exe"
+
+static char sDrives[MAX_PATH+1] = "";
+
+/** Stays around for the whole run, outside of our arena. */
+static wchar_t sParentDir[MAX_PATH+1] = BENCH_VENV;
+static wchar_t sCygRoot[MAX_PATH+1] = BENCH_CYGROOT;
+static wchar_t* sArgs[BENCH_MAX_ARGS+1];
+static wchar_t* sConverted[BENCH_MAX_ARGS+1];
+static wchar_t sPythonPath[MAX_ENV+1];
+static wchar_t sFlipped[MAX_ENV+1];
+static wchar_t sText[MAX_ENV+1];
+static char sText8[UTF8_MAX(MAX_ENV+1)], sEncoded[UTF8_MAX(MAX_ENV+1)];
+static size_t szText, szText8;
+static char* sRelayText[2];
+static char sRelayOut[1024];
+static size_t szRelayOut;
+static wchar_t sPython[] = L"/usr/bin/python3";
+static wchar_t sPoolScript[MAX_PATH+1];
+static pid_t pool_broker = 0;
+static pid_t resolver_service = 0;
+
+/** A launch's worth of paths for our resolver: arguments elsewhere on C:, and a list. */
+static const wchar_t* sResolverPaths[] = {
+	L"C:\\Users\\bench\\project\\main.py",
+	L"C:\\Users\\bench\\project\\tests\\test_main.py",
+	L"C:\\Users\\bench\\project\\data\\input.csv",
+	L"C:\\Users\\bench\\project\\data\\output.csv",
+	L"C:\\Program Files\\Common Files\\config.ini",
+	L"\\\\server\\share\\datasets\\train.json",
+	L"C:\\Users\\bench\\AppData\\Local\\Temp\\scratch",
+	L"C:\\Users\\bench\\project;C:\\Users\\bench\\lib;C:\\Users\\bench\\vendor",
+	NULL
+};
+#define BENCH_RESOLVER_LIST	7 // Which of sResolverPaths is a list.
+
+typedef struct {
+	const char* name;
+	int iterations;
+	void (*setup)(int param);
+	void (*run)(int param);
+	int param;
+} bench_case;
+
+static void bench_fail(const char* message, const char* detail)
+{
+	fprintf(stderr, "bench: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+	exit(1);
+}
+
+/* Fixture */
+static void bench_path(char* out, const char* rest)
+{
+	if(snprintf(out, MAX_PATH+1, "%s/c/%s", sDrives, rest) > MAX_PATH) bench_fail("Path too long", rest);
+}
+
+static void bench_mkdir(const char* rest)
+{
+	char sPath[MAX_PATH+1];
+	bench_path(sPath, rest);
+	if(mkdir(sPath, 0755) != 0) bench_fail("Could not create folder", sPath);
+}
+
+static void bench_write(const char* rest, const void* data, size_t size, mode_t mode)
+{
+	char sPath[MAX_PATH+1];
+	FILE* fp;
+	bench_path(sPath, rest);
+	if(!(fp = fopen(sPath, "wb")) || fwrite(data, 1, size, fp) != size || fclose(fp) != 0) {
+		bench_fail("Could not write", sPath);
+	}
+	if(chmod(sPath, mode) != 0) bench_fail("Could not chmod", sPath);
+}
+
+/**
+ * Write a Cygwin symlink: !<symlink>, a BOM and a UTF-16 target, with the
+ * sticky bit standing in for the SYSTEM attribute.
+ */
+static void bench_symlink(const char* rest, const char* target)
+{
+	byte buffer[MAX_PATH * 2 + 16];
+	size_t size = sizeof(cyglink_sig), i;
+	struct stat st;
+	char sPath[MAX_PATH+1];
+
+	memcpy(buffer, cyglink_sig, sizeof(cyglink_sig));
+	buffer[size++] = 0xff;
+	buffer[size++] = 0xfe;
+	for(i = 0; i <= strlen(target); i++) {
+		buffer[size++] = (byte)target[i];
+		buffer[size++] = 0;
+	}
+	bench_write(rest, buffer, size, 01644);
+
+	bench_path(sPath, rest);
+	if(stat(sPath, &st) != 0 || !(st.st_mode & S_ISVTX)) bench_fail("Could not set the sticky bit on", sPath);
+}
+
+static void bench_fixture()
+{
+	static const char fstab[] =
+		"# Like a default install\n"
+		"none /cygdrive cygdrive binary,posix=0,user 0 0\n";
+	char sPath[MAX_PATH+1];
+	char* tmp = getenv("TMPDIR");
+
+	snprintf(sDrives, MAX_PATH+1, "%s/cyglaunch-bench-XXXXXX", tmp ? tmp : "/tmp");
+	if(!mkdtemp(sDrives)) bench_fail("Could not create our fixture", sDrives);
+	bench_mkdir("");
+	bench_mkdir("Windows");
+	bench_mkdir("Windows/System32");
+
+	bench_mkdir("cygwin");
+	bench_mkdir("cygwin/etc");
+	bench_mkdir("cygwin/bin");
+	bench_write("cygwin/etc/fstab", fstab, sizeof(fstab) - 1, 0644);
+	bench_write("cygwin/bin/python2.7.exe", "MZ", 2, 0755);
+
+	bench_mkdir("venv");
+	bench_mkdir("venv/Scripts");
+	bench_mkdir("venv/bin");
+	bench_mkdir("venv/data");
+	bench_mkdir("venv/sub");
+	bench_write("venv/Scripts/python.exe", "MZ", 2, 0755);
+
+	// python.exe -> hop1 -> hop2 -> hop3 -> hop4 -> python2.7.exe
+	bench_symlink("venv/bin/python.exe", "/usr/bin/python-hop1");
+	bench_symlink("cygwin/bin/python-hop1", "python-hop2");
+	bench_symlink("cygwin/bin/python-hop2", "/cygdrive/c/cygwin/bin/python-hop3");
+	bench_symlink("cygwin/bin/python-hop3", "../bin/python-hop4");
+	bench_symlink("cygwin/bin/python-hop4", "python2.7.exe");
+
+	setenv("CYGLAUNCH_STANDIN_DRIVES", sDrives, 1);
+	setenv("CYGLAUNCH_STANDIN_CYGROOT", "C:\\cygwin", 1);
+	// Relative paths are relative to the venv.
+	bench_path(sPath, "venv");
+	if(chdir(sPath) != 0) bench_fail("Could not change to", sPath);
+}
+
+static int bench_remove(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+	return remove(path);
+}
+
+static void bench_cleanup()
+{
+	if(chdir("/") != 0 || nftw(sDrives, bench_remove, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+		fprintf(stderr, "bench: Could not remove %s\n", sDrives);
+	}
+}
+
+/**
+ * Arguments, the way they'd come from a shell: a script, then a mix of
+ * options, absolute paths, option values, relative paths with
+ * backslashes and plain words.
+ */
+static void bench_args()
+{
+	wchar_t sArg[MAX_PATH+1];
+	int i;
+
+	sArgs[0] = BENCH_TARGET;
+	sArgs[1] = BENCH_VENV L"\\script.py";
+	for(i = 2; i <= BENCH_MAX_ARGS; i++) {
+		switch(i % 5) {
+			case 0: swprintf(sArg, MAX_PATH+1, L"%ls\\data\\file%d.txt", BENCH_VENV, i); break;
+			case 1: swprintf(sArg, MAX_PATH+1, L"--output=%ls\\data\\out%d", BENCH_VENV, i); break;
+			case 2: swprintf(sArg, MAX_PATH+1, L"sub\\item%d", i); break;
+			case 3: swprintf(sArg, MAX_PATH+1, L"-v"); break;
+			default: swprintf(sArg, MAX_PATH+1, L"name with spaces %d", i); break;
+		}
+		if(!(sArgs[i] = wcsdup(sArg))) bench_fail("Out of memory", NULL);
+	}
+}
+
+static void bench_pythonpath()
+{
+	size_t n = 0;
+	int i;
+	for(i = 0; i < BENCH_PYTHONPATH_ENTRIES; i++) {
+		n += swprintf(&(sPythonPath[n]), MAX_ENV+1 - n, L"%ls%ls\\lib\\site-packages\\package%d",
+			i ? L";" : L"", BENCH_VENV, i);
+	}
+}
+
+/** Our PYTHONPATH again, from a home folder that isn't all ASCII. Keeps a UTF-8 copy. */
+static void bench_text()
+{
+	size_t n = 0;
+	int i;
+	for(i = 0; i < BENCH_PYTHONPATH_ENTRIES; i++) {
+		n += swprintf(&(sText[n]), MAX_ENV+1 - n, L"%lsC:\\Users\\J\u00fcrgen\\venv\\lib\\site-packages\\package%d",
+			i ? L";" : L"", i);
+	}
+	szText = n + 1;
+	if((szText8 = utf8_encode(sText, szText, sText8, sizeof(sText8))) == UTF_INVALID) {
+		bench_fail("Could not encode our text", NULL);
+	}
+}
+
+/**
+ * What our interpreter might print, with (BENCH_PATHS) and without
+ * (BENCH_PLAIN) paths in it. Also written to relay-K.txt, for our fake
+ * interpreter to print.
+ */
+#define BENCH_PLAIN	0
+#define BENCH_PATHS	1
+
+static void bench_relay_text()
+{
+	static const char* names[2] = { "relay-plain.txt", "relay-paths.txt" };
+	size_t n;
+	int k, i;
+
+	for(k = BENCH_PLAIN; k <= BENCH_PATHS; k++) {
+		if(!(sRelayText[k] = (char*)malloc(BENCH_RELAY_SIZE + 256))) bench_fail("Out of memory", NULL);
+		for(n = 0, i = 0; n < BENCH_RELAY_SIZE; i++) {
+			if(k == BENCH_PLAIN) {
+				n += sprintf(&(sRelayText[k][n]), "test_case_%d (tests.test_module.TestModule) ... ok, 1 of %d passed\n", i, i + 1);
+			} else if(i % 3 == 0) {
+				n += sprintf(&(sRelayText[k][n]), "  File \"/cygdrive/c/venv/lib/site-packages/package%d/module.py\", line %d, in run\n", i, i);
+			} else if(i % 3 == 1) {
+				n += sprintf(&(sRelayText[k][n]), "    return self.fn(*args, **kwargs)\n");
+			} else {
+				n += sprintf(&(sRelayText[k][n]), "/usr/lib/python2.7/unittest/case.py:%d: AssertionError\n", i);
+			}
+		}
+		bench_write(names[k], sRelayText[k], BENCH_RELAY_SIZE, 0644);
+	}
+}
+
+/**
+ * Starts a pool for our virtualenv, of real interpreters this time, since
+ * starting one is what it saves us. Leaves pool_broker 0 if there's no
+ * interpreter to pool.
+ */
+#define BENCH_COLD	0
+#define BENCH_WARM	1
+
+static void bench_pool_start()
+{
+	static pool_settings settings;
+	char sPath[MAX_PATH+1], *python = os_narrow(sPython);
+
+	if(access(python, X_OK) != 0) {
+		fprintf(stderr, "bench: No %s, so no pool phases\n", python);
+		free(python);
+		return;
+	}
+	free(python);
+	bench_write("venv/pool.py", "", 0, 0644);
+	bench_path(sPath, "venv/pool.py");
+	swprintf(sPoolScript, MAX_PATH+1, L"%hs", sPath);
+
+	SetEnvironmentVariableW(L"CYGLAUNCH_POOL", L"venv");
+	pool_init(sParentDir);
+	SetEnvironmentVariableW(L"CYGLAUNCH_POOL", NULL);
+	settings.launcher = sPython;
+	settings.size = BENCH_POOL_SIZE;
+	settings.idle = 3600 * 1000;
+	settings.failures = 0;
+	fflush(stdout);
+	fflush(stderr);
+	if((pool_broker = fork()) == 0) _exit(os_pool_serve(&settings));
+	if(pool_broker < 0) bench_fail("Could not start our pool", NULL);
+	// Untimed, like the rest of our setup.
+	sleep(1);
+}
+
+static void bench_pool_stop()
+{
+	if(pool_broker <= 0) return;
+	kill(pool_broker, SIGTERM);
+	waitpid(pool_broker, NULL, 0);
+}
+
+/** Forget everything the last run worked out. */
+static void bench_reset()
+{
+	arena_release();
+	// Only resolver/service wants our resolver. Like a launch, it connects anew each time.
+	os_resolver_close();
+	resolver_unavailable = true;
+	#ifndef WITHOUT_MOUNTS
+	mounts = NULL;
+	#endif
+	virtRootCyg = NULL;
+	realPathCyg = NULL;
+	env_block = NULL;
+	hCygwin = NULL;
+	cygwin_unavailable = false;
+	cygRootWin = sCygRoot;
+	virtRootWin = sParentDir;
+	SetEnvironmentVariableW(L"VIRTUAL_ENV", NULL);
+	SetEnvironmentVariableW(L"PYTHONPATH", NULL);
+	SetEnvironmentVariableW(L"PYTHONSTARTUP", NULL);
+	SetEnvironmentVariableW(L"CYGLAUNCH_THREADS", NULL);
+	simd_use(SIMD_AVX2);
+	setlocale(LC_CTYPE, "C");
+	SetEnvironmentVariableW(L"CYGLAUNCH_RELAY", NULL);
+}
+
+/**
+ * Converts sResolverPaths, through our resolver unless resolver_unavailable
+ * is set, (or it doesn't answer) leaving the results in batch. Fails if any
+ * of them couldn't be converted.
+ */
+#define BENCH_INPROC	0
+#define BENCH_SERVICE	1
+
+static void bench_resolver_batch(path_batch* batch)
+{
+	int i;
+
+	batch_init(batch, MOUNT_WIN_TO_POSIX);
+	for(i = 0; sResolverPaths[i]; i++) batch_add(batch, sResolverPaths[i], wcslen(sResolverPaths[i]), i == BENCH_RESOLVER_LIST);
+	if(batch_run(batch)) bench_fail("Could not convert our resolver's paths", NULL);
+}
+
+/**
+ * Starts a resolver for our fixture's Cygwin root, and makes sure it
+ * answers the same way our own stand-in cygwin1.dll does.
+ */
+static void bench_resolver_start()
+{
+	struct timespec ts = { 0, 10 * 1000 * 1000 };
+	path_batch ours, theirs;
+	int i, tries;
+
+	bench_reset();
+	if(!resolver_init()) bench_fail("Could not name our resolver", NULL);
+	fflush(stdout);
+	fflush(stderr);
+	if((resolver_service = fork()) == 0) {
+		if(!setup_cygwin()) _exit(1);
+		arena_release();
+		_exit(os_resolver_serve(0));
+	}
+	if(resolver_service < 0) bench_fail("Could not start our resolver", NULL);
+
+	bench_resolver_batch(&ours);
+	for(tries = 0; tries < 100; tries++) {
+		resolver_unavailable = false;
+		hCygwin = NULL;
+		bench_resolver_batch(&theirs);
+		if(!hCygwin) break;
+		// Not listening yet.
+		nanosleep(&ts, NULL);
+	}
+	if(hCygwin) bench_fail("Our resolver never answered", NULL);
+	for(i = 0; sResolverPaths[i]; i++) {
+		if(wcscmp(batch_result(&ours, i), batch_result(&theirs, i)) != 0) {
+			bench_fail("Our resolver converted a path differently", NULL);
+		}
+	}
+	bench_reset();
+}
+
+static void bench_resolver_stop()
+{
+	if(resolver_service <= 0) return;
+	kill(resolver_service, SIGTERM);
+	waitpid(resolver_service, NULL, 0);
+}
+
+/* Phases */
+static void setup_none(int param)
+{
+}
+
+static void run_root_discovery(int param)
+{
+	wchar_t sExecutable[MAX_PATH+1] = BENCH_LAUNCHER,
+			sParent[MAX_PATH+1] = EMPTYW,
+			sTarget[MAX_PATH+1] = EMPTYW,
+			sRoot[MAX_PATH+1] = EMPTYW,
+			sPATH[MAX_ENV+1] = EMPTYW;
+
+	find_target(sExecutable, wcslen(sExecutable), sParent, sTarget);
+	get_cygwin_root(sRoot, MAX_PATH+1);
+	build_path_var(sParent, sRoot, sPATH);
+}
+
+static void setup_conversion(int param)
+{
+	if(!setup_path_conversion()) bench_fail("Could not set up path conversion", NULL);
+}
+
+static void run_symlink_resolution(int param)
+{
+	real_path(BENCH_TARGET);
+}
+
+static void setup_argv_rewrite(int param)
+{
+	setup_conversion(param);
+	real_path(BENCH_TARGET);
+}
+
+static void run_argv_rewrite(int param)
+{
+	fix_argv(param + 1, sArgs, true, args_profile(BENCH_LAUNCHER));
+}
+
+static void setup_argv_serial(int param)
+{
+	setup_argv_rewrite(param);
+	SetEnvironmentVariableW(L"CYGLAUNCH_THREADS", L"1");
+}
+
+static void setup_argv_scalar(int param)
+{
+	setup_argv_rewrite(param);
+	simd_use(SIMD_SCALAR);
+}
+
+/** Anything past what this CPU has times the best it does have. (See bench_simd_check's output) */
+static void setup_simd(int param)
+{
+	simd_use(param);
+}
+
+static void run_simd_length(int param)
+{
+	int i;
+	for(i = 0; i < 100; i++) simd_length(sPythonPath);
+}
+
+static void run_simd_flip(int param)
+{
+	size_t n = wcslen(sPythonPath);
+	int i;
+	for(i = 0; i < 100; i++) simd_flip(sFlipped, sPythonPath, n, L'\\', L'/');
+}
+
+/** The CRT's need a UTF-8 locale, and a pass to size the result, the way we used them. */
+static void setup_utf8(int param)
+{
+	if(param == BENCH_CRT && !setlocale(LC_CTYPE, "C.UTF-8")) bench_fail("No UTF-8 locale to time the CRT in", NULL);
+}
+
+static void run_utf8_decode(int param)
+{
+	int i;
+	for(i = 0; i < 100; i++) {
+		if(param == BENCH_CRT) {
+			if(mbstowcs(NULL, sText8, 0) != (size_t)-1) mbstowcs(sFlipped, sText8, MAX_ENV+1);
+		} else {
+			utf8_decode(sText8, szText8, sFlipped, MAX_ENV+1);
+		}
+	}
+}
+
+static void run_utf8_encode(int param)
+{
+	int i;
+	for(i = 0; i < 100; i++) {
+		if(param == BENCH_CRT) {
+			if(wcstombs(NULL, sText, 0) != (size_t)-1) wcstombs(sEncoded, sText, sizeof(sEncoded));
+		} else {
+			utf8_encode(sText, szText, sEncoded, sizeof(sEncoded));
+		}
+	}
+}
+
+static bool bench_null_sink(void* context, const char* data, size_t count)
+{
+	return true;
+}
+
+static void run_relay_feed(int param)
+{
+	relay_stream* rs = (relay_stream*)malloc(sizeof(relay_stream));
+	size_t pos, n, room;
+	char* space;
+
+	if(!rs) bench_fail("Out of memory", NULL);
+	relay_init(rs, mounts, bench_null_sink, NULL);
+	for(pos = 0; pos < BENCH_RELAY_SIZE; pos += n) {
+		space = relay_space(rs, &room);
+		n = BENCH_RELAY_SIZE - pos < room ? BENCH_RELAY_SIZE - pos : room;
+		memcpy(space, &(sRelayText[param][pos]), n);
+		relay_feed(rs, n);
+	}
+	relay_flush(rs);
+	free(rs);
+}
+
+static void setup_relay(int param)
+{
+	setup_conversion(param);
+	SetEnvironmentVariableW(L"CYGLAUNCH_RELAY", L"1");
+}
+
+static void run_relay(int param)
+{
+	wchar_t sFile[MAX_PATH+1], *args[3] = { L"/bin/cat", sFile, NULL };
+	char sPath[MAX_PATH+1];
+	int null, out;
+
+	bench_path(sPath, param == BENCH_PLAIN ? "relay-plain.txt" : "relay-paths.txt");
+	swprintf(sFile, MAX_PATH+1, L"%hs", sPath);
+	fflush(stdout);
+	if((null = open("/dev/null", O_WRONLY)) < 0 || (out = dup(STDOUT_FILENO)) < 0 || dup2(null, STDOUT_FILENO) < 0) {
+		bench_fail("Could not redirect our stdout", NULL);
+	}
+	if(os_handoff(os_prepare(args[0], 2, args, NULL), HANDOFF_WAIT) != 0) bench_fail("Our fake interpreter failed", sPath);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+	close(null);
+}
+
+static void setup_pool(int param)
+{
+	struct timespec ts = { 0, 100 * 1000 * 1000 };
+	// Give our pool time to replace whichever interpreter took the last launch.
+	if(param == BENCH_WARM) nanosleep(&ts, NULL);
+}
+
+static void run_pool(int param)
+{
+	wchar_t* args[3] = { sPython, sPoolScript, NULL };
+	int status = -1;
+	pid_t pid;
+
+	if(param == BENCH_WARM) {
+		if(!os_pool_handoff(2, args, NULL, &status)) bench_fail("Our pool didn't take our launch", NULL);
+	} else {
+		fflush(stdout);
+		if((pid = fork()) == 0) _exit(os_handoff(os_prepare(args[0], 2, args, NULL), HANDOFF_WAIT));
+		if(pid < 0 || waitpid(pid, &status, 0) != pid) bench_fail("Could not start our interpreter", NULL);
+		status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+	}
+	if(status != 0) bench_fail("Our interpreter failed", NULL);
+}
+
+static void setup_resolver(int param)
+{
+	resolver_unavailable = param != BENCH_SERVICE;
+}
+
+static void run_resolver(int param)
+{
+	path_batch batch;
+	bench_resolver_batch(&batch);
+	if((param == BENCH_SERVICE) != (hCygwin == NULL)) bench_fail("Our paths weren't converted where they should've been", NULL);
+}
+
+static void setup_env_rewrite(int param)
+{
+	setup_conversion(param);
+	SetEnvironmentVariableW(L"PYTHONPATH", sPythonPath);
+	SetEnvironmentVariableW(L"PYTHONSTARTUP", BENCH_VENV L"\\startup.py");
+}
+
+static void run_env_rewrite(int param)
+{
+	path_batch batch;
+	static env_state env;
+
+	batch_init(&batch, MOUNT_WIN_TO_POSIX);
+	fix_env_collect(&batch, &env);
+	batch_run(&batch);
+	fix_env(&batch, &env);
+	batch_free(&batch);
+}
+
+static void run_cmdline_build(int param)
+{
+	wchar_t* cmdline = (wchar_t*)malloc(cmdline_length(param + 1, sConverted) * sizeof(wchar_t));
+	if(!cmdline) bench_fail("Out of memory", NULL);
+	cmdline_write(param + 1, sConverted, cmdline);
+	free(cmdline);
+}
+
+static const bench_case cases[] = {
+	{ "root_discovery",			2000,	setup_none,			run_root_discovery,		0 },
+	{ "symlink_resolution",		2000,	setup_conversion,	run_symlink_resolution,	5 },
+	{ "argv_rewrite/1",			2000,	setup_argv_rewrite,	run_argv_rewrite,		1 },
+	{ "argv_rewrite/100",		500,	setup_argv_rewrite,	run_argv_rewrite,		100 },
+	{ "argv_rewrite/10000",		20,		setup_argv_rewrite,	run_argv_rewrite,		10000 },
+	{ "argv_serial/10000",		20,		setup_argv_serial,	run_argv_rewrite,		10000 },
+	{ "argv_scalar/10000",		20,		setup_argv_scalar,	run_argv_rewrite,		10000 },
+	{ "env_rewrite",			500,	setup_env_rewrite,	run_env_rewrite,		BENCH_PYTHONPATH_ENTRIES },
+	{ "cmdline_build/1",		20000,	setup_none,			run_cmdline_build,		1 },
+	{ "cmdline_build/100",		5000,	setup_none,			run_cmdline_build,		100 },
+	{ "cmdline_build/10000",	100,	setup_none,			run_cmdline_build,		10000 },
+	{ "simd_length/scalar",		500,	setup_simd,			run_simd_length,		SIMD_SCALAR },
+	{ "simd_length/sse2",		500,	setup_simd,			run_simd_length,		SIMD_SSE2 },
+	{ "simd_length/avx2",		500,	setup_simd,			run_simd_length,		SIMD_AVX2 },
+	{ "simd_flip/scalar",		500,	setup_simd,			run_simd_flip,			SIMD_SCALAR },
+	{ "simd_flip/sse2",			500,	setup_simd,			run_simd_flip,			SIMD_SSE2 },
+	{ "simd_flip/avx2",			500,	setup_simd,			run_simd_flip,			SIMD_AVX2 },
+	{ "utf8_decode/crt",		500,	setup_utf8,			run_utf8_decode,		BENCH_CRT },
+	{ "utf8_decode/ours",		500,	setup_utf8,			run_utf8_decode,		BENCH_OURS },
+	{ "utf8_encode/crt",		500,	setup_utf8,			run_utf8_encode,		BENCH_CRT },
+	{ "utf8_encode/ours",		500,	setup_utf8,			run_utf8_encode,		BENCH_OURS },
+	{ "relay_feed/plain",		50,		setup_conversion,	run_relay_feed,			BENCH_PLAIN },
+	{ "relay_feed/paths",		50,		setup_conversion,	run_relay_feed,			BENCH_PATHS },
+	{ "relay/plain",			20,		setup_relay,		run_relay,				BENCH_PLAIN },
+	{ "relay/paths",			20,		setup_relay,		run_relay,				BENCH_PATHS },
+	{ "pool/cold",				50,		setup_pool,			run_pool,				BENCH_COLD },
+	{ "pool/warm",				50,		setup_pool,			run_pool,				BENCH_WARM },
+	{ "resolver/inproc",		2000,	setup_resolver,		run_resolver,			BENCH_INPROC },
+	{ "resolver/service",		2000,	setup_resolver,		run_resolver,			BENCH_SERVICE },
+	{ NULL, 0, NULL, NULL, 0 }
+};
+
+/**
+ * Make sure our fixture does what we think it does before timing it, and
+ * that our threads convert our arguments the same way (and in the same
+ * order) our own thread does, that a launch with no arguments still gets
+ * its environment converted, without loading cygwin1.dll, and that regexes
+ * that look like paths off the drive's root are left alone. Keeps a
+ * converted copy of our arguments for cmdline_build.
+ */
+static void bench_check()
+{
+	static wchar_t* sProbeArgs[] = { BENCH_TARGET, BENCH_VENV L"\\script.py", L"\\d+", L"\\tmp", L"\\w*",
+		L"sub\\x.py", L"sub\\[a-z]+\\d" };
+	arg_class classes[7];
+	wchar_t** result;
+	const wchar_t* var;
+	wchar_t* target;
+	int i;
+
+	bench_reset();
+	setup_argv_serial(0);
+	result = fix_argv(BENCH_MAX_ARGS + 1, sArgs, true, args_profile(BENCH_LAUNCHER));
+	for(i = 0; i <= BENCH_MAX_ARGS; i++) {
+		if(!(sConverted[i] = wcsdup(result[i]))) bench_fail("Out of memory", NULL);
+	}
+
+	bench_reset();
+	setup_conversion(0);
+	target = real_path(BENCH_TARGET);
+	if(_wcsicmp(target, BENCH_INTERPRETER) != 0) bench_fail("Our symlink chain resolved to the wrong file", NULL);
+	result = fix_argv(BENCH_MAX_ARGS + 1, sArgs, true, args_profile(BENCH_LAUNCHER));
+	if(wcscmp(result[5], L"/cygdrive/c/venv/data/file5.txt") != 0 || !wcsstr(result[0], L"/python2.7.exe")) {
+		bench_fail("Our arguments weren't converted", NULL);
+	}
+	for(i = 0; i <= BENCH_MAX_ARGS; i++) {
+		if(wcscmp(result[i], sConverted[i]) != 0) bench_fail("Our threads converted our arguments differently", NULL);
+	}
+
+	bench_reset();
+	setup_conversion(0);
+	SetEnvironmentVariableW(L"PYTHONPATH", sPythonPath);
+	fix_argv(1, sArgs, true, args_profile(BENCH_LAUNCHER));
+	for(var = env_block; var && *var && wcsncmp(var, L"PYTHONPATH=", 11) != 0; var += wcslen(var) + 1);
+	if(!var || wcsncmp(var, L"PYTHONPATH=/cygdrive/c/venv/lib/site-packages/package0:", 55) != 0) {
+		bench_fail("Our environment wasn't converted without arguments", NULL);
+	}
+	if(hCygwin) bench_fail("We loaded cygwin1.dll with nothing our mount table couldn't convert", NULL);
+
+	// \tmp is there, (on our host's / at least) and the rest aren't. Nor is sub\[a-z]+, even though sub is.
+	bench_reset();
+	args_classify(args_profile(BENCH_LAUNCHER), 7, sProbeArgs, classes);
+	args_probe(7, sProbeArgs, classes);
+	if(classes[2].kind != ARG_LITERAL || classes[3].kind != ARG_PATH || classes[4].kind != ARG_LITERAL) {
+		bench_fail("Our arguments off the drive's root were probed wrongly", NULL);
+	}
+	if(classes[5].kind != ARG_PATH || classes[6].kind != ARG_LITERAL) {
+		bench_fail("Our arguments further down a folder got its answer", NULL);
+	}
+	bench_reset();
+}
+
+/**
+ * Splits a command line back up the way the MSVC runtime (and
+ * CommandLineToArgvW) does, for cmdline.c's output to be checked against.
+ * Returns argc, with each argument written out to buf.
+ */
+static int bench_split(const wchar_t* line, wchar_t** argv, wchar_t* buf)
+{
+	int argc = 1, inquote;
+	size_t slashes;
+
+	// The program name goes up to the next quote, or the first space, without escapes.
+	argv[0] = buf;
+	if(*line == L'"') {
+		for(line++; *line && *line != L'"'; ) *(buf++) = *(line++);
+		if(*line) line++;
+	} else {
+		while(*line && *line != L' ' && *line != L'\t') *(buf++) = *(line++);
+	}
+	*(buf++) = L'\0';
+
+	for(;;) {
+		while(*line == L' ' || *line == L'\t') line++;
+		if(!*line) return argc;
+		argv[argc++] = buf;
+		for(inquote = 0;; ) {
+			for(slashes = 0; *line == L'\\'; line++) slashes++;
+			if(*line == L'"') {
+				for(; slashes > 1; slashes -= 2) *(buf++) = L'\\';
+				if(slashes) {
+					*(buf++) = L'"';
+				} else if(inquote && line[1] == L'"') {
+					// A doubled quote inside quotes is a literal one.
+					*(buf++) = L'"';
+					line++;
+				} else {
+					inquote = !inquote;
+				}
+				line++;
+				continue;
+			}
+			for(; slashes > 0; slashes--) *(buf++) = L'\\';
+			if(!*line || (!inquote && (*line == L' ' || *line == L'\t'))) break;
+			*(buf++) = *(line++);
+		}
+		*(buf++) = L'\0';
+	}
+}
+
+/**
+ * Makes sure the command lines cmdline.c writes split back up into the
+ * arguments they came from, over a set of awkward ones and then some
+ * random ones: trailing backslashes, embedded quotes, empty arguments and
+ * program names with spaces in.
+ */
+static void bench_cmdline_check()
+{
+	static wchar_t* sAwkward[] = { L"C:\\Program Files\\Python 2.7\\python.exe", L"", L"a\\", L"a b\\",
+		L"\\\\", L"\"", L"a\\\"b", L"\\\"\\", L"\"\"", L"*.py", L"tab\there", L"" };
+	static const wchar_t sProgramChars[] = L"ab\\ \t.";
+	static const wchar_t sArgChars[] = L"ab\\\" \t*'";
+	wchar_t words[16][16], line[1024], buf[1024];
+	wchar_t* argv[16];
+	wchar_t* split[sizeof(line) / sizeof(wchar_t)];
+	unsigned int seed = 1;
+	int argc, round, i, j, len;
+
+	for(round = 0; round < 20000; round++) {
+		if(round == 0) {
+			argc = sizeof(sAwkward) / sizeof(wchar_t*);
+			for(i = 0; i < argc; i++) argv[i] = sAwkward[i];
+		} else {
+			seed = seed * 1103515245 + 12345;
+			argc = 1 + (seed >> 16) % 16;
+			for(i = 0; i < argc; i++) {
+				seed = seed * 1103515245 + 12345;
+				len = (seed >> 16) % 16;
+				for(j = 0; j < len; j++) {
+					seed = seed * 1103515245 + 12345;
+					words[i][j] = i ? sArgChars[(seed >> 16) % (sizeof(sArgChars) / sizeof(wchar_t) - 1)] :
+						sProgramChars[(seed >> 16) % (sizeof(sProgramChars) / sizeof(wchar_t) - 1)];
+				}
+				words[i][j] = L'\0';
+				argv[i] = words[i];
+			}
+		}
+		if(cmdline_length(argc, argv) > sizeof(line) / sizeof(wchar_t)) bench_fail("Our command line check overflowed", NULL);
+		cmdline_write(argc, argv, line);
+		if(wcslen(line) + 1 != cmdline_length(argc, argv)) bench_fail("Our command line wasn't the length we said", NULL);
+		if(bench_split(line, split, buf) != argc) {
+			fprintf(stderr, "bench: %ls\n", line);
+			bench_fail("Our command line split into the wrong number of arguments", NULL);
+		}
+		for(i = 0; i < argc; i++) {
+			if(wcscmp(split[i], argv[i]) != 0) {
+				fprintf(stderr, "bench: %ls became %ls in %ls\n", argv[i], split[i], line);
+				bench_fail("Our command line didn't split back into its arguments", NULL);
+			}
+		}
+	}
+	fprintf(stderr, "bench: cmdline.c checked over %d command lines\n", round);
+}
+
+/**
+ * Checks our mount table against conversions recorded from cygwin1.dll
+ * itself, in whichever directions each one goes.
+ */
+static void bench_corpus_check()
+{
+	mount_table* mt = (mount_table*)malloc(sizeof(mount_table));
+	wchar_t out[MAX_PATH+1];
+	const bench_conversion* c;
+
+	if(!mt) bench_fail("Out of memory", NULL);
+	mount_table_init(mt, L"C:\\cygwin64");
+	if(mount_table_parse(mt, sCorpusFstab, sizeof(sCorpusFstab) - 1) != 2 ||
+		mount_table_parse(mt, sCorpusUserFstab, sizeof(sCorpusUserFstab) - 1) != 1) {
+		bench_fail("Our corpus's fstab wasn't read", NULL);
+	}
+	for(c = sCorpus; c->win; c++) {
+		if(c->ways != BENCH_TO_WIN &&
+			(!mount_conv(mt, MOUNT_WIN_TO_POSIX, c->islist, c->win, NULL, out, MAX_PATH+1) || wcscmp(out, c->posix) != 0)) {
+			fprintf(stderr, "bench: %ls became %ls\n", c->win, out);
+			bench_fail("Our mount table disagreed with cygwin1.dll", "Windows -> POSIX");
+		}
+		if(c->ways != BENCH_TO_POSIX &&
+			(!mount_conv(mt, MOUNT_POSIX_TO_WIN, c->islist, c->posix, NULL, out, MAX_PATH+1) || wcscmp(out, c->win) != 0)) {
+			fprintf(stderr, "bench: %ls became %ls\n", c->posix, out);
+			bench_fail("Our mount table disagreed with cygwin1.dll", "POSIX -> Windows");
+		}
+	}
+	free(mt);
+	fprintf(stderr, "bench: mount table checked against %d recorded conversions\n", (int)(c - sCorpus));
+}
+
+/**
+ * Checks each of simd.c's kernels against the plain C ones, at every
+ * length up to BENCH_SIMD_MAX and every alignment, with separators (and
+ * characters that only share a byte with one) scattered through. Then
+ * converts some POSIX paths our mount table flips with them, (drive roots
+ * with nothing left to flip, especially) at every level.
+ */
+static void bench_simd_check()
+{
+	static const wchar_t chars[] = { L'a', L'/', L'\\', L';', L'Z', (wchar_t)0x2F5C, (wchar_t)0x012F, L'.' };
+	wchar_t in[BENCH_SIMD_MAX + 64], out[BENCH_SIMD_MAX + 64], ref[BENCH_SIMD_MAX + 64];
+	static const wchar_t* paths[] = {
+		L"/cygdrive/c", L"/cygdrive/c/", L"/cygdrive/d/a", L"/cygdrive/c/venv/lib/site-packages/package0/module.py", L"/usr/bin", NULL
+	};
+	const simd_kernel *kernel, *scalar = &(simd_kernels[SIMD_SCALAR]);
+	wchar_t conv[MAX_PATH+1], convref[MAX_PATH+1];
+	size_t n, offset, i;
+	int level, best = simd_use(SIMD_AVX2), p;
+	unsigned int seed = 1;
+
+	for(level = SIMD_SCALAR + 1; level <= best; level++) {
+		kernel = &(simd_kernels[level]);
+		for(n = 0; n <= BENCH_SIMD_MAX; n++) {
+			for(offset = 0; offset < 32; offset++) {
+				for(i = 0; i < n; i++) {
+					seed = seed * 1103515245 + 12345;
+					in[offset + i] = chars[(seed >> 16) % (sizeof(chars) / sizeof(wchar_t))];
+				}
+				in[offset + n] = L'\0';
+				if(kernel->length(&(in[offset])) != n ||
+					kernel->find_sep(&(in[offset]), n) != scalar->find_sep(&(in[offset]), n) ||
+					kernel->find(&(in[offset]), n, L';') != scalar->find(&(in[offset]), n, L';')) {
+					bench_fail("A simd.c kernel disagreed with the plain C one", "length/find");
+				}
+				out[n] = ref[n] = L'!';
+				kernel->flip(out, &(in[offset]), n, L'\\', L'/');
+				scalar->flip(ref, &(in[offset]), n, L'\\', L'/');
+				if(wmemcmp(out, ref, n + 1) != 0) bench_fail("A simd.c kernel disagreed with the plain C one", "flip");
+			}
+		}
+	}
+
+	bench_reset();
+	setup_conversion(0);
+	for(p = 0; paths[p]; p++) {
+		simd_use(SIMD_SCALAR);
+		if(!(n = mount_conv(mounts, MOUNT_POSIX_TO_WIN, false, paths[p], NULL, convref, MAX_PATH+1))) {
+			bench_fail("Our mount table couldn't convert a path", NULL);
+		}
+		for(level = SIMD_SCALAR + 1; level <= best; level++) {
+			simd_use(level);
+			if(mount_conv(mounts, MOUNT_POSIX_TO_WIN, false, paths[p], NULL, conv, MAX_PATH+1) != n || wcscmp(conv, convref) != 0) {
+				bench_fail("A simd.c kernel converted a path differently", NULL);
+			}
+		}
+	}
+	if(wcscmp(convref, L"C:\\cygwin\\bin") != 0) bench_fail("Our mount table converted /usr/bin wrongly", NULL);
+	bench_reset();
+	fprintf(stderr, "bench: simd.c kernels checked up to %ls\n", simd_kernels[best].name);
+}
+
+/**
+ * Round-trips text through util.c's transcoder at every level simd.c
+ * has, checking the UTF-8 against the CRT's, (in a UTF-8 locale) over
+ * the same lengths and alignments as above. Then makes sure everything
+ * that isn't valid is turned down, rather than patched up.
+ */
+static void bench_utf8_check()
+{
+	static const wchar_t chars[] = { L'a', L'/', L'\\', (wchar_t)0x7F, (wchar_t)0x80, (wchar_t)0xFC, (wchar_t)0x7FF,
+		(wchar_t)0x800, (wchar_t)0x6587, (wchar_t)0xFFFD };
+	static const char* bad8[] = { "\x80", "\xC0\xAF", "\xC1\xBF", "\xE0\x80\xAF", "\xED\xA0\x80", "\xF0\x80\x80\xAF",
+		"\xF4\x90\x80\x80", "\xF8\x88\x80\x80\x80", "\xE2\x82", "a\xE2\x82(", NULL };
+	static const wchar_t bad16[][3] = { { (wchar_t)0xD800 }, { (wchar_t)0xDC00, L'a' }, { L'a', (wchar_t)0xDBFF, L'a' } };
+	wchar_t in[BENCH_SIMD_MAX + 32], out[BENCH_SIMD_MAX + 32];
+	char narrow[UTF8_MAX(BENCH_SIMD_MAX + 32)], ref[UTF8_MAX(BENCH_SIMD_MAX + 32)];
+	size_t n, offset, i, sznarrow;
+	int level, best = simd_use(SIMD_AVX2);
+	unsigned int seed = 1;
+
+	if(!setlocale(LC_CTYPE, "C.UTF-8")) bench_fail("No UTF-8 locale to check our transcoder against", NULL);
+	for(level = SIMD_SCALAR; level <= best; level++) {
+		simd_use(level);
+		for(n = 0; n <= BENCH_SIMD_MAX; n++) {
+			for(offset = 0; offset < 16; offset++) {
+				// Mostly ASCII, so that the runs are long enough to go through simd.c.
+				for(i = 0; i < n; i++) {
+					seed = seed * 1103515245 + 12345;
+					in[offset + i] = (seed >> 16) % 8 ? (wchar_t)(L' ' + (seed >> 20) % 90) :
+						chars[(seed >> 20) % (sizeof(chars) / sizeof(wchar_t))];
+				}
+				in[offset + n] = L'\0';
+				sznarrow = utf8_encode(&(in[offset]), n + 1, &(narrow[offset]), UTF8_MAX(n + 1));
+				if(sznarrow == UTF_INVALID || wcstombs(ref, &(in[offset]), sizeof(ref)) != sznarrow - 1 ||
+					memcmp(&(narrow[offset]), ref, sznarrow) != 0) {
+					bench_fail("Our transcoder disagreed with the CRT", "encode");
+				}
+				if(utf8_decode(&(narrow[offset]), sznarrow, out, n + 1) != n + 1 || wmemcmp(out, &(in[offset]), n + 1) != 0) {
+					bench_fail("Our transcoder disagreed with the CRT", "decode");
+				}
+				if(n && utf8_encode(&(in[offset]), n, narrow, sznarrow - 2) != UTF_INVALID) {
+					bench_fail("Our transcoder wrote past the end of its buffer", NULL);
+				}
+			}
+		}
+		for(i = 0; bad8[i]; i++) {
+			if(utf8_decode(bad8[i], strlen(bad8[i]), out, 8) != UTF_INVALID) bench_fail("Our transcoder took bad UTF-8", bad8[i]);
+		}
+		for(i = 0; i < sizeof(bad16) / sizeof(bad16[0]); i++) {
+			if(utf8_encode(bad16[i], 3, narrow, 16) != UTF_INVALID) bench_fail("Our transcoder took an unpaired surrogate", NULL);
+		}
+	}
+	setlocale(LC_CTYPE, "C");
+	simd_use(SIMD_AVX2);
+	fprintf(stderr, "bench: util.c transcoder checked up to %ls\n", simd_kernels[best].name);
+}
+
+static bool bench_relay_sink(void* context, const char* data, size_t count)
+{
+	if(szRelayOut + count > sizeof(sRelayOut)) return false;
+	memcpy(&(sRelayOut[szRelayOut]), data, count);
+	szRelayOut += count;
+	return true;
+}
+
+/**
+ * Makes sure our relay converts the paths it should, leaves everything
+ * else alone, and comes out the same however its input is split up.
+ */
+static void bench_relay_check()
+{
+	static const char in[] =
+		"  File \"/cygdrive/c/venv/x.py\", line 3, in <module>\n"
+		"/usr/bin/python2.7: can't open /usr/lib/J\xc3\xbcrgen/y.py.\n"
+		"http://example.com/a 1/2 /proc/self //srv/share (/cygdrive/c/venv/a:12) err\n"
+		"cwd /cygdrive/c, then '/cygdrive/d/' and /cygdrive/c\n"
+		"/usr/bin";
+	static const char out[] =
+		"  File \"C:\\venv\\x.py\", line 3, in <module>\n"
+		"C:\\cygwin\\bin\\python2.7: can't open C:\\cygwin\\lib\\J\xc3\xbcrgen\\y.py.\n"
+		"http://example.com/a 1/2 /proc/self //srv/share (C:\\venv\\a:12) err\n"
+		"cwd C:\\, then 'D:\\' and C:\\\n"
+		"C:\\cygwin\\bin";
+	relay_stream* rs = (relay_stream*)malloc(sizeof(relay_stream));
+	size_t chunk, pos, n, room;
+
+	if(!rs) bench_fail("Out of memory", NULL);
+	bench_reset();
+	setup_conversion(0);
+	for(chunk = 1; chunk < sizeof(in); chunk++) {
+		relay_init(rs, mounts, bench_relay_sink, NULL);
+		szRelayOut = 0;
+		for(pos = 0; pos < sizeof(in) - 1; pos += n) {
+			n = sizeof(in) - 1 - pos < chunk ? sizeof(in) - 1 - pos : chunk;
+			memcpy(relay_space(rs, &room), &(in[pos]), n);
+			relay_feed(rs, n);
+		}
+		relay_flush(rs);
+		if(szRelayOut != sizeof(out) - 1 || memcmp(sRelayOut, out, sizeof(out) - 1) != 0) {
+			sRelayOut[szRelayOut < sizeof(sRelayOut) ? szRelayOut : sizeof(sRelayOut) - 1] = '\0';
+			bench_fail("Our relay got our output wrong", sRelayOut);
+		}
+	}
+	free(rs);
+	bench_reset();
+}
+
+static int bench_compare(const void* a, const void* b)
+{
+	unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void bench_time(const bench_case* bc, bool first)
+{
+	unsigned long long *times, start, total = 0;
+	int i;
+
+	if(!(times = (unsigned long long*)malloc(bc->iterations * sizeof(unsigned long long)))) {
+		bench_fail("Out of memory", NULL);
+	}
+	fprintf(stderr, "bench: %s (%d iterations)..\n", bc->name, bc->iterations);
+	for(i = 0; i < bc->iterations; i++) {
+		bench_reset();
+		bc->setup(bc->param);
+		start = bench_now();
+		bc->run(bc->param);
+		times[i] = bench_now() - start;
+		total += times[i];
+	}
+	bench_reset();
+
+	qsort(times, bc->iterations, sizeof(unsigned long long), bench_compare);
+	printf("%s\n    { \"name\": \"%s\", \"param\": %d, \"iterations\": %d, \"min\": %llu, \"median\": %llu, \"mean\": %llu, \"max\": %llu }",
+		first ? "" : ",", bc->name, bc->param, bc->iterations,
+		times[0], times[bc->iterations / 2], total / bc->iterations, times[bc->iterations - 1]);
+	free(times);
+}
+
+/**
+ * Starts clients processes at once, each sending our resolver
+ * BENCH_RESOLVER_REQUESTS requests through a connection of its own, and
+ * times each request, and all of them. Each client sends its times back
+ * in one write, which fits in a pipe's atomic limit.
+ */
+static void bench_resolver_load(int clients, bool first)
+{
+	static unsigned long long times[BENCH_RESOLVER_CLIENTS * BENCH_RESOLVER_REQUESTS];
+	unsigned long long start, elapsed, total = 0;
+	int count = clients * BENCH_RESOLVER_REQUESTS, gate[2], results[2], status, c, r;
+	size_t got = 0;
+	ssize_t n;
+	path_batch batch;
+	bool failed = false;
+	pid_t pid;
+
+	fprintf(stderr, "bench: resolver_load/%d (%d requests)..\n", clients, count);
+	if(pipe(gate) != 0 || pipe(results) != 0) bench_fail("Could not set up our clients", NULL);
+	bench_reset();
+	fflush(stdout);
+	fflush(stderr);
+	for(c = 0; c < clients; c++) {
+		if((pid = fork()) < 0) bench_fail("Could not start our clients", NULL);
+		if(pid) continue;
+		// Wait until everybody's started.
+		close(gate[1]);
+		close(results[0]);
+		if(read(gate[0], &status, 1) != 0) _exit(1);
+		for(r = 0; r < BENCH_RESOLVER_REQUESTS; r++) {
+			bench_reset();
+			resolver_unavailable = false;
+			start = bench_now();
+			bench_resolver_batch(&batch);
+			times[r] = bench_now() - start;
+			if(hCygwin) _exit(1);
+		}
+		_exit(write(results[1], times, BENCH_RESOLVER_REQUESTS * sizeof(unsigned long long)) < 0);
+	}
+	close(gate[0]);
+	close(results[1]);
+	start = bench_now();
+	close(gate[1]);
+	while(got < count * sizeof(unsigned long long) && (n = read(results[0], (char*)times + got, count * sizeof(unsigned long long) - got)) > 0) {
+		got += (size_t)n;
+	}
+	close(results[0]);
+	while(clients--) {
+		failed |= wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+	elapsed = bench_now() - start;
+	if(failed || got < count * sizeof(unsigned long long)) bench_fail("Our resolver didn't answer all of our clients", NULL);
+
+	for(r = 0; r < count; r++) total += times[r];
+	qsort(times, count, sizeof(unsigned long long), bench_compare);
+	printf("%s\n    { \"name\": \"resolver_load/%d\", \"param\": %d, \"iterations\": %d, \"min\": %llu, \"median\": %llu, \"mean\": %llu, \"p99\": %llu, \"max\": %llu, \"per_second\": %llu }",
+		first ? "" : ",", count / BENCH_RESOLVER_REQUESTS, count / BENCH_RESOLVER_REQUESTS, count,
+		times[0], times[count / 2], total / count, times[count - count / 100 - 1], times[count - 1],
+		count * 1000000000ULL / (elapsed ? elapsed : 1));
+}
+
+/** Runs --train's launches, all the way up to building their command lines. */
+static void bench_train()
+{
+	wchar_t sExecutable[MAX_PATH+1] = BENCH_LAUNCHER,
+			sParent[MAX_PATH+1] = EMPTYW,
+			sTarget[MAX_PATH+1] = EMPTYW,
+			sRoot[MAX_PATH+1] = EMPTYW,
+			sPATH[MAX_ENV+1] = EMPTYW;
+	wchar_t **result, *cmdline;
+	int i, n;
+
+	fprintf(stderr, "bench: training with %d launches..\n", BENCH_TRAIN_LAUNCHES);
+	for(i = 0; i < BENCH_TRAIN_LAUNCHES; i++) {
+		n = sTrainArgs[i % (sizeof(sTrainArgs) / sizeof(sTrainArgs[0]))];
+		bench_reset();
+		if(i & 1) {
+			SetEnvironmentVariableW(L"PYTHONPATH", sPythonPath);
+			SetEnvironmentVariableW(L"PYTHONSTARTUP", BENCH_VENV L"\\startup.py");
+		}
+		find_target(sExecutable, wcslen(sExecutable), sParent, sTarget);
+		get_cygwin_root(sRoot, MAX_PATH+1);
+		build_path_var(sParent, sRoot, sPATH);
+		setup_conversion(0);
+		real_path(BENCH_TARGET);
+		result = fix_argv(n + 1, sArgs, true, args_profile(BENCH_LAUNCHER));
+		if(!(cmdline = (wchar_t*)malloc(cmdline_length(n + 1, result) * sizeof(wchar_t)))) bench_fail("Out of memory", NULL);
+		cmdline_write(n + 1, result, cmdline);
+		free(cmdline);
+	}
+	bench_reset();
+}
+
+int main(int argc, char** argv)
+{
+	const char* filter = argc > 1 ? argv[1] : NULL;
+	bool first = true;
+	int i;
+
+	bench_fixture();
+	bench_args();
+	bench_pythonpath();
+	if(filter && strcmp(filter, "--train") == 0) {
+		bench_train();
+		bench_cleanup();
+		return 0;
+	}
+	bench_text();
+	bench_relay_text();
+	bench_corpus_check();
+	bench_simd_check();
+	bench_utf8_check();
+	bench_relay_check();
+	bench_check();
+	bench_cmdline_check();
+	if(!filter || strstr("pool/cold pool/warm", filter)) bench_pool_start();
+	if(!filter || strstr("resolver/inproc resolver/service resolver_load/64", filter)) bench_resolver_start();
+
+	printf("{\n  \"unit\": \"ns\",\n  \"results\": [");
+	for(i = 0; cases[i].name; i++) {
+		if(filter && !strstr(cases[i].name, filter)) continue;
+		if(cases[i].run == run_pool && !pool_broker) continue;
+		bench_time(&(cases[i]), first);
+		first = false;
+	}
+	if(!filter || strstr("resolver_load/64", filter)) {
+		bench_resolver_load(BENCH_RESOLVER_CLIENTS, first);
+		first = false;
+	}
+	printf("\n  ]\n}\n");
+
+	bench_pool_stop();
+	bench_resolver_stop();
+	bench_cleanup();
+	return 0;
+}
@@ -1,8 +1,211 @@
-from build.msvc import *
-from build.iconex import get_python_icon
+import sys, os
 
-if __name__=='__main__':
+def build_launcher():
+	from build.msvc import find_toolset, compile, link
+	from build.iconex import get_python_icon
 	buildenv = find_toolset()
 	get_python_icon()
 	objs = compile([ 'src/main.c', 'res/cygpython.rc'], buildenv, cflags=[ '-Isrc' ])
-	link(objs, 'python', buildenv)
\ No newline at end of file
+	link(objs, 'python', buildenv)
+
+def build_manifest_tool():
+	"""Builds cyglaunch-manifest, which writes a virtualenv's launch manifest."""
+	if sys.platform == 'win32':
+		from build import msvc as toolset
+	else:
+		from build import gcc as toolset
+	buildenv = toolset.find_toolset()
+	objs = toolset.compile([ 'tools/manifest.c' ], buildenv, cflags=[ '-Isrc' ], objdir='obj/tools')
+	toolset.link(objs, 'cyglaunch-manifest', buildenv)
+
+def build_pool_tool():
+	"""Builds cyglaunch-pool, which keeps a virtualenv's interpreters started and waiting."""
+	if sys.platform == 'win32':
+		from build import msvc as toolset
+	else:
+		from build import gcc as toolset
+	buildenv = toolset.find_toolset()
+	objs = toolset.compile([ 'tools/pool.c' ], buildenv, cflags=[ '-Isrc' ], objdir='obj/tools')
+	toolset.link(objs, 'cyglaunch-pool', buildenv)
+
+def build_resolver_tool():
+	"""Builds cyglaunch-resolver, which keeps cygwin1.dll loaded and converts paths for launchers."""
+	if sys.platform == 'win32':
+		from build import msvc as toolset
+	else:
+		from build import gcc as toolset
+	buildenv = toolset.find_toolset()
+	objs = toolset.compile([ 'tools/resolver.c' ], buildenv, cflags=[ '-Isrc' ], objdir='obj/tools')
+	toolset.link(objs, 'cyglaunch-resolver', buildenv)
+
+def build_bench(args):
+	"""Builds and runs our benchmarks. Results end up in bin/bench.json"""
+	from build import gcc, proc
+	from build.fs import write_bin
+	buildenv = gcc.find_toolset()
+	objs = gcc.compile([ 'bench/bench.c' ], buildenv, cflags=[ '-pthread' ], objdir='obj/bench')
+	bench = gcc.link(objs, 'bench', buildenv, linkflags=[ '-pthread' ])
+	print 'Running benchmarks..'
+	results = proc.outputof(bench, *args)
+	write_bin('bin/bench.json', results)
+	print results
+
+def pgo_best(runs):
+	"""Each result's fastest run, by median. (A busy machine only ever makes things slower)"""
+	best = []
+	for results in zip(*runs):
+		best.append(min(results, key=lambda r: r['median']))
+	return best
+
+def pgo_report(before, after):
+	"""Lines up two runs' results by name, with how much each median changed."""
+	after = dict([ (r['name'], r) for r in after ])
+	report = []
+	print '%-24s %14s %14s %9s' % ('', 'before (ns)', 'after (ns)', 'change')
+	for r in before:
+		if r['name'] not in after: continue
+		old, new = r['median'], after[r['name']]['median']
+		change = round((new - old) * 100.0 / old, 1) if old else 0.0
+		report.append({ 'name': r['name'], 'before': old, 'after': new, 'change': change })
+		print '%-24s %14d %14d %+8.1f%%' % (r['name'], old, new, change)
+	return report
+
+# How many times each build's benchmarks are run, for pgo_best to choose from.
+PGO_RUNS = 3
+
+def build_bench_pgo(args):
+	"""Builds our benchmarks as they are, and then profile-guided, trained on
+	bench --train, and runs both. Our launcher's core is all in there, so
+	this is its portable build."""
+	import json, shutil
+	from build import gcc, proc
+	buildenv = gcc.find_toolset()
+	profdir = 'obj/pgo/profile'
+	if os.path.isdir(profdir):
+		shutil.rmtree(profdir)
+	os.makedirs(profdir)
+	
+	objs = gcc.compile([ 'bench/bench.c' ], buildenv, cflags=[ '-pthread' ], objdir='obj/bench')
+	before = gcc.link(objs, 'bench', buildenv, linkflags=[ '-pthread' ])
+	
+	# Our profiling build and our optimized build share their objects, which is what gcc names its profiles after.
+	flags = gcc.profile_flags(buildenv, 'generate', profdir)
+	objs = gcc.compile([ 'bench/bench.c' ], buildenv, cflags=[ '-pthread' ] + flags, objdir='obj/pgo')
+	trainer = gcc.link(objs, 'bench-train', buildenv, linkflags=[ '-pthread' ] + flags)
+	print 'Training..'
+	proc.outputof(trainer, '--train')
+	gcc.merge_profile(buildenv, profdir)
+	
+	flags = gcc.profile_flags(buildenv, 'use', profdir)
+	objs = gcc.compile([ 'bench/bench.c' ], buildenv, cflags=[ '-pthread' ] + flags, objdir='obj/pgo')
+	after = gcc.link(objs, 'bench-pgo', buildenv, linkflags=[ '-pthread' ] + flags)
+	
+	# Taking turns, so that whatever else the machine's doing is shared out evenly.
+	print 'Running benchmarks, without our profile and then with it, %d times..' % PGO_RUNS
+	runs = ([], [])
+	for i in range(PGO_RUNS):
+		runs[0].append(json.loads(proc.outputof(before, *args))['results'])
+		runs[1].append(json.loads(proc.outputof(after, *args))['results'])
+	return pgo_report(pgo_best(runs[0]), pgo_best(runs[1]))
+
+# How many paths our Windows training launches get, and how many times each one's run.
+PGO_ARG_COUNTS = [ 0, 1, 16, 256 ]
+PGO_ROUNDS = 20
+
+def pgo_launches(scripts):
+	"""Our Windows training launches: `python -c pass` with the files in our
+	Scripts folder as arguments, (some, or lots of them) each run with and
+	without a long PYTHONPATH. bin\\python's own symlinks get followed by every
+	one of them."""
+	venv = os.path.dirname(scripts)
+	files = [ os.path.join(scripts, f) for f in sorted(os.listdir(scripts)) ]
+	pythonpath = ';'.join([ os.path.join(venv, 'lib', 'site-packages', 'package%d' % i) for i in range(256) ])
+	launches = []
+	for n in PGO_ARG_COUNTS:
+		paths = [ files[i % len(files)] for i in range(n) ]
+		launches.append(('argv/%d' % n, [ '-c', 'pass' ] + paths, {}))
+		launches.append(('argv_env/%d' % n, [ '-c', 'pass' ] + paths, { 'PYTHONPATH': pythonpath }))
+	return launches
+
+def pgo_run(launcher, scripts, env):
+	"""Runs our training launches through launcher, in place of Scripts\\python.exe,
+	(which is put back afterwards) and times them."""
+	import shutil, time
+	from build import proc
+	target = os.path.join(scripts, 'python.exe')
+	saved = target + '.pgo'
+	launches = pgo_launches(scripts)
+	times = dict([ (name, []) for name, largs, lenv in launches ])
+	if os.path.isfile(target):
+		os.rename(target, saved)
+	try:
+		shutil.copy(launcher, target)
+		for i in range(PGO_ROUNDS):
+			for name, largs, lenv in launches:
+				runenv = env.copy()
+				runenv.update(lenv)
+				start = time.time()
+				proc.outputof(target, *largs, env=runenv)
+				times[name].append(int((time.time() - start) * 1000000000))
+	finally:
+		if os.path.isfile(target):
+			os.remove(target)
+		if os.path.isfile(saved):
+			os.rename(saved, target)
+	return [ { 'name': name, 'median': sorted(times[name])[len(times[name]) / 2] } for name, largs, lenv in launches ]
+
+def build_launcher_pgo(args):
+	"""Builds our launcher as it is, and then profile-guided, trained on the
+	virtualenv whose Scripts folder we're given, and times both there."""
+	from build.msvc import find_toolset, compile, link, profile_flags
+	from build.iconex import get_python_icon
+	if len(args) != 1 or not os.path.isdir(args[0]):
+		raise Exception('Usage: python build.py pgo C:\\path\\to\\venv\\Scripts')
+	scripts = os.path.abspath(args[0])
+	bindir = os.path.abspath('bin')
+	pgd = os.path.join(bindir, 'python.pgd')
+	buildenv = find_toolset()
+	get_python_icon()
+	objs = compile([ 'src/main.c', 'res/cygpython.rc'], buildenv, cflags=[ '-Isrc' ])
+	link(objs, 'python-plain', buildenv)
+	
+	# The profiling build needs the toolset's PATH, for its runtime, and writes its .pgc files next to our .pgd.
+	for f in os.listdir(bindir):
+		if f.lower().startswith('python!') and f.lower().endswith('.pgc'):
+			os.remove(os.path.join(bindir, f))
+	env = os.environ.copy()
+	env['PATH'] = buildenv.get('PATH', '') + ';' + env.get('PATH', '')
+	env['VCPROFILE_PATH'] = bindir
+	link(objs, 'python', buildenv, linkflags=profile_flags(buildenv, 'generate', pgd))
+	print 'Training..'
+	pgo_run(os.path.join(bindir, 'python.exe'), scripts, env)
+	link(objs, 'python', buildenv, linkflags=profile_flags(buildenv, 'use', pgd))
+	
+	print 'Timing launches, without our profile and then with it..'
+	before = pgo_run(os.path.join(bindir, 'python-plain.exe'), scripts, os.environ.copy())
+	after = pgo_run(os.path.join(bindir, 'python.exe'), scripts, os.environ.copy())
+	return pgo_report(before, after)
+
+def build_pgo(args):
+	"""Profile-guided builds. Results end up in bin/pgo.json"""
+	import json
+	from build.fs import write_bin
+	if sys.platform == 'win32':
+		report = build_launcher_pgo(args)
+	else:
+		report = build_bench_pgo(args)
+	write_bin('bin/pgo.json', json.dumps({ 'unit': 'ns', 'results': report }, indent=2))
+
+if __name__=='__main__':
+	if len(sys.argv) > 1 and sys.argv[1] == 'bench':
+		build_bench(sys.argv[2:])
+	elif len(sys.argv) > 1 and sys.argv[1] == 'manifest':
+		build_manifest_tool()
+	elif len(sys.argv) > 1 and sys.argv[1] == 'pool':
+		build_pool_tool()
+	elif len(sys.argv) > 1 and sys.argv[1] == 'resolver':
+		build_resolver_tool()
+	elif len(sys.argv) > 1 and sys.argv[1] == 'pgo':
+		build_pgo(sys.argv[2:])
+	else:
+		build_launcher()
@@ -0,0 +1,105 @@
+"""
+gcc.py
+Description: Same interface as msvc.py, but for gcc (or anything that takes
+             the same arguments) on a POSIX host. Used to build our benchmarks.
+             Profile-guided builds work with gcc and clang, which each want
+             their own flags. (See profile_flags)
+"""
+import os
+from . import proc
+from .fs import which
+
+# Just to shorten up access to the path functions..
+bname = os.path.basename
+isdir = os.path.isdir
+ext = os.path.splitext
+pj = os.path.join
+
+def find_toolset(cc=None):
+	if cc is None:
+		cc = os.environ.get('CC', 'gcc')
+	print 'Checking for %s..' % cc
+	path = which(cc)
+	if not path:
+		raise Exception('Could not locate a toolset to use!')
+	print 'Found %s.' % path
+	buildenv = os.environ.copy()
+	buildenv['CC'] = path
+	return buildenv
+
+def is_clang(buildenv):
+	return 'clang' in proc.outputof(buildenv['CC'], '--version').lower()
+
+def profile_flags(buildenv, stage, profdir):
+	"""Flags to compile and link with, for a build that writes a profile to
+	profdir, (stage 'generate') or one that's optimized with it. (stage 'use')
+	gcc names its profiles after our object files, so both builds have to
+	put them in the same place."""
+	profdir = os.path.abspath(profdir)
+	if is_clang(buildenv):
+		if stage == 'generate':
+			return [ '-fprofile-instr-generate=%s' % pj(profdir, '%p.profraw') ]
+		return [ '-fprofile-instr-use=%s' % pj(profdir, 'merged.profdata'), '-Wno-profile-instr-unprofiled' ]
+	# Our benchmarks convert arguments on several threads.
+	if stage == 'generate':
+		return [ '-fprofile-generate', '-fprofile-update=atomic', '-fprofile-dir=%s' % profdir ]
+	# Whatever training didn't run (the SIMD kernels our CPU doesn't pick, say) is still optimized for speed.
+	return [ '-fprofile-use', '-fprofile-partial-training', '-fprofile-correction', '-fprofile-dir=%s' % profdir, '-Wno-missing-profile' ]
+
+def merge_profile(buildenv, profdir):
+	"""Gets the profile a generate build wrote ready for a use build."""
+	profdir = os.path.abspath(profdir)
+	if not is_clang(buildenv):
+		# gcc reads its .gcda files as they are.
+		return
+	profdata = which(os.environ.get('LLVM_PROFDATA', 'llvm-profdata'))
+	if not profdata:
+		raise Exception('Could not locate llvm-profdata, to merge our profile with!')
+	raws = [ pj(profdir, f) for f in os.listdir(profdir) if ext(f)[1] == '.profraw' ]
+	print 'Merging %d profile(s)..' % len(raws)
+	proc.outputof(profdata, 'merge', '-o', pj(profdir, 'merged.profdata'), *raws)
+
+def compile(srcs, buildenv=None, cflags=None, objdir='obj'):
+	if buildenv is None:
+		buildenv = find_toolset()
+	if cflags is None:
+		cflags = []
+	if objdir is None:
+		objdir = 'obj'
+	
+	cc = proc.which(buildenv['CC'])
+	
+	# Set up obj dir.
+	objdir = os.path.abspath(objdir)
+	if not isdir(objdir):
+		os.makedirs(objdir)
+	
+	# Set up CFLAGS
+	cflags = cflags + ['-std=gnu99', '-O2', '-Wall', '-Wno-unknown-pragmas', '-Wno-parentheses', '-Wno-unused-function', '-DNDEBUG=1']
+	
+	# Set up object file list and compile source files.
+	objfiles = []
+	for src in srcs:
+		print 'Compiling %s..' % src
+		obj = pj(objdir, bname(ext(src)[0]) + '.o')
+		cc(*tuple(cflags + [ '-c', '-o', obj, src ]))
+		objfiles.append(obj)
+	return objfiles
+
+def link(objfiles, output, buildenv=None, linkflags=None, outdir='bin'):
+	if buildenv is None: buildenv = find_toolset()
+	if linkflags is None: linkflags = []
+	if outdir is None: outdir = 'bin'
+	if output is None: raise Exception('Need an output basename!')
+	
+	cc = proc.which(buildenv['CC'])
+	
+	# Set up output
+	outdir = os.path.abspath(outdir)
+	if not isdir(outdir):
+		os.makedirs(outdir)
+	output = pj(outdir, output)
+	
+	print 'Linking objects..'
+	cc(*tuple(linkflags + [ '-o', output ] + objfiles))
+	return output
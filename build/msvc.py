@@ -48,6 +48,8 @@ MSVC_KEYS = [
 	(10, '10', u'%s\\10.0\\Setup\\VC' % MSVCROOTKEY),
 	(10, '10 Express', u'%s\\10.0\\Setup\\VC' % MSVCEXPROOTKEY),
 	(11, '11', u'%s\\11.0\\Setup\\VC' % MSVCROOTKEY),
+	(12, '12', u'%s\\12.0\\Setup\\VC' % MSVCROOTKEY),
+	(14, '14', u'%s\\14.0\\Setup\\VC' % MSVCROOTKEY),
 	(9, '9', u'%s\\9.0\\Setup\\VC' % MSVCROOTKEY),
 	(9, '9 Express', u'%s\\9.0\\Setup\\VC' % MSVCEXPROOTKEY),
 	(8, '8', u'%s\\8.0\\Setup\\VC' % MSVCROOTKEY),
@@ -127,6 +129,7 @@ def find_toolset(vcvers=None, sdkvers=None):
 	buildenv = {}
 	if vcroot is not None:
 		buildenv = proc.envcmd(pj(vcroot, 'bin', MSVC_ENVCMD))
+		buildenv['VCVERS'] = str(vcvers)
 	
 	if sdkroot is not None:
 		sdkenv = proc.envcmd(pj(sdkroot, 'Bin', MSSDK_ENVCMD), '/Release', '/x86')
@@ -190,6 +193,16 @@ def compile(srcs, buildenv=None, cflags=None, objdir='obj'):
 		objfiles.append(obj)
 	return objfiles
 
+def profile_flags(buildenv, stage, pgd):
+	"""Link flags for a build that writes a profile to pgd, (stage 'generate')
+	or one that's optimized with it. (stage 'use') Our objects are already
+	compiled with -GL, so the same ones do for both. VC14 and up take
+	/GENPROFILE and /USEPROFILE; older ones have /LTCG:PGINSTRUMENT and
+	/LTCG:PGOPTIMIZE instead."""
+	if int(buildenv.get('VCVERS', '0')) >= 14:
+		return [ '-%s:PGD=%s' % ('GENPROFILE' if stage == 'generate' else 'USEPROFILE', pgd) ]
+	return [ '-LTCG:%s' % ('PGINSTRUMENT' if stage == 'generate' else 'PGOPTIMIZE'), '-PGD:%s' % pgd ]
+
 def link(objfiles, output, buildenv=None, linkflags=None, outdir='bin'):
 	if buildenv is None: buildenv = os.environ
 	if linkflags is None: linkflags = []
@@ -207,9 +220,13 @@ def link(objfiles, output, buildenv=None, linkflags=None, outdir='bin'):
 	if ext(output)[1] != '.exe': output += '.exe'
 	
 	# Set up link flags
-	linkflags += ['-nologo', '-OPT:REF', '-OPT:ICF', '-LTCG', '-MACHINE:X86', '-OUT:%s' % output ]
+	linkflags += ['-nologo', '-OPT:REF', '-OPT:ICF', '-MACHINE:X86', '-OUT:%s' % output ]
 	linkflags += objfiles
-	linkargs = tuple(set([ remove_slash_arg(v) for v in linkflags]))
+	linkflags = [ remove_slash_arg(v) for v in linkflags]
+	# Unless a profile-guided build's already asked for its own kind.
+	if not [ v for v in linkflags if v.upper().startswith('-LTCG:') ]:
+		linkflags.append('-LTCG')
+	linkargs = tuple(set(linkflags))
 	
 	# Set up object file list and compile source files.
 	print 'Linking objects..'
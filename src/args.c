@@ -0,0 +1,347 @@
+/**
+ * args.c - Works out which of our arguments are paths, without going
+ *          anywhere near the filesystem if we can help it.
+ *
+ * Each interpreter we launch gets a profile: a table of the options it
+ * knows about and what their values are (a path, a path list, or
+ * something we should never touch, like the code passed to python -c),
+ * plus what its positional arguments usually are. Everything else is
+ * classified lexically:
+ *
+ *   C:\x, C:/x, \\server\share   always a path, whether it exists or not
+ *   C:\a;D:\b                    a path list
+ *   --output=C:\x                the value after the = is
+ *   foo\bar                      ambiguous - could be a relative path, or
+ *                                could be a regex. See args_probe.
+ *   anything else                left alone. Relative paths with forward
+ *                                slashes (or none) work fine in Cygwin.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** How to treat an argument, or the value part of one. */
+#define ARG_LITERAL		0 // Leave it alone.
+#define ARG_PATH		1 // Convert it as a path.
+#define ARG_PATHLIST	2 // Convert it as a ;-separated path list.
+#define ARG_AUTO		3 // Work it out lexically.
+#define ARG_AMBIGUOUS	4 // Couldn't work it out lexically. (args_probe resolves these)
+#define ARG_NODEID		5 // Path, optionally followed by ::name (pytest node ids)
+
+/** Rule flags. */
+#define RULE_VALUE		0x001 // Takes a value. (--opt value, --opt=value)
+#define RULE_ATTACHED	0x002 // The value can be attached to a short option. (-rfile)
+#define RULE_SCRIPT		0x004 // Everything after this option's value belongs to the script.
+
+typedef struct { const wchar_t* option; int kind; dword flags; } arg_rule;
+
+typedef struct {
+	const wchar_t* name;		// Launcher name prefix. (pip matches pip2.7.exe)
+	int positional;				// How to treat positional args.
+	bool scriptPositional;		// Whether the first positional is a script that owns the rest.
+	const arg_rule* rules;
+} arg_profile;
+
+/** The classification of a single argument. The value is arg[offset:offset+length] */
+typedef struct {
+	int kind;
+	size_t offset;
+	size_t length;
+	int slot;		// Where the value was queued up in our conversion batch.
+} arg_class;
+
+/**
+ * Rules used for anything we don't have a profile for, and for the
+ * arguments of scripts run by the interpreter.
+ */
+static const arg_rule default_rules[] = {
+	{ NULL, 0, 0 }
+};
+
+static const arg_rule python_rules[] = {
+	{ L"-c",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED | RULE_SCRIPT },
+	{ L"-m",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED | RULE_SCRIPT },
+	{ L"-W",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ L"-X",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ L"-Q",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ NULL, 0, 0 }
+};
+
+static const arg_rule pip_rules[] = {
+	{ L"-r",				ARG_PATH,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--requirement",		ARG_PATH,		RULE_VALUE },
+	{ L"-c",				ARG_PATH,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--constraint",		ARG_PATH,		RULE_VALUE },
+	{ L"-e",				ARG_PATH,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--editable",		ARG_PATH,		RULE_VALUE },
+	{ L"-t",				ARG_PATH,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--target",			ARG_PATH,		RULE_VALUE },
+	{ L"-d",				ARG_PATH,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--dest",			ARG_PATH,		RULE_VALUE },
+	{ L"-w",				ARG_PATH,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--wheel-dir",		ARG_PATH,		RULE_VALUE },
+	{ L"-f",				ARG_AUTO,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--find-links",		ARG_AUTO,		RULE_VALUE },
+	{ L"--prefix",			ARG_PATH,		RULE_VALUE },
+	{ L"--root",			ARG_PATH,		RULE_VALUE },
+	{ L"--src",				ARG_PATH,		RULE_VALUE },
+	{ L"--build",			ARG_PATH,		RULE_VALUE },
+	{ L"--cache-dir",		ARG_PATH,		RULE_VALUE },
+	{ L"--log",				ARG_PATH,		RULE_VALUE },
+	{ L"--log-file",		ARG_PATH,		RULE_VALUE },
+	{ L"-i",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ L"--index-url",		ARG_LITERAL,	RULE_VALUE },
+	{ L"--extra-index-url",	ARG_LITERAL,	RULE_VALUE },
+	{ L"--proxy",			ARG_LITERAL,	RULE_VALUE },
+	{ NULL, 0, 0 }
+};
+
+static const arg_rule pytest_rules[] = {
+	{ L"-k",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ L"-m",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ L"-p",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ L"-o",				ARG_LITERAL,	RULE_VALUE | RULE_ATTACHED },
+	{ L"-c",				ARG_PATH,		RULE_VALUE | RULE_ATTACHED },
+	{ L"--rootdir",			ARG_PATH,		RULE_VALUE },
+	{ L"--basetemp",		ARG_PATH,		RULE_VALUE },
+	{ L"--confcutdir",		ARG_PATH,		RULE_VALUE },
+	{ L"--junitxml",		ARG_PATH,		RULE_VALUE },
+	{ L"--junit-xml",		ARG_PATH,		RULE_VALUE },
+	{ L"--resultlog",		ARG_PATH,		RULE_VALUE },
+	{ L"--result-log",		ARG_PATH,		RULE_VALUE },
+	{ L"--ignore",			ARG_PATH,		RULE_VALUE },
+	{ L"--deselect",		ARG_NODEID,		RULE_VALUE },
+	{ NULL, 0, 0 }
+};
+
+static const arg_profile arg_profiles[] = {
+	{ L"python",		ARG_AUTO,	true,	python_rules },
+	{ L"pip",			ARG_AUTO,	false,	pip_rules },
+	{ L"easy_install",	ARG_AUTO,	false,	pip_rules },
+	{ L"py.test",		ARG_NODEID,	false,	pytest_rules },
+	{ L"pytest",		ARG_NODEID,	false,	pytest_rules },
+	{ NULL,				ARG_AUTO,	false,	default_rules }
+};
+
+/** Rules for anything run by the interpreter. */
+static const arg_profile script_profile = { NULL, ARG_AUTO, false, default_rules };
+
+/** Pick a profile based on our launcher's filename. */
+static const arg_profile* args_profile(const wchar_t* sLauncher)
+{
+	const wchar_t* sName = wcsrchr(sLauncher, L'\\');
+	int i = -1;
+	sName = sName ? sName + 1 : sLauncher;
+	while(arg_profiles[++i].name) {
+		if(_wcsnicmp(sName, arg_profiles[i].name, wcslen(arg_profiles[i].name)) == 0) break;
+	}
+	return &(arg_profiles[i]);
+}
+
+static inline bool arg_is_abs(const wchar_t* s, size_t n)
+{
+	if(n >= 3 && iswalpha(s[0]) && s[1] == L':' && (s[2] == L'\\' || s[2] == L'/')) return true;
+	return n >= 3 && s[0] == L'\\' && s[1] == L'\\';
+}
+
+/** Classify a value by looking at it. */
+static int arg_lex(const wchar_t* s, size_t n)
+{
+	size_t i;
+	bool backslash = false, semicolon = false;
+	if(n == 0) return ARG_LITERAL;
+	for(i = 0; i < n; i++) {
+		if(s[i] == L'\\') backslash = true;
+		else if(s[i] == L';') semicolon = true;
+	}
+	if(semicolon) return arg_is_abs(s, n) ? ARG_PATHLIST : ARG_LITERAL;
+	if(arg_is_abs(s, n)) return ARG_PATH;
+	if(backslash) return ARG_AMBIGUOUS;
+	return ARG_LITERAL;
+}
+
+/** Classify a value we've been told the kind of by a rule. */
+static void arg_apply(int kind, const wchar_t* arg, size_t offset, arg_class* out)
+{
+	const wchar_t* sep;
+	size_t n = wcslen(arg) - offset;
+	int lexed;
+
+	out->offset = offset;
+	out->length = n;
+	if(kind == ARG_NODEID && (sep = wcsstr(&(arg[offset]), L"::"))) {
+		out->length = n = sep - &(arg[offset]);
+	}
+
+	lexed = arg_lex(&(arg[offset]), n);
+	switch(kind) {
+		case ARG_LITERAL:
+			out->kind = ARG_LITERAL;
+			break;
+		case ARG_PATH:
+		case ARG_NODEID:
+			// A relative path without backslashes works as-is.
+			out->kind = lexed == ARG_LITERAL ? ARG_LITERAL : (lexed == ARG_AMBIGUOUS ? ARG_PATH : lexed);
+			break;
+		case ARG_PATHLIST:
+			out->kind = lexed == ARG_LITERAL && !wcschr(&(arg[offset]), L';') ? ARG_LITERAL : ARG_PATHLIST;
+			break;
+		default:
+			out->kind = lexed;
+			break;
+	}
+}
+
+/** Find the rule for an option. Sets *attached if the value's glued onto it. */
+static const arg_rule* arg_find_rule(const arg_profile* profile, const wchar_t* arg, size_t* szopt, bool* attached)
+{
+	const arg_rule* rule;
+	const wchar_t* eq = wcschr(arg, L'=');
+	size_t n = eq ? (size_t)(eq - arg) : wcslen(arg), szrule;
+
+	for(rule = profile->rules; rule->option; rule++) {
+		szrule = wcslen(rule->option);
+		if(szrule == n && wcsncmp(rule->option, arg, n) == 0) {
+			*szopt = n;
+			*attached = eq != NULL;
+			return rule;
+		}
+		// -rfile
+		if((rule->flags & RULE_ATTACHED) && szrule == 2 && arg[1] == rule->option[1] && arg[2] && arg[1] != L'-') {
+			*szopt = 2;
+			*attached = true;
+			return rule;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Classify every argument after argv[0], using the given profile until
+ * we hit the script being run, and the script profile after that.
+ */
+static void args_classify(const arg_profile* profile, int argc, wchar_t** argv, arg_class* out)
+{
+	const arg_rule* rule;
+	size_t szopt;
+	bool attached, options = true;
+	int i;
+
+	ZeroMemory(out, argc * sizeof(arg_class));
+	for(i = 1; i < argc; i++) {
+		wchar_t* arg = argv[i];
+		if(!options || arg[0] != L'-' || arg[1] == L'\0') {
+			// Positional argument.
+			arg_apply(options ? profile->positional : ARG_AUTO, arg, 0, &(out[i]));
+			if(options && profile->scriptPositional) {
+				profile = &script_profile;
+			}
+			continue;
+		}
+		if(wcscmp(arg, L"--") == 0) {
+			out[i].kind = ARG_LITERAL;
+			options = false;
+			continue;
+		}
+
+		if(!(rule = arg_find_rule(profile, arg, &szopt, &attached))) {
+			// Unknown option. All we can do is look at its value, if it has one.
+			const wchar_t* eq = arg[1] == L'-' ? wcschr(arg, L'=') : NULL;
+			if(eq) arg_apply(ARG_AUTO, arg, (eq - arg) + 1, &(out[i]));
+			continue;
+		}
+
+		if(!(rule->flags & RULE_VALUE)) {
+			out[i].kind = ARG_LITERAL;
+		} else if(attached) {
+			arg_apply(rule->kind, arg, szopt + (arg[szopt] == L'=' ? 1 : 0), &(out[i]));
+		} else if(i + 1 < argc) {
+			out[i++].kind = ARG_LITERAL;
+			arg_apply(rule->kind, argv[i], 0, &(out[i]));
+		}
+		if(rule->flags & RULE_SCRIPT) {
+			profile = &script_profile;
+		}
+	}
+}
+
+/** How much of an ambiguous argument is the folder it'd be in. (Up to its last backslash) */
+static size_t args_dir_length(const wchar_t* value, size_t length)
+{
+	const wchar_t* sep;
+	size_t szdir = 0;
+
+	for(sep = value; sep < value + length; sep++) {
+		if(*sep == L'\\') szdir = sep - value;
+	}
+	// A trailing backslash means the whole thing's supposed to be a folder.
+	return szdir + 1 == length ? length : szdir;
+}
+
+/**
+ * Resolve every ARG_AMBIGUOUS argument. These are relative paths with a
+ * backslash in them (or things that only look like one), so they count
+ * as paths if the folder they'd be in exists. Arguments in the same
+ * folder (not just under it) share a single probe.
+ */
+static void args_probe(int argc, wchar_t** argv, arg_class* classes)
+{
+	wchar_t sDir[MAX_PATH+1];
+	const wchar_t* value;
+	size_t szdir;
+	int i, j, kind, count;
+
+	for(i = 1; i < argc; i++) {
+		if(classes[i].kind != ARG_AMBIGUOUS) continue;
+		value = &(argv[i][classes[i].offset]);
+		szdir = args_dir_length(value, classes[i].length);
+		if(szdir > MAX_PATH) {
+			classes[i].kind = ARG_LITERAL;
+			continue;
+		}
+		if(szdir == 0) {
+			// \foo - relative to the root of the current drive, which is
+			// always there, so it's foo itself that has to be. (\d+ and \w*
+			// are regexes) Nothing else shares its folder.
+			kind = ARG_LITERAL;
+			if(classes[i].length <= MAX_PATH) {
+				wcsncpy(sDir, value, classes[i].length);
+				sDir[classes[i].length] = L'\0';
+				if(exists(sDir)) kind = ARG_PATH;
+				verbose(L"Probed %s for 1 argument(s)..", sDir);
+			}
+			classes[i].kind = kind;
+			continue;
+		}
+		wcsncpy(sDir, value, szdir);
+		sDir[szdir] = L'\0';
+		kind = is_folder(sDir) ? ARG_PATH : ARG_LITERAL;
+
+		// Everything else in the same folder gets the same answer. (src\\a\\b isn't in src)
+		for(j = i, count = 0; j < argc; j++) {
+			if(classes[j].kind != ARG_AMBIGUOUS) continue;
+			if(j != i && (args_dir_length(&(argv[j][classes[j].offset]), classes[j].length) != szdir ||
+				_wcsnicmp(&(argv[j][classes[j].offset]), sDir, szdir) != 0)) continue;
+			classes[j].kind = kind;
+			count++;
+		}
+		verbose(L"Probed %s for %d argument(s)..", sDir, count);
+	}
+}
+
+/**
+ * Rebuild an argument with its value replaced by the converted one,
+ * keeping whatever came before and after it. (--opt=, ::name)
+ */
+static wchar_t* args_rewrite(wchar_t* arg, arg_class* cls, const wchar_t* converted)
+{
+	wchar_t* result;
+	size_t szconv = wcslen(converted);
+
+	result = walloc(wcslen(arg) - cls->length + szconv);
+	wcsncpy(result, arg, cls->offset);
+	wcscpy(&(result[cls->offset]), converted);
+	wcscpy(&(result[cls->offset + szconv]), &(arg[cls->offset + cls->length]));
+	return result;
+}
@@ -0,0 +1,388 @@
+/**
+ * batch.c - Converts all of our paths in one go.
+ *
+ * Everything that needs converting (our arguments, our environment
+ * variables, ..) gets queued up with batch_add, and then converted by
+ * batch_run. The originals and the results all live in a single block
+ * owned by the batch (in our arena), so there's no allocation per path,
+ * and the cwd is only looked up once.
+ *
+ * A path that can't be converted is marked as failed and left alone.
+ * Unlike before, it doesn't stop us from converting the rest.
+ *
+ * Long lists (a test runner handed thousands of files) are split between
+ * a few threads, each converting its own slice with our mount table.
+ * Anything that needs cygwin1.dll is left for our own thread afterwards,
+ * since it can't be called from several at once. Before we load it, all of
+ * that goes to our resolver, if there's one running. (See resolver.c)
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** Entry states */
+#define BATCH_PENDING	0
+#define BATCH_DONE		1
+#define BATCH_FAILED	2
+#define BATCH_MOUNTED	3 // Converted by a worker. (to is in its own block, until batch_parallel copies it over)
+#define BATCH_DEFERRED	4 // Our mount table couldn't convert it. Only our resolver or cygwin1.dll is left.
+
+/** Fewer entries than this aren't worth starting threads for. */
+#define BATCH_PARALLEL_MIN	1024
+/** The fewest entries worth giving a worker of their own. */
+#define BATCH_PER_WORKER	512
+#define BATCH_MAX_WORKERS	16
+/** mount_conv keeps a few MAX_ENV buffers on the stack. */
+#define BATCH_WORKER_STACK	(1024 * 1024)
+
+typedef struct {
+	size_t from;		// Offset of the original in our block.
+	size_t to;			// Offset of the result in our block. (BATCH_DONE only)
+	bool islist;
+	int status;
+	int error;			// errno from cygwin1.dll, or 0 if it never got that far.
+} batch_entry;
+
+typedef struct {
+	int direction;		// MOUNT_WIN_TO_POSIX or MOUNT_POSIX_TO_WIN
+	batch_entry* entries;
+	int count, capacity, failed;
+	wchar_t* block;
+	size_t used, size;
+	char* scratch;		// cygwin1.dll only deals in char strings on the POSIX side.
+	size_t szscratch;
+} path_batch;
+
+#ifndef WITHOUT_RESOLVER
+// See resolver.c
+static void resolver_run(path_batch* batch);
+#else
+#	define resolver_run(x) 
+#endif
+
+static void batch_init(path_batch* batch, int direction)
+{
+	ZeroMemory(batch, sizeof(path_batch));
+	batch->direction = direction;
+}
+
+/** Make sure there's room for another count characters in our block. */
+static void batch_reserve(path_batch* batch, size_t count)
+{
+	wchar_t* block;
+	size_t size = batch->size ? batch->size : 1024;
+
+	if(batch->used + count <= batch->size) return;
+	while(size < batch->used + count) size *= 2;
+	block = (wchar_t*)arena_realloc(batch->block, batch->size * sizeof(wchar_t), size * sizeof(wchar_t));
+	batch->block = block;
+	batch->size = size;
+}
+
+/** Same as above, but for our scratch buffer. Returns the buffer. */
+static char* batch_scratch(path_batch* batch, size_t size)
+{
+	char* scratch;
+	if(size <= batch->szscratch) return batch->scratch;
+	scratch = (char*)arena_realloc(batch->scratch, batch->szscratch, size);
+	batch->szscratch = size;
+	return batch->scratch = scratch;
+}
+
+/**
+ * Queue up the first length characters of from for conversion. Returns
+ * the slot to pass to batch_result afterwards.
+ */
+static int batch_add(path_batch* batch, const wchar_t* from, size_t length, bool islist)
+{
+	batch_entry* entry;
+
+	if(batch->count == batch->capacity) {
+		batch->entries = (batch_entry*)arena_realloc(
+			batch->entries,
+			batch->capacity * sizeof(batch_entry),
+			(batch->capacity ? batch->capacity * 2 : 16) * sizeof(batch_entry)
+		);
+		batch->capacity = batch->capacity ? batch->capacity * 2 : 16;
+	}
+
+	batch_reserve(batch, length + 1);
+	entry = &(batch->entries[batch->count]);
+	entry->from = batch->used;
+	entry->to = 0;
+	entry->islist = islist;
+	entry->status = BATCH_PENDING;
+	entry->error = 0;
+	memcpy(&(batch->block[batch->used]), from, length * sizeof(wchar_t));
+	batch->block[batch->used + length] = L'\0';
+	batch->used += length + 1;
+	return batch->count++;
+}
+
+#ifndef WITHOUT_MOUNTS
+/** Converts an entry with our mount table. */
+static bool batch_mounts(path_batch* batch, batch_entry* entry, wchar_t* cwd)
+{
+	wchar_t converted[MAX_ENV+1];
+	size_t szresult;
+
+	szresult = mount_conv(mounts, batch->direction, entry->islist, &(batch->block[entry->from]),
+	                      cwd, converted, MAX_ENV+1);
+	if(!szresult) return false;
+	batch_reserve(batch, szresult + 1);
+	memcpy(&(batch->block[batch->used]), converted, szresult * sizeof(wchar_t));
+	batch->block[batch->used + szresult] = L'\0';
+	entry->to = batch->used;
+	batch->used += szresult + 1;
+	return true;
+}
+#endif
+
+/**
+ * Has cygwin1.dll convert an entry. We ask it how big the result will be
+ * rather than guessing, and a failure only fails this entry.
+ */
+static bool batch_dll(path_batch* batch, batch_entry* entry)
+{
+	ssize_t(*conversion_func)(cygwin_conv_path_t, const void*, void*, size_t);
+	ssize_t szneeded;
+	size_t szconv, szfrom;
+
+	// Load the DLL, if this is the first conversion that needs it.
+	if(!*phCygwin && !setup_cygwin()) return false;
+	conversion_func = entry->islist ? cygwin_conv_path_list : cygwin_conv_path;
+
+	if(batch->direction == MOUNT_WIN_TO_POSIX) {
+		szneeded = conversion_func(CCP_WIN_W_TO_POSIX, &(batch->block[entry->from]), NULL, 0);
+		if(szneeded <= 0) goto failed;
+		batch_scratch(batch, (size_t)szneeded);
+		if(conversion_func(CCP_WIN_W_TO_POSIX, &(batch->block[entry->from]), batch->scratch, szneeded) != 0) {
+			goto failed;
+		}
+
+		// Widen the result straight into our block, which needs no more units than it has bytes.
+		batch_reserve(batch, (size_t)szneeded);
+		szconv = utf8_decode(batch->scratch, (size_t)szneeded, &(batch->block[batch->used]), (size_t)szneeded);
+		if(szconv == UTF_INVALID) goto failed;
+	} else {
+		// Narrow our POSIX path for cygwin, and have it give us a wide result.
+		szfrom = simd_length(&(batch->block[entry->from])) + 1;
+		batch_scratch(batch, UTF8_MAX(szfrom));
+		if(utf8_encode(&(batch->block[entry->from]), szfrom, batch->scratch, UTF8_MAX(szfrom)) == UTF_INVALID) {
+			goto failed;
+		}
+
+		szneeded = conversion_func(CCP_POSIX_TO_WIN_W, batch->scratch, NULL, 0);
+		if(szneeded <= 0) goto failed;
+		szconv = (size_t)szneeded / sizeof(wchar_t);
+		batch_reserve(batch, szconv);
+		if(conversion_func(CCP_POSIX_TO_WIN_W, batch->scratch, &(batch->block[batch->used]), szneeded) != 0) {
+			goto failed;
+		}
+	}
+	entry->to = batch->used;
+	batch->used += szconv;
+	return true;
+
+failed:
+	entry->error = *cygwin_errno();
+	return false;
+}
+
+#ifndef WITHOUT_MOUNTS
+/**
+ * A slice of our entries, converted on a thread of its own. Our arena
+ * isn't thread safe, so each worker keeps its results in a block of its
+ * own, on the heap, until they're copied into ours.
+ */
+typedef struct {
+	path_batch* batch;
+	const wchar_t* cwd;
+	int first, last;
+	wchar_t* block;
+	size_t used, size;
+} batch_worker;
+
+/** How many workers count entries are worth. (CYGLAUNCH_THREADS can lower it. 1 means none) */
+static int batch_workers(int count)
+{
+	SYSTEM_INFO si;
+	wchar_t sValue[16];
+	int result, limit;
+
+	if(count < BATCH_PARALLEL_MIN) return 1;
+	GetSystemInfo(&si);
+	result = (int)si.dwNumberOfProcessors;
+	if(GetEnvironmentVariableW(L"CYGLAUNCH_THREADS", sValue, 16) && (limit = _wtoi(sValue)) > 0 && limit < result) {
+		result = limit;
+	}
+	if(result > count / BATCH_PER_WORKER) result = count / BATCH_PER_WORKER;
+	if(result > BATCH_MAX_WORKERS) result = BATCH_MAX_WORKERS;
+	return result < 1 ? 1 : result;
+}
+
+/** Converts a worker's slice. Only reads our batch, and only writes its own entries. */
+static DWORD WINAPI batch_work(void* param)
+{
+	batch_worker* worker = (batch_worker*)param;
+	const path_batch* batch = worker->batch;
+	batch_entry* entry;
+	wchar_t* block;
+	size_t szresult, size;
+	int i;
+
+	for(i = worker->first; i < worker->last; i++) {
+		entry = &(batch->entries[i]);
+		if(entry->status != BATCH_PENDING) continue;
+		// Room for the longest result, so it can go straight into our block.
+		if(worker->size - worker->used < MAX_ENV+1) {
+			for(size = worker->size ? worker->size * 2 : 2 * (MAX_ENV+1); size - worker->used < MAX_ENV+1; size *= 2);
+			// Out of memory just leaves the rest to our own thread.
+			if(!(block = (wchar_t*)realloc(worker->block, size * sizeof(wchar_t)))) break;
+			worker->block = block;
+			worker->size = size;
+		}
+		szresult = mount_conv(mounts, batch->direction, entry->islist, &(batch->block[entry->from]),
+		                      worker->cwd, &(worker->block[worker->used]), MAX_ENV+1);
+		if(!szresult) {
+			entry->status = BATCH_DEFERRED;
+			continue;
+		}
+		worker->block[worker->used + szresult] = L'\0';
+		entry->to = worker->used;
+		entry->status = BATCH_MOUNTED;
+		worker->used += szresult + 1;
+	}
+	return 0;
+}
+
+/**
+ * Splits our entries between nworkers workers, our own thread being the
+ * first, and copies what they converted into our block in entry order.
+ */
+static void batch_parallel(path_batch* batch, const wchar_t* cwd, int nworkers)
+{
+	batch_worker workers[BATCH_MAX_WORKERS];
+	HANDLE threads[BATCH_MAX_WORKERS];
+	batch_entry* entry;
+	int per = (batch->count + nworkers - 1) / nworkers, w, i;
+
+	trace_begin_n(L"convert_parallel", nworkers);
+	ZeroMemory(workers, sizeof(workers));
+	for(w = 0; w < nworkers; w++) {
+		workers[w].batch = batch;
+		workers[w].cwd = cwd;
+		workers[w].first = w * per;
+		workers[w].last = w * per + per < batch->count ? w * per + per : batch->count;
+		threads[w] = w ? CreateThread(NULL, BATCH_WORKER_STACK, batch_work, &(workers[w]), STACK_SIZE_PARAM_IS_A_RESERVATION, NULL) : NULL;
+	}
+	batch_work(&(workers[0]));
+	for(w = 1; w < nworkers; w++) {
+		if(!threads[w]) {
+			// Couldn't start it, so it's ours.
+			batch_work(&(workers[w]));
+		} else {
+			WaitForSingleObject(threads[w], INFINITE);
+			CloseHandle(threads[w]);
+		}
+	}
+
+	for(w = 0; w < nworkers; w++) {
+		batch_reserve(batch, workers[w].used);
+		if(workers[w].used) memcpy(&(batch->block[batch->used]), workers[w].block, workers[w].used * sizeof(wchar_t));
+		for(i = workers[w].first; i < workers[w].last; i++) {
+			entry = &(batch->entries[i]);
+			if(entry->status != BATCH_MOUNTED) continue;
+			entry->to += batch->used;
+			entry->status = BATCH_DONE;
+			flight(FLIGHT_CONVERT, i, 0, NULL);
+		}
+		batch->used += workers[w].used;
+		free(workers[w].block);
+	}
+	trace_end(L"convert_parallel");
+}
+#endif
+
+/** Lists what we converted, and what we couldn't. */
+static void batch_report(path_batch* batch)
+{
+	int i;
+	if(!verbose_flag || !batch->count) return;
+	verbose(L"Converted %d of %d path(s):", batch->count - batch->failed, batch->count);
+	for(i = 0; i < batch->count; i++) {
+		if(batch->entries[i].status == BATCH_DONE) {
+			verbose_step(L"%s -> %s", &(batch->block[batch->entries[i].from]), &(batch->block[batch->entries[i].to]));
+		} else {
+			verbose_step(L"%s -> failed (errno %d), leaving it alone", &(batch->block[batch->entries[i].from]), batch->entries[i].error);
+		}
+	}
+}
+
+/** Converts everything queued up so far. Returns the number of failures. */
+static int batch_run(path_batch* batch)
+{
+	batch_entry* entry;
+	int i;
+	#ifndef WITHOUT_MOUNTS
+	wchar_t sCwd[MAX_PATH+1] = EMPTYW, sCwdPosix[MAX_PATH+1] = EMPTYW, *cwd = NULL;
+	int nworkers;
+
+	// Relative paths are relative to the cwd, so only look it up once.
+	if(mounts && GetCurrentDirectoryW(MAX_PATH+1, sCwd)) {
+		if(batch->direction == MOUNT_WIN_TO_POSIX) {
+			cwd = sCwd;
+		} else if(mount_conv(mounts, MOUNT_WIN_TO_POSIX, false, sCwd, NULL, sCwdPosix, MAX_PATH+1)) {
+			cwd = sCwdPosix;
+		}
+	}
+	if(cwd && (nworkers = batch_workers(batch->count)) > 1) batch_parallel(batch, cwd, nworkers);
+	#endif
+
+	// Our mount table first, (if we haven't been through it on several threads already)
+	for(i = 0; i < batch->count; i++) {
+		entry = &(batch->entries[i]);
+		if(entry->status != BATCH_PENDING) continue;
+		entry->status = BATCH_DEFERRED;
+		#ifndef WITHOUT_MOUNTS
+		if(!cwd) continue;
+		trace_begin_n(L"convert", i);
+		if(batch_mounts(batch, entry, cwd)) entry->status = BATCH_DONE;
+		trace_end(L"convert");
+		if(entry->status == BATCH_DONE) flight(FLIGHT_CONVERT, i, 0, NULL);
+		#endif
+	}
+
+	// then our resolver, and then cygwin1.dll, for whatever's left.
+	resolver_run(batch);
+	for(i = 0; i < batch->count; i++) {
+		entry = &(batch->entries[i]);
+		if(entry->status == BATCH_DEFERRED) {
+			trace_begin_n(L"convert", i);
+			entry->status = batch_dll(batch, entry) ? BATCH_DONE : BATCH_FAILED;
+			trace_end(L"convert");
+			flight(FLIGHT_CONVERT, i, entry->status == BATCH_FAILED ? entry->error : 0, NULL);
+		}
+		if(entry->status == BATCH_FAILED) batch->failed++;
+	}
+	flight(FLIGHT_BATCH, batch->count, batch->failed, NULL);
+
+	batch_report(batch);
+	return batch->failed;
+}
+
+/** The converted value for a slot, or NULL if it couldn't be converted. */
+static inline wchar_t* batch_result(path_batch* batch, int slot)
+{
+	if(slot < 0 || slot >= batch->count || batch->entries[slot].status != BATCH_DONE) return NULL;
+	return &(batch->block[batch->entries[slot].to]);
+}
+
+static void batch_free(path_batch* batch)
+{
+	xfree(batch->scratch);
+	xfree(batch->entries);
+	xfree(batch->block);
+	ZeroMemory(batch, sizeof(path_batch));
+}
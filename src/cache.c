@@ -0,0 +1,438 @@
+/**
+ * cache.c - Persistent, memory-mapped cache of everything wmain works out
+ *           before it can launch anything.
+ *
+ * None of the module path surgery, the registry lookup, the PATH we build,
+ * the symlink walk or the conversion of our virtualenv root change between
+ * launches, so the results get stored in a small file next to the launcher
+ * (Scripts\.cyglaunch.cache) with one entry per launcher name. Each entry
+ * remembers the identity (volume serial + file index) and last write time
+ * of every file its results were derived from - the Cygwin root, its
+ * fstab (and our user's fstab.d file) and each hop of the symlink chain,
+ * and for scripts, the chain of the interpreter in their #! line - and is
+ * thrown away as soon as one of them changes.
+ *
+ * The file is shared between every launcher in the virtualenv, so writers
+ * bump a per-entry sequence number around their updates, and readers copy
+ * the entry out and treat it as a miss if it changed underneath them. A
+ * writer that was killed half way through leaves its entry's sequence
+ * number odd, so once CACHE_STUCK_TIMEOUT has gone by, the next writer
+ * takes the entry over. Once the table is full, entries nobody can use
+ * any more (for launchers whose files have changed or gone, or a second
+ * one for the same launcher) are overwritten. The header keeps
+ * hit/miss/invalidation counters, which are shown in verbose mode.
+ *
+ * Can be excluded by defining WITHOUT_CACHE.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+#define CACHE_FILENAME		L".cyglaunch.cache"
+#define CACHE_MAGIC			0x48434c43 // CLCH
+#define CACHE_VERSION		4
+#define CACHE_MAX_ENTRIES	32
+#define CACHE_MAX_DEPS		12
+#define CACHE_PATH_MAX		((MAX_PATH+1) * 6)
+
+/** How long an entry can have been being written before we take it its writer died, in ms. */
+#define CACHE_STUCK_TIMEOUT	2000
+
+/** Flags for the optional parts of an entry. */
+#define CACHE_REAL			0x001 // realTarget and realTargetCyg are set.
+#define CACHE_VROOT			0x002 // virtRootCyg is set.
+#define CACHE_SHEBANG		0x004 // interp, interpCyg and interpArgs are set. (See shebang.c)
+
+/** Identity and last write time of a file or folder. */
+typedef struct {
+	dword missing;			// Set if the file didn't exist when we stamped it.
+	dword volume;
+	dword indexHigh, indexLow;
+	FILETIME written;
+} cache_stamp;
+
+typedef struct {
+	wchar_t path[MAX_PATH+1];
+	cache_stamp stamp;
+} cache_dep;
+
+typedef struct {
+	volatile LONG seq;		// Odd while somebody is writing the entry.
+	volatile LONG since;	// GetTickCount() when they started.
+	dword flags;
+	wchar_t name[MAX_PATH+1];
+
+	int ndeps;
+	cache_dep deps[CACHE_MAX_DEPS];
+
+	wchar_t parentDir[MAX_PATH+1];
+	wchar_t target[MAX_PATH+1];
+	wchar_t cygRoot[MAX_PATH+1];
+	wchar_t path[CACHE_PATH_MAX];
+	wchar_t realTarget[MAX_PATH+1];
+	wchar_t realTargetCyg[MAX_PATH+1];
+	wchar_t virtRootCyg[MAX_PATH+1];
+	wchar_t interp[MAX_PATH+1];
+	wchar_t interpCyg[MAX_PATH+1];
+	wchar_t interpArgs[MAX_PATH+1];
+} cache_entry;
+
+/** Where the part of an entry its writer copies in starts. */
+#define CACHE_ENTRY_DATA FIELD_OFFSET(cache_entry, flags)
+
+typedef struct {
+	dword magic;
+	dword version;
+	dword entrySize;
+	volatile LONG hits;
+	volatile LONG misses;
+	volatile LONG invalidations;
+	volatile LONG count;
+	cache_entry entries[CACHE_MAX_ENTRIES];
+} cache_file;
+
+/** Our mapped view of the cache file. */
+static cache_file* cache_view = NULL;
+static bool cache_writable = false;
+
+/**
+ * Our copy of the entry for this launcher. On a hit, this is what wmain
+ * and exec_cmd read from. On a miss, this gets filled in as we go and is
+ * written back by cache_commit.
+ */
+static cache_entry cache_current;
+static bool cache_hit = false;
+static bool cache_dirty = false;
+static int cache_slot = -1;
+
+/** Whether our current entry has a particular optional part, and getting at it. */
+#define cache_has(f) (cache_hit && (cache_current.flags & (f)))
+#define cache_get(f, field) (cache_has(f) ? cache_current.field : NULL)
+
+/** Fill in a stamp for path. Missing files get stamped as missing. */
+static void cache_stamp_path(const wchar_t* path, cache_stamp* stamp)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	HANDLE hFile;
+
+	ZeroMemory(stamp, sizeof(cache_stamp));
+	hFile = CreateFileW(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		stamp->missing = 1;
+		return;
+	}
+	if(GetFileInformationByHandle(hFile, &info)) {
+		stamp->volume = info.dwVolumeSerialNumber;
+		stamp->indexHigh = info.nFileIndexHigh;
+		stamp->indexLow = info.nFileIndexLow;
+		stamp->written = info.ftLastWriteTime;
+	} else {
+		stamp->missing = 1;
+	}
+	CloseHandle(hFile);
+}
+
+/** Check that every file an entry depends on is still the file we saw. */
+static bool cache_validate(const cache_entry* entry)
+{
+	int i;
+	cache_stamp now;
+	for(i = 0; i < entry->ndeps; i++) {
+		cache_stamp_path(entry->deps[i].path, &now);
+		if(memcmp(&now, &(entry->deps[i].stamp), sizeof(cache_stamp)) != 0) {
+			verbose(L"Cache dependency changed: %s", entry->deps[i].path);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Record a file that the current entry's results depend on. Called for the
+ * Cygwin root, its fstab and every path readlink looks at. If there are
+ * too many, the entry just doesn't get stored.
+ */
+static void cache_add_dep(const wchar_t* path)
+{
+	int i;
+	if(!cache_view || !path) return;
+	for(i = 0; i < cache_current.ndeps && i < CACHE_MAX_DEPS; i++) {
+		if(_wcsicmp(cache_current.deps[i].path, path) == 0) return;
+	}
+	if(cache_current.ndeps++ >= CACHE_MAX_DEPS) return;
+	if(FAILED(StringCchCopyW(cache_current.deps[i].path, MAX_PATH+1, path))) {
+		cache_current.ndeps = CACHE_MAX_DEPS + 1;
+		return;
+	}
+	cache_stamp_path(path, &(cache_current.deps[i].stamp));
+	cache_dirty = true;
+}
+
+/** Map the cache file, creating or resetting it if needed. */
+static bool cache_map(const wchar_t* sCachePath)
+{
+	HANDLE hFile, hMapping;
+	LARGE_INTEGER szFile;
+	dword dwAccess = GENERIC_READ | GENERIC_WRITE;
+
+	cache_writable = true;
+	hFile = CreateFileW(sCachePath, dwAccess, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		// Read-only virtualenv. We can still use whatever's there.
+		cache_writable = false;
+		hFile = CreateFileW(sCachePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(hFile == INVALID_HANDLE_VALUE) return false;
+	}
+
+	if(!GetFileSizeEx(hFile, &szFile) || (!cache_writable && szFile.QuadPart != sizeof(cache_file))) {
+		CloseHandle(hFile);
+		return false;
+	}
+
+	// Mapping a file with a size larger than its current one grows it. (zero-filled)
+	hMapping = CreateFileMappingW(hFile, NULL, cache_writable ? PAGE_READWRITE : PAGE_READONLY, 0, sizeof(cache_file), NULL);
+	CloseHandle(hFile);
+	if(hMapping == NULL) return false;
+
+	cache_view = (cache_file*)MapViewOfFile(hMapping, cache_writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, sizeof(cache_file));
+	CloseHandle(hMapping);
+	if(cache_view == NULL) return false;
+
+	if(cache_view->magic != CACHE_MAGIC || cache_view->version != CACHE_VERSION || cache_view->entrySize != sizeof(cache_entry)) {
+		if(!cache_writable) {
+			UnmapViewOfFile(cache_view);
+			cache_view = NULL;
+			return false;
+		}
+		// New or stale file. Other launchers racing us will do the same thing.
+		ZeroMemory(cache_view, sizeof(cache_file));
+		cache_view->version = CACHE_VERSION;
+		cache_view->entrySize = sizeof(cache_entry);
+		cache_view->magic = CACHE_MAGIC;
+	}
+	return true;
+}
+
+/** Copy entry i out of the view, returning false if a writer got in the way. */
+static bool cache_read_entry(int i, cache_entry* out)
+{
+	LONG seq = cache_view->entries[i].seq;
+	if(seq & 1) return false;
+	CopyMemory(out, (const void*)&(cache_view->entries[i]), sizeof(cache_entry));
+	return cache_view->entries[i].seq == seq;
+}
+
+/**
+ * Look up the entry for our executable. sExecutable is the full path of
+ * our module. On a hit, the remaining buffers are filled in from the cache
+ * and true is returned.
+ */
+static bool cache_lookup(wchar_t* sExecutable, wchar_t* sParentDir, wchar_t* sTarget, wchar_t* sCygRoot, wchar_t* sPATH)
+{
+	wchar_t sCachePath[MAX_PATH+1] = EMPTYW, *sName, *sRoot;
+	size_t szRoot;
+	LONG i, count;
+
+	ZeroMemory(&cache_current, sizeof(cache_entry));
+	if(!(sName = wcsrchr(sExecutable, L'\\'))) return false;
+	if(FAILED(StringCchCopyW(cache_current.name, MAX_PATH+1, ++sName))) return false;
+
+	// Our virtualenv's root, (Scripts\..) which every entry has to be for. It could have been moved, cache and all.
+	for(sRoot = sName - 1; sRoot > sExecutable && sRoot[-1] != L'\\'; sRoot--);
+	if(sRoot == sExecutable) return false;
+	szRoot = (size_t)(sRoot - 1 - sExecutable);
+
+	// Scripts\.cyglaunch.cache
+	if((size_t)(sName - sExecutable) + wcslen(CACHE_FILENAME) > MAX_PATH) return false;
+	wcsncpy(sCachePath, sExecutable, sName - sExecutable);
+	wcscat(sCachePath, CACHE_FILENAME);
+	if(!cache_map(sCachePath)) return false;
+
+	count = cache_view->count;
+	if(count > CACHE_MAX_ENTRIES) count = CACHE_MAX_ENTRIES;
+	for(i = 0; i < count; i++) {
+		cache_entry entry;
+		if(_wcsicmp((const wchar_t*)cache_view->entries[i].name, cache_current.name) != 0) continue;
+		cache_slot = (int)i;
+		if(!cache_read_entry(i, &entry) || _wcsicmp(entry.name, cache_current.name) != 0) break;
+		if(wcslen(entry.parentDir) != szRoot || _wcsnicmp(entry.parentDir, sExecutable, szRoot) != 0) {
+			verbose(L"Cache entry is for another virtual environment: %s", entry.parentDir);
+			InterlockedIncrement(&(cache_view->invalidations));
+			break;
+		}
+		if(!cache_validate(&entry)) {
+			InterlockedIncrement(&(cache_view->invalidations));
+			break;
+		}
+
+		CopyMemory(&cache_current, &entry, sizeof(cache_entry));
+		wcscpy(sParentDir, entry.parentDir);
+		wcscpy(sTarget, entry.target);
+		wcscpy(sCygRoot, entry.cygRoot);
+		wcscpy(sPATH, entry.path);
+		cache_hit = true;
+		InterlockedIncrement(&(cache_view->hits));
+		return true;
+	}
+
+	InterlockedIncrement(&(cache_view->misses));
+	return false;
+}
+
+/** After a miss, record what wmain worked out the slow way. */
+static void cache_prepare(wchar_t* sParentDir, wchar_t* sTarget, wchar_t* sCygRoot, wchar_t* sPATH)
+{
+	wchar_t sFstab[MAX_PATH+1] = EMPTYW, sUser[MAX_PATH+1] = EMPTYW;
+	if(cache_hit || !cache_view) return;
+	if(FAILED(StringCchCopyW(cache_current.parentDir, MAX_PATH+1, sParentDir)) ||
+		FAILED(StringCchCopyW(cache_current.target, MAX_PATH+1, sTarget)) ||
+		FAILED(StringCchCopyW(cache_current.cygRoot, MAX_PATH+1, sCygRoot)) ||
+		FAILED(StringCchCopyW(cache_current.path, CACHE_PATH_MAX, sPATH))) {
+		cache_current.ndeps = CACHE_MAX_DEPS + 1;
+		return;
+	}
+	cache_dirty = true;
+	cache_add_dep(sCygRoot);
+	if(SUCCEEDED(StringCchPrintfW(sFstab, MAX_PATH+1, L"%s\\etc\\fstab", sCygRoot))) {
+		cache_add_dep(sFstab);
+	}
+	// Our user's mounts are read from there too. (See load_mount_table)
+	if(GetEnvironmentVariableW(L"USERNAME", sUser, MAX_PATH+1) &&
+		SUCCEEDED(StringCchPrintfW(sFstab, MAX_PATH+1, L"%s\\etc\\fstab.d\\%s", sCygRoot, sUser))) {
+		cache_add_dep(sFstab);
+	}
+}
+
+/** Record the resolved interpreter, in both formats. */
+static void cache_set_real(const wchar_t* sRealTarget, const wchar_t* sRealTargetCyg)
+{
+	if((cache_current.flags & CACHE_REAL) || !sRealTarget || !sRealTargetCyg) return;
+	if(SUCCEEDED(StringCchCopyW(cache_current.realTarget, MAX_PATH+1, sRealTarget)) &&
+		SUCCEEDED(StringCchCopyW(cache_current.realTargetCyg, MAX_PATH+1, sRealTargetCyg))) {
+		cache_current.flags |= CACHE_REAL;
+		cache_dirty = true;
+	}
+}
+
+/** Record the converted virtualenv root. */
+static void cache_set_vroot(const wchar_t* sVirtRootCyg)
+{
+	if((cache_current.flags & CACHE_VROOT) || !sVirtRootCyg) return;
+	if(SUCCEEDED(StringCchCopyW(cache_current.virtRootCyg, MAX_PATH+1, sVirtRootCyg))) {
+		cache_current.flags |= CACHE_VROOT;
+		cache_dirty = true;
+	}
+}
+
+/** Record the interpreter our target's #! line starts, and its arguments. */
+static void cache_set_shebang(const wchar_t* sInterp, const wchar_t* sInterpCyg, const wchar_t* sArgs)
+{
+	if((cache_current.flags & CACHE_SHEBANG) || !(cache_current.flags & CACHE_REAL)) return;
+	if(SUCCEEDED(StringCchCopyW(cache_current.interp, MAX_PATH+1, sInterp)) &&
+		SUCCEEDED(StringCchCopyW(cache_current.interpCyg, MAX_PATH+1, sInterpCyg)) &&
+		SUCCEEDED(StringCchCopyW(cache_current.interpArgs, MAX_PATH+1, sArgs))) {
+		cache_current.flags |= CACHE_SHEBANG;
+		cache_dirty = true;
+	}
+}
+
+/** Whether slot i's writer started more than CACHE_STUCK_TIMEOUT ago, and never finished. */
+static bool cache_stuck(int i)
+{
+	return (cache_view->entries[i].seq & 1) && GetTickCount() - (dword)cache_view->entries[i].since > CACHE_STUCK_TIMEOUT;
+}
+
+/**
+ * Whether slot i holds an entry nobody can use: one left half written, a
+ * second one for a launcher that has an earlier one, (which lookups find
+ * first) one for another virtualenv, or one whose files have changed.
+ */
+static bool cache_useless(int i)
+{
+	cache_entry entry;
+	int j;
+
+	if(cache_stuck(i)) return true;
+	if(!cache_read_entry(i, &entry)) return false;
+	for(j = 0; j < i; j++) {
+		if(_wcsicmp((const wchar_t*)cache_view->entries[j].name, entry.name) == 0) return true;
+	}
+	return _wcsicmp(entry.parentDir, cache_current.parentDir) != 0 || !cache_validate(&entry);
+}
+
+/**
+ * Find a slot for an entry our lookup didn't find. Another launcher may
+ * have added it since, then there's the next free slot, and once there
+ * are none, one whose entry is useless. Returns -1 if there's no room.
+ */
+static int cache_claim()
+{
+	LONG i, count = cache_view->count;
+
+	if(count > CACHE_MAX_ENTRIES) count = CACHE_MAX_ENTRIES;
+	for(i = 0; i < count; i++) {
+		if(_wcsicmp((const wchar_t*)cache_view->entries[i].name, cache_current.name) == 0) return (int)i;
+	}
+	if(count < CACHE_MAX_ENTRIES) {
+		if((i = InterlockedIncrement(&(cache_view->count))) <= CACHE_MAX_ENTRIES) return (int)(i - 1);
+		InterlockedExchange(&(cache_view->count), CACHE_MAX_ENTRIES);
+	}
+	for(i = 0; i < CACHE_MAX_ENTRIES; i++) {
+		if(!cache_useless((int)i)) continue;
+		verbose(L"Cache is full. Replacing the entry for %s..", (const wchar_t*)cache_view->entries[i].name);
+		return (int)i;
+	}
+	return -1;
+}
+
+/**
+ * Write our entry back to the cache file, if we learned anything new.
+ * Entries are overwritten in place, and if the table is full of ones
+ * that are still good, we just don't bother.
+ */
+static void cache_commit()
+{
+	cache_entry* slot;
+	LONG seq, mine;
+
+	if(!cache_view || !cache_writable || !cache_dirty || cache_current.ndeps > CACHE_MAX_DEPS) return;
+	cache_dirty = false;
+
+	if(cache_slot < 0 && (cache_slot = cache_claim()) < 0) return;
+	slot = &(cache_view->entries[cache_slot]);
+	seq = slot->seq;
+	// Somebody else is writing it right now, unless they died doing it.
+	if((seq & 1) && !cache_stuck(cache_slot)) return;
+	mine = seq + ((seq & 1) ? 2 : 1);
+	// Before we take it, so that we never look stuck. If we lose it, whoever won only looks newer.
+	slot->since = (LONG)GetTickCount();
+	if(InterlockedCompareExchange(&(slot->seq), mine, seq) != seq) return;
+	CopyMemory((byte*)slot + CACHE_ENTRY_DATA, (byte*)&cache_current + CACHE_ENTRY_DATA, sizeof(cache_entry) - CACHE_ENTRY_DATA);
+	// If we took so long that somebody took it over, it's theirs now.
+	InterlockedCompareExchange(&(slot->seq), mine + 1, mine);
+}
+
+/** Print the state of the cache. Only called in verbose mode. */
+static void cache_report()
+{
+	if(!cache_view) {
+		verbose(L"Launch cache unavailable.");
+		return;
+	}
+	verbose(L"Launch cache %s for %s..", cache_hit ? L"hit" : L"miss", cache_current.name);
+	verbose_step(L"hits: %d", cache_view->hits);
+	verbose_step(L"misses: %d", cache_view->misses);
+	verbose_step(L"invalidations: %d", cache_view->invalidations);
+	verbose_step(L"entries: %d/%d", cache_view->count, CACHE_MAX_ENTRIES);
+}
+
+/** Unmap the cache file. */
+static void cache_close()
+{
+	if(cache_view) UnmapViewOfFile(cache_view);
+	cache_view = NULL;
+}
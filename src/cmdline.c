@@ -0,0 +1,130 @@
+/**
+ * cmdline.c - Builds the command line we hand to CreateProcess.
+ *
+ * Arguments are quoted and escaped the way the MSVC runtime (and
+ * cygwin1.dll, when started from a Windows process) splits them back up:
+ *
+ *   - Backslashes are literal, unless they come right before a quote.
+ *   - 2n backslashes followed by a quote become n backslashes, and the
+ *     quote starts or ends a quoted section.
+ *   - 2n+1 backslashes followed by a quote become n backslashes and a
+ *     literal quote.
+ *
+ * On top of what whitespace strictly needs, we also quote anything
+ * cygwin1.dll would glob or treat specially (* ? [ ] { } '), since
+ * nothing on the Windows side would have expanded those for us.
+ *
+ * Like mounts.c, this only uses standard C, so it can be built and
+ * checked by itself.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	include <stddef.h>
+#	include <wchar.h>
+#endif
+
+/** Characters that mean an argument needs quoting. */
+#define CMDLINE_QUOTE_CHARS L" \t\n\v\"*?[]{}'"
+
+/** CreateProcess won't take a longer command line than this. (Including its terminator) */
+#define CMDLINE_MAX 32767
+
+static int cmdline_needs_quotes(const wchar_t* arg)
+{
+	if(!*arg) return 1;
+	for(; *arg; arg++) {
+		if(wcschr(CMDLINE_QUOTE_CHARS, *arg)) return 1;
+	}
+	return 0;
+}
+
+/** How many characters an argument takes up once quoted. */
+static size_t cmdline_arg_length(const wchar_t* arg)
+{
+	size_t result = 2, slashes = 0;
+	if(!cmdline_needs_quotes(arg)) return wcslen(arg);
+	for(; *arg; arg++) {
+		if(*arg == L'"') {
+			// Double up the backslashes before it, and escape the quote itself.
+			result += slashes + 2;
+			slashes = 0;
+		} else {
+			slashes = *arg == L'\\' ? slashes + 1 : 0;
+			result++;
+		}
+	}
+	// Same with any backslashes before our closing quote.
+	return result + slashes;
+}
+
+/** Writes an argument out, quoted as needed. Returns the end of what was written. */
+static wchar_t* cmdline_arg_write(wchar_t* out, const wchar_t* arg)
+{
+	size_t slashes = 0;
+	if(!cmdline_needs_quotes(arg)) {
+		while(*arg) *(out++) = *(arg++);
+		return out;
+	}
+	*(out++) = L'"';
+	for(; *arg; arg++) {
+		if(*arg == L'"') {
+			for(slashes++; slashes > 0; slashes--) *(out++) = L'\\';
+			*(out++) = L'"';
+			continue;
+		}
+		slashes = *arg == L'\\' ? slashes + 1 : 0;
+		*(out++) = *arg;
+	}
+	for(; slashes > 0; slashes--) *(out++) = L'\\';
+	*(out++) = L'"';
+	return out;
+}
+
+/**
+ * The program name is split up differently: everything up to the next
+ * quote if it starts with one, otherwise everything up to the first
+ * space. No escapes, so all we can do is quote it if it has spaces.
+ */
+static int cmdline_program_needs_quotes(const wchar_t* program)
+{
+	return !*program || wcspbrk(program, L" \t") != NULL;
+}
+
+/** How many characters argv[1..] take up, with a space before each. (Without a terminator) */
+static size_t cmdline_args_length(int argc, wchar_t** argv)
+{
+	size_t result = 0;
+	int i;
+	for(i = 1; i < argc; i++) result += cmdline_arg_length(argv[i]) + 1;
+	return result;
+}
+
+/** Writes argv[1..] out, with a space before each. Returns the end of what was written. */
+static wchar_t* cmdline_args_write(int argc, wchar_t** argv, wchar_t* out)
+{
+	int i;
+	for(i = 1; i < argc; i++) {
+		*(out++) = L' ';
+		out = cmdline_arg_write(out, argv[i]);
+	}
+	return out;
+}
+
+/** How many characters the command line for argv takes up, including its terminator. */
+static size_t cmdline_length(int argc, wchar_t** argv)
+{
+	return wcslen(argv[0]) + (cmdline_program_needs_quotes(argv[0]) ? 2 : 0) + cmdline_args_length(argc, argv) + 1;
+}
+
+/** Writes the command line for argv to out, which must hold cmdline_length(argc, argv) characters. */
+static void cmdline_write(int argc, wchar_t** argv, wchar_t* out)
+{
+	const wchar_t* program = argv[0];
+	int quoted = cmdline_program_needs_quotes(program);
+
+	if(quoted) *(out++) = L'"';
+	while(*program) *(out++) = *(program++);
+	if(quoted) *(out++) = L'"';
+	out = cmdline_args_write(argc, argv, out);
+	*out = L'\0';
+}
@@ -0,0 +1,1047 @@
+/**
+ * compat.h - Stand-ins for the bits of Win32 (and cygwin1.dll) we use, so
+ *            that everything but our entry point can be built as a library
+ *            on a POSIX host. Only included by precompiled.h, and only when
+ *            we're not building for Windows. (See bench/bench.c)
+ *
+ * These aren't trying to be Wine. They do just enough for our own code to
+ * behave the way it does on Windows:
+ *
+ *   - Windows paths are mapped onto the host's filesystem. X:\some\path
+ *     lives at $CYGLAUNCH_STANDIN_DRIVES/x/some/path.
+ *   - Cygwin marks its symlinks with the SYSTEM attribute, which we don't
+ *     have, so the sticky bit stands in for it. A file without its owner's
+ *     write bit is READONLY.
+ *   - Our registry only has the one value we read, Cygwin's rootdir, which
+ *     comes from $CYGLAUNCH_STANDIN_CYGROOT. (A Windows path)
+ *   - cygwin1.dll is never really loaded. LoadLibraryW hands back our own
+ *     cygwin_conv_path and friends, which only know about /cygdrive and
+ *     the root mount - anything smarter is mounts.c's job anyway.
+ *   - Format strings follow MSVC's conventions, where %s is a wide string
+ *     and %hs a narrow one, so every wide printf goes through
+ *     compat_format first.
+ */
+
+#ifndef _COMPAT_H_
+#define _COMPAT_H_
+
+// For setenv, wcscasecmp and friends.
+#ifndef _XOPEN_SOURCE
+#	define _XOPEN_SOURCE 700
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Types */
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int32_t HRESULT;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef BYTE* LPBYTE;
+typedef void* HANDLE;
+typedef void* HMODULE;
+typedef void* HKEY;
+typedef void(*FARPROC)();
+
+typedef struct { DWORD dwLowDateTime, dwHighDateTime; } FILETIME;
+
+typedef int64_t LONGLONG;
+
+typedef union {
+	struct { DWORD LowPart, HighPart; } u;
+	uint64_t QuadPart;
+} ULARGE_INTEGER;
+
+typedef union {
+	struct { DWORD LowPart; LONG HighPart; } u;
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime, ftLastAccessTime, ftLastWriteTime;
+	DWORD nFileSizeHigh, nFileSizeLow;
+} WIN32_FILE_ATTRIBUTE_DATA;
+
+typedef enum { GetFileExInfoStandard } GET_FILEEX_INFO_LEVELS;
+
+typedef struct {
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime, ftLastAccessTime, ftLastWriteTime;
+	DWORD dwVolumeSerialNumber;
+	DWORD nFileSizeHigh, nFileSizeLow;
+	DWORD nNumberOfLinks;
+	DWORD nFileIndexHigh, nFileIndexLow;
+} BY_HANDLE_FILE_INFORMATION;
+
+typedef struct {
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime, ftLastAccessTime, ftLastWriteTime;
+	DWORD nFileSizeHigh, nFileSizeLow;
+	DWORD dwReserved0, dwReserved1;
+	wchar_t cFileName[260];
+	wchar_t cAlternateFileName[14];
+} WIN32_FIND_DATAW;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+#define ANYSIZE_ARRAY 1
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+
+/* Limits */
+#define _MAX_PATH 260
+#define _MAX_ENV 32767
+
+/* Error codes */
+#define S_OK ((HRESULT)0L)
+#define STRSAFE_E_INSUFFICIENT_BUFFER ((HRESULT)0x8007007AL)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define ERROR_SUCCESS 0L
+#define ERROR_FILE_NOT_FOUND ENOENT
+#define ERROR_PATH_NOT_FOUND ENOENT
+#define ERROR_FILENAME_EXCED_RANGE ENAMETOOLONG
+#define ERROR_MORE_DATA 234L
+
+/* Files */
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+#define FILE_ATTRIBUTE_READONLY 0x001
+#define FILE_ATTRIBUTE_SYSTEM 0x004
+#define FILE_ATTRIBUTE_DIRECTORY 0x010
+#define FILE_ATTRIBUTE_NORMAL 0x080
+#define FILE_ATTRIBUTE_REPARSE_POINT 0x400
+#define GENERIC_READ 0x80000000L
+#define GENERIC_WRITE 0x40000000L
+#define FILE_SHARE_READ 0x001
+#define FILE_SHARE_WRITE 0x002
+#define FILE_SHARE_DELETE 0x004
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000L
+#define FILE_FLAG_BACKUP_SEMANTICS 0x02000000L
+#define FILE_FLAG_OPEN_REPARSE_POINT 0x00200000L
+#define FSCTL_GET_REPARSE_POINT 0x000900A8L
+#define MOVEFILE_REPLACE_EXISTING 0x001
+
+/* Memory */
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_READ 0x0004
+
+/* Registry */
+#define HKEY_LOCAL_MACHINE ((HKEY)(intptr_t)0x80000002L)
+#define KEY_READ 0x20019
+#define REG_SZ 1
+#define REG_EXPAND_SZ 2
+
+/* Strings */
+#define CP_ACP 0
+#define CP_UTF8 65001
+#define FORMAT_MESSAGE_IGNORE_INSERTS 0x200
+#define FORMAT_MESSAGE_FROM_SYSTEM 0x1000
+#define LANG_NEUTRAL 0
+#define SUBLANG_DEFAULT 1
+#define MAKELANGID(p, s) ((((WORD)(s)) << 10) | (WORD)(p))
+
+#define _wcsicmp wcscasecmp
+#define _wcsnicmp wcsncasecmp
+#define lstrlenW(s) ((int)wcslen(s))
+#define _wtoi(s) ((int)wcstol((s), NULL, 10))
+
+/** Where our Windows drives live. ($CYGLAUNCH_STANDIN_DRIVES) */
+static const char* compat_drives = NULL;
+
+/** Our last error. Everything here sets errno, so that's all it is. */
+#define GetLastError() ((DWORD)errno)
+#define ExitProcess(code) exit((int)(code))
+#define GetCurrentProcessId() ((DWORD)getpid())
+
+/* Atomics */
+#define InterlockedIncrement(p) __sync_add_and_fetch((p), 1)
+#define InterlockedExchange(p, v) __sync_lock_test_and_set((p), (v))
+
+/* Timing - our performance counter ticks in nanoseconds. */
+static BOOL QueryPerformanceCounter(LARGE_INTEGER* counter)
+{
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return FALSE;
+	counter->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return TRUE;
+}
+
+static BOOL QueryPerformanceFrequency(LARGE_INTEGER* freq)
+{
+	freq->QuadPart = 1000000000;
+	return TRUE;
+}
+
+/**
+ * Threads. Their handles start past anything open() will give us, so
+ * that CloseHandle can tell them from our files. Only ever started and
+ * waited on from one thread. (See batch.c)
+ */
+#define INFINITE 0xFFFFFFFFL
+#define WAIT_OBJECT_0 0L
+#define WAIT_FAILED ((DWORD)0xFFFFFFFF)
+#define STACK_SIZE_PARAM_IS_A_RESERVATION 0x00010000L
+#define COMPAT_MAX_THREADS 64
+#define COMPAT_THREAD_BASE 0x40000000
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(void*);
+typedef struct { DWORD dwNumberOfProcessors; } SYSTEM_INFO;
+
+static struct { pthread_t thread; LPTHREAD_START_ROUTINE start; void* param; BOOL used, running; } compat_threads[COMPAT_MAX_THREADS];
+
+static void* compat_thread_start(void* slot)
+{
+	compat_threads[(intptr_t)slot].start(compat_threads[(intptr_t)slot].param);
+	return NULL;
+}
+
+static int compat_thread_slot(HANDLE h)
+{
+	intptr_t slot = (intptr_t)h - COMPAT_THREAD_BASE;
+	return slot >= 0 && slot < COMPAT_MAX_THREADS && compat_threads[slot].used ? (int)slot : -1;
+}
+
+static HANDLE CreateThread(void* security, SIZE_T szstack, LPTHREAD_START_ROUTINE start, void* param, DWORD flags, DWORD* id)
+{
+	pthread_attr_t attr;
+	intptr_t slot;
+	int ret;
+
+	for(slot = 0; slot < COMPAT_MAX_THREADS && compat_threads[slot].used; slot++);
+	if(slot == COMPAT_MAX_THREADS) { errno = EAGAIN; return NULL; }
+	compat_threads[slot].start = start;
+	compat_threads[slot].param = param;
+	pthread_attr_init(&attr);
+	if(szstack) pthread_attr_setstacksize(&attr, szstack);
+	ret = pthread_create(&(compat_threads[slot].thread), &attr, compat_thread_start, (void*)slot);
+	pthread_attr_destroy(&attr);
+	if(ret != 0) { errno = ret; return NULL; }
+	compat_threads[slot].used = compat_threads[slot].running = TRUE;
+	return (HANDLE)(COMPAT_THREAD_BASE + slot);
+}
+
+/** Only threads can be waited on, and only for as long as they take. */
+static DWORD WaitForSingleObject(HANDLE h, DWORD timeout)
+{
+	int slot = compat_thread_slot(h);
+	if(slot < 0 || (compat_threads[slot].running && pthread_join(compat_threads[slot].thread, NULL) != 0)) return WAIT_FAILED;
+	compat_threads[slot].running = FALSE;
+	return WAIT_OBJECT_0;
+}
+
+static void GetSystemInfo(SYSTEM_INFO* info)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	info->dwNumberOfProcessors = n > 0 ? (DWORD)n : 1;
+}
+
+/**
+ * UTF-8 <-> wchar_t. (Which is UTF-32 everywhere we care about) Both take
+ * and return counts the way MultiByteToWideChar and WideCharToMultiByte do,
+ * so -1 means "up to and including the terminator".
+ */
+static int compat_utf8_decode(const char* src, int cbsrc, wchar_t* dst, int cchdst)
+{
+	const unsigned char *p = (const unsigned char*)src, *end;
+	unsigned long c;
+	int n = 0, extra;
+
+	if(cbsrc < 0) cbsrc = (int)strlen(src) + 1;
+	for(end = p + cbsrc; p < end; n++) {
+		c = *(p++);
+		extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+		if(extra) c &= 0x3F >> extra;
+		for(; extra > 0 && p < end && (*p & 0xC0) == 0x80; extra--) c = (c << 6) | (*(p++) & 0x3F);
+		if(extra) c = 0xFFFD;
+		if(dst) {
+			if(n >= cchdst) { errno = ENOSPC; return 0; }
+			dst[n] = (wchar_t)c;
+		}
+	}
+	return n;
+}
+
+static int compat_utf8_encode(const wchar_t* src, int cchsrc, char* dst, int cbdst)
+{
+	char buf[4];
+	unsigned long c;
+	int n = 0, len, i;
+
+	if(cchsrc < 0) cchsrc = (int)wcslen(src) + 1;
+	for(i = 0; i < cchsrc; i++) {
+		c = (unsigned long)src[i];
+		if(c < 0x80) {
+			buf[0] = (char)c;
+			len = 1;
+		} else if(c < 0x800) {
+			buf[0] = (char)(0xC0 | (c >> 6));
+			buf[1] = (char)(0x80 | (c & 0x3F));
+			len = 2;
+		} else if(c < 0x10000) {
+			buf[0] = (char)(0xE0 | (c >> 12));
+			buf[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+			buf[2] = (char)(0x80 | (c & 0x3F));
+			len = 3;
+		} else {
+			buf[0] = (char)(0xF0 | (c >> 18));
+			buf[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+			buf[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+			buf[3] = (char)(0x80 | (c & 0x3F));
+			len = 4;
+		}
+		if(dst) {
+			if(n + len > cbdst) { errno = ENOSPC; return 0; }
+			memcpy(&(dst[n]), buf, len);
+		}
+		n += len;
+	}
+	return n;
+}
+
+// Our ANSI codepage is UTF-8, same as any sane POSIX host.
+#define MultiByteToWideChar(cp, flags, src, cbsrc, dst, cchdst) compat_utf8_decode(src, cbsrc, dst, cchdst)
+#define WideCharToMultiByte(cp, flags, src, cchsrc, dst, cbdst, def, useddef) compat_utf8_encode(src, cchsrc, dst, cbdst)
+
+/** A narrow copy of s, on the heap. */
+static char* compat_narrow(const wchar_t* s)
+{
+	int sz = compat_utf8_encode(s, -1, NULL, 0);
+	char* result = (char*)malloc(sz);
+	if(result) compat_utf8_encode(s, -1, result, sz);
+	return result;
+}
+
+/**
+ * Map a Windows path onto the host. Drive paths go under our drives
+ * folder, anything else (relative paths) just has its slashes flipped.
+ * Returns NULL, with errno set, if there's no host equivalent.
+ */
+static char* compat_host_path(const wchar_t* path)
+{
+	char *narrow, *result, *p;
+	size_t szdrives;
+
+	if(!path || !(narrow = compat_narrow(path))) { errno = EINVAL; return NULL; }
+	for(p = narrow; *p; p++) if(*p == '\\') *p = '/';
+	if(!isalpha((unsigned char)narrow[0]) || narrow[1] != ':') return narrow;
+
+	if(!compat_drives && !(compat_drives = getenv("CYGLAUNCH_STANDIN_DRIVES"))) {
+		free(narrow);
+		errno = ENOENT;
+		return NULL;
+	}
+	szdrives = strlen(compat_drives);
+	if(!(result = (char*)malloc(szdrives + strlen(narrow) + 2))) {
+		free(narrow);
+		return NULL;
+	}
+	// X:/rest -> <drives>/x/rest
+	memcpy(result, compat_drives, szdrives);
+	result[szdrives] = '/';
+	result[szdrives + 1] = (char)tolower((unsigned char)narrow[0]);
+	strcpy(&(result[szdrives + 2]), &(narrow[2]));
+	free(narrow);
+	return result;
+}
+
+/** Copies a wide string into a counted buffer, GetXxxW style. */
+static DWORD compat_copy_out(const wchar_t* value, wchar_t* buffer, DWORD size)
+{
+	DWORD szvalue = (DWORD)wcslen(value);
+	if(!buffer || szvalue >= size) return szvalue + 1;
+	wmemcpy(buffer, value, szvalue + 1);
+	return szvalue;
+}
+
+/* Files */
+static DWORD compat_attributes(const struct stat* st)
+{
+	DWORD result = 0;
+	if(S_ISDIR(st->st_mode)) result |= FILE_ATTRIBUTE_DIRECTORY;
+	if(st->st_mode & S_ISVTX) result |= FILE_ATTRIBUTE_SYSTEM;
+	if(!(st->st_mode & S_IWUSR)) result |= FILE_ATTRIBUTE_READONLY;
+	return result ? result : FILE_ATTRIBUTE_NORMAL;
+}
+
+/** 100ns ticks since 1601, like the real thing. */
+static void compat_filetime(const struct stat* st, FILETIME* ft)
+{
+	uint64_t ticks = ((uint64_t)st->st_mtim.tv_sec + 11644473600ULL) * 10000000ULL + (uint64_t)st->st_mtim.tv_nsec / 100;
+	ft->dwLowDateTime = (DWORD)(ticks & 0xFFFFFFFF);
+	ft->dwHighDateTime = (DWORD)(ticks >> 32);
+}
+
+static BOOL compat_stat(const wchar_t* path, struct stat* st)
+{
+	char* host = compat_host_path(path);
+	int ret;
+	if(!host) return FALSE;
+	ret = stat(host, st);
+	free(host);
+	return ret == 0;
+}
+
+static DWORD GetFileAttributesW(const wchar_t* path)
+{
+	struct stat st;
+	return compat_stat(path, &st) ? compat_attributes(&st) : INVALID_FILE_ATTRIBUTES;
+}
+
+static BOOL GetFileAttributesExW(const wchar_t* path, GET_FILEEX_INFO_LEVELS level, void* info)
+{
+	WIN32_FILE_ATTRIBUTE_DATA* data = (WIN32_FILE_ATTRIBUTE_DATA*)info;
+	struct stat st;
+	if(!compat_stat(path, &st)) return FALSE;
+	memset(data, 0, sizeof(WIN32_FILE_ATTRIBUTE_DATA));
+	data->dwFileAttributes = compat_attributes(&st);
+	data->nFileSizeLow = (DWORD)((uint64_t)st.st_size & 0xFFFFFFFF);
+	data->nFileSizeHigh = (DWORD)((uint64_t)st.st_size >> 32);
+	compat_filetime(&st, &(data->ftLastWriteTime));
+	return TRUE;
+}
+
+/** Only ever opens for reading. That's all our stand-ins are used for. */
+static HANDLE CreateFileW(const wchar_t* path, DWORD access, DWORD share, void* security,
+	DWORD disposition, DWORD flags, HANDLE tmpl)
+{
+	char* host = compat_host_path(path);
+	int fd;
+	if(!host) return INVALID_HANDLE_VALUE;
+	fd = open(host, O_RDONLY);
+	free(host);
+	return fd < 0 ? INVALID_HANDLE_VALUE : (HANDLE)(intptr_t)fd;
+}
+
+static BOOL ReadFile(HANDLE hFile, void* buffer, DWORD size, DWORD* szread, void* overlapped)
+{
+	ssize_t ret = read((int)(intptr_t)hFile, buffer, size);
+	if(ret < 0) return FALSE;
+	*szread = (DWORD)ret;
+	return TRUE;
+}
+
+static BOOL CloseHandle(HANDLE h)
+{
+	int slot = compat_thread_slot(h);
+	if(slot < 0) return close((int)(intptr_t)h) == 0;
+	if(compat_threads[slot].running) pthread_detach(compat_threads[slot].thread);
+	compat_threads[slot].used = compat_threads[slot].running = FALSE;
+	return TRUE;
+}
+
+/** The device and inode stand in for the volume serial and file index. */
+static BOOL GetFileInformationByHandle(HANDLE hFile, BY_HANDLE_FILE_INFORMATION* info)
+{
+	struct stat st;
+	if(fstat((int)(intptr_t)hFile, &st) != 0) return FALSE;
+	memset(info, 0, sizeof(BY_HANDLE_FILE_INFORMATION));
+	info->dwFileAttributes = compat_attributes(&st);
+	compat_filetime(&st, &(info->ftLastWriteTime));
+	info->dwVolumeSerialNumber = (DWORD)st.st_dev;
+	info->nFileSizeLow = (DWORD)((uint64_t)st.st_size & 0xFFFFFFFF);
+	info->nFileSizeHigh = (DWORD)((uint64_t)st.st_size >> 32);
+	info->nNumberOfLinks = (DWORD)st.st_nlink;
+	info->nFileIndexLow = (DWORD)((uint64_t)st.st_ino & 0xFFFFFFFF);
+	info->nFileIndexHigh = (DWORD)((uint64_t)st.st_ino >> 32);
+	return TRUE;
+}
+
+static BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* size)
+{
+	struct stat st;
+	if(fstat((int)(intptr_t)hFile, &st) != 0) return FALSE;
+	size->QuadPart = (LONGLONG)st.st_size;
+	return TRUE;
+}
+
+/**
+ * Read-only mappings of whole files. A mapping is just another descriptor
+ * for the file, and we remember how big each view is so it can be unmapped.
+ */
+#define COMPAT_MAX_VIEWS 8
+static struct { void* addr; size_t size; } compat_views[COMPAT_MAX_VIEWS];
+
+static HANDLE CreateFileMappingW(HANDLE hFile, void* security, DWORD protect, DWORD sizeHigh, DWORD sizeLow, const wchar_t* name)
+{
+	int fd = dup((int)(intptr_t)hFile);
+	return fd < 0 ? NULL : (HANDLE)(intptr_t)fd;
+}
+
+static void* MapViewOfFile(HANDLE hMapping, DWORD access, DWORD offsetHigh, DWORD offsetLow, SIZE_T size)
+{
+	struct stat st;
+	void* addr;
+	int i;
+	if(fstat((int)(intptr_t)hMapping, &st) != 0 || st.st_size <= 0) return NULL;
+	if(!size) size = (SIZE_T)st.st_size;
+	for(i = 0; i < COMPAT_MAX_VIEWS && compat_views[i].addr; i++);
+	if(i == COMPAT_MAX_VIEWS) return NULL;
+	if((addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, (int)(intptr_t)hMapping, 0)) == MAP_FAILED) return NULL;
+	compat_views[i].addr = addr;
+	compat_views[i].size = size;
+	return addr;
+}
+
+static BOOL UnmapViewOfFile(const void* addr)
+{
+	int i;
+	for(i = 0; i < COMPAT_MAX_VIEWS; i++) {
+		if(compat_views[i].addr == addr) {
+			munmap(compat_views[i].addr, compat_views[i].size);
+			compat_views[i].addr = NULL;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/** Only handles folder\* and folder\*.ext, which is all we ask for. */
+typedef struct {
+	DIR* dir;
+	char* folder;
+	wchar_t ext[16];
+} compat_find;
+
+static BOOL FindNextFileW(HANDLE hFind, WIN32_FIND_DATAW* data)
+{
+	compat_find* find = (compat_find*)hFind;
+	struct dirent* ent;
+	struct stat st;
+	char* path;
+	size_t szname, szext = wcslen(find->ext);
+
+	while((ent = readdir(find->dir)) != NULL) {
+		memset(data, 0, sizeof(WIN32_FIND_DATAW));
+		if(compat_utf8_decode(ent->d_name, -1, data->cFileName, 260) <= 0) continue;
+		szname = wcslen(data->cFileName);
+		if(szext && (szname < szext || wcscasecmp(&(data->cFileName[szname - szext]), find->ext) != 0)) continue;
+		if(!(path = (char*)malloc(strlen(find->folder) + strlen(ent->d_name) + 2))) return FALSE;
+		sprintf(path, "%s/%s", find->folder, ent->d_name);
+		if(stat(path, &st) == 0) {
+			data->dwFileAttributes = compat_attributes(&st);
+			data->nFileSizeLow = (DWORD)((uint64_t)st.st_size & 0xFFFFFFFF);
+			data->nFileSizeHigh = (DWORD)((uint64_t)st.st_size >> 32);
+			compat_filetime(&st, &(data->ftLastWriteTime));
+		}
+		free(path);
+		return TRUE;
+	}
+	errno = ENOENT;
+	return FALSE;
+}
+
+static BOOL FindClose(HANDLE hFind)
+{
+	compat_find* find = (compat_find*)hFind;
+	closedir(find->dir);
+	free(find->folder);
+	free(find);
+	return TRUE;
+}
+
+static HANDLE FindFirstFileW(const wchar_t* pattern, WIN32_FIND_DATAW* data)
+{
+	const wchar_t* star = wcsrchr(pattern, L'*');
+	wchar_t folder[_MAX_PATH+1];
+	compat_find* find;
+	size_t szfolder;
+
+	if(!star || star == pattern || star[-1] != L'\\' || wcslen(&(star[1])) >= 16) return INVALID_HANDLE_VALUE;
+	szfolder = (size_t)(star - pattern) - 1;
+	if(szfolder > _MAX_PATH) return INVALID_HANDLE_VALUE;
+	wmemcpy(folder, pattern, szfolder);
+	folder[szfolder] = L'\0';
+	if(!(find = (compat_find*)calloc(1, sizeof(compat_find)))) return INVALID_HANDLE_VALUE;
+	wcscpy(find->ext, &(star[1]));
+	if(!(find->folder = compat_host_path(folder)) || !(find->dir = opendir(find->folder))) {
+		free(find->folder);
+		free(find);
+		return INVALID_HANDLE_VALUE;
+	}
+	if(!FindNextFileW((HANDLE)find, data)) {
+		FindClose((HANDLE)find);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)find;
+}
+
+/** We never report reparse points, so nobody should get this far. */
+static BOOL DeviceIoControl(HANDLE h, DWORD code, void* in, DWORD szin, void* out, DWORD szout,
+	DWORD* szreturned, void* overlapped)
+{
+	errno = ENOSYS;
+	return FALSE;
+}
+
+static int _waccess(const wchar_t* path, int mode)
+{
+	char* host = compat_host_path(path);
+	int ret;
+	if(!host) return -1;
+	ret = access(host, mode);
+	free(host);
+	return ret;
+}
+
+static FILE* _wfopen(const wchar_t* path, const wchar_t* mode)
+{
+	char *host = compat_host_path(path), *narrowmode = compat_narrow(mode);
+	FILE* result = host && narrowmode ? fopen(host, narrowmode) : NULL;
+	free(host);
+	free(narrowmode);
+	return result;
+}
+
+/** rename() always replaces, which is the only way we ask for it. */
+static BOOL MoveFileExW(const wchar_t* from, const wchar_t* to, DWORD flags)
+{
+	char *hostfrom = compat_host_path(from), *hostto = compat_host_path(to);
+	BOOL result = hostfrom && hostto && rename(hostfrom, hostto) == 0;
+	free(hostfrom);
+	free(hostto);
+	return result;
+}
+
+static BOOL CreateHardLinkW(const wchar_t* path, const wchar_t* existing, void* security)
+{
+	char *hostpath = compat_host_path(path), *hostexisting = compat_host_path(existing);
+	BOOL result = hostpath && hostexisting && link(hostexisting, hostpath) == 0;
+	free(hostpath);
+	free(hostexisting);
+	return result;
+}
+
+static BOOL DeleteFileW(const wchar_t* path)
+{
+	char* host = compat_host_path(path);
+	BOOL result = host && unlink(host) == 0;
+	free(host);
+	return result;
+}
+
+/** Maps our cwd back to a Windows path, if it's on one of our drives. */
+static DWORD GetCurrentDirectoryW(DWORD size, wchar_t* buffer)
+{
+	char cwd[4096];
+	wchar_t wide[_MAX_ENV+1];
+	size_t szdrives;
+	int n;
+
+	if(!getcwd(cwd, sizeof(cwd))) return 0;
+	if(!compat_drives && !(compat_drives = getenv("CYGLAUNCH_STANDIN_DRIVES"))) return 0;
+	szdrives = strlen(compat_drives);
+	if(strncmp(cwd, compat_drives, szdrives) != 0 || cwd[szdrives] != '/' || !cwd[szdrives + 1] ||
+		(cwd[szdrives + 2] && cwd[szdrives + 2] != '/')) {
+		errno = ENOENT;
+		return 0;
+	}
+	wide[0] = (wchar_t)towupper((wint_t)cwd[szdrives + 1]);
+	wide[1] = L':';
+	if((n = compat_utf8_decode(&(cwd[szdrives + 2]), -1, &(wide[2]), _MAX_ENV - 2)) <= 0) return 0;
+	if(n == 1) wcscpy(&(wide[2]), L"\\");
+	for(n = 2; wide[n]; n++) if(wide[n] == L'/') wide[n] = L'\\';
+	return compat_copy_out(wide, buffer, size);
+}
+
+static unsigned int GetSystemDirectoryW(wchar_t* buffer, unsigned int size)
+{
+	return compat_copy_out(L"C:\\Windows\\System32", buffer, size);
+}
+
+/* Environment */
+static DWORD GetEnvironmentVariableW(const wchar_t* name, wchar_t* buffer, DWORD size)
+{
+	char *narrow = compat_narrow(name), *value = narrow ? getenv(narrow) : NULL;
+	wchar_t* wide;
+	int szwide;
+	DWORD result;
+
+	free(narrow);
+	if(!value) { errno = ENOENT; return 0; }
+	szwide = compat_utf8_decode(value, -1, NULL, 0);
+	if(!(wide = (wchar_t*)malloc(szwide * sizeof(wchar_t)))) return 0;
+	compat_utf8_decode(value, -1, wide, szwide);
+	result = compat_copy_out(wide, buffer, size);
+	free(wide);
+	return result;
+}
+
+static BOOL SetEnvironmentVariableW(const wchar_t* name, const wchar_t* value)
+{
+	char *narrow = compat_narrow(name), *narrowvalue = NULL;
+	int ret;
+	if(!narrow) return FALSE;
+	if(!value) {
+		ret = unsetenv(narrow);
+	} else if((narrowvalue = compat_narrow(value)) != NULL) {
+		ret = setenv(narrow, narrowvalue, 1);
+	} else {
+		ret = -1;
+	}
+	free(narrow);
+	free(narrowvalue);
+	return ret == 0;
+}
+
+extern char** environ;
+
+/** A copy of environ, as a block of NUL-terminated NAME=value strings ending in an empty one. */
+static wchar_t* GetEnvironmentStringsW(void)
+{
+	size_t szblock = 1, i;
+	wchar_t *result, *p;
+
+	for(i = 0; environ[i]; i++) szblock += (size_t)compat_utf8_decode(environ[i], -1, NULL, 0);
+	if(!(result = (wchar_t*)malloc(szblock * sizeof(wchar_t)))) return NULL;
+	for(p = result, i = 0; environ[i]; i++) p += compat_utf8_decode(environ[i], -1, p, (int)(szblock - (p - result)));
+	*p = L'\0';
+	return result;
+}
+
+static BOOL FreeEnvironmentStringsW(wchar_t* block)
+{
+	free(block);
+	return TRUE;
+}
+
+/* Memory - calloc gives us the same zeroed pages VirtualAlloc does. */
+#define VirtualAlloc(addr, size, type, protect) calloc(1, (size))
+static BOOL VirtualFree(void* addr, SIZE_T size, DWORD type)
+{
+	free(addr);
+	return TRUE;
+}
+
+/* Registry */
+static LONG RegOpenKeyExW(HKEY root, const wchar_t* subkey, DWORD options, DWORD sam, HKEY* result)
+{
+	if(!getenv("CYGLAUNCH_STANDIN_CYGROOT")) return errno = ENOENT;
+	*result = root;
+	return ERROR_SUCCESS;
+}
+
+/** The only value in our registry is Cygwin's rootdir. Sizes are in bytes. */
+static LONG RegQueryValueExW(HKEY key, const wchar_t* name, DWORD* reserved, DWORD* type, LPBYTE data, DWORD* szdata)
+{
+	const char* value = getenv("CYGLAUNCH_STANDIN_CYGROOT");
+	int szvalue;
+
+	if(!value) return errno = ENOENT;
+	szvalue = compat_utf8_decode(value, -1, NULL, 0);
+	if(type) *type = REG_SZ;
+	if(!data || *szdata < szvalue * sizeof(wchar_t)) {
+		*szdata = szvalue * sizeof(wchar_t);
+		return data ? ERROR_MORE_DATA : ERROR_SUCCESS;
+	}
+	compat_utf8_decode(value, -1, (wchar_t*)data, szvalue);
+	*szdata = szvalue * sizeof(wchar_t);
+	return ERROR_SUCCESS;
+}
+
+#define RegCloseKey(key) ERROR_SUCCESS
+
+/**
+ * Our cygwin1.dll. Same signatures and the same size-then-convert
+ * protocol as the real cygwin_conv_path, but all it knows about is
+ * /cygdrive and $CYGLAUNCH_STANDIN_CYGROOT mounted at /.
+ */
+#define COMPAT_CCP_POSIX_TO_WIN_W	1
+#define COMPAT_CCP_WIN_W_TO_POSIX	3
+
+static void compat_cygwin_dll_init() {}
+static int* compat_cygwin_errno() { return &errno; }
+
+/** Converts one path, appending it to out. Returns false if it won't fit. */
+static BOOL compat_conv_one(int towin, const wchar_t* path, size_t n, wchar_t* out, size_t* pos, size_t szout)
+{
+	const char* cygroot;
+	wchar_t prefix[_MAX_PATH+1];
+	size_t i = 0, szprefix = 0;
+
+	if(!towin && n >= 2 && path[1] == L':') {
+		// X:\rest -> /cygdrive/x/rest
+		szprefix = swprintf(prefix, _MAX_PATH+1, L"/cygdrive/%lc", (wint_t)towlower((wint_t)path[0]));
+		i = 2;
+	} else if(towin && n >= 11 && wcsncmp(path, L"/cygdrive/", 10) == 0 && (n == 11 || path[11] == L'/')) {
+		// /cygdrive/x/rest -> X:\rest
+		prefix[0] = (wchar_t)towupper((wint_t)path[10]);
+		prefix[1] = L':';
+		szprefix = 2;
+		i = 11;
+		if(n == 11) prefix[szprefix++] = L'\\';
+	} else if(towin && n && path[0] == L'/') {
+		if(!(cygroot = getenv("CYGLAUNCH_STANDIN_CYGROOT"))) return FALSE;
+		szprefix = compat_utf8_decode(cygroot, (int)strlen(cygroot), prefix, _MAX_PATH);
+	}
+	if(*pos + szprefix + (n - i) + 1 > szout) return FALSE;
+	wmemcpy(&(out[*pos]), prefix, szprefix);
+	*pos += szprefix;
+	for(; i < n; i++) out[(*pos)++] = path[i] == (towin ? L'/' : L'\\') ? (towin ? L'\\' : L'/') : path[i];
+	return TRUE;
+}
+
+static ssize_t compat_cygwin_conv(unsigned int what, const void* from, void* to, size_t size, BOOL islist)
+{
+	int towin = (what & 0xFF) == COMPAT_CCP_POSIX_TO_WIN_W;
+	wchar_t *src, *out, sepin = towin ? L':' : L';', sepout = towin ? L';' : L':';
+	const wchar_t *p, *next;
+	size_t pos = 0, szout = _MAX_ENV+1;
+	ssize_t needed, result = 0;
+	int szsrc;
+
+	if(!towin && (what & 0xFF) != COMPAT_CCP_WIN_W_TO_POSIX) { errno = EINVAL; return -1; }
+	if(!from) { errno = EFAULT; return -1; }
+	if(towin) {
+		szsrc = compat_utf8_decode((const char*)from, -1, NULL, 0);
+		if(!(src = (wchar_t*)malloc(szsrc * sizeof(wchar_t)))) return -1;
+		compat_utf8_decode((const char*)from, -1, src, szsrc);
+	} else {
+		src = (wchar_t*)from;
+	}
+	if(!(out = (wchar_t*)malloc(szout * sizeof(wchar_t)))) result = -1;
+
+	for(p = src; result == 0; p = next + 1) {
+		next = islist ? wcschr(p, sepin) : NULL;
+		if(!next) next = p + wcslen(p);
+		if(!compat_conv_one(towin, p, (size_t)(next - p), out, &pos, szout)) { errno = ENAMETOOLONG; result = -1; }
+		if(!*next) break;
+		out[pos++] = sepout;
+	}
+
+	if(result == 0) {
+		out[pos] = L'\0';
+		needed = towin ? (ssize_t)((pos + 1) * sizeof(wchar_t)) : (ssize_t)compat_utf8_encode(out, -1, NULL, 0);
+		if(size == 0) {
+			result = needed;
+		} else if((size_t)needed > size) {
+			errno = ENOSPC;
+			result = -1;
+		} else if(towin) {
+			memcpy(to, out, needed);
+		} else {
+			compat_utf8_encode(out, -1, (char*)to, (int)size);
+		}
+	}
+	free(out);
+	if(towin) free(src);
+	return result;
+}
+
+static ssize_t compat_cygwin_conv_path(unsigned int what, const void* from, void* to, size_t size)
+{
+	return compat_cygwin_conv(what, from, to, size, FALSE);
+}
+
+static ssize_t compat_cygwin_conv_path_list(unsigned int what, const void* from, void* to, size_t size)
+{
+	return compat_cygwin_conv(what, from, to, size, TRUE);
+}
+
+static const struct { const char* name; FARPROC proc; } compat_cygwin_exports[] = {
+	{ "cygwin_dll_init",		(FARPROC)compat_cygwin_dll_init },
+	{ "cygwin_conv_path",		(FARPROC)compat_cygwin_conv_path },
+	{ "cygwin_conv_path_list",	(FARPROC)compat_cygwin_conv_path_list },
+	{ "__errno",				(FARPROC)compat_cygwin_errno },
+	{ NULL, NULL }
+};
+
+/** Our stand-in cygwin1.dll is never already loaded. */
+#define GetModuleHandleW(name) ((HMODULE)NULL)
+
+static BOOL FreeLibrary(HMODULE module)
+{
+	return TRUE;
+}
+
+static HMODULE LoadLibraryW(const wchar_t* name)
+{
+	if(wcscasecmp(name, L"cygwin1.dll") != 0) { errno = ENOENT; return NULL; }
+	return (HMODULE)compat_cygwin_exports;
+}
+
+static FARPROC GetProcAddress(HMODULE module, const char* name)
+{
+	int i = -1;
+	if(module != (HMODULE)compat_cygwin_exports) return NULL;
+	while(compat_cygwin_exports[++i].name) {
+		if(strcmp(compat_cygwin_exports[i].name, name) == 0) return compat_cygwin_exports[i].proc;
+	}
+	return NULL;
+}
+
+/* Strings */
+static wchar_t* lstrcpynW(wchar_t* dst, const wchar_t* src, int count)
+{
+	int i;
+	if(count <= 0) return NULL;
+	for(i = 0; i < count - 1 && src[i]; i++) dst[i] = src[i];
+	dst[i] = L'\0';
+	return dst;
+}
+
+/**
+ * Translate an MSVC format string to a C99 one: %s and %c take wide
+ * arguments unless they're %hs or %hc. Returns fmt if out's too small.
+ */
+#define COMPAT_FORMAT_MAX 1024
+static const wchar_t* compat_format(const wchar_t* fmt, wchar_t* out)
+{
+	const wchar_t* p = fmt;
+	size_t n = 0;
+
+	while(*p) {
+		if(n + 3 >= COMPAT_FORMAT_MAX) return fmt;
+		if((out[n++] = *(p++)) != L'%') continue;
+		if(*p == L'%') { out[n++] = *(p++); continue; }
+		while(*p && wcschr(L"-+ #0123456789.*", *p) && n + 3 < COMPAT_FORMAT_MAX) out[n++] = *(p++);
+		if(*p == L'h' && (p[1] == L's' || p[1] == L'c')) {
+			p++;
+		} else if((*p == L'l' || *p == L'w') && (p[1] == L's' || p[1] == L'c')) {
+			out[n++] = L'l';
+			p++;
+		} else if(*p == L's' || *p == L'c') {
+			out[n++] = L'l';
+		}
+	}
+	out[n] = L'\0';
+	return out;
+}
+
+static int compat_vswprintf(wchar_t* buffer, size_t count, const wchar_t* fmt, va_list args)
+{
+	wchar_t sFormat[COMPAT_FORMAT_MAX];
+	return vswprintf(buffer, count, compat_format(fmt, sFormat), args);
+}
+
+/**
+ * How many characters fmt comes out to. Leaves args alone, since callers
+ * go on to use them again. (Fine on MSVC, where a va_list is a pointer)
+ */
+static int _vscwprintf(const wchar_t* fmt, va_list args)
+{
+	wchar_t sFormat[COMPAT_FORMAT_MAX], *buffer = NULL, *grown;
+	const wchar_t* translated = compat_format(fmt, sFormat);
+	size_t size = 256;
+	va_list copy;
+	int result = -1;
+
+	// glibc won't tell us how much room we'd need, so keep trying.
+	while(size <= 16 * 1024 * 1024 && (grown = (wchar_t*)realloc(buffer, size * sizeof(wchar_t))) != NULL) {
+		buffer = grown;
+		va_copy(copy, args);
+		result = vswprintf(buffer, size, translated, copy);
+		va_end(copy);
+		if(result >= 0) break;
+		size *= 2;
+	}
+	free(buffer);
+	return result;
+}
+
+static HRESULT StringCchVPrintfW(wchar_t* dst, size_t cchdst, const wchar_t* fmt, va_list args)
+{
+	va_list copy;
+	int ret;
+	if(!cchdst) return STRSAFE_E_INSUFFICIENT_BUFFER;
+	va_copy(copy, args);
+	ret = compat_vswprintf(dst, cchdst, fmt, copy);
+	va_end(copy);
+	if(ret < 0 || (size_t)ret >= cchdst) {
+		dst[cchdst - 1] = L'\0';
+		return STRSAFE_E_INSUFFICIENT_BUFFER;
+	}
+	return S_OK;
+}
+
+static HRESULT StringCchPrintfW(wchar_t* dst, size_t cchdst, const wchar_t* fmt, ...)
+{
+	va_list args;
+	HRESULT result;
+	va_start(args, fmt);
+	result = StringCchVPrintfW(dst, cchdst, fmt, args);
+	va_end(args);
+	return result;
+}
+
+static HRESULT StringCchCopyW(wchar_t* dst, size_t cchdst, const wchar_t* src)
+{
+	size_t szsrc = wcslen(src);
+	if(!cchdst) return STRSAFE_E_INSUFFICIENT_BUFFER;
+	if(szsrc >= cchdst) {
+		wmemcpy(dst, src, cchdst - 1);
+		dst[cchdst - 1] = L'\0';
+		return STRSAFE_E_INSUFFICIENT_BUFFER;
+	}
+	wmemcpy(dst, src, szsrc + 1);
+	return S_OK;
+}
+
+/**
+ * Prints as UTF-8, so that stdout never becomes wide-oriented under
+ * whoever's sharing it with us.
+ */
+static int compat_wprintf(const wchar_t* fmt, ...)
+{
+	wchar_t* buffer;
+	char* narrow;
+	va_list args;
+	int result;
+
+	va_start(args, fmt);
+	result = _vscwprintf(fmt, args);
+	if(result >= 0 && (buffer = (wchar_t*)malloc((result + 1) * sizeof(wchar_t))) != NULL) {
+		compat_vswprintf(buffer, result + 1, fmt, args);
+		if((narrow = compat_narrow(buffer)) != NULL) {
+			fputs(narrow, stdout);
+			free(narrow);
+		}
+		free(buffer);
+	}
+	va_end(args);
+	return result;
+}
+
+static DWORD FormatMessageW(DWORD flags, const void* source, DWORD code, DWORD lang, wchar_t* buffer,
+	DWORD size, va_list* args)
+{
+	int n = compat_utf8_decode(strerror((int)code), -1, buffer, (int)size);
+	return n > 0 ? (DWORD)(n - 1) : 0;
+}
+
+#define vswprintf compat_vswprintf
+#define wprintf compat_wprintf
+
+#endif /* _COMPAT_H_ */
@@ -9,6 +9,16 @@
 
 #define CYGWIN_DLL L"cygwin1.dll"
 
+#include "mounts.c"
+
+#include "probe.c"
+
+/**
+ * Set in main.c - Will contain a string representing the
+ * Windows path to the root folder of our cygwin installation.
+ */
+static wchar_t* cygRootWin = NULL;
+
 /**
  * Set in main.c - Will contain a string representing the
  * Windows path to our virtualenv's root folder.
@@ -16,7 +26,8 @@
 static wchar_t* virtRootWin = NULL;
 
 /**
- * Set either in cygwin.c or in envvars.c
+ * The POSIX version of virtRootWin. Only ever set through
+ * get_virt_root_cyg(), or from our cache.
  */
 static wchar_t* virtRootCyg = NULL;
 
@@ -29,9 +40,11 @@ typedef void(*cygwin_func)();
 typedef struct { const char *name; cygwin_func proc; } cygwin_func_entry;
 
 /** Typedefs taken from Python for defining ssize_t on MSVC */
+#ifdef _MSC_VER
 typedef _W64 int ssize_t;
+#endif
 
-/** Possible 'what' values in calls to cygwin_conv_path/cygwin_create_path. */
+/** Possible 'what' values in calls to cygwin_conv_path/cygwin_conv_path_list. */
 enum {
 	CCP_POSIX_TO_WIN_A = 0, /* from is char*, to is char*       */
 	CCP_POSIX_TO_WIN_W,      /* from is char*, to is wchar_t*    */
@@ -65,19 +78,11 @@ static cygwin_func_entry cygwin_funcs[] = {
 #	define cygwin_conv_path_list ((ssize_t(*)(cygwin_conv_path_t, const void*, void*, size_t))(cygwin_funcs[1].proc))
 
 	/**
-	 * Allocate a buffer for the conversion result using malloc(3), and return
-	 * a pointer to it.  Returns NULL if something goes wrong with errno set
-	 * to one of the above values, or to ENOMEM if malloc fails.
+	 * cygwin's errno lives in cygwin's thread-local storage, rather than
+	 * the CRT's, so we need its accessor to see why a conversion failed.
 	 */
-	{ "cygwin_create_path", NULL },
-#	define cygwin_create_path ((void*(*)(cygwin_conv_path_t, const void*))(cygwin_funcs[2].proc))
-
-	/**
-	 * For the purposes of freeing the buffer allocated in the previous function,
-	 * we're also going to grab cygwin's implementation of free, just to be safe.
-	 */
-	{ "free", NULL },
-#	define cygwin_free ((void(*)(void*))(cygwin_funcs[3].proc))
+	{ "__errno", NULL },
+#	define cygwin_errno ((int*(*)())(cygwin_funcs[2].proc))
 
 	/**
 	 * Left NULL to allow us to iterate and setup the last 4 functions at once.
@@ -88,6 +93,17 @@ static cygwin_func_entry cygwin_funcs[] = {
 static HMODULE hCygwin = NULL;
 static PHMODULE phCygwin = &hCygwin;
 
+/** Set once loading the DLL has failed, so that we don't keep retrying. */
+static bool cygwin_unavailable = false;
+
+#ifndef WITHOUT_MOUNTS
+/** Our in-process mount table. NULL if it couldn't be loaded. */
+static mount_table* mounts = NULL;
+#	define path_conv_ready() (mounts != NULL || *phCygwin != NULL)
+#else
+#	define path_conv_ready() (*phCygwin != NULL)
+#endif
+
 /** Load our cygwin DLL or return false on failure. */
 static bool load_cygwin_library()
 {
@@ -108,8 +124,8 @@ static bool init_cygwin_library()
 	cygwin_func cygwin_dll_init = NULL;
 	verbose(L"Attempting to initialize cygwin context..");
 	if((cygwin_dll_init = (cygwin_func)GetProcAddress(*phCygwin,"cygwin_dll_init")) == NULL) {
+		// setup_cygwin unloads it.
 		verbose(L"Failed. Skipping path conversions.");
-		FreeLibrary(*phCygwin);
 		return false;
 	}
 	cygwin_dll_init();
@@ -123,13 +139,27 @@ static bool init_cygwin_library()
 static bool setup_cygwin()
 {
 	int i = -1;
+	bool ok;
+	
+	// Don't bother if we've already failed once.
+	if(cygwin_unavailable) return false;
+	cygwin_unavailable = true;
 	
 	// Load the cygwin dll into our application.
-	if(!load_cygwin_library()) return false;
+	trace_begin(L"cygwin_dll_load");
+	ok = load_cygwin_library();
+	trace_end(L"cygwin_dll_load");
+	flight(FLIGHT_DLL_LOAD, ok, 0, NULL);
+	if(!ok) return false;
 	
 	// Init the cygwin environment. (Required)
-	if(!init_cygwin_library()) {
+	trace_begin(L"cygwin_dll_init");
+	ok = init_cygwin_library();
+	trace_end(L"cygwin_dll_init");
+	flight(FLIGHT_DLL_INIT, ok, 0, NULL);
+	if(!ok) {
 		FreeLibrary(*phCygwin);
+		*phCygwin = NULL;
 		return false;
 	}
 	
@@ -139,187 +169,296 @@ static bool setup_cygwin()
 		if(!(cygwin_funcs[i].proc = (cygwin_func)GetProcAddress(*phCygwin, cygwin_funcs[i].name))) {
 			verbose(L"Failed to load a cygwin function. Skipping path conversions.");
 			FreeLibrary(*phCygwin);
+			*phCygwin = NULL;
 			return false;
 		}
 	}
 	
+	cygwin_unavailable = false;
 	return true;
 }
 
-/** Does any necessary path format conversion and quoting for paths/path lists needing them. */
-#define fix_path(x)			fix_path_type((void*)x, false, CCP_WIN_W_TO_POSIX)
-#define fix_path_list(x)	fix_path_type((void*)x, true, CCP_WIN_W_TO_POSIX)
-static wchar_t* fix_path_type(void* arg, bool islist, cygwin_conv_path_t convtyp)
+/**
+ * Unload our cygwin DLL, if we loaded it. Anything that needs it after
+ * this loads it again, rather than calling into what's left of it.
+ */
+static void unload_cygwin()
 {
-	const char* cygpath = NULL;
-	wchar_t* result = NULL;
-	size_t	szcount = 0, szresult = 0;
-	ssize_t(*conversion_func)(cygwin_conv_path_t, const void*, void*, size_t);
-	
-	// We'll use cygwin to allocate the buffer for the original value.
-	if(!(cygpath = (const char*)cygwin_create_path(convtyp, (const void*)arg))) {
-		FreeLibrary(*phCygwin);
-		*phCygwin = NULL;
-		return NULL;
-	}
+	if(!*phCygwin) return;
+	FreeLibrary(*phCygwin);
+	*phCygwin = NULL;
+	cygwin_unavailable = false;
+}
+
+#ifndef WITHOUT_MOUNTS
+/** Read an fstab file into our mount table. Missing files are fine. */
+static void read_fstab(wchar_t* sPath)
+{
+	FILE* fp;
+	char* buffer;
+	size_t szbuf;
 	
-	// Figure out which function to use.
-	if(islist) {
-		conversion_func = cygwin_conv_path_list;
-	} else {
-		conversion_func = cygwin_conv_path;
+	if(!(fp = _wfopen((const wchar_t*)sPath, L"rb"))) return;
+	verbose(L"Reading mount table from %s..", sPath);
+	szbuf = get_file_length(fp);
+	if(szbuf != -1) {
+		buffer = (char*)xalloc(szbuf, sizeof(char));
+		szbuf = fread(buffer, 1, szbuf, fp);
+		verbose_step(L"%d entries", mount_table_parse(mounts, buffer, szbuf));
+		xfree(buffer);
 	}
+	fclose(fp);
+}
+
+/**
+ * Build our mount table from the implicit mounts, /etc/fstab and the
+ * current user's /etc/fstab.d file, the same way cygwin1.dll does
+ * when it initializes.
+ */
+static bool load_mount_table()
+{
+	wchar_t sPath[MAX_PATH+1] = EMPTYW, sUser[MAX_PATH+1] = EMPTYW;
 	
-	// Since cygwin allocated our buffer, we can assume it's big enough to hold the output.
-	// For now, though, we'll just use MAX_ENV+1
-	if(conversion_func(convtyp, (const void*)arg, (void*)cygpath, (MAX_ENV+1) * sizeof(char)) == -1) {
-		cygwin_free((void*)cygpath);
-		FreeLibrary(*phCygwin);
-		*phCygwin = NULL;
-		return NULL;
-	}
+	if(!cygRootWin) return false;
+	verbose(L"Loading cygwin mount table..");
+	mounts = (mount_table*)xalloc(1, sizeof(mount_table));
+	mount_table_init(mounts, cygRootWin);
 	
-	// Finally, allocate our result buffer.
-	szcount = lstrlenA(cygpath) + 1;
-	szresult = szcount * sizeof(wchar_t);
-	if(!szresult || !(result = (wchar_t*)malloc(szresult))) {
-		cygwin_free((void*)cygpath);
-		FreeLibrary(*phCygwin);
-		*phCygwin = NULL;
-		return NULL;
+	if(FAILED(StringCchPrintfW(sPath, MAX_PATH+1, L"%s\\etc\\fstab", cygRootWin))) {
+		fatal_api_call(L"StringCchPrintfW (Building path to fstab)");
 	}
+	read_fstab(sPath);
 	
-	// Zero out the allocated data.
-	memset((void*)result, 0, szresult);
-	
-	// And convert the char string to our resulting wchar string.
-	mbstowcs(result, cygpath, szcount);
-	
-	// At this point, we can free up the buffer cygwin created.
-	cygwin_free((void*)cygpath);
-	if(!verbose_flag) return result;
-
-	verbose(L"Converted file path/path list:");
-	verbose_step(L"fix_path_type(x)");
-	if(*(((char*)arg) + 1) != '\0') {
-		printf("# [%d] x -> %s\n", verbose_stepi++, arg);
-	} else {
-		verbose_step(L"  x -> %s", arg);
+	if(GetEnvironmentVariableW(L"USERNAME", sUser, MAX_PATH+1) &&
+		SUCCEEDED(StringCchPrintfW(sPath, MAX_PATH+1, L"%s\\etc\\fstab.d\\%s", cygRootWin, sUser))) {
+		read_fstab(sPath);
 	}
-	verbose_step(L"  r <- %s", result);
-	return result;
+	return true;
 }
+#endif
 
-static const byte cyglink_sig[] = { '!', '<', 's', 'y', 'm', 'l', 'i', 'n', 'k', '>' };
-static const word dummy_val = 0xfeff;
+/**
+ * Get ready to convert paths. The cygwin DLL isn't loaded here, even if
+ * our mount table couldn't be - batch_dll loads it on demand, once there's
+ * a path that needs it, so a launch with none never pays for it. Returns
+ * false if we already know it can't be loaded, and we've no mount table.
+ */
+static bool setup_path_conversion()
+{
+	#ifndef WITHOUT_MOUNTS
+	bool loaded;
+	trace_begin(L"mount_table");
+	loaded = load_mount_table();
+	trace_end(L"mount_table");
+	flight(FLIGHT_MOUNTS, loaded, 0, NULL);
+	if(loaded) return true;
+	#endif
+	return !cygwin_unavailable;
+}
+
+#include "batch.c"
 
-typedef struct _cyglink {
-	byte tag[10];					// !<symlink>
-	word dummy;						// Still not sure what these two bytes actually stand for.
-									// Regardless, they seem to always contain \xff\xfe
-	wchar_t target[ANYSIZE_ARRAY];	// And lastly, our target as a unicode string.
-} cyglink, *pcyglink;
+#ifndef WITHOUT_RESOLVER
+#	include "resolver.c"
+#endif
 
-static bool is_buf_symlink(byte* buffer, size_t szbuf)
+/** Converts a single path/path list. Returns NULL on failure. */
+#define fix_path(x)			fix_path_type(x, false, MOUNT_WIN_TO_POSIX)
+#define fix_path_list(x)	fix_path_type(x, true, MOUNT_WIN_TO_POSIX)
+#define fix_posix_path(x)	fix_path_type(x, false, MOUNT_POSIX_TO_WIN)
+static wchar_t* fix_path_type(const wchar_t* path, bool islist, int direction)
 {
-	int i;
-	pcyglink slink = NULL;
-	if(szbuf < sizeof(cyglink)) return false;
+	path_batch batch;
+	wchar_t* result = NULL;
 	
-	slink = (pcyglink)buffer;
-	for(i = 0; i < 10; i++) {
-		if(slink->tag[i] == cyglink_sig[i]) continue;
-		return false;
+	batch_init(&batch, direction);
+	batch_add(&batch, path, wcslen(path), islist);
+	// The result can stay in the batch's block. It's all in our arena anyway.
+	if(!batch_run(&batch)) result = batch_result(&batch, 0);
+	return result;
+}
+
+/** The venv root in POSIX format, converted at most once per process. */
+static wchar_t* get_virt_root_cyg()
+{
+	if(!virtRootCyg && virtRootWin) {
+		verbose(L"Converting virtual environment root..");
+		virtRootCyg = fix_path(virtRootWin);
 	}
-	
-	if(slink->dummy != dummy_val) return false;
-	return true;
+	return virtRootCyg;
 }
 
-static wchar_t* readlink(wchar_t* path)
+/**
+ * Windows -> POSIX for a path we're resolving. Anything under the venv
+ * root gets rewritten from the already converted root, so the common
+ * case doesn't cost a conversion at all.
+ */
+static wchar_t* to_cyg_path(wchar_t* path)
 {
-	size_t szbuf = 0;
-	wchar_t* result = path;
-	char* cygbuf = NULL;
-	byte* buffer = NULL;
-	pcyglink slink = NULL;
-	
-	verbose(L"Checking %s for symbolic link..", path);
+	wchar_t *root = get_virt_root_cyg(), *result, *p;
+	size_t szwin, szroot, szpath;
 	
-	// Make sure path is a file flagged as a system file.
-	if(!is_file(path) || !has_system_attr(path)) goto cleanup;
-	
-	// Allocate our buffer and read the file into it.
-	buffer = file_to_buffer(path, &szbuf);
-	
-	// Check if our buffer contains a symbolic link.
-	if(!is_buf_symlink(buffer, szbuf)) goto cleanup;
-	
-	// If we get to this point, we're definitely working
-	// with a symbolic link, so cast it to the struct.
-	verbose(L"Detected symbolic link..");
-	slink = (pcyglink)buffer;
-	
-	// Get the string length of our link's target.
-	szbuf = wcslen(slink->target);
-	if(szbuf == 0) {
-		fatal(1, L"Empty path found as target of the symbolic link at %s.", path);
+	if(root && virtRootWin) {
+		szwin = wcslen(virtRootWin);
+		if(_wcsnicmp(path, virtRootWin, szwin) == 0 && path[szwin] == L'\\') {
+			szroot = wcslen(root);
+			szpath = wcslen(&(path[szwin]));
+			result = walloc(szroot + szpath);
+			memcpy(result, root, szroot * sizeof(wchar_t));
+			memcpy(&(result[szroot]), &(path[szwin]), szpath * sizeof(wchar_t));
+			for(p = &(result[szroot]); *p; p++) if(*p == L'\\') *p = L'/';
+			return result;
+		}
 	}
-	
-	// Before converting it, we need to check whether it's a relative
-	// or absolute file path.
-	if(slink->target[0] != L'/') {
-		verbose(L"Symbolic link target resolved to a relative path. Prefixing bin dir..");
-		virtRootCyg = fix_path(virtRootWin);
-		// len(virtualenv root) + len('/bin/') + len(target)
-		szbuf += wcslen(virtRootCyg) + 5;
-		result = walloc(szbuf++);
-		swprintf(result, szbuf, L"%s/bin/%s", virtRootCyg, slink->target);
-	} else {
-		// Duping it to allow freeing the memory a few
-		// lines later without issue.
-		verbose(L"Symbolic link target appears to be an absolute path. Continuing..");
-		result = _wcsdup(slink->target);
+	return fix_path(path);
+}
+
+/**
+ * How many symlinks we'll follow before giving up. (CYGLAUNCH_MAX_HOPS, up
+ * to half our visited set, which keeps it at most half full)
+ */
+#ifndef MAX_SYMLINK_HOPS
+#	define MAX_SYMLINK_HOPS 40
+#endif
+#define VISITED_SLOTS 128
+
+static int get_max_hops()
+{
+	wchar_t sValue[16] = EMPTYW;
+	int result = MAX_SYMLINK_HOPS;
+	if(GetEnvironmentVariableW(L"CYGLAUNCH_MAX_HOPS", sValue, 16) && (result = _wtoi(sValue)) <= 0) {
+		result = MAX_SYMLINK_HOPS;
 	}
-	
-	// Convert it to a ANSI string to allow converting
-	// it with cygwin.
-	cygbuf = xalloc(szbuf, sizeof(char));
-	wcstombs(cygbuf, result, szbuf+1);
-	xfree(result);
-	if(!(result = fix_path_type((void*)cygbuf, false, CCP_POSIX_TO_WIN_A))) {
-		result = path;
-		goto cleanup;
+	if(result <= VISITED_SLOTS / 2) return result;
+	verbose(L"CYGLAUNCH_MAX_HOPS is %d, but we follow at most %d symbolic links..", result, VISITED_SLOTS / 2);
+	return VISITED_SLOTS / 2;
+}
+
+/**
+ * Open-addressed set of the Windows paths we've visited while resolving a
+ * chain, keyed on a case-insensitive hash. Owns the paths it holds.
+ */
+typedef struct {
+	dword hashes[VISITED_SLOTS];
+	wchar_t* paths[VISITED_SLOTS];
+} visited_set;
+
+static dword path_hash(const wchar_t* path)
+{
+	dword result = 2166136261UL;
+	while(*path) {
+		result ^= (dword)towlower(*(path++));
+		result *= 16777619UL;
 	}
-	verbose_step(L"readlink(x)");
-	verbose_step(L"  x -> %s", path);
-	verbose_step(L"  r <- %s", result);
-cleanup:
-	xfree(buffer);
-	xfree(cygbuf);
-	#ifdef WITHOUT_ENVVARS
-	xfree(virtRootCyg);
-	#endif
 	return result;
 }
 
+/** Add path to the set. Returns false if it was already in there. */
+static bool visited_add(visited_set* set, wchar_t* path)
+{
+	dword hash = path_hash(path), i = hash % VISITED_SLOTS;
+	while(set->paths[i]) {
+		if(set->hashes[i] == hash && _wcsicmp(set->paths[i], path) == 0) return false;
+		i = (i + 1) % VISITED_SLOTS;
+	}
+	set->hashes[i] = hash;
+	set->paths[i] = path;
+	return true;
+}
+
+static void visited_free(visited_set* set, wchar_t* keep)
+{
+	int i;
+	for(i = 0; i < VISITED_SLOTS; i++) {
+		if(set->paths[i] != keep) xfree(set->paths[i]);
+	}
+}
+
+/**
+ * Set by real_path to the POSIX form of the path it resolved to, if it
+ * had to work that out along the way.
+ */
+static wchar_t* realPathCyg = NULL;
+
+/**
+ * Follow a chain of symbolic links to the file at the end of it. Targets
+ * are resolved lexically - relative ones against the folder containing
+ * the link - so each hop costs at most one conversion. Loops and chains
+ * longer than get_max_hops() are fatal.
+ */
 static wchar_t* real_path(wchar_t* path)
 {
-	wchar_t *result,
-	*last = _wcsdup(path);
+	visited_set visited;
+	probe_result probe;
+	wchar_t canon[MAX_ENV+1], *dir, *sep, *next, *nextCyg,
+		*current = xwcsdup(path), *currentCyg = NULL;
+	int hops = 0, maxhops = get_max_hops();
+	bool trailing;
+	
+	ZeroMemory(&visited, sizeof(visited_set));
+	visited_add(&visited, current);
 	
 	while(true) {
-		result = last;
-		last = readlink(result);
-		if(result == last) { break; }
-		if(_wcsicmp(path, last) == 0) {
-			fatal(1, L"Detected recursive symlinks at target %s", path);
+		verbose(L"Checking %s for symbolic link..", current);
+		cache_add_dep(current);
+		
+		// One attribute lookup, and at most one small read.
+		if(!probe_path(current, &probe) || probe.kind != PROBE_LINK) break;
+		verbose(L"Detected symbolic link.. (flavour %d)", probe.flavour);
+		flight(FLIGHT_HOP, hops + 1, probe.flavour, NULL);
+		if(++hops > maxhops) {
+			fatal(1, L"Too many levels of symbolic links (more than %d) while resolving %s", maxhops, path);
+		}
+		
+		next = nextCyg = dir = NULL;
+		if(probe.posix) {
+			// Relative targets are relative to the link's folder, which we need in POSIX format.
+			if(probe.target[0] != L'/') {
+				if(!currentCyg && !(currentCyg = to_cyg_path(current))) break;
+				dir = xwcsdup(currentCyg);
+				sep = wcsrchr(dir, L'/');
+				sep[sep == dir ? 1 : 0] = L'\0';
+			}
+			if(mount_canon_posix(probe.target, dir, canon, MAX_ENV+1, &trailing)) {
+				nextCyg = xwcsdup(canon);
+				if(!(next = fix_posix_path(nextCyg))) {
+					xfree(nextCyg);
+					nextCyg = NULL;
+				}
+			}
+		} else {
+			// Native links point at Windows paths already.
+			dir = xwcsdup(current);
+			*wcsrchr(dir, L'\\') = L'\0';
+			if(mount_canon_win(probe.target, dir, canon, MAX_ENV+1, &trailing)) next = xwcsdup(canon);
+		}
+		xfree(dir);
+		if(!next) break;
+		
+		verbose_step(L"readlink(x)");
+		verbose_step(L"  x -> %s", current);
+		verbose_step(L"  r <- %s", next);
+		if(!visited_add(&visited, next)) {
+			fatal(1, L"Detected recursive symlinks at target %s", next);
 		}
-		xfree(result);
+		xfree(currentCyg);
+		currentCyg = nextCyg;
+		current = next;
 	}
-	return result;
+	
+	visited_free(&visited, current);
+	realPathCyg = currentCyg;
+	return current;
 }
 
+#ifndef WITHOUT_SHEBANG
+#	include "shebang.c"
+#endif
+
 #ifndef WITHOUT_ENVVARS
 #	include "envvars.c"
+#endif
+
+#ifndef WITHOUT_RELAY
+#	include "relay.c"
 #endif
\ No newline at end of file
@@ -16,6 +16,12 @@
  * leave this in by default for the time being. (Unless, of course
  * someone knows something I don't and tells me they're completely
  * unnecessary)
+ *
+ * Our environment block is read once, and every variable in it matched
+ * against our rules. (Exact names, or globs like PYTHON*) The ones that
+ * need converting go into the same batch as our arguments, and once
+ * that's run, a new block is put together for our interpreter, so our
+ * own environment is never touched.
  */
 
 #ifndef _PRECOMPILED_H_
@@ -23,7 +29,7 @@
 #endif
 
 /** Conversion tab entry */
-typedef struct { const wchar_t *name; dword flags; } env_entry;
+typedef struct { const wchar_t *name; dword flags; const wchar_t *value; } env_entry;
 
 /**
  * Bitwise flags to help interpret the environment
@@ -34,6 +40,7 @@ typedef struct { const wchar_t *name; dword flags; } env_entry;
 #define LPATH		0x002L // Pathlist
 #define VROOT		0x004L // Set to the root folder of our virtual env.
 #define UNSET		0x008L // Unset if set
+#define PREPEND		0x010L // Put value (a Windows path list) in front of what's there, or set it to value.
 
 /**
  * All environment variables that should be converted to
@@ -47,56 +54,225 @@ static const env_entry vars_tab[] = {
 	{ NULL,				NONE			}
 };
 
-/* Handles changes made to our environment variables */
-static void fix_env()
+/**
+ * The rules we actually go by. Our launch manifest can swap in its own,
+ * (See manifest.c) as long as there's no more than ENV_MAX_RULES of them.
+ */
+#define ENV_MAX_RULES 32
+static const env_entry* env_rules = vars_tab;
+
+/** The most variables our rules can match. Anything past that is passed through as it is. */
+#define ENV_MAX_HITS 64
+
+/** A variable one of our rules matched, or one we're adding. */
+typedef struct {
+	const wchar_t* var;			// NAME=value in our block, or NULL if we're adding it.
+	int rule;
+	const wchar_t* value;		// What it'll be before converting, or NULL to unset it.
+	int slot;					// Batch slot, or -1 if it isn't being converted.
+} env_hit;
+
+typedef struct {
+	wchar_t* block;				// As GetEnvironmentStringsW gave it to us.
+	int nvars, nhits;
+	env_hit hits[ENV_MAX_HITS + ENV_MAX_RULES];
+} env_state;
+
+/** The block fix_env put together for our interpreter, or NULL if it should get ours. */
+static wchar_t* env_block = NULL;
+
+/** Length of the name in NAME=value. Per-drive folders (=C:=C:\..) start with an =. */
+static inline size_t env_name_length(const wchar_t* var)
 {
-	int i = -1;
-	wchar_t* virtRoot;
-	if(!virtRootCyg) {
-		verbose(L"Pre-converting virtual environment root, in case var found to be missing from environment.");
-		virtRoot = fix_path(virtRootWin);
-	} else {
-		virtRoot = virtRootCyg;
-	}
-	
-	while(vars_tab[++i].name && *phCygwin) {
-		wchar_t current[MAX_ENV+1] = EMPTYW, *converted;
-		
-		// Get our environment variable.
-		if(GetEnvironmentVariableW(vars_tab[i].name, current, MAX_ENV+1)) {
-			verbose(L"Detected environment variable, %s..", vars_tab[i].name);
-			// If it exists, check against the following flags..
-			if(vars_tab[i].flags & UNSET) {
-				verbose_step(L"Unsetting..");
-				converted = NULL;
-			} else if(vars_tab[i].flags & SPATH) {
-				verbose_step(L"Attempting to convert path..");
-				converted = fix_path(current);
-			} else if(vars_tab[i].flags & LPATH) {
-				verbose_step(L"Attempting to convert path list..");
-				converted = fix_path_list(current);
-			}
-			
-			// Set it to our new value.
-			if(!SetEnvironmentVariableW(vars_tab[i].name, converted)) {
-				fatal_api_call(L"SetEnvironmentVariableW");
-			}
-			
-			xfree(converted);
+	const wchar_t* sep = wcschr(var + 1, L'=');
+	return sep ? (size_t)(sep - var) : wcslen(var);
+}
+
+static inline bool env_is_glob(const wchar_t* pattern)
+{
+	return wcspbrk(pattern, L"*?") != NULL;
+}
+
+/** Case-insensitive match of the first szname characters of name against a pattern with * and ? in it. */
+static bool env_glob(const wchar_t* pattern, const wchar_t* name, size_t szname)
+{
+	const wchar_t *star = NULL, *end = name + szname, *resume = NULL;
+
+	while(name < end) {
+		if(*pattern == L'*') {
+			star = ++pattern;
+			resume = name;
+		} else if(*pattern && (*pattern == L'?' || towupper(*pattern) == towupper(*name))) {
+			pattern++;
+			name++;
+		} else if(star) {
+			pattern = star;
+			name = ++resume;
 		} else {
-			// Otherwise..
-			if(vars_tab[i].flags & VROOT) {
-				if(verbose_flag) {
-					verbose(L"Detected lack of environment variable, %s", vars_tab[i].name);
-					verbose(L"Setting to converted virtual environment path:");
-					verbose_step(virtRoot);
-					
-				}
-				if(!SetEnvironmentVariableW(vars_tab[i].name, virtRoot)) {
-					fatal_api_call(L"SetEnvironmentVariableW");
-				}
+			return false;
+		}
+	}
+	while(*pattern == L'*') pattern++;
+	return !*pattern;
+}
+
+/** The first rule matching a variable, or -1. */
+static int env_match(const wchar_t* var, size_t szname)
+{
+	int i;
+	for(i = 0; env_rules[i].name; i++) {
+		if(env_is_glob(env_rules[i].name) ? env_glob(env_rules[i].name, var, szname) :
+			(wcslen(env_rules[i].name) == szname && _wcsnicmp(env_rules[i].name, var, szname) == 0)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** Work out what a variable becomes, and queue it for converting if it needs it. current is NULL if it's missing. */
+static void env_queue(path_batch* batch, env_state* env, const wchar_t* var, int rule, const wchar_t* current)
+{
+	env_hit* hit = &(env->hits[env->nhits++]);
+	const env_entry* entry = &(env_rules[rule]);
+	wchar_t* joined;
+	size_t szvalue, szcurrent;
+
+	hit->var = var;
+	hit->rule = rule;
+	hit->value = (entry->flags & UNSET) ? NULL : current;
+	hit->slot = -1;
+	if(!hit->value && !(entry->flags & UNSET) && (entry->flags & PREPEND)) hit->value = entry->value;
+	if(hit->value && (entry->flags & PREPEND) && entry->value && hit->value != entry->value) {
+		szvalue = wcslen(entry->value);
+		szcurrent = wcslen(current);
+		joined = walloc(szvalue + 1 + szcurrent);
+		memcpy(joined, entry->value, szvalue * sizeof(wchar_t));
+		joined[szvalue] = L';';
+		memcpy(&(joined[szvalue + 1]), current, szcurrent * sizeof(wchar_t));
+		hit->value = joined;
+	}
+	if(hit->value && (entry->flags & (SPATH | LPATH))) {
+		hit->slot = batch_add(batch, hit->value, wcslen(hit->value), (entry->flags & LPATH) != 0);
+	}
+}
+
+/**
+ * Reads our environment block, and queues up the variables that need
+ * converting. Anything missing that a rule adds is queued up too.
+ */
+static void fix_env_collect(path_batch* batch, env_state* env)
+{
+	bool seen[ENV_MAX_RULES];
+	const wchar_t* var;
+	size_t szname;
+	int rule;
+
+	ZeroMemory(seen, sizeof(seen));
+	env->nvars = env->nhits = 0;
+	if(!(env->block = GetEnvironmentStringsW())) fatal_api_call(L"GetEnvironmentStringsW");
+
+	for(var = env->block; *var; var += wcslen(var) + 1) {
+		env->nvars++;
+		szname = env_name_length(var);
+		if(!var[szname] || (rule = env_match(var, szname)) < 0) continue;
+		if(rule < ENV_MAX_RULES) seen[rule] = true;
+		if(env->nhits == ENV_MAX_HITS) {
+			verbose(L"Too many environment variables match our rules. Leaving %s alone..", var);
+			continue;
+		}
+		verbose(L"Detected environment variable, %s..", var);
+		env_queue(batch, env, var, rule, &(var[szname + 1]));
+	}
+
+	for(rule = 0; rule < ENV_MAX_RULES && env_rules[rule].name; rule++) {
+		if(!seen[rule] && (env_rules[rule].flags & (VROOT | PREPEND)) && !env_is_glob(env_rules[rule].name)) {
+			env_queue(batch, env, NULL, rule, NULL);
+		}
+	}
+}
+
+/** Sort our block the way Windows keeps it. (By name, case-insensitively) */
+static int env_compare(const void* a, const void* b)
+{
+	const wchar_t *x = *(const wchar_t**)a, *y = *(const wchar_t**)b;
+	size_t szx = env_name_length(x), szy = env_name_length(y);
+	int result = _wcsnicmp(x, y, szx < szy ? szx : szy);
+	return result ? result : (int)szx - (int)szy;
+}
+
+/** NAME=value, in our arena. */
+static wchar_t* env_join(const wchar_t* name, size_t szname, const wchar_t* value)
+{
+	size_t szvalue = wcslen(value);
+	wchar_t* result = walloc(szname + 1 + szvalue);
+	memcpy(result, name, szname * sizeof(wchar_t));
+	result[szname] = L'=';
+	memcpy(&(result[szname + 1]), value, szvalue * sizeof(wchar_t));
+	return result;
+}
+
+/**
+ * Puts together our interpreter's environment block, once the values
+ * queued up by fix_env_collect have been converted. Anything that
+ * couldn't be converted is left as it was.
+ */
+static void fix_env(path_batch* batch, env_state* env)
+{
+	const wchar_t **vars, *var, *value;
+	wchar_t *virtRoot, *converted, *out;
+	size_t szblock = 1, szvar;
+	int nvars = 0, h = 0, i;
+	env_hit* hit;
+
+	verbose(L"Pre-converting virtual environment root, in case var found to be missing from environment.");
+	virtRoot = get_virt_root_cyg();
+	cache_set_vroot(virtRoot);
+
+	vars = (const wchar_t**)xalloc((size_t)(env->nvars + env->nhits), sizeof(wchar_t*));
+	for(var = env->block; *var; var += wcslen(var) + 1) {
+		if(h == env->nhits || env->hits[h].var != var) {
+			vars[nvars++] = var;
+			continue;
+		}
+		hit = &(env->hits[h++]);
+		if(!hit->value) {
+			verbose(L"Unsetting environment variable, %s..", env_rules[hit->rule].name);
+			continue;
+		}
+		value = hit->value;
+		if(hit->slot >= 0) {
+			converted = batch_result(batch, hit->slot);
+			flight(FLIGHT_ENV, hit->rule, converted != NULL, NULL);
+			if(converted) value = converted;
+		}
+		vars[nvars++] = value == &(var[env_name_length(var) + 1]) ? var : env_join(var, env_name_length(var), value);
+	}
+
+	// Whatever we're adding.
+	for(; h < env->nhits; h++) {
+		hit = &(env->hits[h]);
+		value = hit->value;
+		if(hit->slot >= 0 && (converted = batch_result(batch, hit->slot))) {
+			value = converted;
+		} else if(!value && (env_rules[hit->rule].flags & VROOT)) {
+			if(!(value = virtRoot)) continue;
+			if(verbose_flag) {
+				verbose(L"Detected lack of environment variable, %s", env_rules[hit->rule].name);
+				verbose(L"Setting to converted virtual environment path:");
+				verbose_step(virtRoot);
 			}
 		}
+		if(value) vars[nvars++] = env_join(env_rules[hit->rule].name, wcslen(env_rules[hit->rule].name), value);
+	}
+
+	qsort((void*)vars, nvars, sizeof(wchar_t*), env_compare);
+	for(i = 0; i < nvars; i++) szblock += wcslen(vars[i]) + 1;
+	out = env_block = walloc(szblock);
+	for(i = 0; i < nvars; i++) {
+		szvar = wcslen(vars[i]) + 1;
+		memcpy(out, vars[i], szvar * sizeof(wchar_t));
+		out += szvar;
 	}
-	xfree(virtRoot);
+	FreeEnvironmentStringsW(env->block);
+	env->block = NULL;
 }
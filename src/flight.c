@@ -0,0 +1,141 @@
+/**
+ * flight.c - Our flight recorder. Keeps the last few hundred things the
+ *            launcher did in a ring buffer, so that when a launch fails,
+ *            we can say how we got there.
+ *
+ * Unlike -v, this is always on, so recording has to cost next to
+ * nothing: an event is an id and a few integer/pointer payloads, written
+ * into a fixed-size static ring with one interlocked increment to claim
+ * a slot. Nothing is formatted, and nothing is allocated. Events are only
+ * turned into text by flight_dump, which fatal() and our crash handler
+ * call on their way out.
+ *
+ * Any thread can record. Each slot's sequence number is written last, so
+ * flight_dump can tell a slot that's been overwritten (or is still being
+ * written) from the event it was expecting.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** How many events we keep. Must be a power of 2. */
+#define FLIGHT_SIZE 256
+
+/** Event ids. Keep in sync with flight_events below. */
+#define FLIGHT_START		1 // a: argc
+#define FLIGHT_MODULE		2 // p: our module path
+#define FLIGHT_CACHE		3 // a: hit?
+#define FLIGHT_TARGET		4 // p: bin\exename
+#define FLIGHT_CYGROOT		5 // p: cygwin root
+#define FLIGHT_MOUNTS		6 // a: loaded?
+#define FLIGHT_DLL_LOAD		7 // a: loaded?
+#define FLIGHT_DLL_INIT		8 // a: initialized?
+#define FLIGHT_HOP			9 // a: hop, b: flavour
+#define FLIGHT_CONVERT		10 // a: batch slot, b: errno (0 if it worked)
+#define FLIGHT_BATCH		11 // a: paths, b: failures
+#define FLIGHT_ENV			12 // a: env rule index, b: converted?
+#define FLIGHT_CMDLINE		13 // a: length (in args, on POSIX)
+#define FLIGHT_SPAWN		14 // a: handoff mode
+#define FLIGHT_MANIFEST		15 // a: hit?
+#define FLIGHT_SHEBANG		16 // a: #! args
+#define FLIGHT_SPILL		17 // a: length our command line would have been
+#define FLIGHT_POOL			18 // a: taken?
+#define FLIGHT_RESOLVER		19 // a: paths sent, b: answered
+#define FLIGHT_PLAN			20 // a: paths to convert, b: args
+
+/** Event flags. */
+#define FLIGHT_STRING		0x001 // p is a wide string, which has to stay around until we exit.
+
+typedef struct {
+	volatile LONG seq;
+	word id;
+	int a, b;
+	const void* p;
+} flight_entry;
+
+/** Format strings take a, then b. Anything they don't use is ignored. */
+static const struct { const wchar_t* format; dword flags; } flight_events[] = {
+	{ L"(unknown event)",								0 },
+	{ L"started with %d arg(s)",						0 },
+	{ L"module path:",									FLIGHT_STRING },
+	{ L"cache hit: %d",									0 },
+	{ L"target:",										FLIGHT_STRING },
+	{ L"cygwin root:",									FLIGHT_STRING },
+	{ L"mount table loaded: %d",						0 },
+	{ L"cygwin1.dll loaded: %d",						0 },
+	{ L"cygwin1.dll initialized: %d",					0 },
+	{ L"followed symlink %d (flavour %d)",				0 },
+	{ L"converted path %d (errno %d)",					0 },
+	{ L"converted %d path(s), %d failure(s)",			0 },
+	{ L"fixed environment variable %d (converted: %d)",	0 },
+	{ L"built a command line of length %d",				0 },
+	{ L"spawning interpreter (handoff mode %d)",		0 },
+	{ L"manifest hit: %d",								0 },
+	{ L"starting script through its interpreter (%d #! arg(s))",	0 },
+	{ L"spilled a command line of length %d to a response file",	0 },
+	{ L"pooled interpreter took our launch: %d",		0 },
+	{ L"sent %d path(s) to our resolver, %d answered",	0 },
+	{ L"planned %d conversion(s) for %d arg(s) and our environment",	0 }
+};
+
+static flight_entry flight_ring[FLIGHT_SIZE];
+static volatile LONG flight_seq = 0;
+
+static void flight_record(word id, int a, int b, const void* p)
+{
+	LONG seq = InterlockedIncrement(&flight_seq);
+	flight_entry* entry = &(flight_ring[seq & (FLIGHT_SIZE - 1)]);
+	// Anyone dumping while we're in here will skip this slot.
+	InterlockedExchange(&(entry->seq), 0);
+	entry->id = id;
+	entry->a = a;
+	entry->b = b;
+	entry->p = p;
+	InterlockedExchange(&(entry->seq), seq);
+}
+
+#define flight(id, a, b, p) flight_record((word)(id), (int)(a), (int)(b), (const void*)(p))
+
+/** In util.c, which needs us for fatal(). */
+static size_t utf8_encode(const wchar_t* src, size_t count, char* dst, size_t cbdst);
+
+/** Writes a line to stderr. Static buffers, since we could be out of memory. */
+static void flight_write(const wchar_t* line)
+{
+	static char sLine[1024];
+	size_t szline = utf8_encode(line, wcslen(line) + 1, sLine, 1023);
+	if(szline == (size_t)-1 || szline <= 1) return;
+	sLine[szline - 1] = '\n';
+	fwrite(sLine, 1, szline, stderr);
+}
+
+/** Decode everything still in our ring, oldest first. */
+static void flight_dump()
+{
+	static wchar_t sLine[512], sEvent[256];
+	LONG last = flight_seq, seq;
+	flight_entry *slot, entry;
+	word id;
+
+	if(!last) return;
+	flight_write(L"Recent launcher events:");
+	for(seq = last > FLIGHT_SIZE ? last - FLIGHT_SIZE + 1 : 1; seq <= last; seq++) {
+		// Make sure nobody wrote to the slot while we were copying it.
+		slot = &(flight_ring[seq & (FLIGHT_SIZE - 1)]);
+		entry = *slot;
+		if(entry.seq != seq || slot->seq != seq) {
+			StringCchPrintfW(sLine, 512, L"  [%d] (overwritten)", (int)seq);
+		} else {
+			id = entry.id < sizeof(flight_events) / sizeof(flight_events[0]) ? entry.id : 0;
+			StringCchPrintfW(sEvent, 256, flight_events[id].format, entry.a, entry.b);
+			if((flight_events[id].flags & FLIGHT_STRING) && entry.p) {
+				StringCchPrintfW(sLine, 512, L"  [%d] %s %s", (int)seq, sEvent, (const wchar_t*)entry.p);
+			} else {
+				StringCchPrintfW(sLine, 512, L"  [%d] %s", (int)seq, sEvent);
+			}
+		}
+		flight_write(sLine);
+	}
+	fflush(stderr);
+}
@@ -8,135 +8,334 @@
 #define CYGWIN_SUBKEY L"rootdir"
 #define CYGWIN_REGKEY REG_SOFTWARE L"\\Cygwin\\setup"
 
+// Our flight recorder. (Needed by fatal)
+#include "flight.c"
+
+// Our vectorized loops. (Needed by util.c, and by mounts.c)
+#include "simd.c"
+
 // Our utility functions.
 #include "util.c"
 
 #ifndef WITHOUT_VERBOSITY
 #	include "verbosity.c"
 #else
-#	define verbose_array(x) 
+#	define verbose_flag false
+#	define verbose_array(x, y) 
 #	define verbose_step(x,...) 
 #	define verbose(x, ...) 
 #	define check_verbosity(a, b, c, d, e) 
 #endif
 
+#ifndef WITHOUT_TRACE
+#	include "trace.c"
+#else
+#	define trace_init() 
+#	define trace_begin(x) 
+#	define trace_begin_n(x, n) 
+#	define trace_end(x) 
+#	define trace_flush() 
+#endif
+
+#ifndef WITHOUT_CACHE
+#	include "cache.c"
+#else
+#	define cache_has(f) false
+#	define cache_get(f, field) NULL
+#	define cache_lookup(a, b, c, d, e) false
+#	define cache_prepare(a, b, c, d) 
+#	ifndef cache_add_dep
+#		define cache_add_dep(x) 
+#	endif
+#	define cache_set_real(x, y) 
+#	define cache_set_vroot(x) 
+#	define cache_set_shebang(x, y, z) 
+#	define cache_commit() 
+#	define cache_report() 
+#	define cache_close() 
+#endif
+
+// Our output relay needs our mount table.
+#if !defined(USE_CYGWIN) || defined(WITHOUT_MOUNTS)
+#	ifndef WITHOUT_RELAY
+#		define WITHOUT_RELAY
+#	endif
+#endif
+
+// Our resolver stands in for cygwin1.dll, so it's no use without it.
+#ifndef USE_CYGWIN
+#	ifndef WITHOUT_RESOLVER
+#		define WITHOUT_RESOLVER
+#	endif
+#endif
+
 #ifdef USE_CYGWIN
 #	include "cygwin.c"
+#	include "args.c"
 #endif
 
-/** Allocates, and adds quotes to an arg. */
-static wchar_t* quote_arg(wchar_t* arg)
-{
-	wchar_t* result = NULL;
-	size_t szcount = 0;
-	
-	// Check for EMPTYW args. If found, don't both adding quotes.
-	szcount = lstrlenW(arg);
-	if(szcount == 0) {
-		return walloc(0);
-	}
-	
-	szcount += 2;
-	result = walloc(szcount);
-	szcount = (szcount + 1) * sizeof(wchar_t);
-	
-	// Now set result to the value of arg, with surrounding quotes.
-	if(FAILED(StringCchPrintfW(result, szcount, L"\"%s\"", arg))) {
-		fatal_api_call(L"quote_arg");
-	}
-	
-	return result;
-}
+#ifndef WITHOUT_MANIFEST
+#	include "manifest.c"
+#else
+#	define manifest_has(f) false
+#	define manifest_get(f, field) NULL
+#	define manifest_lookup(a, b, c, d, e, f) false
+#	define manifest_report() 
+#	define manifest_close() 
+#endif
+
+// Our CreateProcess command line.
+#include "cmdline.c"
+
+#ifndef WITHOUT_POOL
+#	include "pool.c"
+#else
+#	define pool_init(x)
+#	define os_pool_handoff(a, b, c, d) false
+#endif
+
+/**
+ * How we hand over to our interpreter. Either we wait on it, at as small
+ * a footprint as we can manage, and pass its exit code along, or we exit
+ * as soon as it's started. (For callers that don't need the exit code)
+ */
+#define HANDOFF_WAIT	0
+#define HANDOFF_DETACH	1
+
+// Our platform layer.
+#ifdef _WIN32
+#	include "os_win32.c"
+#else
+#	include "os_posix.c"
+#endif
 
 /**
- * Iterates through our args, quoting all of them and in the cases of paths,
- * converting them to a cygwin-compatible format.
+ * Iterates through our args, converting any paths to a cygwin-compatible
+ * format. (Quoting happens later, when we build our command line) Which
+ * args are paths is decided by our launcher's argument profile. (See
+ * args.c) Our args and environment are planned into one batch first, and
+ * if there's nothing in it, there's nothing to run, so nothing gets loaded
+ * to run it.
  */
+#ifdef USE_CYGWIN
+static wchar_t** fix_argv(int argc, wchar_t** argv, bool useCygwin, const arg_profile* profile)
+#else
 static wchar_t** fix_argv(int argc, wchar_t** argv, bool useCygwin)
+#endif
 {
 	int i;
 	wchar_t** result = NULL;
+	#ifdef USE_CYGWIN
+	arg_class* classes = NULL;
+	path_batch batch;
+	#ifndef WITHOUT_ENVVARS
+	env_state env;
+	#endif
+	#endif
 	
 	// First allocate our array of arguments.
 	verbose(L"Allocating new arg buffer..");
 	result = waalloc(argc);
 	
-	// Duplicate arg 0, which does not need quoting.
+	// Duplicate arg 0.
 	#ifdef USE_CYGWIN
-	if(!(result[0] = fix_path(argv[0]))) fatal_api_call(L"real_path");
+	if(manifest_has(MANIFEST_REAL)) {
+		result[0] = xwcsdup(manifest_get(MANIFEST_REAL, realTargetCyg));
+	} else if(cache_has(CACHE_REAL)) {
+		result[0] = xwcsdup(cache_get(CACHE_REAL, realTargetCyg));
+	} else if(realPathCyg) {
+		// Already worked out while following symlinks.
+		result[0] = realPathCyg;
+	} else if(!(result[0] = to_cyg_path(argv[0]))) {
+		fatal_api_call(L"real_path");
+	}
+	cache_set_real(argv[0], result[0]);
+	
+	// Work out which args (and environment variables) need converting,
+	// and convert them all at once, if there are any.
+	batch_init(&batch, MOUNT_WIN_TO_POSIX);
+	if(useCygwin) {
+		classes = (arg_class*)xalloc((size_t)argc, sizeof(arg_class));
+		args_classify(profile, argc, argv, classes);
+		args_probe(argc, argv, classes);
+		for(i = 1; i < argc; i++) {
+			classes[i].slot = classes[i].kind == ARG_LITERAL ? -1 :
+				batch_add(&batch, &(argv[i][classes[i].offset]), classes[i].length, classes[i].kind == ARG_PATHLIST);
+		}
+		#ifndef WITHOUT_ENVVARS
+		fix_env_collect(&batch, &env);
+		#endif
+		flight(FLIGHT_PLAN, batch.count, argc - 1, NULL);
+		if(batch.count) {
+			batch_run(&batch);
+		} else {
+			verbose(L"Nothing to convert..");
+		}
+	}
 	#else
-	if(!(result[0] = _wcsdup(argv[0]))) fatal_api_call(L"wcsdup");
+	result[0] = xwcsdup(argv[0]);
 	#endif
 	// Now, begin the fixes.
 	for(i = 1; i < argc; i++) {
 		#ifdef USE_CYGWIN
-		wchar_t* check = NULL;
-		if(useCygwin && *(argv[i]) && is_file(argv[i])) {
-			verbose(L"Detected convertable path argument.");
-			verbose_step(argv[i]);
-			if(check = fix_path(argv[i])) {
-				argv[i] = check;
-			} else {
-				useCygwin = false;
-			}
+		wchar_t* converted;
+		if(useCygwin && (converted = batch_result(&batch, classes[i].slot))) {
+			result[i] = args_rewrite(argv[i], &(classes[i]), converted);
+			continue;
 		}
 		#endif
-		
-		// Quote the argument for our spawn call.
-		result[i] = quote_arg(argv[i]);
-		
-		#ifdef USE_CYGWIN
-		if(useCygwin && check) xfree(check);
-		#endif
+		result[i] = argv[i];
 	}
 	
 	#ifdef USE_CYGWIN
+	if(classes) xfree(classes);
+	#ifndef WITHOUT_ENVVARS
 	if(useCygwin) {
-		#ifndef WITHOUT_ENVVARS
-		fix_env();
-		#endif
-		FreeLibrary(*phCygwin);
+		trace_begin(L"fix_env");
+		fix_env(&batch, &env);
+		trace_end(L"fix_env");
 	}
 	#endif
+	batch_free(&batch);
+	#endif
 	
 	return result;
 }
 
+#ifdef USE_CYGWIN
+#ifndef WITHOUT_SHEBANG
+/**
+ * What our target's #! line starts, if it has one. Our manifest and cache
+ * know for launchers they've seen before, so the script only gets read the
+ * first time.
+ */
+static bool find_shebang(wchar_t* cmd, shebang_result* shebang)
+{
+	bool found;
+	if(manifest_has(MANIFEST_SHEBANG)) {
+		verbose(L"Using script interpreter from our manifest..");
+		shebang->interp = xwcsdup(manifest_get(MANIFEST_SHEBANG, interp));
+		shebang->interpCyg = xwcsdup(manifest_get(MANIFEST_SHEBANG, interpCyg));
+		shebang->args = xwcsdup(manifest_get(MANIFEST_SHEBANG, interpArgs));
+		return true;
+	} else if(manifest_has(MANIFEST_REAL)) {
+		// The manifest already looked, and it isn't a script.
+		return false;
+	} else if(cache_has(CACHE_SHEBANG)) {
+		verbose(L"Using cached script interpreter..");
+		shebang->interp = xwcsdup(cache_get(CACHE_SHEBANG, interp));
+		shebang->interpCyg = xwcsdup(cache_get(CACHE_SHEBANG, interpCyg));
+		shebang->args = xwcsdup(cache_get(CACHE_SHEBANG, interpArgs));
+		return true;
+	}
+	trace_begin(L"shebang");
+	if((found = shebang_resolve(cmd, shebang))) {
+		cache_set_shebang(shebang->interp, shebang->interpCyg, shebang->args);
+	}
+	trace_end(L"shebang");
+	return found;
+}
+#endif
+#endif
+
+/** Shows how much we allocated, in verbose mode. */
+static void report_allocations()
+{
+	if(!verbose_flag) return;
+	verbose(L"Allocated %d bytes in %d allocation(s), from %d chunk(s)..",
+		(int)arena_stats.bytes, (int)arena_stats.allocs, (int)arena_stats.chunks);
+	verbose_step(L"%d grown in place, %d given back early", (int)arena_stats.grows, (int)arena_stats.reclaimed);
+}
+
 /**
- * Execute our command. If no args are specified, we can simply
- * execute the program. (In hindsight, I probably should've done
- * the environment variable stuff anyways, but since I still think
- * it's unnecessary, I don't feel like wasting the time.
+ * Execute our command. Every launch goes the same way, whatever it was
+ * given: our arguments and environment are worked out into one batch of
+ * conversions first, and cygwin1.dll is only loaded if something in that
+ * batch turns out to need it. (So `python -c ..` and a bare REPL never
+ * load it, but the REPL still gets a converted PYTHONPATH)
  */
 static int exec_cmd(wchar_t* cmd, int argc, wchar_t** argv)
 {
-	int r;
-	if(argc > 1) {
-		wchar_t** args;
-		bool useCygwin = false;
-		// Fuck, now we actually have to load cygwin to convert the paths from Windows -> Cygwin format.
-		#ifdef USE_CYGWIN
-		useCygwin = setup_cygwin();
-		verbose(L"Fixing executable name..");
-		cmd = real_path(cmd);
-		argv[0] = cmd;
-		#endif
-		
-		verbose(L"Fixing up argv..");
-		args = fix_argv(argc, argv, useCygwin);
-		
-		verbose(L"Executing..");
-		verbose_array(argc, args);
-		r = (int)_wspawnvp(_P_WAIT, cmd,  (const wchar_t* const*)args);
-		
-		wafree(args);
-		#ifdef USE_CYGWIN
-		xfree(cmd);
-		#endif
+	os_launch* launch;
+	wchar_t* env = NULL;
+	wchar_t** args;
+	bool useCygwin = false;
+	int status;
+	#ifdef USE_CYGWIN
+	const arg_profile* profile = args_profile(cmd);
+	#ifndef WITHOUT_SHEBANG
+	shebang_result shebang;
+	#endif
+	#endif
+	
+	// Fuck, now we actually have to convert the paths from Windows -> Cygwin format.
+	#ifdef USE_CYGWIN
+	useCygwin = setup_path_conversion();
+	verbose(L"Fixing executable name..");
+	if(manifest_has(MANIFEST_REAL)) {
+		verbose(L"Using interpreter path from our manifest..");
+		cmd = xwcsdup(manifest_get(MANIFEST_REAL, realTarget));
+	} else if(cache_has(CACHE_REAL)) {
+		verbose(L"Using cached interpreter path..");
+		cmd = xwcsdup(cache_get(CACHE_REAL, realTarget));
 	} else {
-		r = (int)_wspawnlp(_P_WAIT, cmd, cmd, NULL);
+		trace_begin(L"real_path");
+		cmd = real_path(cmd);
+		trace_end(L"real_path");
+	}
+	argv[0] = cmd;
+	#ifndef WITHOUT_ENVVARS
+	if(manifest_has(MANIFEST_VROOT)) {
+		virtRootCyg = xwcsdup(manifest_get(MANIFEST_VROOT, virtRootCyg));
+	} else if(cache_has(CACHE_VROOT)) {
+		virtRootCyg = xwcsdup(cache_get(CACHE_VROOT, virtRootCyg));
+	}
+	#endif
+	#endif
+	
+	verbose(L"Fixing up argv..");
+	trace_begin(L"fix_argv");
+	#ifdef USE_CYGWIN
+	args = fix_argv(argc, argv, useCygwin, profile);
+	#else
+	args = fix_argv(argc, argv, useCygwin);
+	#endif
+	trace_end(L"fix_argv");
+	
+	#ifdef USE_CYGWIN
+	#ifndef WITHOUT_SHEBANG
+	// args[0] is our script, in POSIX format by now.
+	if(find_shebang(cmd, &shebang)) {
+		args = shebang_argv(&shebang, &argc, args);
+		cmd = (wchar_t*)shebang.interp;
 	}
-	return r;
+	#endif
+	// Nothing past this point converts anything. (Our shebang may have, just now)
+	unload_cygwin();
+	#endif
+	
+	// Everything we need to know has been worked out at this point.
+	cache_commit();
+	cache_close();
+	manifest_close();
+	
+	#ifdef USE_CYGWIN
+	#ifndef WITHOUT_ENVVARS
+	env = env_block;
+	#endif
+	#endif
+	
+	// One of our pool's interpreters may be waiting for us, already started.
+	if(os_pool_handoff(argc, args, env, &status)) return status;
+	
+	trace_begin(L"prepare");
+	launch = os_prepare(cmd, argc, args, env);
+	trace_end(L"prepare");
+	report_allocations();
+	
+	// Give everything else back before we hand over to our interpreter.
+	arena_release();
+	return os_handoff(launch, os_handoff_mode());
 }
 
 /**
@@ -156,6 +355,8 @@ static void get_cygwin_root(wchar_t* sBuffer, dword szBuffer)
 		fatal_api_call(L"RegOpenKeyExW");
 	}
 	
+	// Our size is in bytes, not characters.
+	szBuffer *= sizeof(wchar_t);
 	lRet = RegQueryValueExW(hkeyCygSetup, CYGWIN_SUBKEY, NULL, &dwValType, (LPBYTE)sBuffer, &szBuffer);
 	if(lRet != ERROR_SUCCESS) {
 		if(lRet == ERROR_MORE_DATA) {
@@ -178,25 +379,15 @@ static void get_cygwin_root(wchar_t* sBuffer, dword szBuffer)
 	}
 }
 
-/** Entry Point */
-int wmain(int argc, wchar_t* argv[])
+/**
+ * Work out the path to our real executable (bin\exename, next to our
+ * Scripts folder) and the root folder of our virtual environment, given
+ * the path to ourselves.
+ */
+static void find_target(wchar_t* sExecutable, size_t szPath, wchar_t* sParentDir, wchar_t* sTarget)
 {
-	wchar_t	sParentDir[MAX_PATH+1] = EMPTYW,
-			sExecutable[MAX_PATH+1] = EMPTYW,
-			sTarget[MAX_PATH+1] = EMPTYW,
-			sPATH[MAX_ENV+1] = EMPTYW,
-			sCygRoot[MAX_PATH+1] = EMPTYW,
-			sSystemDir[MAX_PATH+1] = EMPTYW,
-			sWinDir[MAX_PATH+1] = EMPTYW,
-			*sExecutableName;
-	int i = 0;
-	size_t	szPath = 0, szParent = 0, szName = 0;
-	
-	/* First, get the path to our real executable */
-	// Get our module filepath.
-	if(!(szPath = GetModuleFileNameW(NULL, sExecutable, MAX_PATH))) {
-		fatal_api_call(L"GetModuleFileNameW");
-	}
+	wchar_t* sExecutableName;
+	size_t szParent = 0;
 	
 	// Get our parent folder
 	if(!get_dirname(sExecutable, szPath, sParentDir, &szParent)) {
@@ -211,26 +402,31 @@ int wmain(int argc, wchar_t* argv[])
 		fatal(ERROR_PATH_NOT_FOUND, L"Could not get the root folder of our virtual environment.");
 	}
 	
-	#ifndef WITHOUT_ENVVARS
-	// Possibly needed later.
-	virtRootWin = sParentDir;
-	#endif
-	
 	// Finally, append bin\exename to the root virtualenv folder.
 	if(FAILED(StringCchPrintfW(sTarget, MAX_PATH+1, L"%s\\bin%s", sParentDir, sExecutableName))) {
 		fatal_api_call(L"StringCchPrintfW (Building path to real executable)");
 	}
 	
-	// Make sure that our real executable exists.
-	if(FAILED(sTarget)) {
-		fatal(ERROR_FILE_NOT_FOUND, L"Did not find an existing file at %s", sTarget);
+	// pip's scripts don't end in .exe, so a hardlinked launcher for one
+	// (See cyglaunch-manifest --sync) has to drop ours.
+	szPath = wcslen(sTarget);
+	if(szPath > 4 && _wcsicmp(&(sTarget[szPath - 4]), L".exe") == 0 && !exists(sTarget)) {
+		sTarget[szPath - 4] = L'\0';
+		if(!exists(sTarget)) sTarget[szPath - 4] = L'.';
 	}
 	
-	/* Now that we have the real path, set up our environment variables. */
-	// First, find our cygwin root folder
-	get_cygwin_root(sCygRoot, MAX_PATH + 1);
+	// Whether it actually exists is checked once we've followed any
+	// symlinks to it. (See os_prepare)
+}
+
+/** Build the PATH our interpreter gets. */
+static void build_path_var(wchar_t* sParentDir, wchar_t* sCygRoot, wchar_t* sPATH)
+{
+	wchar_t	sSystemDir[MAX_PATH+1] = EMPTYW,
+			sWinDir[MAX_PATH+1] = EMPTYW;
+	size_t	szPath = 0, szParent = 0;
 	
-	// And then our system directory.
+	// First, our system directory.
 	if(!(szPath = (size_t)GetSystemDirectoryW(sSystemDir, MAX_PATH))) {
 		fatal_api_call(L"GetSystemDirectoryW");
 	}
@@ -253,13 +449,84 @@ int wmain(int argc, wchar_t* argv[])
 	))) {
 		fatal_api_call(L"StringCchPrintfW (Building PATH variable)");
 	}
+}
+
+#ifndef LAUNCHER_LIBRARY
+/** Entry Point */
+int wmain(int argc, wchar_t* argv[])
+{
+	wchar_t	sParentDir[MAX_PATH+1] = EMPTYW,
+			sExecutable[MAX_PATH+1] = EMPTYW,
+			sTarget[MAX_PATH+1] = EMPTYW,
+			sPATH[MAX_ENV+1] = EMPTYW,
+			sCygRoot[MAX_PATH+1] = EMPTYW;
+	size_t	szPath = 0;
+	bool	known;
+	
+	trace_init();
+	os_install_crash_handler();
+	flight(FLIGHT_START, argc, 0, NULL);
+	
+	/* First, get the path to our real executable */
+	// Get our module filepath.
+	trace_begin(L"module_path");
+	if(!(szPath = GetModuleFileNameW(NULL, sExecutable, MAX_PATH))) {
+		fatal_api_call(L"GetModuleFileNameW");
+	}
+	trace_end(L"module_path");
+	flight(FLIGHT_MODULE, 0, 0, sExecutable);
+	
+	// Everything below may already be in our manifest, or if we've been
+	// launched before, in our cache.
+	trace_begin(L"manifest_lookup");
+	known = manifest_lookup(sExecutable, szPath, sParentDir, sTarget, sCygRoot, sPATH);
+	trace_end(L"manifest_lookup");
+	flight(FLIGHT_MANIFEST, known, 0, NULL);
+	if(known) goto launch;
+	
+	trace_begin(L"cache_lookup");
+	known = cache_lookup(sExecutable, sParentDir, sTarget, sCygRoot, sPATH);
+	trace_end(L"cache_lookup");
+	flight(FLIGHT_CACHE, known, 0, NULL);
+	if(known) goto launch;
+	
+	trace_begin(L"find_target");
+	find_target(sExecutable, szPath, sParentDir, sTarget);
+	trace_end(L"find_target");
+	flight(FLIGHT_TARGET, 0, 0, sTarget);
+	
+	/* Now that we have the real path, set up our environment variables. */
+	// First, find our cygwin root folder
+	trace_begin(L"registry");
+	get_cygwin_root(sCygRoot, MAX_PATH + 1);
+	trace_end(L"registry");
+	flight(FLIGHT_CYGROOT, 0, 0, sCygRoot);
+	build_path_var(sParentDir, sCygRoot, sPATH);
+	
+	// Remember all of that for next time.
+	cache_prepare(sParentDir, sTarget, sCygRoot, sPATH);
+	
+launch:
+	pool_init(sParentDir);
+	#ifdef USE_CYGWIN
+	cygRootWin = sCygRoot;
+	#ifndef WITHOUT_ENVVARS
+	// Possibly needed later.
+	virtRootWin = sParentDir;
+	#endif
+	#endif
 	
 	// Check for verbosity fag. (maybe)
 	check_verbosity(argc, argv, sCygRoot, sTarget, sPATH);
+	if(verbose_flag) {
+		manifest_report();
+		cache_report();
+	}
 	
 	if(!SetEnvironmentVariableW(L"PATH", sPATH)) {
 		fatal_api_call(L"SetEnvironmentVariableW");
 	}
 	argv[0] = sTarget;
 	return exec_cmd(sTarget, argc, argv);
-}
\ No newline at end of file
+}
+#endif
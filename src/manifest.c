@@ -0,0 +1,385 @@
+/**
+ * manifest.c - Read-only launch manifest, written ahead of time by
+ *              cyglaunch-manifest. (See tools\manifest.c)
+ *
+ * Where our cache (cache.c) is filled in lazily and checks every file its
+ * results came from, the manifest is generated once for the whole
+ * virtualenv, right after it's created, and holds everything wmain and
+ * exec_cmd would otherwise work out: the Cygwin root, the PATH we build,
+ * the converted virtualenv root, the resolved interpreter for each
+ * launcher name in Scripts\, (And for scripts, the interpreter in their
+ * #! line) and the environment variable rules fix_env uses. It lives in
+ * Scripts\.cyglaunch.manifest.
+ *
+ * It's also the index for a multi-call launcher: with --sync, the
+ * generator hardlinks one launcher image under the name of every script
+ * in bin\, so every launcher in the virtualenv shares one set of code
+ * pages, and each finds its target by its own name. Entries are sorted
+ * by name, so that lookup is a binary search.
+ *
+ * Loading it is one mapped read. Checking it is cheap: a header with a
+ * magic number, version and layout stamp, the user it was generated by,
+ * and the size and last write time of Cygwin's fstab and that user's
+ * fstab.d file, plus every hop of each launcher's symlink chain, (and its
+ * script's interpreter's) - one attribute lookup each, no handles opened.
+ * If any of that doesn't match, (another user's mounts can differ, so
+ * their launches don't use it) or the manifest doesn't know our launcher,
+ * we fall back to working everything out (and to our cache). Rerun the
+ * generator after moving the virtualenv.
+ *
+ * Can be excluded by defining WITHOUT_MANIFEST.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+#define MANIFEST_FILENAME	L".cyglaunch.manifest"
+#define MANIFEST_MAGIC		0x464d4c43 // CLMF
+#define MANIFEST_VERSION	6
+#define MANIFEST_MAX_SIZE	(1024 * 1024)
+
+/** Flags for the optional parts of what we found. */
+#define MANIFEST_REAL		0x001 // realTarget and realTargetCyg are set.
+#define MANIFEST_VROOT		0x002 // virtRootCyg is set.
+#define MANIFEST_RULES		0x004 // Our env rules came from the manifest.
+#define MANIFEST_SHEBANG	0x008 // interp, interpCyg and interpArgs are set. (See shebang.c)
+
+/** Size and last write time of a file, as GetFileAttributesExW sees it. */
+typedef struct {
+	dword missing;
+	dword sizeHigh, sizeLow;
+	FILETIME written;
+} manifest_stamp;
+
+/** Strings are offsets into the string pool, in characters. 0 is always "". */
+typedef struct {
+	dword name;
+	dword target;
+	dword realTarget;
+	dword realTargetCyg;
+	dword interp;				// Only set if realTarget is a script.
+	dword interpCyg;
+	dword interpArgs;
+	dword hop, nhops;			// Every file real_path looked at for it, in the manifest's hops.
+} manifest_entry;
+
+typedef struct {
+	dword path;
+	manifest_stamp stamp;
+} manifest_hop;
+
+typedef struct {
+	dword name;
+	dword flags;
+	dword value;		// For PREPEND. Empty if there's none.
+} manifest_rule;
+
+/**
+ * The file is this header, then nentries entries, (Sorted by name, case
+ * insensitively) then nrules rules, then nhops hops, then the string
+ * pool. Everything is at the offsets the header says.
+ */
+typedef struct {
+	dword magic;
+	dword version;
+	dword size;					// Of the whole file, in bytes.
+	dword layout;				// sizeof our structs and wchar_t, so a manifest from another build is stale.
+	dword parentDir;
+	dword cygRoot;
+	dword path;
+	dword virtRootCyg;
+	dword user;					// USERNAME, whose fstab.d file our mount table read too.
+	manifest_stamp fstab;
+	manifest_stamp userFstab;
+	dword nentries, entries;	// Count, and offset in bytes.
+	dword nrules, rules;
+	dword nhops, hops;
+	dword nstrings, strings;	// Length in characters, and offset in bytes.
+} manifest_header;
+
+#define MANIFEST_LAYOUT ((dword)(sizeof(manifest_header) | (sizeof(manifest_entry) << 8) | (sizeof(manifest_rule) << 16) | \
+	(sizeof(manifest_hop) << 22) | (sizeof(wchar_t) << 28)))
+
+/** What we found for this launcher. Strings point into our mapped view, which stays mapped until we exit. */
+static struct {
+	dword flags;
+	const wchar_t* realTarget;
+	const wchar_t* realTargetCyg;
+	const wchar_t* virtRootCyg;
+	const wchar_t* interp;
+	const wchar_t* interpCyg;
+	const wchar_t* interpArgs;
+} manifest_found;
+
+static const manifest_header* manifest_view = NULL;
+static bool manifest_hit = false;
+
+#define manifest_has(f) ((manifest_found.flags & (f)) != 0)
+#define manifest_get(f, field) (manifest_has(f) ? manifest_found.field : NULL)
+
+/** Fill in a stamp for path. Missing files get stamped as missing. */
+static void manifest_stamp_path(const wchar_t* path, manifest_stamp* stamp)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	ZeroMemory(stamp, sizeof(manifest_stamp));
+	if(!GetFileAttributesExW(path, GetFileExInfoStandard, &data)) {
+		stamp->missing = 1;
+		return;
+	}
+	stamp->sizeHigh = data.nFileSizeHigh;
+	stamp->sizeLow = data.nFileSizeLow;
+	stamp->written = data.ftLastWriteTime;
+}
+
+static bool manifest_check(const wchar_t* path, const manifest_stamp* stamp)
+{
+	manifest_stamp now;
+	manifest_stamp_path(path, &now);
+	if(memcmp(&now, stamp, sizeof(manifest_stamp)) == 0) return true;
+	verbose(L"Manifest is stale: %s changed.", path);
+	return false;
+}
+
+/** A string from our pool. Offsets were checked when the manifest was loaded. */
+static inline const wchar_t* manifest_string(dword offset)
+{
+	return &(((const wchar_t*)((const byte*)manifest_view + manifest_view->strings))[offset]);
+}
+
+/** Map the manifest, and make sure everything in it is where it says it is. */
+static bool manifest_map(const wchar_t* sManifestPath)
+{
+	HANDLE hFile, hMapping;
+	LARGE_INTEGER szFile;
+	const manifest_header* header;
+	const manifest_entry* entries;
+	const manifest_rule* rules;
+	const manifest_hop* hops;
+	const wchar_t* strings;
+	dword i, n;
+	bool ok;
+
+	hFile = CreateFileW(sManifestPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(hFile == INVALID_HANDLE_VALUE) return false;
+	if(!GetFileSizeEx(hFile, &szFile) || szFile.QuadPart < (LONGLONG)sizeof(manifest_header) || szFile.QuadPart > MANIFEST_MAX_SIZE) {
+		CloseHandle(hFile);
+		return false;
+	}
+	hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(hFile);
+	if(hMapping == NULL) return false;
+	header = (const manifest_header*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hMapping);
+	if(header == NULL) return false;
+
+	// Header, then bounds, so that nothing after this has to check.
+	if(header->magic != MANIFEST_MAGIC || header->version != MANIFEST_VERSION || header->layout != MANIFEST_LAYOUT ||
+		header->size != (dword)szFile.QuadPart ||
+		header->nentries > MANIFEST_MAX_SIZE / sizeof(manifest_entry) ||
+		header->nrules > MANIFEST_MAX_SIZE / sizeof(manifest_rule) ||
+		header->nhops > MANIFEST_MAX_SIZE / sizeof(manifest_hop) ||
+		header->entries % sizeof(dword) || header->rules % sizeof(dword) || header->hops % sizeof(dword) ||
+		header->strings % sizeof(wchar_t) ||
+		header->entries > header->size || header->size - header->entries < header->nentries * sizeof(manifest_entry) ||
+		header->rules > header->size || header->size - header->rules < header->nrules * sizeof(manifest_rule) ||
+		header->hops > header->size || header->size - header->hops < header->nhops * sizeof(manifest_hop) ||
+		header->strings > header->size || (header->size - header->strings) / sizeof(wchar_t) < header->nstrings ||
+		!header->nstrings) {
+		verbose(L"Ignoring outdated or malformed manifest: %s", sManifestPath);
+		UnmapViewOfFile((void*)header);
+		return false;
+	}
+	strings = (const wchar_t*)((const byte*)header + header->strings);
+	entries = (const manifest_entry*)((const byte*)header + header->entries);
+	rules = (const manifest_rule*)((const byte*)header + header->rules);
+	hops = (const manifest_hop*)((const byte*)header + header->hops);
+
+	// Every string, and every entry's hops, has to start inside the pool, and the pool has to end in a NUL.
+	n = header->nstrings;
+	ok = strings[n - 1] == L'\0' && header->parentDir < n && header->cygRoot < n && header->path < n && header->virtRootCyg < n &&
+		header->user < n;
+	for(i = 0; ok && i < header->nentries; i++) {
+		ok = entries[i].name < n && entries[i].target < n && entries[i].realTarget < n && entries[i].realTargetCyg < n &&
+			entries[i].interp < n && entries[i].interpCyg < n && entries[i].interpArgs < n &&
+			entries[i].hop <= header->nhops && header->nhops - entries[i].hop >= entries[i].nhops;
+	}
+	for(i = 0; ok && i < header->nrules; i++) {
+		ok = rules[i].name < n && rules[i].value < n;
+	}
+	for(i = 0; ok && i < header->nhops; i++) {
+		ok = hops[i].path < n;
+	}
+	if(!ok) {
+		verbose(L"Ignoring malformed manifest: %s", sManifestPath);
+		UnmapViewOfFile((void*)header);
+		return false;
+	}
+
+	manifest_view = header;
+	return true;
+}
+
+/** Binary search for the entry for a launcher name. */
+static const manifest_entry* manifest_find(const wchar_t* sName)
+{
+	const manifest_entry* entries = (const manifest_entry*)((const byte*)manifest_view + manifest_view->entries);
+	dword lo = 0, hi = manifest_view->nentries, mid;
+	int cmp;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(!(cmp = _wcsicmp(sName, manifest_string(entries[mid].name)))) return &(entries[mid]);
+		if(cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+/** An entry's first hop. Its hops were checked when the manifest was loaded. */
+static inline const manifest_hop* manifest_hops(const manifest_entry* entry)
+{
+	return &(((const manifest_hop*)((const byte*)manifest_view + manifest_view->hops))[entry->hop]);
+}
+
+/** Whether every hop of an entry's symlink chain (and its script's interpreter's) is still the one we saw. */
+static bool manifest_entry_current(const manifest_entry* entry)
+{
+	const manifest_hop* hops = manifest_hops(entry);
+	dword i;
+
+	for(i = 0; i < entry->nhops; i++) {
+		if(!manifest_check(manifest_string(hops[i].path), &(hops[i].stamp))) return false;
+	}
+	return true;
+}
+
+#ifndef WITHOUT_ENVVARS
+/** Replace our built-in env rules with the manifest's, if there's room for them. */
+static void manifest_use_rules()
+{
+	static env_entry rules[ENV_MAX_RULES+1];
+	const manifest_rule* manifestRules = (const manifest_rule*)((const byte*)manifest_view + manifest_view->rules);
+	dword i;
+
+	if(manifest_view->nrules > ENV_MAX_RULES) return;
+	for(i = 0; i < manifest_view->nrules; i++) {
+		rules[i].name = manifest_string(manifestRules[i].name);
+		rules[i].flags = manifestRules[i].flags;
+		rules[i].value = *manifest_string(manifestRules[i].value) ? manifest_string(manifestRules[i].value) : NULL;
+	}
+	rules[i].name = NULL;
+	rules[i].flags = NONE;
+	rules[i].value = NULL;
+	env_rules = rules;
+	manifest_found.flags |= MANIFEST_RULES;
+}
+#endif
+
+/**
+ * Look up our launcher in the manifest next to it. sExecutable is the full
+ * path of our module. On a hit, the remaining buffers are filled in and
+ * true is returned; what exec_cmd needs is left in manifest_found.
+ */
+static bool manifest_lookup(wchar_t* sExecutable, size_t szPath, wchar_t* sParentDir, wchar_t* sTarget, wchar_t* sCygRoot, wchar_t* sPATH)
+{
+	wchar_t sManifestPath[MAX_PATH+1] = EMPTYW, sFstab[MAX_PATH+1] = EMPTYW, sUser[MAX_PATH+1] = EMPTYW, *sName;
+	const manifest_entry* entry;
+	size_t szParent = 0;
+
+	ZeroMemory(&manifest_found, sizeof(manifest_found));
+	if(!(sName = wcsrchr(sExecutable, L'\\'))) return false;
+	sName++;
+
+	// Scripts\.cyglaunch.manifest
+	if((size_t)(sName - sExecutable) + wcslen(MANIFEST_FILENAME) > MAX_PATH) return false;
+	wcsncpy(sManifestPath, sExecutable, sName - sExecutable);
+	wcscat(sManifestPath, MANIFEST_FILENAME);
+	if(!manifest_map(sManifestPath)) return false;
+
+	// Make sure it's for the virtualenv we're in. (It could have been moved)
+	if(!get_dirname(sExecutable, szPath, sParentDir, &szParent) ||
+		!get_dirname(sParentDir, szParent, sParentDir, &szParent) ||
+		_wcsicmp(sParentDir, manifest_string(manifest_view->parentDir)) != 0) {
+		verbose(L"Manifest is for another virtual environment: %s", manifest_string(manifest_view->parentDir));
+		return false;
+	}
+
+	// Our mount table reads our user's fstab.d file too, so their mounts could convert differently.
+	if(GetEnvironmentVariableW(L"USERNAME", sUser, MAX_PATH+1) > MAX_PATH) *sUser = L'\0';
+	if(_wcsicmp(sUser, manifest_string(manifest_view->user)) != 0) {
+		verbose(L"Manifest was generated by another user: %s", manifest_string(manifest_view->user));
+		return false;
+	}
+
+	if(!(entry = manifest_find(sName))) {
+		verbose(L"Manifest has no entry for %s.", sName);
+		return false;
+	}
+
+	if(FAILED(StringCchPrintfW(sFstab, MAX_PATH+1, L"%s\\etc\\fstab", manifest_string(manifest_view->cygRoot))) ||
+		!manifest_check(sFstab, &(manifest_view->fstab))) {
+		return false;
+	}
+	if(*sUser && (FAILED(StringCchPrintfW(sFstab, MAX_PATH+1, L"%s\\etc\\fstab.d\\%s", manifest_string(manifest_view->cygRoot), sUser)) ||
+		!manifest_check(sFstab, &(manifest_view->userFstab)))) {
+		return false;
+	}
+	if(!manifest_entry_current(entry)) return false;
+
+	if(FAILED(StringCchCopyW(sTarget, MAX_PATH+1, manifest_string(entry->target))) ||
+		FAILED(StringCchCopyW(sCygRoot, MAX_PATH+1, manifest_string(manifest_view->cygRoot))) ||
+		FAILED(StringCchCopyW(sPATH, MAX_ENV+1, manifest_string(manifest_view->path)))) {
+		return false;
+	}
+	if(*manifest_string(entry->realTarget) && *manifest_string(entry->realTargetCyg)) {
+		manifest_found.realTarget = manifest_string(entry->realTarget);
+		manifest_found.realTargetCyg = manifest_string(entry->realTargetCyg);
+		manifest_found.flags |= MANIFEST_REAL;
+		if(*manifest_string(entry->interp) && *manifest_string(entry->interpCyg)) {
+			manifest_found.interp = manifest_string(entry->interp);
+			manifest_found.interpCyg = manifest_string(entry->interpCyg);
+			manifest_found.interpArgs = manifest_string(entry->interpArgs);
+			manifest_found.flags |= MANIFEST_SHEBANG;
+		}
+	}
+	if(*manifest_string(manifest_view->virtRootCyg)) {
+		manifest_found.virtRootCyg = manifest_string(manifest_view->virtRootCyg);
+		manifest_found.flags |= MANIFEST_VROOT;
+	}
+	#ifndef WITHOUT_ENVVARS
+	if(manifest_view->nrules) manifest_use_rules();
+	#endif
+	manifest_hit = true;
+	return true;
+}
+
+/** Print what we got from our manifest. Only called in verbose mode. */
+static void manifest_report()
+{
+	if(!manifest_view) {
+		verbose(L"Launch manifest unavailable.");
+		return;
+	}
+	verbose(L"Launch manifest %s..", manifest_hit ? L"hit" : L"miss");
+	verbose_step(L"entries: %d", (int)manifest_view->nentries);
+	verbose_step(L"env rules: %d%s", (int)manifest_view->nrules, manifest_has(MANIFEST_RULES) ? L" (in use)" : L"");
+}
+
+/**
+ * Unmap the manifest, so that it can be regenerated while our interpreter
+ * runs. Nothing in manifest_found is valid afterwards.
+ */
+static void manifest_close()
+{
+	if(manifest_view) UnmapViewOfFile((void*)manifest_view);
+	manifest_view = NULL;
+	ZeroMemory(&manifest_found, sizeof(manifest_found));
+	#ifndef WITHOUT_ENVVARS
+	env_rules = vars_tab;
+	#endif
+}
@@ -0,0 +1,598 @@
+/**
+ * mounts.c - In-process replacement for cygwin_conv_path, driven by the
+ *            Cygwin mount table.
+ *
+ * Loading and initializing cygwin1.dll just to have it flip a few slashes
+ * around is the single most expensive thing this launcher does, so this
+ * file reimplements the part of Cygwin's path handling that we actually
+ * need: parsing <cygroot>/etc/fstab, the cygdrive prefix and the implicit
+ * root mounts, and then mapping paths between the two worlds the same way
+ * mount_info::conv_to_posix_path and conv_to_win32_path do.
+ *
+ * Anything we don't know how to handle (/proc, /dev, drive-relative paths,
+ * mount entries we can't parse, etc) makes the conversion fail, at which
+ * point cygwin.c falls back to the real thing.
+ *
+ * The code in this file only depends on the standard C library, (and
+ * simd.c, for the loops over every character) so it can be built by
+ * itself on a platform that isn't Windows.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	include <stdlib.h>
+#	include <string.h>
+#	include <wchar.h>
+#	include <wctype.h>
+#	ifndef bool
+#		define bool int
+#		define true 1
+#		define false 0
+#	endif
+#	define EMPTYW L""
+#	define MAX_PATH 260
+#	define MAX_ENV 32767
+#	include "simd.c"
+#endif
+
+/** Limits for the mount table. Cygwin itself caps the table at 64 entries. */
+#define MOUNT_MAX			64
+#define MOUNT_POOL_SIZE		8192
+#define MOUNT_MAX_PARTS		512
+
+/** Conversion directions, mirroring the cygwin_conv_path 'what' values we use. */
+#define MOUNT_WIN_TO_POSIX	0
+#define MOUNT_POSIX_TO_WIN	1
+
+/** Mount entry flags. */
+#define MOUNT_IMPLICIT		0x001 // Added by us, rather than read from fstab.
+#define MOUNT_DEFER			0x002 // We couldn't parse the native path. Let cygwin handle it.
+
+/** A single mount point. Both strings live in the table's pool. */
+typedef struct {
+	const wchar_t* win;		// Native path. Backslashes, no trailing slash. (C:\cygwin)
+	size_t szwin;
+	const wchar_t* posix;	// Mount point. No trailing slash, so "/" is stored as "".
+	size_t szposix;
+	int flags;
+} mount_entry;
+
+typedef struct {
+	mount_entry entries[MOUNT_MAX];
+	int count;
+
+	// The cygdrive prefix, without the trailing slash. ("/cygdrive")
+	wchar_t cygdrive[MAX_PATH+1];
+	size_t szcygdrive;
+
+	// String storage for the entries above.
+	wchar_t pool[MOUNT_POOL_SIZE];
+	size_t szpool;
+} mount_table;
+
+/** A path component, pointing into someone else's string. */
+typedef struct { const wchar_t* s; size_t n; } mount_part;
+
+typedef struct {
+	mount_part parts[MOUNT_MAX_PARTS];
+	int count;
+	bool overflow;
+} mount_parts;
+
+static inline bool mount_is_sep(wchar_t c)
+{
+	return c == L'/' || c == L'\\';
+}
+
+static inline bool mount_is_drive(const wchar_t* p)
+{
+	return ((p[0] >= L'a' && p[0] <= L'z') || (p[0] >= L'A' && p[0] <= L'Z')) && p[1] == L':';
+}
+
+/** Case-insensitive comparison of n characters. (Windows paths) */
+static bool mount_iequal(const wchar_t* a, const wchar_t* b, size_t n)
+{
+	size_t i;
+	for(i = 0; i < n; i++) {
+		if(a[i] == b[i]) continue;
+		if(towlower(a[i]) != towlower(b[i])) return false;
+	}
+	return true;
+}
+
+/** Copy a string into the table's pool and return a pointer to the copy. */
+static const wchar_t* mount_intern(mount_table* mt, const wchar_t* s, size_t n)
+{
+	wchar_t* result;
+	if(mt->szpool + n + 1 > MOUNT_POOL_SIZE) return NULL;
+	result = &(mt->pool[mt->szpool]);
+	memcpy(result, s, n * sizeof(wchar_t));
+	result[n] = L'\0';
+	mt->szpool += n + 1;
+	return result;
+}
+
+/**
+ * Split a path into components, appending them to pp and lexically
+ * resolving "." and ".." as we go. A ".." at the root stays at the root,
+ * which is what both Windows and Cygwin do.
+ */
+static void mount_push_parts(mount_parts* pp, const wchar_t* s, size_t n)
+{
+	size_t i = 0, start;
+	while(i < n) {
+		while(i < n && mount_is_sep(s[i])) i++;
+		start = i;
+		i += simd_find_sep(&(s[i]), n - i);
+		if(i == start) break;
+		if(i - start == 1 && s[start] == L'.') continue;
+		if(i - start == 2 && s[start] == L'.' && s[start+1] == L'.') {
+			if(pp->count > 0) pp->count--;
+			continue;
+		}
+		if(pp->count == MOUNT_MAX_PARTS) {
+			pp->overflow = true;
+			return;
+		}
+		pp->parts[pp->count].s = &(s[start]);
+		pp->parts[pp->count++].n = i - start;
+	}
+}
+
+/** Appends n chars of s to out, keeping track of the remaining space. */
+static inline bool mount_emit(wchar_t* out, size_t szout, size_t* pos, const wchar_t* s, size_t n)
+{
+	if(*pos + n >= szout) return false;
+	memcpy(&(out[*pos]), s, n * sizeof(wchar_t));
+	*pos += n;
+	out[*pos] = L'\0';
+	return true;
+}
+
+/** Same as mount_emit, but with every from in s turned into a to. */
+static inline bool mount_emit_flipped(wchar_t* out, size_t szout, size_t* pos, const wchar_t* s, size_t n, wchar_t from, wchar_t to)
+{
+	if(*pos + n >= szout) return false;
+	simd_flip(&(out[*pos]), s, n, from, to);
+	*pos += n;
+	out[*pos] = L'\0';
+	return true;
+}
+
+/** Joins path components with sep. */
+static bool mount_emit_parts(wchar_t* out, size_t szout, size_t* pos, const mount_parts* pp, int first, wchar_t sep)
+{
+	int i;
+	for(i = first; i < pp->count; i++) {
+		if(!mount_emit(out, szout, pos, &sep, 1)) return false;
+		if(!mount_emit(out, szout, pos, pp->parts[i].s, pp->parts[i].n)) return false;
+	}
+	return true;
+}
+
+/**
+ * Turn a Windows path into its canonical absolute form: "X:\a\b" or
+ * "\\server\share\a". Relative paths are resolved against cwd, which must
+ * be absolute. Returns the number of characters written, or 0 if the path
+ * is one we can't handle.
+ */
+static size_t mount_canon_win(const wchar_t* path, const wchar_t* cwd, wchar_t* out, size_t szout, bool* trailing)
+{
+	mount_parts pp;
+	size_t pos = 0, n = simd_length(path);
+	wchar_t prefix[2];
+	bool unc = false;
+
+	pp.count = 0;
+	pp.overflow = false;
+	*trailing = n > 0 && mount_is_sep(path[n-1]);
+
+	// Strip the \\?\ prefix, since we're not passing the result to Win32 anyways.
+	if(n >= 4 && mount_is_sep(path[0]) && mount_is_sep(path[1]) && path[2] == L'?' && mount_is_sep(path[3])) {
+		path += 4;
+		n -= 4;
+		if(n >= 4 && mount_iequal(path, L"UNC", 3) && mount_is_sep(path[3])) {
+			path += 3;
+			n -= 3;
+			unc = true;
+		}
+	}
+
+	if(unc || (n >= 2 && mount_is_sep(path[0]) && mount_is_sep(path[1]))) {
+		// UNC path. The server and share names become the first two parts,
+		// and can't be ..'d away.
+		mount_push_parts(&pp, path, n);
+		if(pp.overflow || pp.count < 2) return 0;
+		if(!mount_emit(out, szout, &pos, L"\\\\", 2)) return 0;
+		if(!mount_emit(out, szout, &pos, pp.parts[0].s, pp.parts[0].n)) return 0;
+		if(!mount_emit_parts(out, szout, &pos, &pp, 1, L'\\')) return 0;
+		return pos;
+	}
+
+	if(mount_is_drive(path)) {
+		// Drive-relative paths (C:foo) depend on per-drive state we don't have.
+		if(!mount_is_sep(path[2])) return 0;
+		prefix[0] = (wchar_t)towupper(path[0]);
+		mount_push_parts(&pp, path + 2, n - 2);
+	} else {
+		// Relative to cwd, or relative to the root of cwd's drive.
+		if(!cwd || !mount_is_drive(cwd)) return 0;
+		prefix[0] = (wchar_t)towupper(cwd[0]);
+		if(n == 0 || !mount_is_sep(path[0])) {
+			mount_push_parts(&pp, cwd + 2, wcslen(cwd) - 2);
+		}
+		mount_push_parts(&pp, path, n);
+	}
+
+	prefix[1] = L':';
+	if(pp.overflow) return 0;
+	if(!mount_emit(out, szout, &pos, prefix, 2)) return 0;
+	if(!mount_emit_parts(out, szout, &pos, &pp, 0, L'\\')) return 0;
+	return pos;
+}
+
+/**
+ * Turn a POSIX path into its canonical absolute form. Relative paths are
+ * resolved against cwd, which must already be an absolute POSIX path.
+ * Leading double slashes (//server/share) are preserved, everything else
+ * is collapsed.
+ */
+static size_t mount_canon_posix(const wchar_t* path, const wchar_t* cwd, wchar_t* out, size_t szout, bool* trailing)
+{
+	mount_parts pp;
+	size_t pos = 0, n = simd_length(path);
+
+	pp.count = 0;
+	pp.overflow = false;
+	*trailing = n > 1 && path[n-1] == L'/';
+
+	// Backslashes in a POSIX path mean the caller handed us something odd.
+	if(simd_find(path, n, L'\\') < n) return 0;
+
+	if(n >= 2 && path[0] == L'/' && path[1] == L'/' && path[2] != L'/') {
+		mount_push_parts(&pp, path, n);
+		if(pp.overflow || pp.count < 2) return 0;
+		if(!mount_emit(out, szout, &pos, L"/", 1)) return 0;
+	} else {
+		if(path[0] != L'/') {
+			if(!cwd || cwd[0] != L'/') return 0;
+			mount_push_parts(&pp, cwd, wcslen(cwd));
+		}
+		mount_push_parts(&pp, path, n);
+		if(pp.overflow) return 0;
+		if(pp.count == 0) return mount_emit(out, szout, &pos, L"/", 1) ? pos : 0;
+	}
+	if(!mount_emit_parts(out, szout, &pos, &pp, 0, L'/')) return 0;
+	return pos;
+}
+
+/** Add a mount point to the table, replacing an existing one for the same POSIX path. */
+static bool mount_table_add(mount_table* mt, const wchar_t* win, size_t szwin, const wchar_t* posix, size_t szposix, int flags)
+{
+	int i;
+	mount_entry* entry = NULL;
+
+	// Normalize both sides: no trailing slashes, backslashes on the Windows side.
+	while(szposix > 0 && posix[szposix-1] == L'/') szposix--;
+	while(szwin > 0 && mount_is_sep(win[szwin-1])) szwin--;
+
+	for(i = 0; i < mt->count; i++) {
+		if(mt->entries[i].szposix == szposix && wcsncmp(mt->entries[i].posix, posix, szposix) == 0) {
+			entry = &(mt->entries[i]);
+			break;
+		}
+	}
+
+	if(entry == NULL) {
+		if(mt->count == MOUNT_MAX) return false;
+		entry = &(mt->entries[mt->count++]);
+		if(!(entry->posix = mount_intern(mt, posix, szposix))) {
+			mt->count--;
+			return false;
+		}
+		entry->szposix = szposix;
+	}
+
+	entry->flags = flags;
+	entry->szwin = szwin;
+	if(!(entry->win = mount_intern(mt, win, szwin))) {
+		entry->flags |= MOUNT_DEFER;
+		return false;
+	}
+
+	// Flip any forward slashes in the native path. (fstab allows either)
+	for(i = 0; i < (int)szwin; i++) {
+		if(entry->win[i] == L'/') ((wchar_t*)entry->win)[i] = L'\\';
+	}
+	return true;
+}
+
+/**
+ * Set up the mounts Cygwin creates without being told to:
+ *   /         -> cygroot
+ *   /usr/bin  -> cygroot\bin
+ *   /usr/lib  -> cygroot\lib
+ * and the default cygdrive prefix.
+ */
+static void mount_table_init(mount_table* mt, const wchar_t* cygroot)
+{
+	wchar_t sub[MAX_PATH+1];
+	size_t szroot = wcslen(cygroot);
+
+	mt->count = 0;
+	mt->szpool = 0;
+	wcscpy(mt->cygdrive, L"/cygdrive");
+	mt->szcygdrive = 9;
+
+	while(szroot > 0 && mount_is_sep(cygroot[szroot-1])) szroot--;
+	mount_table_add(mt, cygroot, szroot, L"/", 1, MOUNT_IMPLICIT);
+	if(szroot + 4 < MAX_PATH) {
+		wcsncpy(sub, cygroot, szroot);
+		wcscpy(&(sub[szroot]), L"\\bin");
+		mount_table_add(mt, sub, szroot + 4, L"/usr/bin", 8, MOUNT_IMPLICIT);
+		wcscpy(&(sub[szroot]), L"\\lib");
+		mount_table_add(mt, sub, szroot + 4, L"/usr/lib", 8, MOUNT_IMPLICIT);
+	}
+}
+
+/** Copies a table somewhere else, pointing its entries at the copy's pool. */
+static void mount_table_copy(mount_table* dst, const mount_table* src)
+{
+	int i;
+	memcpy(dst, src, sizeof(mount_table));
+	for(i = 0; i < dst->count; i++) {
+		if(src->entries[i].win) dst->entries[i].win = &(dst->pool[src->entries[i].win - src->pool]);
+		if(src->entries[i].posix) dst->entries[i].posix = &(dst->pool[src->entries[i].posix - src->pool]);
+	}
+}
+
+/**
+ * Decode one whitespace-delimited fstab field into out, handling the
+ * octal escapes (\040 for space, etc) fstab uses. Input is UTF-8.
+ */
+static const char* mount_fstab_field(const char* p, const char* end, wchar_t* out, size_t szout, size_t* n)
+{
+	unsigned int c, extra;
+	*n = 0;
+	while(p < end && (*p == ' ' || *p == '\t')) p++;
+	while(p < end && *p != ' ' && *p != '\t') {
+		c = (unsigned char)*p++;
+		extra = 0;
+		if(c == '\\' && end - p >= 3 && p[0] >= '0' && p[0] <= '3') {
+			c = ((p[0] - '0') << 6) | ((p[1] - '0') << 3) | (p[2] - '0');
+			p += 3;
+		} else if(c >= 0xf0) {
+			c &= 0x07; extra = 3;
+		} else if(c >= 0xe0) {
+			c &= 0x0f; extra = 2;
+		} else if(c >= 0xc0) {
+			c &= 0x1f; extra = 1;
+		}
+		while(extra-- > 0 && p < end && (*p & 0xc0) == 0x80) {
+			c = (c << 6) | (*p++ & 0x3f);
+		}
+		if(*n + 1 >= szout) return NULL;
+		#if WCHAR_MAX <= 0xffff
+		if(c >= 0x10000) {
+			if(*n + 2 >= szout) return NULL;
+			c -= 0x10000;
+			out[(*n)++] = (wchar_t)(0xd800 | (c >> 10));
+			c = 0xdc00 | (c & 0x3ff);
+		}
+		#endif
+		out[(*n)++] = (wchar_t)c;
+	}
+	out[*n] = L'\0';
+	return p;
+}
+
+/**
+ * Parse the contents of an fstab file into the mount table. Entries that
+ * look like something we wouldn't convert the same way Cygwin would are
+ * kept, but flagged so conversions underneath them get deferred.
+ * Returns the number of entries read.
+ */
+static int mount_table_parse(mount_table* mt, const char* text, size_t len)
+{
+	const char *p = text, *end = text + len, *eol;
+	wchar_t device[MAX_PATH+1], mountpt[MAX_PATH+1], fstype[32];
+	size_t szdevice, szmountpt, szfstype;
+	int result = 0, flags;
+
+	while(p < end) {
+		eol = p;
+		while(eol < end && *eol != '\n') eol++;
+		while(p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+
+		if(p < eol && *p != '#' &&
+			(p = mount_fstab_field(p, eol, device, MAX_PATH+1, &szdevice)) &&
+			(p = mount_fstab_field(p, eol, mountpt, MAX_PATH+1, &szmountpt)) &&
+			(p = mount_fstab_field(p, eol, fstype, 32, &szfstype)) &&
+			szdevice > 0 && szmountpt > 0 && szfstype > 0
+		) {
+			while(szfstype > 0 && fstype[szfstype-1] == L'\r') fstype[--szfstype] = L'\0';
+			if(wcscmp(fstype, L"cygdrive") == 0) {
+				// none /cygdrive cygdrive binary,posix=0,user 0 0
+				while(szmountpt > 0 && mountpt[szmountpt-1] == L'/') szmountpt--;
+				wcsncpy(mt->cygdrive, mountpt, szmountpt);
+				mt->cygdrive[szmountpt] = L'\0';
+				mt->szcygdrive = szmountpt;
+				result++;
+			} else if(mountpt[0] == L'/') {
+				flags = 0;
+				if(!mount_is_drive(device) && !(mount_is_sep(device[0]) && mount_is_sep(device[1]))) {
+					flags |= MOUNT_DEFER;
+				}
+				if(mount_table_add(mt, device, szdevice, mountpt, szmountpt, flags)) result++;
+			}
+		}
+		p = eol + 1;
+	}
+	return result;
+}
+
+/** Find the mount whose native path is the longest prefix of a canonical Windows path. */
+static const mount_entry* mount_find_win(const mount_table* mt, const wchar_t* path, size_t n)
+{
+	int i;
+	const mount_entry *entry, *result = NULL;
+	for(i = 0; i < mt->count; i++) {
+		entry = &(mt->entries[i]);
+		if(entry->flags & MOUNT_DEFER) continue;
+		if(entry->szwin > n || (result && entry->szwin <= result->szwin)) continue;
+		if(entry->szwin < n && path[entry->szwin] != L'\\') continue;
+		if(mount_iequal(entry->win, path, entry->szwin)) result = entry;
+	}
+	return result;
+}
+
+/**
+ * Find the mount whose mount point is the longest prefix of a canonical
+ * POSIX path. Deferred entries are matched too, so that the caller can
+ * tell we shouldn't touch the path.
+ */
+static const mount_entry* mount_find_posix(const mount_table* mt, const wchar_t* path, size_t n)
+{
+	int i;
+	const mount_entry *entry, *result = NULL;
+	for(i = 0; i < mt->count; i++) {
+		entry = &(mt->entries[i]);
+		if(entry->szposix > n || (result && entry->szposix <= result->szposix)) continue;
+		if(entry->szposix < n && path[entry->szposix] != L'/') continue;
+		if(wcsncmp(entry->posix, path, entry->szposix) == 0) result = entry;
+	}
+	return result;
+}
+
+/** Windows -> POSIX for a single path. Returns the length written, or 0. */
+static size_t mount_win_to_posix(const mount_table* mt, const wchar_t* path, const wchar_t* cwd, wchar_t* out, size_t szout)
+{
+	wchar_t canon[MAX_ENV+1];
+	wchar_t drive[2];
+	size_t szcanon, pos = 0, i;
+	const mount_entry* entry;
+	bool trailing;
+
+	if(!(szcanon = mount_canon_win(path, cwd, canon, MAX_ENV+1, &trailing))) return 0;
+
+	if((entry = mount_find_win(mt, canon, szcanon))) {
+		if(!mount_emit(out, szout, &pos, entry->posix, entry->szposix)) return 0;
+		i = entry->szwin;
+	} else if(mount_is_drive(canon)) {
+		drive[0] = L'/';
+		drive[1] = (wchar_t)towlower(canon[0]);
+		if(!mount_emit(out, szout, &pos, mt->cygdrive, mt->szcygdrive)) return 0;
+		if(!mount_emit(out, szout, &pos, drive, 2)) return 0;
+		i = 2;
+	} else {
+		// UNC path: \\server\share -> //server/share
+		i = 0;
+	}
+
+	if(!mount_emit_flipped(out, szout, &pos, &(canon[i]), szcanon - i, L'\\', L'/')) return 0;
+
+	if(pos == 0 || (trailing && out[pos-1] != L'/')) {
+		if(!mount_emit(out, szout, &pos, L"/", 1)) return 0;
+	}
+	return pos;
+}
+
+/** POSIX -> Windows for a single path. Returns the length written, or 0. */
+static size_t mount_posix_to_win(const mount_table* mt, const wchar_t* path, const wchar_t* cwd, wchar_t* out, size_t szout)
+{
+	wchar_t canon[MAX_ENV+1];
+	wchar_t drive[3];
+	size_t szcanon, pos = 0, i;
+	const mount_entry* entry;
+	bool trailing;
+
+	if(!(szcanon = mount_canon_posix(path, cwd, canon, MAX_ENV+1, &trailing))) return 0;
+
+	// Device and process namespaces only exist inside of cygwin1.dll.
+	if((szcanon >= 4 && wcsncmp(canon, L"/dev", 4) == 0 && (canon[4] == L'/' || canon[4] == L'\0')) ||
+		(szcanon >= 5 && wcsncmp(canon, L"/proc", 5) == 0 && (canon[5] == L'/' || canon[5] == L'\0'))) {
+		return 0;
+	}
+
+	// Characters Cygwin would remap into the private use area.
+	if(wcspbrk(canon, L":*?\"<>|")) return 0;
+
+	if(canon[0] == L'/' && canon[1] == L'/') {
+		if(!mount_emit(out, szout, &pos, L"\\", 1)) return 0;
+		i = 1;
+	} else if(
+		szcanon >= mt->szcygdrive + 2 &&
+		wcsncmp(canon, mt->cygdrive, mt->szcygdrive) == 0 &&
+		canon[mt->szcygdrive] == L'/' &&
+		iswalpha(canon[mt->szcygdrive + 1]) &&
+		(canon[mt->szcygdrive + 2] == L'/' || canon[mt->szcygdrive + 2] == L'\0')
+	) {
+		drive[0] = (wchar_t)towupper(canon[mt->szcygdrive + 1]);
+		drive[1] = L':';
+		drive[2] = L'\\';
+		if(!mount_emit(out, szout, &pos, drive, 3)) return 0;
+		// Past the drive's slash, if it has one. (/cygdrive/c doesn't)
+		i = mt->szcygdrive + 3 < szcanon ? mt->szcygdrive + 3 : szcanon;
+	} else {
+		if(!(entry = mount_find_posix(mt, canon, szcanon)) || (entry->flags & MOUNT_DEFER)) return 0;
+		if(!mount_emit(out, szout, &pos, entry->win, entry->szwin)) return 0;
+		i = entry->szposix;
+		if(i == szcanon || (entry->szposix == 0 && szcanon == 1)) {
+			// Mount point itself. Drive roots need their trailing slash.
+			if(pos == 2 && out[1] == L':') trailing = true;
+			i = szcanon;
+		}
+	}
+
+	if(!mount_emit_flipped(out, szout, &pos, &(canon[i]), szcanon - i, L'/', L'\\')) return 0;
+
+	if(trailing && out[pos-1] != L'\\') {
+		if(!mount_emit(out, szout, &pos, L"\\", 1)) return 0;
+	}
+	return pos;
+}
+
+/**
+ * Convert a path or path list in the given direction. cwd is the current
+ * directory in the source format, used to make relative paths absolute.
+ * Returns the number of characters written to out, or 0 if the conversion
+ * should be left to cygwin1.dll.
+ */
+static size_t mount_conv(const mount_table* mt, int what, bool islist, const wchar_t* from, const wchar_t* cwd, wchar_t* out, size_t szout)
+{
+	wchar_t item[MAX_ENV+1];
+	const wchar_t *p = from, *sep, *end;
+	wchar_t insep, outsep;
+	size_t n, pos = 0;
+
+	if(!mt || !from || !out || szout == 0) return 0;
+	out[0] = L'\0';
+
+	if(!islist) {
+		if(what == MOUNT_WIN_TO_POSIX) return mount_win_to_posix(mt, from, cwd, out, szout);
+		return mount_posix_to_win(mt, from, cwd, out, szout);
+	}
+
+	insep = what == MOUNT_WIN_TO_POSIX ? L';' : L':';
+	outsep = what == MOUNT_WIN_TO_POSIX ? L':' : L';';
+	end = from + simd_length(from);
+	while(true) {
+		n = simd_find(p, (size_t)(end - p), insep);
+		sep = p + n < end ? p + n : NULL;
+		if(n > MAX_ENV) return 0;
+		if(n > 0) {
+			wcsncpy(item, p, n);
+			item[n] = L'\0';
+			if(what == MOUNT_WIN_TO_POSIX) {
+				n = mount_win_to_posix(mt, item, cwd, &(out[pos]), szout - pos);
+			} else {
+				n = mount_posix_to_win(mt, item, cwd, &(out[pos]), szout - pos);
+			}
+			if(n == 0) return 0;
+			pos += n;
+		}
+		if(!sep) break;
+		if(!mount_emit(out, szout, &pos, &outsep, 1)) return 0;
+		p = sep + 1;
+	}
+	return pos;
+}
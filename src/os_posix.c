@@ -0,0 +1,869 @@
+/**
+ * os_posix.c - The POSIX side of our platform layer. Finds the file our
+ *              interpreter lives in, and hands over to it.
+ *
+ * Here a handoff is just an execve, so there's nothing left of us to
+ * keep resident, and our caller gets our interpreter's exit code (and
+ * its signals) directly. HANDOFF_WAIT and HANDOFF_DETACH end up the
+ * same.
+ *
+ * Unless our output's being relayed, (See relay.c) in which case we fork
+ * instead, and poll our interpreter's end of it until it's done.
+ *
+ * A pool (See pool.c) listens on a UNIX socket, and our std handles go to
+ * it (and from it, to the interpreter that takes our launch) as fds, in
+ * SCM_RIGHTS messages. The pool itself is one poll loop, passing replies
+ * and Ctrl+Cs between launches and the interpreters running them.
+ *
+ * So does a resolver, (See resolver.c) which is one poll loop, answering
+ * each request as it comes in. They only take it a few microseconds each.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#if !defined(WITHOUT_POOL) || !defined(WITHOUT_RESOLVER)
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <sys/time.h>
+#	include <sys/un.h>
+#endif
+
+extern char** environ;
+
+/** Everything we need to launch our interpreter, kept outside of our arena. */
+typedef struct {
+	char* app;
+	char** argv;
+	char** envp;
+	#ifndef WITHOUT_RELAY
+	mount_table* relay;	// What to relay our interpreter's output with, or NULL to leave it alone.
+	#endif
+} os_launch;
+
+/** Converts a wide string to UTF-8, on the heap. (Our stand-ins in compat.h assume the same) */
+static char* os_narrow(const wchar_t* s)
+{
+	size_t szs = wcslen(s) + 1;
+	char* result;
+
+	if(!(result = (char*)malloc(UTF8_MAX(szs)))) fatal(ENOMEM, L"Out of memory in os_narrow");
+	if(utf8_encode(s, szs, result, UTF8_MAX(szs)) == UTF_INVALID) {
+		fatal(EILSEQ, L"Could not convert %s to UTF-8.", s);
+	}
+	return result;
+}
+
+/**
+ * Copies everything needed to launch cmd with args (and env, if it isn't
+ * NULL) out of our arena, so that the arena can be released before we
+ * launch.
+ */
+static os_launch* os_prepare(wchar_t* cmd, int argc, wchar_t** args, wchar_t* env)
+{
+	os_launch* launch = (os_launch*)malloc(sizeof(os_launch));
+	const wchar_t* var;
+	int i, nvars = 0;
+
+	if(!launch || !(launch->argv = (char**)malloc((argc + 1) * sizeof(char*)))) {
+		fatal(ENOMEM, L"Out of memory in os_prepare");
+	}
+	launch->app = os_narrow(cmd);
+	if(access(launch->app, X_OK) != 0) {
+		fatal(ENOENT, L"Did not find an executable file at %s", cmd);
+	}
+	for(i = 0; i < argc; i++) launch->argv[i] = os_narrow(args[i]);
+	launch->argv[argc] = NULL;
+	launch->envp = environ;
+	if(env) {
+		for(var = env; *var; var += wcslen(var) + 1) nvars++;
+		if(!(launch->envp = (char**)malloc((nvars + 1) * sizeof(char*)))) fatal(ENOMEM, L"Out of memory in os_prepare");
+		for(i = 0, var = env; *var; var += wcslen(var) + 1) launch->envp[i++] = os_narrow(var);
+		launch->envp[nvars] = NULL;
+	}
+	flight(FLIGHT_CMDLINE, argc, 0, NULL);
+	#ifndef WITHOUT_RELAY
+	launch->relay = relay_prepare();
+	#endif
+
+	if(verbose_flag) {
+		verbose(L"Executing..");
+		for(i = 0; i < argc; i++) verbose_step(L"%s", args[i]);
+	}
+	return launch;
+}
+
+/**
+ * Dumps our flight recorder on the way down, then dies of whatever killed
+ * us. Best-effort: stdio isn't async-signal-safe, but we're going anyway.
+ */
+static void os_crash_handler(int sig)
+{
+	flight_dump();
+	raise(sig);
+}
+
+static void os_install_crash_handler()
+{
+	static const int signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+	struct sigaction action;
+	size_t i;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = os_crash_handler;
+	action.sa_flags = SA_RESETHAND;
+	sigemptyset(&action.sa_mask);
+	for(i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) sigaction(signals[i], &action, NULL);
+}
+
+/** Which handoff mode to use. (CYGLAUNCH_HANDOFF=wait|detach) */
+static int os_handoff_mode()
+{
+	const char* sValue = getenv("CYGLAUNCH_HANDOFF");
+	return sValue && strcmp(sValue, "detach") == 0 ? HANDOFF_DETACH : HANDOFF_WAIT;
+}
+
+/** Milliseconds, from whenever. */
+static long long os_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#ifndef WITHOUT_RELAY
+static bool os_relay_sink(void* context, const char* data, size_t count)
+{
+	ssize_t n;
+	while(count) {
+		if((n = write((int)(intptr_t)context, data, count)) < 0) {
+			if(errno == EINTR) continue;
+			return false;
+		}
+		data += n;
+		count -= (size_t)n;
+	}
+	return true;
+}
+
+/**
+ * Starts our interpreter with whichever of our stdout and stderr aren't
+ * terminals going to pipes, and relays them until it's done with them, or
+ * for RELAY_DRAIN after it exits. Returns its exit code, or 128 plus the
+ * signal that killed it, the way a shell would.
+ */
+static int os_relay_handoff(os_launch* launch)
+{
+	static const int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	relay_stream* streams[2] = { NULL, NULL };
+	struct pollfd pfds[2];
+	int pipes[2][2], status = 0, nopen = 0, timeout, ready, i;
+	long long deadline = -1;
+	bool exited = false;
+	size_t room;
+	ssize_t n;
+	char* space;
+	pid_t pid;
+
+	for(i = 0; i < 2; i++) {
+		pipes[i][0] = pipes[i][1] = -1;
+		if(isatty(fds[i])) continue;
+		if(pipe(pipes[i]) != 0) fatal(errno, L"Could not create a pipe: %hs", strerror(errno));
+		if(!(streams[i] = (relay_stream*)malloc(sizeof(relay_stream)))) fatal(ENOMEM, L"Out of memory in os_relay_handoff");
+		relay_init(streams[i], launch->relay, os_relay_sink, (void*)(intptr_t)fds[i]);
+		nopen++;
+	}
+
+	if((pid = fork()) < 0) fatal(errno, L"Could not fork: %hs", strerror(errno));
+	if(pid == 0) {
+		for(i = 0; i < 2; i++) {
+			if(pipes[i][1] < 0) continue;
+			dup2(pipes[i][1], fds[i]);
+			close(pipes[i][0]);
+			close(pipes[i][1]);
+		}
+		execve(launch->app, launch->argv, launch->envp);
+		fatal(errno, L"Could not execute %hs: %hs", launch->app, strerror(errno));
+	}
+
+	// Our interpreter gets these too. We just stay around to pass its output along.
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	for(i = 0; i < 2; i++) {
+		pfds[i].fd = pipes[i][0];
+		pfds[i].events = POLLIN;
+		if(pipes[i][1] >= 0) close(pipes[i][1]);
+	}
+
+	while(nopen) {
+		// Wake up to flush a path that's been cut off, and to check whether our interpreter's exited.
+		timeout = exited ? (int)(deadline - os_now()) : RELAY_DRAIN;
+		if(exited && timeout <= 0) break;
+		for(i = 0; i < 2; i++) {
+			if(pfds[i].fd >= 0 && relay_holding(streams[i]) && timeout > RELAY_LATENCY) timeout = RELAY_LATENCY;
+		}
+		if((ready = poll(pfds, 2, timeout)) < 0 && errno != EINTR) break;
+
+		for(i = 0; i < 2; i++) {
+			if(pfds[i].fd < 0) continue;
+			if(!ready) relay_flush(streams[i]);
+			if(ready <= 0 || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			space = relay_space(streams[i], &room);
+			if((n = read(pfds[i].fd, space, room)) > 0) {
+				relay_feed(streams[i], (size_t)n);
+			} else if(n == 0 || errno != EINTR) {
+				relay_flush(streams[i]);
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				nopen--;
+			}
+		}
+		if(!exited && waitpid(pid, &status, WNOHANG) == pid) {
+			exited = true;
+			deadline = os_now() + RELAY_DRAIN;
+		}
+	}
+
+	for(i = 0; i < 2; i++) {
+		if(pfds[i].fd >= 0) {
+			relay_flush(streams[i]);
+			close(pfds[i].fd);
+		}
+		free(streams[i]);
+	}
+	if(!exited) waitpid(pid, &status, 0);
+	free(launch->relay);
+	return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+#endif
+
+#if !defined(WITHOUT_POOL) || !defined(WITHOUT_RESOLVER)
+/** Our fds can't be left lying around in the interpreters we start. */
+static inline void os_cloexec(int fd)
+{
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/**
+ * Where the socket of the pool or resolver called name is:
+ * $TMPDIR/cyglaunch-UID/NAME. Makes the folder first, if make is set.
+ * Returns false if anybody but us can get at it, since they could pretend
+ * to be our pool or resolver.
+ */
+static bool os_socket_address(struct sockaddr_un* addr, const wchar_t* name, bool make)
+{
+	const char* tmp = getenv("TMPDIR");
+	struct stat st;
+	char* narrow;
+	int n;
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/cyglaunch-%d", tmp && *tmp ? tmp : "/tmp", (int)getuid());
+	if(n < 0 || (size_t)n + 2 + wcslen(name) > sizeof(addr->sun_path)) return false;
+	if(make && mkdir(addr->sun_path, 0700) != 0 && errno != EEXIST) return false;
+	if(lstat(addr->sun_path, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) return false;
+	narrow = os_narrow(name);
+	snprintf(&(addr->sun_path[n]), sizeof(addr->sun_path) - (size_t)n, "/%s", narrow);
+	free(narrow);
+	return true;
+}
+
+/** Reads or writes all of count bytes of a socket. */
+static bool os_socket_io(int fd, void* data, size_t count, bool write)
+{
+	ssize_t n;
+
+	for(; count; count -= (size_t)n, data = (char*)data + n) {
+		if((n = write ? send(fd, data, count, MSG_NOSIGNAL) : recv(fd, data, count, 0)) > 0) continue;
+		if(n == 0 || errno != EINTR) return false;
+		n = 0;
+	}
+	return true;
+}
+
+#if defined(POOL_BROKER) || defined(RESOLVER_SERVICE)
+/**
+ * Listens at addr, unless there's already a what (our pool or resolver)
+ * listening there. Anything else left there is from one that didn't shut
+ * down cleanly.
+ */
+static int os_socket_listen(struct sockaddr_un* addr, const wchar_t* what)
+{
+	int listener;
+
+	if((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) fatal(errno, L"Could not create a socket: %hs", strerror(errno));
+	if(connect(listener, (struct sockaddr*)addr, sizeof(struct sockaddr_un)) == 0) {
+		fatal(EADDRINUSE, L"There's already a %s running at %hs", what, addr->sun_path);
+	}
+	close(listener);
+	unlink(addr->sun_path);
+	if((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		bind(listener, (struct sockaddr*)addr, sizeof(struct sockaddr_un)) != 0 || listen(listener, SOMAXCONN) != 0) {
+		fatal(errno, L"Could not listen at %hs: %hs", addr->sun_path, strerror(errno));
+	}
+	os_cloexec(listener);
+	return listener;
+}
+#endif
+#endif
+
+#ifndef WITHOUT_POOL
+
+/** Sends a request, with fds (our std handles) riding along with its first byte. */
+static bool os_pool_send(int fd, const pool_request* request, const int* fds)
+{
+	union { char buffer[CMSG_SPACE(3 * sizeof(int))]; struct cmsghdr align; } control;
+	const char* data = (const char*)request;
+	size_t sent = 0;
+	struct cmsghdr* cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	iov.iov_base = (void*)data;
+	iov.iov_len = request->size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+	while((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	for(; n > 0 && (sent += (size_t)n) < request->size;) {
+		if((n = send(fd, &(data[sent]), request->size - sent, MSG_NOSIGNAL)) < 0 && errno == EINTR) n = 0;
+	}
+	return n > 0;
+}
+
+/** Reads a dword's worth of reply. */
+static inline bool os_pool_reply(int fd, dword* reply)
+{
+	return os_socket_io(fd, reply, sizeof(dword), false);
+}
+
+static volatile int os_pool_fd = -1;
+
+/** Passes Ctrl+C on to whichever interpreter took our launch. */
+static void os_pool_interrupt(int sig)
+{
+	char c = POOL_INTERRUPT;
+	if(send(os_pool_fd, &c, 1, MSG_NOSIGNAL) < 0) return;
+}
+
+/**
+ * Hands our launch over to one of our pool's interpreters, if there's a
+ * pool and it takes it, and waits for it to exit. Returns false if we
+ * should launch as usual.
+ */
+static bool os_pool_handoff(int argc, wchar_t** args, wchar_t* env, int* status)
+{
+	static const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	struct timeval tv = { POOL_TIMEOUT / 1000, (POOL_TIMEOUT % 1000) * 1000 };
+	struct sockaddr_un addr;
+	pool_request* request = NULL;
+	char sCwd[MAX_PATH+1];
+	wchar_t sWideCwd[MAX_PATH+1];
+	size_t szcwd;
+	dword reply = 0;
+	bool taken;
+	int fd;
+
+	if(!pool_eligible(argc, args) || !os_socket_address(&addr, pool_name, false)) return false;
+	trace_begin(L"pool");
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		trace_end(L"pool");
+		return false;
+	}
+	taken = connect(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == 0 &&
+		getcwd(sCwd, MAX_PATH+1) && (szcwd = strlen(sCwd) + 1) &&
+		utf8_decode(sCwd, szcwd, sWideCwd, MAX_PATH+1) != UTF_INVALID &&
+		(request = pool_build(sWideCwd, argc, args, env)) &&
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval)) == 0 &&
+		os_pool_send(fd, request, fds) && os_pool_reply(fd, &reply) && reply == POOL_ACCEPTED;
+	free(request);
+	trace_end(L"pool");
+	flight(FLIGHT_POOL, taken, 0, NULL);
+	if(!taken) {
+		verbose(L"No pooled interpreter took our launch. Launching as usual..");
+		close(fd);
+		return false;
+	}
+
+	verbose(L"Launched in a pooled interpreter..");
+	trace_flush();
+	tv.tv_sec = tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+	os_pool_fd = fd;
+	signal(SIGINT, os_pool_interrupt);
+	*status = os_pool_reply(fd, &reply) ? (int)(reply & 0xff) : 1;
+	close(fd);
+	return true;
+}
+
+#ifdef POOL_BROKER
+/** How many interpreters our pool keeps track of, waiting or running. */
+#define OS_POOL_SLOTS (4 * POOL_MAX_SIZE)
+
+typedef struct {
+	int state;
+	int fd;				// Our end of its socket.
+	int client;			// The launch it's running, or -1.
+	dword replies;		// How many replies we've had from it since it last changed state.
+	size_t nreply;
+	char reply[sizeof(dword)];
+} os_pool_worker;
+
+/** Starts an interpreter running our bootstrap, with its end of a socket pair as its argument. */
+static void os_pool_spawn(os_pool_worker* worker, char** argv)
+{
+	char sFd[16];
+	pid_t pid;
+	int pair[2], null;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) return;
+	// Our end mustn't outlive us in it, or it'd never see us go.
+	os_cloexec(pair[0]);
+	snprintf(sFd, 16, "%d", pair[1]);
+	argv[3] = sFd;
+	if((pid = fork()) == 0) {
+		// Ctrl+C at our terminal is for us, not for interpreters that haven't taken a launch yet.
+		setsid();
+		if((null = open("/dev/null", O_RDWR)) >= 0) {
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			if(null > STDERR_FILENO) close(null);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	close(pair[1]);
+	if(pid < 0) {
+		close(pair[0]);
+		return;
+	}
+	worker->state = POOL_STARTING;
+	worker->fd = pair[0];
+	worker->client = -1;
+	worker->replies = 0;
+	worker->nreply = 0;
+}
+
+/** Done with an interpreter. If it's still around, it sees its socket close and exits. */
+static void os_pool_retire(os_pool_worker* worker)
+{
+	close(worker->fd);
+	if(worker->client >= 0) close(worker->client);
+	worker->state = POOL_FREE;
+	worker->fd = worker->client = -1;
+}
+
+/** Reads a launch's request, and the fds that come with it. Returns NULL if it isn't one. */
+static pool_request* os_pool_receive(int client, int* fds)
+{
+	union { char buffer[CMSG_SPACE(3 * sizeof(int))]; struct cmsghdr align; } control;
+	struct timeval tv = { POOL_TIMEOUT / 1000, (POOL_TIMEOUT % 1000) * 1000 };
+	pool_request header, *request;
+	struct cmsghdr* cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t got = 0;
+	ssize_t n;
+	int i;
+
+	// A launch that's connected but won't say anything can't hold everybody else up for long.
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+	while(got < sizeof(pool_request)) {
+		memset(&msg, 0, sizeof(struct msghdr));
+		iov.iov_base = (char*)&header + got;
+		iov.iov_len = sizeof(pool_request) - got;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		if((n = recvmsg(client, &msg, 0)) <= 0) return NULL;
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || fds[0] >= 0) continue;
+			if(cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))) memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+			for(i = 0; i < 3; i++) if(fds[i] >= 0) os_cloexec(fds[i]);
+		}
+		got += (size_t)n;
+	}
+	if(!pool_valid(&header) || fds[0] < 0 || !(request = (pool_request*)malloc(header.size))) return NULL;
+	memcpy(request, &header, sizeof(pool_request));
+	for(; got < header.size; got += (size_t)n) {
+		if((n = read(client, (char*)request + got, header.size - got)) <= 0) {
+			free(request);
+			return NULL;
+		}
+	}
+	return request;
+}
+
+/** Hands a launch that's just connected to a waiting interpreter, or turns it down. */
+static void os_pool_take(os_pool_worker* workers, int client)
+{
+	int fds[3] = { -1, -1, -1 }, i;
+	os_pool_worker* worker = NULL;
+	dword reply = POOL_DECLINED;
+	pool_request* request;
+	bool valid;
+
+	os_cloexec(client);
+	if((valid = (request = os_pool_receive(client, fds)) != NULL)) {
+		for(i = 0; i < OS_POOL_SLOTS && !worker; i++) {
+			if(workers[i].state == POOL_WAITING) worker = &(workers[i]);
+		}
+		if(worker && os_pool_send(worker->fd, request, fds)) {
+			worker->state = POOL_RUNNING;
+			worker->client = client;
+			worker->replies = 0;
+			client = -1;
+		} else if(worker) {
+			os_pool_retire(worker);
+		}
+		free(request);
+	}
+	for(i = 0; i < 3; i++) if(fds[i] >= 0) close(fds[i]);
+	if(client >= 0) {
+		if(valid) send(client, &reply, sizeof(dword), MSG_NOSIGNAL);
+		close(client);
+	}
+}
+
+/**
+ * Deals with a reply from one of our interpreters. Starting ones tell us
+ * they're ready, (and their pid) and running ones whether they've taken
+ * their launch, and then its exit code, which we pass along.
+ */
+static void os_pool_answer(pool_settings* settings, os_pool_worker* worker)
+{
+	ssize_t n;
+	dword reply;
+
+	if((n = read(worker->fd, &(worker->reply[worker->nreply]), sizeof(dword) - worker->nreply)) <= 0) {
+		if(n < 0 && errno == EINTR) return;
+		if(worker->state == POOL_STARTING && ++settings->failures == POOL_MAX_FAILURES) {
+			fatal(ECHILD, L"Our interpreters keep exiting before they're ready. (Does %s run Python?)", settings->launcher);
+		}
+		os_pool_retire(worker);
+		return;
+	}
+	if((worker->nreply += (size_t)n) < sizeof(dword)) return;
+	memcpy(&reply, worker->reply, sizeof(dword));
+	worker->nreply = 0;
+	worker->replies++;
+	if(worker->state == POOL_STARTING) {
+		if(worker->replies == 1 && reply != POOL_READY) {
+			os_pool_retire(worker);
+		} else if(worker->replies == 2) {
+			worker->state = POOL_WAITING;
+			settings->failures = 0;
+		}
+	} else if(worker->state == POOL_RUNNING) {
+		if(send(worker->client, &reply, sizeof(dword), MSG_NOSIGNAL) < 0 ||
+			worker->replies == 2 || reply == POOL_DECLINED) {
+			os_pool_retire(worker);
+		}
+	} else {
+		// Waiting interpreters have nothing to say.
+		os_pool_retire(worker);
+	}
+}
+
+/** Passes a Ctrl+C along, or if the launch has gone away, retires the interpreter running it. */
+static void os_pool_pass(os_pool_worker* worker)
+{
+	char buffer[64];
+	ssize_t n;
+
+	if((n = read(worker->client, buffer, sizeof(buffer))) < 0 && errno == EINTR) return;
+	if(n <= 0 || send(worker->fd, buffer, (size_t)n, MSG_NOSIGNAL) < 0) os_pool_retire(worker);
+}
+
+static volatile sig_atomic_t os_pool_stopping = 0;
+
+/** Shuts our pool down as if it had gone idle, so that our socket's cleaned up. */
+static void os_pool_stop(int sig)
+{
+	os_pool_stopping = 1;
+}
+
+/**
+ * Runs a pool until it's gone settings->idle without a launch, and has
+ * nothing running, or until we're told to stop. Returns our exit code.
+ */
+static int os_pool_serve(pool_settings* settings)
+{
+	static os_pool_worker workers[OS_POOL_SLOTS];
+	struct pollfd pfds[1 + 2 * OS_POOL_SLOTS];
+	int who[1 + 2 * OS_POOL_SLOTS];
+	char* argv[5] = { NULL, "-c", POOL_BOOTSTRAP, NULL, NULL };
+	struct sockaddr_un addr;
+	long long deadline;
+	int listener, client, nfds, nwarm, nwaiting, nrunning, timeout, i;
+
+	if(!os_socket_address(&addr, pool_name, true)) {
+		fatal(EACCES, L"Could not make a folder only we can get at, for our pool's socket.");
+	}
+	listener = os_socket_listen(&addr, L"pool");
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, os_pool_stop);
+	signal(SIGTERM, os_pool_stop);
+	pool_prepare_env();
+	argv[0] = os_narrow(settings->launcher);
+	for(i = 0; i < OS_POOL_SLOTS; i++) {
+		workers[i].state = POOL_FREE;
+		workers[i].fd = workers[i].client = -1;
+	}
+	verbose(L"Pooling %d interpreter(s) at %hs..", settings->size, addr.sun_path);
+
+	deadline = os_now() + settings->idle;
+	while(!os_pool_stopping) {
+		while(waitpid(-1, NULL, WNOHANG) > 0);
+
+		// Top ourselves up. Starting interpreters would only slow down what's
+		// running, so unless we've nothing left waiting, that can wait.
+		for(i = nwarm = nwaiting = nrunning = 0; i < OS_POOL_SLOTS; i++) {
+			if(workers[i].state == POOL_STARTING || workers[i].state == POOL_WAITING) nwarm++;
+			if(workers[i].state == POOL_WAITING) nwaiting++;
+			if(workers[i].state == POOL_RUNNING) nrunning++;
+		}
+		for(i = 0; i < OS_POOL_SLOTS && nwarm < settings->size && (!nrunning || !nwaiting); i++) {
+			if(workers[i].state == POOL_FREE && (os_pool_spawn(&(workers[i]), argv), workers[i].state != POOL_FREE)) nwarm++;
+		}
+
+		// Work out what to wait on.
+		pfds[0].fd = listener;
+		pfds[0].events = POLLIN;
+		for(i = nrunning = 0, nfds = 1; i < OS_POOL_SLOTS; i++) {
+			if(workers[i].state == POOL_FREE) continue;
+			pfds[nfds].fd = workers[i].fd;
+			pfds[nfds].events = POLLIN;
+			who[nfds++] = i;
+			if(workers[i].client < 0) continue;
+			pfds[nfds].fd = workers[i].client;
+			pfds[nfds].events = POLLIN;
+			who[nfds++] = -1 - i;
+			nrunning++;
+		}
+		timeout = nrunning ? -1 : (int)(deadline - os_now());
+		if(!nrunning && timeout <= 0) break;
+
+		if(poll(pfds, (nfds_t)nfds, timeout) <= 0) continue;
+		if(pfds[0].revents & POLLIN) {
+			if((client = accept(listener, NULL, NULL)) >= 0) os_pool_take(workers, client);
+			deadline = os_now() + settings->idle;
+		}
+		for(i = 1; i < nfds; i++) {
+			// Skip anything that's been retired since we started waiting.
+			if(!pfds[i].revents) continue;
+			if(who[i] >= 0 && workers[who[i]].fd == pfds[i].fd) {
+				os_pool_answer(settings, &(workers[who[i]]));
+			} else if(who[i] < 0 && workers[-1 - who[i]].client == pfds[i].fd) {
+				os_pool_pass(&(workers[-1 - who[i]]));
+			}
+		}
+	}
+
+	if(!os_pool_stopping) verbose(L"No launches for %d second(s). Shutting down..", (int)(settings->idle / 1000));
+	for(i = 0; i < OS_POOL_SLOTS; i++) {
+		if(workers[i].state != POOL_FREE) os_pool_retire(&(workers[i]));
+	}
+	close(listener);
+	unlink(addr.sun_path);
+	free(argv[0]);
+	return 0;
+}
+#endif
+#endif
+
+#ifndef WITHOUT_RESOLVER
+/** Our connection to our resolver, kept for as long as we are. */
+static int os_resolver_fd = -1;
+
+static void os_resolver_close()
+{
+	if(os_resolver_fd >= 0) close(os_resolver_fd);
+	os_resolver_fd = -1;
+}
+
+/**
+ * Sends our resolver a request, connecting first if we haven't yet, and
+ * returns its reply, on the heap. Returns NULL if there's no resolver, or
+ * it didn't answer.
+ */
+static char* os_resolver_call(const char* request)
+{
+	struct timeval tv = { RESOLVER_CONNECT_TIMEOUT / 1000, (RESOLVER_CONNECT_TIMEOUT % 1000) * 1000 };
+	struct sockaddr_un addr;
+	resolver_header header;
+	char* reply;
+
+	if(os_resolver_fd < 0) {
+		if(!os_socket_address(&addr, resolver_name, false) || (os_resolver_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return NULL;
+		os_cloexec(os_resolver_fd);
+		// Connecting to a resolver with a full backlog waits as long as a send would.
+		if(setsockopt(os_resolver_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(struct timeval)) != 0 ||
+			connect(os_resolver_fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) != 0) {
+			os_resolver_close();
+			return NULL;
+		}
+		tv.tv_sec = RESOLVER_TIMEOUT / 1000;
+		tv.tv_usec = (RESOLVER_TIMEOUT % 1000) * 1000;
+		setsockopt(os_resolver_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(struct timeval));
+		setsockopt(os_resolver_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+	}
+	if(!os_socket_io(os_resolver_fd, (void*)request, ((const resolver_header*)request)->size, true) ||
+		!os_socket_io(os_resolver_fd, &header, sizeof(resolver_header), false) || !resolver_valid(&header) ||
+		!(reply = (char*)malloc(header.size))) {
+		os_resolver_close();
+		return NULL;
+	}
+	memcpy(reply, &header, sizeof(resolver_header));
+	if(!os_socket_io(os_resolver_fd, reply + sizeof(resolver_header), header.size - sizeof(resolver_header), false)) {
+		free(reply);
+		os_resolver_close();
+		return NULL;
+	}
+	return reply;
+}
+
+#ifdef RESOLVER_SERVICE
+/** How many launchers our resolver keeps connections open to at once. */
+#define OS_RESOLVER_SLOTS 256
+
+/**
+ * Reads a launcher's request and answers it. Returns false once it's gone
+ * away, or sent us something that isn't a request.
+ */
+static bool os_resolver_answer(int client)
+{
+	resolver_header header;
+	char *request, *reply = NULL;
+	bool ok;
+
+	if(!os_socket_io(client, &header, sizeof(resolver_header), false) || !resolver_valid(&header) ||
+		!(request = (char*)malloc(header.size))) {
+		return false;
+	}
+	memcpy(request, &header, sizeof(resolver_header));
+	ok = os_socket_io(client, request + sizeof(resolver_header), header.size - sizeof(resolver_header), false) &&
+		(reply = resolver_answer(request)) != NULL &&
+		os_socket_io(client, reply, ((resolver_header*)reply)->size, true);
+	free(request);
+	free(reply);
+	return ok;
+}
+
+static volatile sig_atomic_t os_resolver_stopping = 0;
+
+/** Shuts our resolver down as if it had gone idle, so that our socket's cleaned up. */
+static void os_resolver_stop(int sig)
+{
+	os_resolver_stopping = 1;
+}
+
+/**
+ * Runs our resolver until it's gone idle ms without a launcher connected,
+ * (never, if idle is 0) or until we're told to stop. cygwin1.dll has to
+ * be loaded already. Returns our exit code.
+ */
+static int os_resolver_serve(dword idle)
+{
+	static int clients[OS_RESOLVER_SLOTS];
+	struct timeval tv = { RESOLVER_TIMEOUT / 1000, (RESOLVER_TIMEOUT % 1000) * 1000 };
+	struct pollfd pfds[1 + OS_RESOLVER_SLOTS];
+	int who[1 + OS_RESOLVER_SLOTS];
+	struct sockaddr_un addr;
+	long long deadline;
+	int listener, client, nfds, timeout, i;
+
+	if(!os_socket_address(&addr, resolver_name, true)) {
+		fatal(EACCES, L"Could not make a folder only we can get at, for our resolver's socket.");
+	}
+	listener = os_socket_listen(&addr, L"resolver");
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, os_resolver_stop);
+	signal(SIGTERM, os_resolver_stop);
+	for(i = 0; i < OS_RESOLVER_SLOTS; i++) clients[i] = -1;
+	verbose(L"Resolving paths at %hs..", addr.sun_path);
+
+	deadline = os_now() + idle;
+	while(!os_resolver_stopping) {
+		pfds[0].fd = listener;
+		pfds[0].events = POLLIN;
+		for(i = 0, nfds = 1; i < OS_RESOLVER_SLOTS; i++) {
+			if(clients[i] < 0) continue;
+			pfds[nfds].fd = clients[i];
+			pfds[nfds].events = POLLIN;
+			who[nfds++] = i;
+		}
+		timeout = !idle || nfds > 1 ? -1 : (int)(deadline - os_now());
+		if(idle && nfds == 1 && timeout <= 0) break;
+
+		if(poll(pfds, (nfds_t)nfds, timeout) <= 0) continue;
+		if((pfds[0].revents & POLLIN) && (client = accept(listener, NULL, NULL)) >= 0) {
+			for(i = 0; i < OS_RESOLVER_SLOTS && clients[i] >= 0; i++);
+			if(i == OS_RESOLVER_SLOTS) {
+				// Too many at once. This one loads cygwin1.dll itself.
+				close(client);
+			} else {
+				// A launcher that's stopped halfway through a request can't hold everybody else up for long.
+				os_cloexec(client);
+				setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+				setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(struct timeval));
+				clients[i] = client;
+			}
+		}
+		for(i = 1; i < nfds; i++) {
+			if(!pfds[i].revents || os_resolver_answer(pfds[i].fd)) continue;
+			close(pfds[i].fd);
+			clients[who[i]] = -1;
+			deadline = os_now() + idle;
+		}
+	}
+
+	if(!os_resolver_stopping) verbose(L"No launchers for %d second(s). Shutting down..", (int)(idle / 1000));
+	for(i = 0; i < OS_RESOLVER_SLOTS; i++) {
+		if(clients[i] >= 0) close(clients[i]);
+	}
+	close(listener);
+	unlink(addr.sun_path);
+	return 0;
+}
+#endif
+#endif
+
+/**
+ * Replace ourselves with our interpreter. Only returns on failure, or
+ * once our interpreter's done, if its output was relayed.
+ */
+static int os_handoff(os_launch* launch, int mode)
+{
+	// There's nothing after a successful execve to time, so this is as
+	// far as our trace goes.
+	trace_begin(L"spawn");
+	trace_end(L"spawn");
+	trace_flush();
+	flight(FLIGHT_SPAWN, mode, 0, NULL);
+	#ifndef WITHOUT_RELAY
+	if(launch->relay && (!isatty(STDOUT_FILENO) || !isatty(STDERR_FILENO))) return os_relay_handoff(launch);
+	#endif
+	execve(launch->app, launch->argv, launch->envp);
+	fatal(errno, L"Could not execute %hs: %hs", launch->app, strerror(errno));
+	return 1;
+}
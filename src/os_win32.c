@@ -0,0 +1,1098 @@
+/**
+ * os_win32.c - The Windows side of our platform layer. Finds the file our
+ *              interpreter lives in, and hands over to it.
+ *
+ * Windows has no exec, so in HANDOFF_WAIT mode we still have to stick
+ * around to pass our interpreter's exit code along. We do it at as small
+ * a footprint as we can: our arena's already gone, what's left of our
+ * working set is handed back to the OS, and console signals go to our
+ * interpreter (which shares our console) rather than killing us first.
+ * Our interpreter is also put in a job that dies with us, so that killing
+ * the launcher doesn't leave it orphaned.
+ *
+ * A command line that'd be too long for CreateProcess once our paths are
+ * converted is written to a response file instead, and passed as @file,
+ * for programs that read those back in. (cygwin1.dll does, for every
+ * Cygwin program) The file's deleted once our interpreter exits.
+ *
+ * When our output is being relayed, (See relay.c) a thread per stream
+ * reads our interpreter's end of it, and we wait for those to finish too.
+ *
+ * A pool (See pool.c) is a named pipe. Its interpreters are started through
+ * our launcher, and talk to it over their stdin and stdout; a launch's std
+ * handles are duplicated straight into whichever one takes it, which
+ * attaches them to its fds with cygwin1.dll. The pool itself is a thread
+ * per launch, plus one per interpreter while it starts up.
+ *
+ * A resolver (See resolver.c) is a named pipe too, with a thread per
+ * launcher connected to it. They take turns with cygwin1.dll.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** Everything we need to launch our interpreter, kept outside of our arena. */
+typedef struct {
+	wchar_t* app;
+	wchar_t* cmdline;
+	wchar_t* env;		// NULL to pass ours along.
+	wchar_t* response;	// Response file to delete once our interpreter exits, or NULL.
+	#ifndef WITHOUT_RELAY
+	mount_table* relay;	// What to relay our interpreter's output with, or NULL to leave it alone.
+	#endif
+} os_launch;
+
+/**
+ * Programs that read @file arguments back in: file names, or the start of
+ * one followed by a *, separated by ;s. CYGLAUNCH_RESPONSE_FILES replaces
+ * these, and setting it to - turns response files off.
+ */
+#ifdef USE_CYGWIN
+#	define OS_RESPONSE_RULES L"*"
+#else
+#	define OS_RESPONSE_RULES L"-"
+#endif
+
+/**
+ * Find the file our interpreter actually lives in. Unlike _wspawnvp,
+ * CreateProcess won't add an extension for us, and cygwin symlinks
+ * tend to point at python2.7 rather than python2.7.exe.
+ */
+static wchar_t* os_find_executable(wchar_t* cmd)
+{
+	size_t szcmd = wcslen(cmd);
+	wchar_t* result = (wchar_t*)malloc((szcmd + 5) * sizeof(wchar_t));
+
+	if(!result) fatal_api_call(L"os_find_executable");
+	wcscpy(result, cmd);
+	if(!is_file(result)) {
+		wcscpy(&(result[szcmd]), L".exe");
+		if(!is_file(result)) {
+			fatal(ERROR_FILE_NOT_FOUND, L"Did not find an existing file at %s", cmd);
+		}
+	}
+	return result;
+}
+
+/** Whether app reads response files, going by our rules. */
+static bool os_takes_response(const wchar_t* app)
+{
+	wchar_t sRules[MAX_PATH+1] = OS_RESPONSE_RULES;
+	const wchar_t *name = wcsrchr(app, L'\\'), *rule, *end;
+	dword dwRules = GetEnvironmentVariableW(L"CYGLAUNCH_RESPONSE_FILES", sRules, MAX_PATH+1);
+	size_t szrule;
+
+	if(!dwRules || dwRules > MAX_PATH) wcscpy(sRules, OS_RESPONSE_RULES);
+	name = name ? name + 1 : app;
+	for(rule = sRules; *rule; rule = *end ? end + 1 : end) {
+		if(!(end = wcschr(rule, L';'))) end = rule + wcslen(rule);
+		szrule = (size_t)(end - rule);
+		if(szrule && rule[szrule - 1] == L'*' ? _wcsnicmp(name, rule, szrule - 1) == 0 :
+			szrule == wcslen(name) && _wcsnicmp(name, rule, szrule) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Writes args[1..] to a new response file in our temp folder, converted
+ * and written in one go, and returns its path. Returns NULL if we can't,
+ * if its path would need quoting, which cygwin1.dll doesn't expect, or if
+ * an argument isn't valid UTF-16.
+ */
+static wchar_t* os_spill(int argc, wchar_t** args)
+{
+	wchar_t sTemp[MAX_PATH+1], *result, *wide;
+	char* narrow;
+	size_t szwide, sznarrow;
+	dword dwWritten;
+	HANDLE hFile;
+	bool ok;
+
+	if(!GetTempPathW(MAX_PATH+1, sTemp) || !GetShortPathNameW(sTemp, sTemp, MAX_PATH+1) ||
+		wcspbrk(sTemp, CMDLINE_QUOTE_CHARS)) {
+		return NULL;
+	}
+	szwide = cmdline_args_length(argc, args);
+	if(!(result = (wchar_t*)malloc((MAX_PATH+1) * sizeof(wchar_t))) ||
+		!(wide = (wchar_t*)malloc((szwide + 1) * sizeof(wchar_t))) ||
+		!(narrow = (char*)malloc(UTF8_MAX(szwide) + 1))) {
+		fatal_api_call(L"os_spill");
+	}
+
+	// cygwin1.dll reads it back as UTF-8, and splits it up like a command line.
+	szwide = (size_t)(cmdline_args_write(argc, args, wide) - wide);
+	sznarrow = utf8_encode(wide, szwide, narrow, UTF8_MAX(szwide));
+	free(wide);
+	if(sznarrow == UTF_INVALID || !GetTempFileNameW(sTemp, L"cyl", 0, result)) {
+		free(result);
+		free(narrow);
+		return NULL;
+	}
+
+	hFile = CreateFileW(result, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	ok = hFile != INVALID_HANDLE_VALUE && WriteFile(hFile, narrow, (dword)sznarrow, &dwWritten, NULL) &&
+		dwWritten == (dword)sznarrow;
+	if(hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+	free(narrow);
+	if(!ok) {
+		DeleteFileW(result);
+		free(result);
+		return NULL;
+	}
+	return result;
+}
+
+/**
+ * Builds our command line in one go. (See cmdline.c) If it'd be too long,
+ * and app reads response files, our arguments are spilled to one, whose
+ * path ends up in response.
+ */
+static wchar_t* os_build_cmdline(const wchar_t* app, int argc, wchar_t** args, wchar_t** response)
+{
+	size_t szcmdline = cmdline_length(argc, args);
+	wchar_t *result, *spilled[2] = { NULL, NULL };
+
+	*response = NULL;
+	if(szcmdline > CMDLINE_MAX) {
+		if(!os_takes_response(app) || !(*response = os_spill(argc, args))) {
+			fatal(ERROR_FILENAME_EXCED_RANGE, L"Our command line would be %d characters long, which is more than Windows allows.", (int)szcmdline);
+		}
+		verbose(L"Our command line would be %d characters long. Passing our arguments in %s instead..", (int)szcmdline, *response);
+		flight(FLIGHT_SPILL, szcmdline, 0, NULL);
+		spilled[0] = args[0];
+		if(!(spilled[1] = (wchar_t*)malloc((wcslen(*response) + 2) * sizeof(wchar_t)))) fatal_api_call(L"os_build_cmdline");
+		spilled[1][0] = L'@';
+		wcscpy(&(spilled[1][1]), *response);
+		argc = 2;
+		args = spilled;
+		szcmdline = cmdline_length(argc, args);
+	}
+	if(!(result = (wchar_t*)malloc(szcmdline * sizeof(wchar_t)))) {
+		fatal_api_call(L"os_build_cmdline");
+	}
+	cmdline_write(argc, args, result);
+	free(spilled[1]);
+	flight(FLIGHT_CMDLINE, szcmdline, 0, NULL);
+	return result;
+}
+
+/** Copies an environment block (NAME=value strings, ending in an empty one) out of our arena. */
+static wchar_t* os_copy_env(const wchar_t* env)
+{
+	const wchar_t* end = env;
+	wchar_t* result;
+
+	while(*end) end += wcslen(end) + 1;
+	if(!(result = (wchar_t*)malloc((end - env + 1) * sizeof(wchar_t)))) fatal_api_call(L"os_copy_env");
+	memcpy(result, env, (end - env + 1) * sizeof(wchar_t));
+	return result;
+}
+
+/**
+ * Copies everything needed to launch cmd with args (and env, if it isn't
+ * NULL) out of our arena, so that the arena can be released before we
+ * launch.
+ */
+static os_launch* os_prepare(wchar_t* cmd, int argc, wchar_t** args, wchar_t* env)
+{
+	os_launch* launch = (os_launch*)malloc(sizeof(os_launch));
+	if(!launch) fatal_api_call(L"os_prepare");
+	launch->app = os_find_executable(cmd);
+	launch->cmdline = os_build_cmdline(launch->app, argc, args, &(launch->response));
+	launch->env = env ? os_copy_env(env) : NULL;
+	#ifndef WITHOUT_RELAY
+	launch->relay = relay_prepare();
+	#endif
+	verbose(L"Executing..");
+	verbose_step(L"%s", launch->app);
+	verbose_step(L"%s", launch->cmdline);
+	return launch;
+}
+
+/** Which handoff mode to use. (CYGLAUNCH_HANDOFF=wait|detach) */
+static int os_handoff_mode()
+{
+	wchar_t sValue[16] = EMPTYW;
+	if(GetEnvironmentVariableW(L"CYGLAUNCH_HANDOFF", sValue, 16) && _wcsicmp(sValue, L"detach") == 0) {
+		return HANDOFF_DETACH;
+	}
+	return HANDOFF_WAIT;
+}
+
+/** Dumps our flight recorder on the way down, then lets Windows carry on as usual. */
+static LONG WINAPI os_crash_handler(EXCEPTION_POINTERS* info)
+{
+	flight_dump();
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void os_install_crash_handler()
+{
+	SetUnhandledExceptionFilter(os_crash_handler);
+}
+
+/**
+ * Our interpreter gets the same console events we do, so all we need to
+ * do is not die before it's had a chance to deal with them.
+ */
+static BOOL WINAPI os_ctrl_handler(dword dwCtrlType)
+{
+	return TRUE;
+}
+
+/** Puts our interpreter in a job that's killed when we go away. Failing that, we just carry on. */
+static HANDLE os_tie_to_launcher(HANDLE hProcess)
+{
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION jeli;
+	HANDLE hJob;
+
+	if(!(hJob = CreateJobObjectW(NULL, NULL))) return NULL;
+	ZeroMemory(&jeli, sizeof(JOBOBJECT_EXTENDED_LIMIT_INFORMATION));
+	// Anything our interpreter starts is free to outlive us.
+	jeli.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE | JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK;
+	if(!SetInformationJobObject(hJob, JobObjectExtendedLimitInformation, &jeli, sizeof(JOBOBJECT_EXTENDED_LIMIT_INFORMATION)) ||
+		!AssignProcessToJobObject(hJob, hProcess)) {
+		CloseHandle(hJob);
+		return NULL;
+	}
+	return hJob;
+}
+
+#ifndef WITHOUT_RELAY
+/** One of our interpreter's output streams, on its way to one of ours. */
+typedef struct {
+	HANDLE hRead;		// Our end of the pipe our interpreter writes to.
+	HANDLE hThread;
+	relay_stream rs;
+} os_relay;
+
+static bool os_relay_sink(void* context, const char* data, size_t count)
+{
+	dword dwWritten;
+	while(count) {
+		if(!WriteFile((HANDLE)context, data, (dword)count, &dwWritten, NULL)) return false;
+		data += dwWritten;
+		count -= dwWritten;
+	}
+	return true;
+}
+
+/** Reads our interpreter's output until it's done with it. */
+static dword WINAPI os_relay_pump(void* param)
+{
+	os_relay* relay = (os_relay*)param;
+	dword dwRead, dwAvail, dwWaited;
+	size_t room;
+	char* space;
+
+	while(true) {
+		// Give the rest of a path that's been cut off a little while to turn up.
+		if(relay_holding(&(relay->rs))) {
+			for(dwAvail = dwWaited = 0; dwWaited < RELAY_LATENCY &&
+				PeekNamedPipe(relay->hRead, NULL, 0, NULL, &dwAvail, NULL) && !dwAvail; dwWaited += 5) {
+				Sleep(5);
+			}
+			if(!dwAvail) relay_flush(&(relay->rs));
+		}
+		space = relay_space(&(relay->rs), &room);
+		if(!ReadFile(relay->hRead, space, (dword)room, &dwRead, NULL) || !dwRead) break;
+		relay_feed(&(relay->rs), dwRead);
+	}
+	relay_flush(&(relay->rs));
+	return 0;
+}
+
+/**
+ * Sets up a relay for one of our std handles, unless it's a console, (in
+ * which case there's nobody to parse it) or we can't. Returns the handle
+ * our interpreter should write to instead.
+ */
+static HANDLE os_relay_open(os_relay** relay, const mount_table* mt, dword dwStdHandle)
+{
+	SECURITY_ATTRIBUTES sa;
+	HANDLE hOut = GetStdHandle(dwStdHandle), hRead, hWrite;
+
+	*relay = NULL;
+	if(!hOut || hOut == INVALID_HANDLE_VALUE || GetFileType(hOut) == FILE_TYPE_CHAR) return hOut;
+	ZeroMemory(&sa, sizeof(SECURITY_ATTRIBUTES));
+	sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+	sa.bInheritHandle = TRUE;
+	if(!CreatePipe(&hRead, &hWrite, &sa, RELAY_BUFFER)) return hOut;
+	if(!SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0) || !(*relay = (os_relay*)malloc(sizeof(os_relay)))) {
+		CloseHandle(hRead);
+		CloseHandle(hWrite);
+		return hOut;
+	}
+	(*relay)->hRead = hRead;
+	(*relay)->hThread = NULL;
+	relay_init(&((*relay)->rs), mt, os_relay_sink, (void*)hOut);
+	return hWrite;
+}
+
+/** Starts relaying, now that our interpreter has its own copy of the pipe's other end. */
+static void os_relay_start(os_relay* relay, HANDLE hWrite)
+{
+	CloseHandle(hWrite);
+	if(!(relay->hThread = CreateThread(NULL, 0, os_relay_pump, relay, 0, NULL))) fatal_api_call(L"CreateThread");
+}
+
+/** Waits for a relay to pass along whatever's left, for RELAY_DRAIN at most. */
+static void os_relay_finish(os_relay* relay)
+{
+	if(!relay || WaitForSingleObject(relay->hThread, RELAY_DRAIN) != WAIT_OBJECT_0) return;
+	CloseHandle(relay->hThread);
+	CloseHandle(relay->hRead);
+	free(relay);
+}
+#endif
+
+#if !defined(WITHOUT_POOL) || !defined(WITHOUT_RESOLVER)
+/**
+ * Reads or writes count bytes of a pool's or resolver's pipe, (opened for
+ * overlapped I/O, so that one thread can read while another writes)
+ * giving up after timeout ms.
+ */
+static bool os_pipe_io(HANDLE hPipe, void* data, dword count, bool write, dword timeout)
+{
+	OVERLAPPED ov;
+	dword done = 0, n = 0;
+	bool ok = true;
+
+	ZeroMemory(&ov, sizeof(OVERLAPPED));
+	if(!(ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL))) return false;
+	while(ok && done < count) {
+		ok = (write ? WriteFile(hPipe, (char*)data + done, count - done, NULL, &ov) :
+			ReadFile(hPipe, (char*)data + done, count - done, NULL, &ov)) || GetLastError() == ERROR_IO_PENDING;
+		if(ok && WaitForSingleObject(ov.hEvent, timeout) != WAIT_OBJECT_0) {
+			CancelIo(hPipe);
+			GetOverlappedResult(hPipe, &ov, &n, TRUE);
+			ok = false;
+		} else if(ok) {
+			ok = GetOverlappedResult(hPipe, &ov, &n, FALSE) && n;
+			done += n;
+		}
+	}
+	CloseHandle(ov.hEvent);
+	return ok;
+}
+
+#ifndef PROCESS_QUERY_LIMITED_INFORMATION
+#	define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+#endif
+
+typedef BOOL (WINAPI *os_pipe_server_pid)(HANDLE, ULONG*);
+
+/** Gets the user a process runs as, on the heap. Returns NULL if we can't tell. */
+static TOKEN_USER* os_process_user(HANDLE hProcess)
+{
+	TOKEN_USER* user = NULL;
+	HANDLE hToken;
+	dword size = 0;
+
+	if(!OpenProcessToken(hProcess, TOKEN_QUERY, &hToken)) return NULL;
+	if(!GetTokenInformation(hToken, TokenUser, NULL, 0, &size) && GetLastError() == ERROR_INSUFFICIENT_BUFFER &&
+		(user = (TOKEN_USER*)malloc(size)) && !GetTokenInformation(hToken, TokenUser, user, size, &size)) {
+		free(user);
+		user = NULL;
+	}
+	CloseHandle(hToken);
+	return user;
+}
+
+/**
+ * Whether the pool or resolver we've connected to runs as us. Anyone can
+ * make a pipe with its name before it does, and FILE_FLAG_FIRST_PIPE_INSTANCE
+ * only stops it making its pipe after them. Windows before Vista can't tell
+ * us whose the pipe is, so there, it's never ours.
+ */
+static bool os_pipe_ours(HANDLE hPipe)
+{
+	static os_pipe_server_pid get_server_pid = NULL;
+	TOKEN_USER *ours = NULL, *theirs = NULL;
+	HANDLE hProcess;
+	ULONG ulPid;
+	bool ok;
+
+	if(!get_server_pid) get_server_pid = (os_pipe_server_pid)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "GetNamedPipeServerProcessId");
+	if(!get_server_pid || !get_server_pid(hPipe, &ulPid)) return false;
+	if(!(hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, ulPid))) return false;
+	theirs = os_process_user(hProcess);
+	CloseHandle(hProcess);
+	ok = theirs && (ours = os_process_user(GetCurrentProcess())) && EqualSid(ours->User.Sid, theirs->User.Sid);
+	free(ours);
+	free(theirs);
+	if(!ok) verbose(L"Our pipe was made by process %lu, which isn't running as us. Not using it..", (unsigned long)ulPid);
+	return ok;
+}
+
+#if defined(POOL_BROKER) || defined(RESOLVER_SERVICE)
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#	define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+/**
+ * Makes another instance of a pool's or resolver's pipe, for the next
+ * launcher to connect to. Our first is the only one allowed to create it,
+ * so there can't already be a what (pool or resolver) there.
+ */
+static HANDLE os_pipe_listen(const wchar_t* sPipe, bool first, const wchar_t* what)
+{
+	HANDLE hPipe = CreateNamedPipeW(sPipe, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, NULL);
+
+	if(hPipe != INVALID_HANDLE_VALUE) return hPipe;
+	if(first && GetLastError() == ERROR_ACCESS_DENIED) fatal(ERROR_PIPE_BUSY, L"There's already a %s running at %s", what, sPipe);
+	fatal_api_call(L"CreateNamedPipeW");
+	return NULL;
+}
+#endif
+#endif
+
+#ifndef WITHOUT_POOL
+static HANDLE os_pool_pipe = INVALID_HANDLE_VALUE;
+
+/** Passes Ctrl+C on to whichever interpreter took our launch, which doesn't share our console. */
+static BOOL WINAPI os_pool_ctrl_handler(dword dwCtrlType)
+{
+	char c = POOL_INTERRUPT;
+	if(dwCtrlType == CTRL_C_EVENT || dwCtrlType == CTRL_BREAK_EVENT) os_pipe_io(os_pool_pipe, &c, 1, true, POOL_TIMEOUT);
+	return TRUE;
+}
+
+/**
+ * Hands our launch over to one of our pool's interpreters, if there's a
+ * pool and it takes it, and waits for it to exit. Returns false if we
+ * should launch as usual.
+ */
+static bool os_pool_handoff(int argc, wchar_t** args, wchar_t* env, int* status)
+{
+	static const dword dwStdHandles[3] = { STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE };
+	wchar_t sPipe[64], sCwd[MAX_PATH+1];
+	pool_request* request = NULL;
+	dword handles[3], types[3], reply = 0, dwCwd;
+	HANDLE hPipe;
+	bool taken;
+	int i;
+
+	if(!pool_eligible(argc, args)) return false;
+	// Consoles and pipes are all cygwin1.dll can attach to our interpreter's fds.
+	for(i = 0; i < 3; i++) {
+		HANDLE hStd = GetStdHandle(dwStdHandles[i]);
+		if(!hStd || hStd == INVALID_HANDLE_VALUE) return false;
+		types[i] = GetFileType(hStd);
+		if(types[i] != FILE_TYPE_CHAR && types[i] != FILE_TYPE_PIPE) return false;
+		handles[i] = (dword)(ULONG_PTR)hStd;
+	}
+	if(FAILED(StringCchPrintfW(sPipe, 64, L"\\\\.\\pipe\\%s", pool_name))) return false;
+	trace_begin(L"pool");
+	hPipe = CreateFileW(sPipe, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, NULL);
+	if(hPipe != INVALID_HANDLE_VALUE && !os_pipe_ours(hPipe)) {
+		CloseHandle(hPipe);
+		hPipe = INVALID_HANDLE_VALUE;
+	}
+	if(hPipe == INVALID_HANDLE_VALUE) {
+		trace_end(L"pool");
+		return false;
+	}
+	taken = (dwCwd = GetCurrentDirectoryW(MAX_PATH+1, sCwd)) && dwCwd <= MAX_PATH &&
+		(request = pool_build(sCwd, argc, args, env));
+	if(taken) {
+		memcpy(request->handles, handles, sizeof(handles));
+		memcpy(request->types, types, sizeof(types));
+		taken = os_pipe_io(hPipe, request, request->size, true, POOL_TIMEOUT) &&
+			os_pipe_io(hPipe, &reply, sizeof(dword), false, POOL_TIMEOUT) && reply == POOL_ACCEPTED;
+	}
+	free(request);
+	trace_end(L"pool");
+	flight(FLIGHT_POOL, taken, 0, NULL);
+	if(!taken) {
+		verbose(L"No pooled interpreter took our launch. Launching as usual..");
+		CloseHandle(hPipe);
+		return false;
+	}
+
+	verbose(L"Launched in a pooled interpreter..");
+	trace_flush();
+	os_pool_pipe = hPipe;
+	SetConsoleCtrlHandler(os_pool_ctrl_handler, TRUE);
+	*status = os_pipe_io(hPipe, &reply, sizeof(dword), false, INFINITE) ? (int)reply : 1;
+	CloseHandle(hPipe);
+	return true;
+}
+
+#ifdef POOL_BROKER
+
+/** How many interpreters our pool keeps track of, waiting or running. */
+#define OS_POOL_SLOTS (4 * POOL_MAX_SIZE)
+
+typedef BOOL (WINAPI *os_pool_client_pid)(HANDLE, ULONG*);
+
+typedef struct {
+	int state;
+	HANDLE hIn;			// Our end of its stdin, which takes requests and Ctrl+Cs.
+	HANDLE hOut;		// Our end of its stdout, which replies.
+	HANDLE hProcess;	// Opened to duplicate handles into, once it's told us its pid.
+} os_pool_worker;
+
+/** Everything our threads share. Workers only change state with os_pool_lock held. */
+static os_pool_worker os_pool_workers[OS_POOL_SLOTS];
+static CRITICAL_SECTION os_pool_lock;
+static pool_settings* os_pool_settings;
+static os_pool_client_pid os_pool_get_client_pid;
+static HANDLE os_pool_wake;			// Set whenever an interpreter's ready or done, so we top ourselves up.
+static volatile LONG os_pool_running = 0;
+
+/** Reads or writes all of count bytes of one of our interpreters' pipes. */
+static bool os_pool_worker_io(HANDLE hPipe, void* data, dword count, bool write)
+{
+	dword n;
+	for(; count; count -= n, data = (char*)data + n) {
+		if(!(write ? WriteFile(hPipe, data, count, &n, NULL) : ReadFile(hPipe, data, count, &n, NULL)) || !n) return false;
+	}
+	return true;
+}
+
+/** Done with an interpreter. If it's still around, it sees its stdin close and exits. (Call with os_pool_lock held) */
+static void os_pool_retire(os_pool_worker* worker)
+{
+	if(worker->hIn) CloseHandle(worker->hIn);
+	if(worker->hOut) CloseHandle(worker->hOut);
+	if(worker->hProcess) CloseHandle(worker->hProcess);
+	worker->hIn = worker->hOut = worker->hProcess = NULL;
+	worker->state = POOL_FREE;
+}
+
+/** Waits for a starting interpreter to tell us it's ready, and its pid. */
+static dword WINAPI os_pool_warm(void* param)
+{
+	os_pool_worker* worker = (os_pool_worker*)param;
+	dword hello[2] = { 0, 0 };
+	HANDLE hProcess = NULL;
+
+	if(os_pool_worker_io(worker->hOut, hello, sizeof(hello), false) && hello[0] == POOL_READY) {
+		hProcess = OpenProcess(PROCESS_DUP_HANDLE, FALSE, hello[1]);
+	}
+	EnterCriticalSection(&os_pool_lock);
+	if(hProcess) {
+		worker->hProcess = hProcess;
+		worker->state = POOL_WAITING;
+		os_pool_settings->failures = 0;
+	} else {
+		os_pool_retire(worker);
+		if(++os_pool_settings->failures == POOL_MAX_FAILURES) {
+			fatal(ERROR_PROCESS_ABORTED, L"Our interpreters keep exiting before they're ready. (Does %s run Python?)", os_pool_settings->launcher);
+		}
+	}
+	LeaveCriticalSection(&os_pool_lock);
+	SetEvent(os_pool_wake);
+	return 0;
+}
+
+/**
+ * Starts an interpreter running our bootstrap, talking to us over its
+ * stdin and stdout, in a console of its own that nobody sees. (So that
+ * the interpreter our launcher starts in it doesn't pop one up) Call with
+ * os_pool_lock held.
+ */
+static void os_pool_spawn(os_pool_worker* worker, wchar_t* cmdline)
+{
+	SECURITY_ATTRIBUTES sa;
+	STARTUPINFOW si;
+	PROCESS_INFORMATION pi;
+	HANDLE hInRead, hInWrite, hOutRead, hOutWrite, hNull, hThread;
+
+	ZeroMemory(&sa, sizeof(SECURITY_ATTRIBUTES));
+	sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+	sa.bInheritHandle = TRUE;
+	if(!CreatePipe(&hInRead, &hInWrite, &sa, 0) || !CreatePipe(&hOutRead, &hOutWrite, &sa, 0) ||
+		!SetHandleInformation(hInWrite, HANDLE_FLAG_INHERIT, 0) || !SetHandleInformation(hOutRead, HANDLE_FLAG_INHERIT, 0)) {
+		fatal_api_call(L"CreatePipe");
+	}
+	hNull = CreateFileW(L"NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+
+	ZeroMemory(&si, sizeof(STARTUPINFOW));
+	si.cb = sizeof(STARTUPINFOW);
+	si.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+	si.wShowWindow = SW_HIDE;
+	si.hStdInput = hInRead;
+	si.hStdOutput = hOutWrite;
+	si.hStdError = hNull;
+	if(!CreateProcessW(os_pool_settings->launcher, cmdline, NULL, NULL, TRUE, CREATE_NEW_CONSOLE, NULL, NULL, &si, &pi)) {
+		fatal_api_call(L"CreateProcessW");
+	}
+	// Our launcher hands over to the interpreter, (CYGLAUNCH_HANDOFF=detach) and exits.
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+	CloseHandle(hInRead);
+	CloseHandle(hOutWrite);
+	if(hNull != INVALID_HANDLE_VALUE) CloseHandle(hNull);
+
+	worker->state = POOL_STARTING;
+	worker->hIn = hInWrite;
+	worker->hOut = hOutRead;
+	worker->hProcess = NULL;
+	if(!(hThread = CreateThread(NULL, 0, os_pool_warm, worker, 0, NULL))) fatal_api_call(L"CreateThread");
+	CloseHandle(hThread);
+}
+
+typedef struct {
+	HANDLE hClient;
+	os_pool_worker* worker;
+} os_pool_forward;
+
+/** Passes Ctrl+Cs from a launch to the interpreter running it, until it goes away. */
+static dword WINAPI os_pool_forwarder(void* param)
+{
+	os_pool_forward* forward = (os_pool_forward*)param;
+	char c;
+
+	while(os_pipe_io(forward->hClient, &c, 1, false, INFINITE) && os_pool_worker_io(forward->worker->hIn, &c, 1, true));
+	CloseHandle(forward->worker->hIn);
+	forward->worker->hIn = NULL;
+	return 0;
+}
+
+/** Reads a launch's request, or returns NULL if it isn't one. */
+static pool_request* os_pool_receive(HANDLE hClient)
+{
+	pool_request header, *request;
+
+	if(!os_pipe_io(hClient, &header, sizeof(pool_request), false, POOL_TIMEOUT) || !pool_valid(&header) ||
+		!(request = (pool_request*)malloc(header.size))) {
+		return NULL;
+	}
+	memcpy(request, &header, sizeof(pool_request));
+	if(!os_pipe_io(hClient, (char*)request + sizeof(pool_request), header.size - sizeof(pool_request), false, POOL_TIMEOUT)) {
+		free(request);
+		return NULL;
+	}
+	return request;
+}
+
+/**
+ * Duplicates a launch's std handles into the interpreter about to run it,
+ * and rewrites its request to match.
+ */
+static bool os_pool_lend(HANDLE hClient, pool_request* request, HANDLE hProcess)
+{
+	HANDLE hFrom, hTo;
+	ULONG ulPid;
+	bool ok;
+	int i;
+
+	if(!os_pool_get_client_pid(hClient, &ulPid) || !(hFrom = OpenProcess(PROCESS_DUP_HANDLE, FALSE, ulPid))) return false;
+	for(i = 0, ok = true; i < 3 && ok; i++) {
+		if((ok = DuplicateHandle(hFrom, (HANDLE)(ULONG_PTR)request->handles[i], hProcess, &hTo, 0, FALSE, DUPLICATE_SAME_ACCESS) != FALSE)) {
+			request->handles[i] = (dword)(ULONG_PTR)hTo;
+		}
+	}
+	CloseHandle(hFrom);
+	return ok;
+}
+
+/**
+ * Hands a launch to a waiting interpreter, or turns it down, and passes
+ * along its replies: whether it's taken the launch, and its exit code.
+ */
+static dword WINAPI os_pool_session(void* param)
+{
+	HANDLE hClient = (HANDLE)param, hForwarder = NULL;
+	os_pool_worker* worker = NULL;
+	os_pool_forward forward;
+	pool_request* request;
+	dword reply = POOL_DECLINED, replies = 0;
+	int i;
+
+	if((request = os_pool_receive(hClient))) {
+		EnterCriticalSection(&os_pool_lock);
+		for(i = 0; i < OS_POOL_SLOTS && !worker; i++) {
+			if(os_pool_workers[i].state == POOL_WAITING) worker = &(os_pool_workers[i]);
+		}
+		if(worker) worker->state = POOL_RUNNING;
+		LeaveCriticalSection(&os_pool_lock);
+		SetEvent(os_pool_wake);
+	}
+	if(worker && os_pool_lend(hClient, request, worker->hProcess) &&
+		os_pool_worker_io(worker->hIn, request, request->size, true)) {
+		forward.hClient = hClient;
+		forward.worker = worker;
+		if(!(hForwarder = CreateThread(NULL, 0, os_pool_forwarder, &forward, 0, NULL))) fatal_api_call(L"CreateThread");
+		while(replies < 2 && os_pool_worker_io(worker->hOut, &reply, sizeof(dword), false) &&
+			os_pipe_io(hClient, &reply, sizeof(dword), true, INFINITE) && reply != POOL_DECLINED) {
+			replies++;
+		}
+	} else if(request) {
+		os_pipe_io(hClient, &reply, sizeof(dword), true, POOL_TIMEOUT);
+	}
+	free(request);
+
+	// Our replies have to be read before we disconnect, or they're thrown away.
+	FlushFileBuffers(hClient);
+	DisconnectNamedPipe(hClient);
+	if(hForwarder) {
+		WaitForSingleObject(hForwarder, INFINITE);
+		CloseHandle(hForwarder);
+	}
+	CloseHandle(hClient);
+	if(worker) {
+		EnterCriticalSection(&os_pool_lock);
+		os_pool_retire(worker);
+		LeaveCriticalSection(&os_pool_lock);
+	}
+	InterlockedDecrement(&os_pool_running);
+	SetEvent(os_pool_wake);
+	return 0;
+}
+
+/**
+ * Runs a pool until it's gone settings->idle without a launch, and has
+ * nothing running. Returns our exit code.
+ */
+static int os_pool_serve(pool_settings* settings)
+{
+	wchar_t *args[4] = { NULL, L"-c", NULL, L"-" }, *cmdline, sPipe[64];
+	HANDLE hPipe, hThread, waits[2];
+	OVERLAPPED ov;
+	dword dwLast, dwElapsed, dwWait, n;
+	bool pending = false, connected;
+	int nwarm, nwaiting, i;
+
+	os_pool_get_client_pid = (os_pool_client_pid)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "GetNamedPipeClientProcessId");
+	if(!os_pool_get_client_pid) fatal(ERROR_CALL_NOT_IMPLEMENTED, L"Pools need Windows Vista or later.");
+	if(FAILED(StringCchPrintfW(sPipe, 64, L"\\\\.\\pipe\\%s", pool_name))) fatal(ERROR_FILENAME_EXCED_RANGE, L"Pool name too long: %s", pool_name);
+	// Our pipe's default security only lets us (and SYSTEM, and admins) write to it.
+	hPipe = os_pipe_listen(sPipe, true, L"pool");
+	pool_prepare_env();
+
+	// Our interpreters run: launcher -c POOL_BOOTSTRAP -
+	if(!(args[2] = (wchar_t*)malloc(sizeof(POOL_BOOTSTRAP) * sizeof(wchar_t)))) fatal_api_call(L"os_pool_serve");
+	for(i = 0; (args[2][i] = (wchar_t)POOL_BOOTSTRAP[i]); i++);
+	args[0] = (wchar_t*)settings->launcher;
+	if(!(cmdline = (wchar_t*)malloc(cmdline_length(4, args) * sizeof(wchar_t)))) fatal_api_call(L"os_pool_serve");
+	cmdline_write(4, args, cmdline);
+	free(args[2]);
+
+	InitializeCriticalSection(&os_pool_lock);
+	os_pool_settings = settings;
+	ZeroMemory(os_pool_workers, sizeof(os_pool_workers));
+	ZeroMemory(&ov, sizeof(OVERLAPPED));
+	if(!(os_pool_wake = CreateEventW(NULL, FALSE, FALSE, NULL)) || !(ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL))) {
+		fatal_api_call(L"CreateEventW");
+	}
+	waits[0] = ov.hEvent;
+	waits[1] = os_pool_wake;
+	verbose(L"Pooling %d interpreter(s) at %s..", settings->size, sPipe);
+
+	dwLast = GetTickCount();
+	while(true) {
+		// Top ourselves up. Starting interpreters would only slow down what's
+		// running, so unless we've nothing left waiting, that can wait.
+		EnterCriticalSection(&os_pool_lock);
+		for(i = nwarm = nwaiting = 0; i < OS_POOL_SLOTS; i++) {
+			if(os_pool_workers[i].state == POOL_STARTING || os_pool_workers[i].state == POOL_WAITING) nwarm++;
+			if(os_pool_workers[i].state == POOL_WAITING) nwaiting++;
+		}
+		for(i = 0; i < OS_POOL_SLOTS && nwarm < settings->size && (!os_pool_running || !nwaiting); i++) {
+			if(os_pool_workers[i].state == POOL_FREE) {
+				os_pool_spawn(&(os_pool_workers[i]), cmdline);
+				nwarm++;
+			}
+		}
+		LeaveCriticalSection(&os_pool_lock);
+
+		// Wait for a launch to connect.
+		connected = false;
+		if(!pending) {
+			if(ConnectNamedPipe(hPipe, &ov) || GetLastError() == ERROR_PIPE_CONNECTED) {
+				connected = true;
+			} else if(GetLastError() == ERROR_IO_PENDING) {
+				pending = true;
+			} else {
+				fatal_api_call(L"ConnectNamedPipe");
+			}
+		}
+		if(pending) {
+			dwElapsed = GetTickCount() - dwLast;
+			if(!os_pool_running && dwElapsed >= settings->idle) break;
+			dwWait = WaitForMultipleObjects(2, waits, FALSE, os_pool_running ? INFINITE : settings->idle - dwElapsed);
+			if(dwWait != WAIT_OBJECT_0) continue;
+			pending = false;
+			connected = GetOverlappedResult(hPipe, &ov, &n, FALSE) != FALSE;
+		}
+		dwLast = GetTickCount();
+		if(!connected) {
+			DisconnectNamedPipe(hPipe);
+			continue;
+		}
+		InterlockedIncrement(&os_pool_running);
+		if(!(hThread = CreateThread(NULL, 0, os_pool_session, hPipe, 0, NULL))) fatal_api_call(L"CreateThread");
+		CloseHandle(hThread);
+		hPipe = os_pipe_listen(sPipe, false, L"pool");
+	}
+
+	verbose(L"No launches for %d second(s). Shutting down..", (int)(settings->idle / 1000));
+	CancelIo(hPipe);
+	CloseHandle(hPipe);
+	// Our waiting interpreters see their stdin close, and exit. (Starting ones, once we have)
+	EnterCriticalSection(&os_pool_lock);
+	for(i = 0; i < OS_POOL_SLOTS; i++) {
+		if(os_pool_workers[i].state == POOL_WAITING) os_pool_retire(&(os_pool_workers[i]));
+	}
+	LeaveCriticalSection(&os_pool_lock);
+	free(cmdline);
+	return 0;
+}
+#endif
+#endif
+
+#ifndef WITHOUT_RESOLVER
+/** Our connection to our resolver, kept for as long as we are. */
+static HANDLE os_resolver_pipe = INVALID_HANDLE_VALUE;
+
+static void os_resolver_close()
+{
+	if(os_resolver_pipe != INVALID_HANDLE_VALUE) CloseHandle(os_resolver_pipe);
+	os_resolver_pipe = INVALID_HANDLE_VALUE;
+}
+
+/**
+ * Sends our resolver a request, connecting first if we haven't yet, and
+ * returns its reply, on the heap. Returns NULL if there's no resolver, or
+ * it didn't answer.
+ */
+static char* os_resolver_call(const char* request)
+{
+	resolver_header header;
+	wchar_t sPipe[64];
+	char* reply;
+	int tries;
+
+	if(os_resolver_pipe == INVALID_HANDLE_VALUE) {
+		if(FAILED(StringCchPrintfW(sPipe, 64, L"\\\\.\\pipe\\%s", resolver_name))) return NULL;
+		// If every instance of its pipe is taken, our resolver makes another as soon as it can.
+		for(tries = 0; tries < 2; tries++) {
+			os_resolver_pipe = CreateFileW(sPipe, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+				FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, NULL);
+			if(os_resolver_pipe != INVALID_HANDLE_VALUE || GetLastError() != ERROR_PIPE_BUSY ||
+				!WaitNamedPipeW(sPipe, RESOLVER_CONNECT_TIMEOUT)) {
+				break;
+			}
+		}
+		if(os_resolver_pipe == INVALID_HANDLE_VALUE) return NULL;
+		if(!os_pipe_ours(os_resolver_pipe)) {
+			os_resolver_close();
+			return NULL;
+		}
+	}
+	if(!os_pipe_io(os_resolver_pipe, (void*)request, ((const resolver_header*)request)->size, true, RESOLVER_TIMEOUT) ||
+		!os_pipe_io(os_resolver_pipe, &header, sizeof(resolver_header), false, RESOLVER_TIMEOUT) ||
+		!resolver_valid(&header) || !(reply = (char*)malloc(header.size))) {
+		os_resolver_close();
+		return NULL;
+	}
+	memcpy(reply, &header, sizeof(resolver_header));
+	if(header.size > sizeof(resolver_header) && !os_pipe_io(os_resolver_pipe, reply + sizeof(resolver_header),
+		header.size - sizeof(resolver_header), false, RESOLVER_TIMEOUT)) {
+		free(reply);
+		os_resolver_close();
+		return NULL;
+	}
+	return reply;
+}
+
+#ifdef RESOLVER_SERVICE
+/** Everything our threads share. */
+static CRITICAL_SECTION os_resolver_lock;	// Held while answering, since cygwin1.dll and our arena are shared.
+static volatile LONG os_resolver_running = 0;
+static volatile LONG os_resolver_last = 0;	// GetTickCount() when a launcher last went away.
+
+/** Answers a launcher's requests, until it goes away or sends us something that isn't one. */
+static dword WINAPI os_resolver_session(void* param)
+{
+	HANDLE hClient = (HANDLE)param;
+	resolver_header header;
+	char *request, *reply;
+	bool ok = true;
+
+	while(ok && os_pipe_io(hClient, &header, sizeof(resolver_header), false, INFINITE) && resolver_valid(&header) &&
+		(request = (char*)malloc(header.size))) {
+		memcpy(request, &header, sizeof(resolver_header));
+		reply = NULL;
+		if((ok = header.size == sizeof(resolver_header) || os_pipe_io(hClient, request + sizeof(resolver_header),
+			header.size - sizeof(resolver_header), false, RESOLVER_TIMEOUT))) {
+			EnterCriticalSection(&os_resolver_lock);
+			reply = resolver_answer(request);
+			LeaveCriticalSection(&os_resolver_lock);
+			ok = reply && os_pipe_io(hClient, reply, ((resolver_header*)reply)->size, true, RESOLVER_TIMEOUT);
+		}
+		free(request);
+		free(reply);
+	}
+	DisconnectNamedPipe(hClient);
+	CloseHandle(hClient);
+	InterlockedExchange(&os_resolver_last, (LONG)GetTickCount());
+	InterlockedDecrement(&os_resolver_running);
+	return 0;
+}
+
+/**
+ * Runs our resolver until it's gone idle ms without a launcher connected,
+ * (never, if idle is 0) or until it's stopped. cygwin1.dll has to be
+ * loaded already. Returns our exit code.
+ */
+static int os_resolver_serve(dword idle)
+{
+	wchar_t sPipe[64];
+	HANDLE hPipe, hThread;
+	OVERLAPPED ov;
+	dword dwElapsed, n;
+	bool pending = false, connected;
+
+	if(FAILED(StringCchPrintfW(sPipe, 64, L"\\\\.\\pipe\\%s", resolver_name))) {
+		fatal(ERROR_FILENAME_EXCED_RANGE, L"Resolver name too long: %s", resolver_name);
+	}
+	// Our pipe's default security only lets us (and SYSTEM, and admins) write to it.
+	hPipe = os_pipe_listen(sPipe, true, L"resolver");
+	InitializeCriticalSection(&os_resolver_lock);
+	ZeroMemory(&ov, sizeof(OVERLAPPED));
+	if(!(ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL))) fatal_api_call(L"CreateEventW");
+	verbose(L"Resolving paths at %s..", sPipe);
+
+	os_resolver_last = (LONG)GetTickCount();
+	while(true) {
+		// Wait for a launcher to connect.
+		connected = false;
+		if(!pending) {
+			if(ConnectNamedPipe(hPipe, &ov) || GetLastError() == ERROR_PIPE_CONNECTED) {
+				connected = true;
+			} else if(GetLastError() == ERROR_IO_PENDING) {
+				pending = true;
+			} else {
+				fatal_api_call(L"ConnectNamedPipe");
+			}
+		}
+		if(pending) {
+			dwElapsed = os_resolver_running ? 0 : GetTickCount() - (dword)os_resolver_last;
+			if(idle && !os_resolver_running && dwElapsed >= idle) break;
+			// Launchers come and go without telling us, so check back once we might've gone idle.
+			if(WaitForSingleObject(ov.hEvent, idle ? idle - dwElapsed : INFINITE) != WAIT_OBJECT_0) continue;
+			pending = false;
+			connected = GetOverlappedResult(hPipe, &ov, &n, FALSE) != FALSE;
+		}
+		if(!connected) {
+			DisconnectNamedPipe(hPipe);
+			continue;
+		}
+		InterlockedIncrement(&os_resolver_running);
+		if(!(hThread = CreateThread(NULL, 0, os_resolver_session, hPipe, 0, NULL))) fatal_api_call(L"CreateThread");
+		CloseHandle(hThread);
+		hPipe = os_pipe_listen(sPipe, false, L"resolver");
+	}
+
+	verbose(L"No launchers for %d second(s). Shutting down..", (int)(idle / 1000));
+	CancelIo(hPipe);
+	CloseHandle(hPipe);
+	CloseHandle(ov.hEvent);
+	return 0;
+}
+#endif
+#endif
+
+/**
+ * Launch our interpreter. In HANDOFF_WAIT mode, waits on it and returns
+ * its exit code; in HANDOFF_DETACH mode, returns 0 as soon as it's
+ * started. Takes ownership of launch.
+ */
+static int os_handoff(os_launch* launch, int mode)
+{
+	STARTUPINFOW si;
+	PROCESS_INFORMATION pi;
+	HANDLE hJob = NULL;
+	dword dwExitCode = 1;
+	wchar_t* response = launch->response;
+	#ifndef WITHOUT_RELAY
+	mount_table* mt = launch->relay;
+	os_relay* relays[2] = { NULL, NULL };
+	HANDLE hPipes[2];
+	int i;
+	#endif
+
+	// Someone has to be around to delete our response file.
+	if(response) mode = HANDOFF_WAIT;
+
+	trace_begin(L"spawn");
+	ZeroMemory(&si, sizeof(STARTUPINFOW));
+	si.cb = sizeof(STARTUPINFOW);
+	#ifndef WITHOUT_RELAY
+	if(mt) {
+		hPipes[0] = os_relay_open(&(relays[0]), mt, STD_OUTPUT_HANDLE);
+		hPipes[1] = os_relay_open(&(relays[1]), mt, STD_ERROR_HANDLE);
+		if(relays[0] || relays[1]) {
+			// ..and to pass our interpreter's output along.
+			mode = HANDOFF_WAIT;
+			si.dwFlags |= STARTF_USESTDHANDLES;
+			si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+			si.hStdOutput = hPipes[0];
+			si.hStdError = hPipes[1];
+		}
+	}
+	#endif
+	flight(FLIGHT_SPAWN, mode, 0, NULL);
+	if(!CreateProcessW(launch->app, launch->cmdline, NULL, NULL, TRUE,
+		(mode == HANDOFF_WAIT ? CREATE_SUSPENDED : 0) | CREATE_UNICODE_ENVIRONMENT, launch->env, NULL, &si, &pi)) {
+		if(response) DeleteFileW(response);
+		fatal_api_call(L"CreateProcessW");
+	}
+	#ifndef WITHOUT_RELAY
+	for(i = 0; i < 2; i++) {
+		if(relays[i]) os_relay_start(relays[i], hPipes[i]);
+	}
+	#endif
+	free(launch->app);
+	free(launch->cmdline);
+	free(launch->env);
+	free(launch);
+
+	if(mode == HANDOFF_DETACH) {
+		trace_end(L"spawn");
+		trace_flush();
+		CloseHandle(pi.hThread);
+		CloseHandle(pi.hProcess);
+		return 0;
+	}
+
+	hJob = os_tie_to_launcher(pi.hProcess);
+	SetConsoleCtrlHandler(os_ctrl_handler, TRUE);
+	if(ResumeThread(pi.hThread) == (dword)-1) {
+		TerminateProcess(pi.hProcess, 1);
+		if(response) DeleteFileW(response);
+		fatal_api_call(L"ResumeThread");
+	}
+	CloseHandle(pi.hThread);
+	trace_end(L"spawn");
+	trace_flush();
+
+	// Give back as much of ourselves as we can while we wait.
+	SetProcessWorkingSetSize(GetCurrentProcess(), (SIZE_T)-1, (SIZE_T)-1);
+
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	if(!GetExitCodeProcess(pi.hProcess, &dwExitCode)) {
+		fatal_api_call(L"GetExitCodeProcess");
+	}
+	#ifndef WITHOUT_RELAY
+	os_relay_finish(relays[0]);
+	os_relay_finish(relays[1]);
+	#endif
+	CloseHandle(pi.hProcess);
+	if(hJob) CloseHandle(hJob);
+	if(response) {
+		DeleteFileW(response);
+		free(response);
+	}
+	return (int)dwExitCode;
+}
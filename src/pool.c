@@ -0,0 +1,298 @@
+/**
+ * pool.c - Hands our launch over to an interpreter that's already been
+ *          started, when there's a pool of them waiting for one. (See
+ *          tools\pool.c, which keeps them)
+ *
+ * Launching the same virtualenv's interpreter over and over again for
+ * short scripts (from an IDE, or a test loop) spends most of its time in
+ * Cygwin's process startup and Python's own, rather than in the script.
+ * cyglaunch-pool keeps a few interpreters around that have gotten past
+ * all of that, each running POOL_BOOTSTRAP and waiting for a launch. With
+ * CYGLAUNCH_POOL set, once we've worked out our interpreter's arguments
+ * and environment, we connect to the pool for our virtualenv instead of
+ * starting a new one, hand over our arguments, environment, working folder
+ * and std handles, and wait for its exit code. Ctrl+C is passed along.
+ *
+ * If there's no pool, it has nothing ready, or what's ready declines,
+ * (it's a different interpreter) we launch as usual, so a pool only ever
+ * makes things faster. So are launches it wouldn't know what to do with:
+ * anything but a script, -m or -c, and on Windows, std handles that
+ * aren't consoles or pipes. An interpreter's never used for more than one
+ * launch; the pool starts another in its place.
+ *
+ * Pools are named after our virtualenv's root, (CYGLAUNCH_POOL=venv, or 1)
+ * or that and the PYTHON* variables we were started with, so launches with
+ * different environments never share interpreters. (CYGLAUNCH_POOL=env)
+ * On Windows, a pool is a named pipe only its owner can write to, and
+ * since anyone can make one with its name first, we only send our launch
+ * (environment and all) to one that runs as us. On POSIX hosts, a pool is
+ * a UNIX socket in a folder only its owner can get at.
+ *
+ * Requests are a pool_request, followed by our working folder, arguments
+ * and environment, as UTF-8 strings. Replies are dwords: POOL_ACCEPTED
+ * and our interpreter's exit code, or POOL_DECLINED.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+#define POOL_MAGIC		0x6c6f6f70L // "pool"
+
+/** The most a request can be, and the most interpreters a pool can keep waiting. */
+#define POOL_MAX_REQUEST	(4 * 1024 * 1024)
+#define POOL_MAX_SIZE		32
+
+/** How long we wait for a pool to take our launch, in ms. */
+#define POOL_TIMEOUT	2000
+
+/** Replies. (POOL_READY goes from an interpreter to its pool, with its pid) */
+#define POOL_READY		1
+#define POOL_ACCEPTED	2
+#define POOL_DECLINED	3
+
+/** Sent on to our interpreter, on Ctrl+C. */
+#define POOL_INTERRUPT	'I'
+
+/** Where a pool's interpreters are at. */
+#define POOL_FREE		0
+#define POOL_STARTING	1
+#define POOL_WAITING	2
+#define POOL_RUNNING	3
+
+typedef struct {
+	dword magic;
+	dword size;			// Of the whole request.
+	dword argc;
+	dword nvars;
+	dword handles[3];	// Our std handles. (Windows only. Duplicated into our interpreter by the pool)
+	dword types[3];		// What they are. (FILE_TYPE_CHAR or FILE_TYPE_PIPE)
+} pool_request;
+
+/**
+ * What each of a pool's interpreters runs, with where to find its pool as
+ * its argument: - for its stdin and stdout, or a UNIX socket's fd. Python
+ * 2 and 3 alike. Cygwin sets up a new process's std handles and converts
+ * a few variables (PATH, HOME, TMP..) on its way in, so on Cygwin, ours
+ * are attached and converted with cygwin1.dll.
+ */
+#define POOL_BOOTSTRAP \
+	"import os, sys, struct, signal, threading, traceback, runpy, pkgutil, atexit, types\n" \
+	"ctl, cyg, fds = sys.argv[1], None, None\n" \
+	"if ctl == '-':\n" \
+	"\timport ctypes\n" \
+	"\tcyg, rfd, wfd = ctypes.CDLL('cygwin1.dll'), os.dup(0), os.dup(1)\n" \
+	"\tread, write = lambda n: os.read(rfd, n), lambda b: os.write(wfd, b)\n" \
+	"else:\n" \
+	"\timport socket\n" \
+	"\tsock = socket.fromfd(int(ctl), socket.AF_UNIX, socket.SOCK_STREAM)\n" \
+	"\tos.close(int(ctl))\n" \
+	"\tif not hasattr(sock, 'recvmsg'): os._exit(2)\n" \
+	"\tread, write = sock.recv, sock.sendall\n" \
+	"def readall(n, data=b''):\n" \
+	"\twhile len(data) < n:\n" \
+	"\t\tmore = read(n - len(data))\n" \
+	"\t\tif not more: os._exit(0)\n" \
+	"\t\tdata += more\n" \
+	"\treturn data\n" \
+	"def cygenv(name, value):\n" \
+	"\twhat = {b'PATH': 1, b'LD_LIBRARY_PATH': 1, b'HOME': 0, b'TMPDIR': 0, b'TMP': 0, b'TEMP': 0}.get(name)\n" \
+	"\tif not cyg or what is None or value[:1] == b'/': return value\n" \
+	"\tout = ctypes.create_string_buffer(32768)\n" \
+	"\treturn out.value if (cyg.cygwin_conv_path, cyg.cygwin_conv_path_list)[what](2, value, out, 32768) == 0 else value\n" \
+	"def watch():\n" \
+	"\ttry:\n" \
+	"\t\twhile True:\n" \
+	"\t\t\tb = read(1)\n" \
+	"\t\t\tif not b: break\n" \
+	"\t\t\tif b == b'I': os.kill(os.getpid(), signal.SIGINT)\n" \
+	"\texcept Exception: pass\n" \
+	"\tos._exit(1)\n" \
+	"pid = os.path.exists('/proc/self/winpid') and int(open('/proc/self/winpid').read()) or os.getpid()\n" \
+	"write(struct.pack('=II', 1, pid))\n" \
+	"if cyg: head = readall(40)\n" \
+	"else:\n" \
+	"\thead, anc, flags, addr = sock.recvmsg(40, socket.CMSG_SPACE(12))\n" \
+	"\tif not head: os._exit(0)\n" \
+	"\tfds, head = anc and struct.unpack('=3i', anc[0][2][:12]), readall(40, head)\n" \
+	"magic, size, argc, nvars, h0, h1, h2, t0, t1, t2 = struct.unpack('=10I', head)\n" \
+	"strings = readall(size - 40).split(b'\\0')\n" \
+	"dec = getattr(os, 'fsdecode', lambda s: s)\n" \
+	"cwd, args, env = dec(strings[0]), [dec(s) for s in strings[1:1 + argc]], strings[1 + argc:1 + argc + nvars]\n" \
+	"if os.path.realpath(args[0]) != os.path.realpath(sys.executable) or not (cyg or fds):\n" \
+	"\twrite(struct.pack('=I', 3))\n" \
+	"\tos._exit(0)\n" \
+	"for fd in range(3):\n" \
+	"\tif cyg:\n" \
+	"\t\tos.close(fd)\n" \
+	"\t\tname = (b'/dev/conin', b'/dev/conout') if (t0, t1, t2)[fd] == 2 else (b'/dev/piper', b'/dev/pipew')\n" \
+	"\t\tcyg.cygwin_attach_handle_to_fd(name[fd > 0], fd, ctypes.c_void_p((h0, h1, h2)[fd]), 0, ctypes.c_uint32((0x80000000, 0x40000000)[fd > 0]))\n" \
+	"\telse:\n" \
+	"\t\tos.dup2(fds[fd], fd)\n" \
+	"\t\tos.close(fds[fd])\n" \
+	"sys.stdin, sys.stdout, sys.stderr = os.fdopen(0, 'r'), os.fdopen(1, 'w', os.isatty(1) and 1 or -1), os.fdopen(2, 'w', 1)\n" \
+	"old = os.environ.get('PYTHONPATH', '').split(os.pathsep)\n" \
+	"os.environ.clear()\n" \
+	"for var in env:\n" \
+	"\tname, sep, value = var.partition(b'=')\n" \
+	"\tif name and sep: os.environ[dec(name)] = dec(cygenv(name, value))\n" \
+	"new = os.environ.get('PYTHONPATH', '').split(os.pathsep)\n" \
+	"if new != old: sys.path[1:] = [p for p in new if p] + [p for p in sys.path[1:] if p not in old]\n" \
+	"t = threading.Thread(target=watch)\n" \
+	"t.daemon = True\n" \
+	"t.start()\n" \
+	"write(struct.pack('=I', 2))\n" \
+	"status = 0\n" \
+	"try:\n" \
+	"\tos.chdir(cwd)\n" \
+	"\tif args[1] == '-c':\n" \
+	"\t\tsys.argv, sys.path[0] = ['-c'] + args[3:], ''\n" \
+	"\t\tmain = sys.modules['__main__'] = types.ModuleType('__main__')\n" \
+	"\t\texec(compile(args[2], '<string>', 'exec'), main.__dict__)\n" \
+	"\telif args[1] == '-m':\n" \
+	"\t\tsys.argv, sys.path[0] = ['-m'] + args[3:], ''\n" \
+	"\t\trunpy._run_module_as_main(args[2])\n" \
+	"\telse:\n" \
+	"\t\tsys.argv, sys.path[0] = args[1:], os.path.dirname(os.path.realpath(args[1]))\n" \
+	"\t\trunpy.run_path(args[1], run_name='__main__')\n" \
+	"except SystemExit as e:\n" \
+	"\tstatus = e.code\n" \
+	"\tif status is None: status = 0\n" \
+	"\telif not isinstance(status, int):\n" \
+	"\t\tsys.stderr.write('%s\\n' % (status,))\n" \
+	"\t\tstatus = 1\n" \
+	"except:\n" \
+	"\ttraceback.print_exc()\n" \
+	"\tstatus = 1\n" \
+	"for done in (getattr(threading, '_shutdown', None), atexit._run_exitfuncs, sys.stdout.flush, sys.stderr.flush):\n" \
+	"\ttry: done and done()\n" \
+	"\texcept: pass\n" \
+	"write(struct.pack('=I', status & 0xffffffff))\n" \
+	"os._exit(status & 0xff)\n"
+
+/** Whether we're to look for a pool, and which one. (CYGLAUNCH_POOL=venv|env) */
+static bool pool_wanted = false;
+static wchar_t pool_name[40] = EMPTYW;
+
+/** Case-insensitive FNV-1a, carried on from hash. */
+static dword pool_hash(dword hash, const wchar_t* s, size_t count)
+{
+	while(count--) {
+		hash ^= (dword)towlower(*(s++));
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * Works out which pool our launches would go to, if CYGLAUNCH_POOL asks
+ * for one: cyglaunch-pool-X-Y, where X is a hash of our virtualenv's root
+ * and user, and Y, of the PYTHON* variables we were started with, or 0.
+ * The pool works its name out the same way.
+ */
+static void pool_init(const wchar_t* sParentDir)
+{
+	wchar_t sValue[16] = EMPTYW, sUser[256] = EMPTYW;
+	wchar_t *block, *var;
+	dword root, vars = 0;
+	size_t szroot = wcslen(sParentDir);
+
+	if(!GetEnvironmentVariableW(L"CYGLAUNCH_POOL", sValue, 16) || wcscmp(sValue, L"0") == 0) return;
+	pool_wanted = true;
+	while(szroot > 3 && (sParentDir[szroot - 1] == L'\\' || sParentDir[szroot - 1] == L'/')) szroot--;
+	root = pool_hash(2166136261UL, sParentDir, szroot);
+	if(GetEnvironmentVariableW(L"USERNAME", sUser, 256) < 256) root = pool_hash(root, sUser, wcslen(sUser));
+	if(_wcsicmp(sValue, L"env") == 0 && (block = GetEnvironmentStringsW())) {
+		// Windows keeps these sorted, so the same variables always hash the same.
+		vars = 2166136261UL;
+		for(var = block; *var; var += wcslen(var) + 1) {
+			if(_wcsnicmp(var, L"PYTHON", 6) == 0) vars = pool_hash(vars, var, wcslen(var) + 1);
+		}
+		FreeEnvironmentStringsW(block);
+	}
+	StringCchPrintfW(pool_name, 40, L"cyglaunch-pool-%08x-%08x", (unsigned int)root, (unsigned int)vars);
+}
+
+/** Whether a pool would know what to do with our interpreter's arguments. */
+static bool pool_eligible(int argc, wchar_t** args)
+{
+	if(!pool_wanted || argc < 2 || !*args[1]) return false;
+	if(args[1][0] != L'-') return true;
+	return argc > 2 && (wcscmp(args[1], L"-c") == 0 || wcscmp(args[1], L"-m") == 0);
+}
+
+/** Appends s to our request as UTF-8, growing it if need be. */
+static bool pool_append(char** request, size_t* size, size_t* capacity, const wchar_t* s)
+{
+	size_t szs = wcslen(s) + 1, n;
+	char* grown;
+
+	if(*size + UTF8_MAX(szs) > *capacity) {
+		*capacity = (*size + UTF8_MAX(szs)) * 2;
+		if(*capacity > POOL_MAX_REQUEST || !(grown = (char*)realloc(*request, *capacity))) return false;
+		*request = grown;
+	}
+	if((n = utf8_encode(s, szs, &((*request)[*size]), *capacity - *size)) == UTF_INVALID) return false;
+	*size += n;
+	return true;
+}
+
+/**
+ * Puts together our request: cwd, then args, then env, or our own
+ * environment if that's NULL. Returns NULL if it'd be too large, or
+ * something in it isn't valid UTF-16. Our caller fills in the handles.
+ */
+static pool_request* pool_build(const wchar_t* cwd, int argc, wchar_t** args, wchar_t* env)
+{
+	size_t size = sizeof(pool_request), capacity = 4096;
+	wchar_t *block = env ? env : GetEnvironmentStringsW(), *var;
+	char* request = (char*)malloc(capacity);
+	pool_request* header;
+	bool ok = request && block;
+	dword nvars = 0;
+	int i;
+
+	ok = ok && pool_append(&request, &size, &capacity, cwd);
+	for(i = 0; ok && i < argc; i++) ok = pool_append(&request, &size, &capacity, args[i]);
+	for(var = block; ok && *var; var += wcslen(var) + 1, nvars++) ok = pool_append(&request, &size, &capacity, var);
+	if(block && !env) FreeEnvironmentStringsW(block);
+	if(!ok) {
+		free(request);
+		return NULL;
+	}
+	header = (pool_request*)request;
+	ZeroMemory(header, sizeof(pool_request));
+	header->magic = POOL_MAGIC;
+	header->size = (dword)size;
+	header->argc = (dword)argc;
+	header->nvars = nvars;
+	return header;
+}
+
+/** Whether a request that's come in looks like one of ours. */
+static inline bool pool_valid(const pool_request* header)
+{
+	return header->magic == POOL_MAGIC && header->size > sizeof(pool_request) &&
+		header->size <= POOL_MAX_REQUEST && header->argc >= 2;
+}
+
+#ifdef POOL_BROKER
+/** How a pool's run. (See tools\pool.c) */
+typedef struct {
+	const wchar_t* launcher;	// What our interpreters are started with. (Our virtualenv's Scripts\python.exe)
+	int size;					// How many we keep waiting.
+	dword idle;					// How long we go without a launch before shutting down, in ms.
+	int failures;				// How many have exited before they were ready, one after the other.
+} pool_settings;
+
+/** After this many interpreters exit before they're ready, we stop starting them. */
+#define POOL_MAX_FAILURES	3
+
+/** Our interpreters start the way any launch of ours would, but without a pool or relay of their own. */
+static void pool_prepare_env()
+{
+	SetEnvironmentVariableW(L"CYGLAUNCH_POOL", NULL);
+	SetEnvironmentVariableW(L"CYGLAUNCH_RELAY", NULL);
+	SetEnvironmentVariableW(L"CYGLAUNCH_HANDOFF", L"detach");
+}
+#endif
@@ -48,7 +48,7 @@
 
 // MSVC's C compiler doesn't support the inline
 // keyword.
-#ifndef __cplusplus
+#if defined(_MSC_VER) && !defined(__cplusplus)
 //	To be safe..
 #	ifdef inline
 #		undef inline
@@ -78,7 +78,15 @@
 #define NTDDI_VERSION 0x05020000
 
 // x64/x86 Stuff
-#if defined(_M_X64) || defined(_M_IA64)
+#if !defined(_WIN32)
+	// Not Windows at all - we're being built as a library, for benchmarking
+	// and the like, on top of the stand-ins in compat.h.
+#	define USE_CYGWIN
+#	define REG_SOFTWARE L"SOFTWARE"
+#	ifndef NO_MSGBOX
+#		define NO_MSGBOX
+#	endif
+#elif defined(_M_X64) || defined(_M_IA64)
 #	pragma message("WARNING: Compiling a non-X86 version of this app removes the ability to use Cygwin to convert paths. This is not recommended.")
 #	ifndef _WIN64
 #		define _WIN64
@@ -103,12 +111,17 @@
 #endif
 
 /* Our includes */
-#include <windows.h>
-#include <strsafe.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <process.h>
-#include <io.h>
+#ifdef _WIN32
+#	include <windows.h>
+#	include <winioctl.h>
+#	include <strsafe.h>
+#	include <stdlib.h>
+#	include <stdio.h>
+#	include <process.h>
+#	include <io.h>
+#else
+#	include "compat.h"
+#endif
 
 /* Pretty-ify heavily-used constants */
 #ifndef MAX_ENV
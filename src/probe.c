@@ -0,0 +1,363 @@
+/**
+ * probe.c - Works out whether a path is a symbolic link, and where it
+ *           points, touching the filesystem as little as possible.
+ *
+ * Cygwin has made symlinks in a few different ways over the years,
+ * depending on its version and the winsymlinks setting:
+ *
+ *   - System-flagged files starting with "!<symlink>", followed by a
+ *     \xff\xfe BOM and a UTF-16 target. (The default)
+ *   - The same thing, but with a UTF-8 target and no BOM. (Older versions)
+ *   - Read-only Windows shortcuts, named "<link>.lnk", with the POSIX
+ *     target in the shortcut's description. (winsymlinks:lnk)
+ *   - NTFS symlinks, WSL symlinks and junctions. (winsymlinks:native)
+ *
+ * probe_path gets the attributes of a path once, and then reads at most
+ * PROBE_READ_MAX bytes from it, so probing a huge system-flagged file costs
+ * the same as probing a tiny one.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** The most we'll ever read from a file while probing it. */
+#define PROBE_READ_MAX		4096
+
+/** What probe_path found. */
+#define PROBE_MISSING		0
+#define PROBE_FOLDER		1
+#define PROBE_FILE			2
+#define PROBE_LINK			3
+
+/** Symlink flavours. */
+#define LINK_NONE			0
+#define LINK_CYG_UTF16		1 // !<symlink>\xff\xfe + UTF-16 target
+#define LINK_CYG_UTF8		2 // !<symlink> + UTF-8 target
+#define LINK_SHORTCUT		3 // .lnk shortcut
+#define LINK_NTFS			4 // IO_REPARSE_TAG_SYMLINK
+#define LINK_JUNCTION		5 // IO_REPARSE_TAG_MOUNT_POINT
+#define LINK_WSL			6 // IO_REPARSE_TAG_LX_SYMLINK
+
+typedef struct {
+	int kind;
+	int flavour;
+	dword attrs;
+	ULARGE_INTEGER size;
+	// Whether target is a POSIX path (Cygwin's own links) or a Windows one. (native links)
+	bool posix;
+	wchar_t target[MAX_PATH+1];
+} probe_result;
+
+/** The cygwin symlink header. */
+static const byte cyglink_sig[] = { '!', '<', 's', 'y', 'm', 'l', 'i', 'n', 'k', '>' };
+static const word dummy_val = 0xfeff;
+
+typedef struct _cyglink {
+	byte tag[10];					// !<symlink>
+	word dummy;						// Still not sure what these two bytes actually stand for.
+									// Regardless, they seem to always contain \xff\xfe
+	word target[ANYSIZE_ARRAY];		// And lastly, our target as a UTF-16 string.
+} cyglink, *pcyglink;
+
+/** The fixed part of a .lnk file. See [MS-SHLLINK] 2.1 */
+#pragma pack(push, 1)
+typedef struct {
+	dword size;						// Always 0x4C
+	byte clsid[16];					// 00021401-0000-0000-C000-000000000046
+	dword flags;
+	dword attrs;
+	FILETIME created, accessed, written;
+	dword fileSize;
+	dword iconIndex;
+	dword showCommand;
+	word hotKey;
+	byte reserved[10];
+} shortcut_hdr;
+#pragma pack(pop)
+
+static const byte shortcut_clsid[] = {
+	0x01, 0x14, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46
+};
+
+#define SHORTCUT_IDLIST		0x001
+#define SHORTCUT_LINKINFO	0x002
+#define SHORTCUT_NAME		0x004
+#define SHORTCUT_RELPATH	0x008
+#define SHORTCUT_UNICODE	0x080
+
+/**
+ * Reparse point data, as returned by FSCTL_GET_REPARSE_POINT. This lives
+ * in the DDK headers, so we declare the bits we need ourselves.
+ */
+#ifndef IO_REPARSE_TAG_SYMLINK
+#	define IO_REPARSE_TAG_SYMLINK		0xA000000CL
+#endif
+#ifndef IO_REPARSE_TAG_MOUNT_POINT
+#	define IO_REPARSE_TAG_MOUNT_POINT	0xA0000003L
+#endif
+#ifndef IO_REPARSE_TAG_LX_SYMLINK
+#	define IO_REPARSE_TAG_LX_SYMLINK	0xA000001DL
+#endif
+#define REPARSE_MAX_SIZE		(16 * 1024)
+#define SYMLINK_FLAG_RELATIVE	0x001
+
+typedef struct {
+	ULONG tag;
+	word length;
+	word reserved;
+	union {
+		struct {
+			word substOffset, substLength;
+			word printOffset, printLength;
+			ULONG flags;
+			word buffer[ANYSIZE_ARRAY];
+		} symlink;
+		struct {
+			word substOffset, substLength;
+			word printOffset, printLength;
+			word buffer[ANYSIZE_ARRAY];
+		} junction;
+		struct {
+			ULONG version;
+			char target[ANYSIZE_ARRAY];
+		} wsl;
+	} u;
+} reparse_data;
+
+/**
+ * Copy a counted UTF-16 string into our result, truncating at the first
+ * NUL. On-disk strings are always UTF-16, whatever size our wchar_t is.
+ */
+static bool probe_set_wide(probe_result* probe, const word* src, size_t count)
+{
+	size_t i, n = 0;
+	for(i = 0; i < count && src[i]; i++) {
+		if(n == MAX_PATH) return false;
+		#if WCHAR_MAX > 0xFFFF
+		// Surrogate pairs become a single character.
+		if(src[i] >= 0xD800 && src[i] < 0xDC00 && i + 1 < count && src[i+1] >= 0xDC00 && src[i+1] < 0xE000) {
+			probe->target[n++] = (wchar_t)(0x10000 + ((src[i] - 0xD800) << 10) + (src[i+1] - 0xDC00));
+			i++;
+			continue;
+		}
+		#endif
+		probe->target[n++] = (wchar_t)src[i];
+	}
+	if(n == 0) return false;
+	probe->target[n] = L'\0';
+	return true;
+}
+
+/** Same as above, but for UTF-8 (or ANSI, for old shortcuts) strings. */
+static bool probe_set_narrow(probe_result* probe, const char* src, size_t count, unsigned int codepage)
+{
+	size_t i, n;
+	for(i = 0; i < count && src[i]; i++);
+	if(i == 0) return false;
+	if(codepage == CP_UTF8) {
+		if((n = utf8_decode(src, i, probe->target, MAX_PATH)) == UTF_INVALID) return false;
+	} else if(!(n = (size_t)MultiByteToWideChar(codepage, 0, src, (int)i, probe->target, MAX_PATH))) {
+		return false;
+	}
+	probe->target[n] = L'\0';
+	return true;
+}
+
+/** Decode the !<symlink> flavours. */
+static bool probe_cyglink(probe_result* probe, byte* buffer, size_t szbuf)
+{
+	pcyglink slink = (pcyglink)buffer;
+	if(szbuf <= sizeof(cyglink_sig)) return false;
+	if(memcmp(slink->tag, cyglink_sig, sizeof(cyglink_sig)) != 0) return false;
+
+	if(szbuf >= sizeof(cyglink) && slink->dummy == dummy_val) {
+		probe->flavour = LINK_CYG_UTF16;
+		return probe_set_wide(probe, slink->target, (szbuf - FIELD_OFFSET(cyglink, target)) / sizeof(word));
+	}
+
+	probe->flavour = LINK_CYG_UTF8;
+	return probe_set_narrow(probe, (const char*)&(buffer[sizeof(cyglink_sig)]), szbuf - sizeof(cyglink_sig), CP_UTF8);
+}
+
+/**
+ * Decode a shortcut created by Cygwin. The POSIX target is kept in the
+ * shortcut's description, and the Windows one in its relative path.
+ */
+static bool probe_shortcut(probe_result* probe, byte* buffer, size_t szbuf)
+{
+	shortcut_hdr* hdr = (shortcut_hdr*)buffer;
+	size_t pos = sizeof(shortcut_hdr), count;
+	int i;
+
+	if(szbuf < sizeof(shortcut_hdr) + 2) return false;
+	if(hdr->size != sizeof(shortcut_hdr) || memcmp(hdr->clsid, shortcut_clsid, 16) != 0) return false;
+	if(!(hdr->flags & (SHORTCUT_NAME | SHORTCUT_RELPATH))) return false;
+
+	// Skip the item id list, and the link info.
+	if(hdr->flags & SHORTCUT_IDLIST) {
+		if(pos + 2 > szbuf) return false;
+		pos += 2 + *(word*)&(buffer[pos]);
+	}
+	if(hdr->flags & SHORTCUT_LINKINFO) {
+		if(pos + 4 > szbuf) return false;
+		pos += *(dword*)&(buffer[pos]);
+	}
+
+	// The description comes first in the string data, then the relative path.
+	for(i = 0; i < 2; i++) {
+		if(!(hdr->flags & (i == 0 ? SHORTCUT_NAME : SHORTCUT_RELPATH))) continue;
+		if(pos + 2 > szbuf) return false;
+		count = *(word*)&(buffer[pos]);
+		pos += 2;
+		if(hdr->flags & SHORTCUT_UNICODE) {
+			if(pos + count * sizeof(word) > szbuf) return false;
+			if(count && probe_set_wide(probe, (const word*)&(buffer[pos]), count)) break;
+			pos += count * sizeof(word);
+		} else {
+			if(pos + count > szbuf) return false;
+			if(count && probe_set_narrow(probe, (const char*)&(buffer[pos]), count, CP_ACP)) break;
+			pos += count;
+		}
+	}
+	if(i == 2) return false;
+
+	probe->flavour = LINK_SHORTCUT;
+	probe->posix = i == 0;
+	return true;
+}
+
+/** Decode a native reparse point. */
+static bool probe_reparse(probe_result* probe, const wchar_t* path)
+{
+	byte buffer[REPARSE_MAX_SIZE];
+	reparse_data* data = (reparse_data*)buffer;
+	const word* name;
+	word offset, length;
+	dword szread = 0;
+	HANDLE hFile;
+	bool result = false;
+
+	hFile = CreateFileW(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if(hFile == INVALID_HANDLE_VALUE) return false;
+	if(!DeviceIoControl(hFile, FSCTL_GET_REPARSE_POINT, NULL, 0, buffer, REPARSE_MAX_SIZE, &szread, NULL)) {
+		CloseHandle(hFile);
+		return false;
+	}
+	CloseHandle(hFile);
+
+	switch(data->tag) {
+		case IO_REPARSE_TAG_SYMLINK:
+		case IO_REPARSE_TAG_MOUNT_POINT:
+			if(data->tag == IO_REPARSE_TAG_SYMLINK) {
+				probe->flavour = LINK_NTFS;
+				name = data->u.symlink.buffer;
+				offset = data->u.symlink.printOffset;
+				length = data->u.symlink.printLength;
+				if(!length) {
+					offset = data->u.symlink.substOffset;
+					length = data->u.symlink.substLength;
+				}
+			} else {
+				probe->flavour = LINK_JUNCTION;
+				name = data->u.junction.buffer;
+				offset = data->u.junction.printOffset;
+				length = data->u.junction.printLength;
+				if(!length) {
+					offset = data->u.junction.substOffset;
+					length = data->u.junction.substLength;
+				}
+			}
+			if((byte*)name + offset + length > buffer + szread) break;
+			name = (const word*)((byte*)name + offset);
+			length /= sizeof(word);
+			// Substitute names are NT paths. (\??\C:\...)
+			if(length > 4 && name[0] == L'\\' && name[1] == L'?' && name[2] == L'?' && name[3] == L'\\') {
+				name += 4;
+				length -= 4;
+			}
+			result = probe_set_wide(probe, name, length);
+			break;
+		case IO_REPARSE_TAG_LX_SYMLINK:
+			// Version (always 2) followed by a UTF-8 POSIX target.
+			if(data->length <= sizeof(ULONG)) break;
+			probe->flavour = LINK_WSL;
+			probe->posix = true;
+			result = probe_set_narrow(probe, data->u.wsl.target, data->length - sizeof(ULONG), CP_UTF8);
+			break;
+	}
+	return result;
+}
+
+/** Read at most PROBE_READ_MAX bytes from the start of a file. */
+static size_t probe_read(const wchar_t* path, byte* buffer)
+{
+	dword szread = 0;
+	HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(hFile == INVALID_HANDLE_VALUE) return 0;
+	if(!ReadFile(hFile, buffer, PROBE_READ_MAX, &szread, NULL)) szread = 0;
+	CloseHandle(hFile);
+	return (size_t)szread;
+}
+
+/** Whether path ends with a .lnk extension. */
+static inline bool has_lnk_ext(const wchar_t* path, size_t szpath)
+{
+	return szpath > 4 && _wcsicmp(&(path[szpath - 4]), L".lnk") == 0;
+}
+
+/**
+ * Probe path. Fills in probe and returns true if path exists. If it's a
+ * symlink of any flavour, probe->kind will be PROBE_LINK and probe->target
+ * its target.
+ */
+static bool probe_path(const wchar_t* path, probe_result* probe)
+{
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	wchar_t sShortcut[MAX_PATH+1];
+	byte buffer[PROBE_READ_MAX];
+	size_t szpath = wcslen(path), szbuf;
+
+	ZeroMemory(probe, sizeof(probe_result) - sizeof(probe->target));
+	probe->target[0] = L'\0';
+	probe->posix = true;
+
+	if(!GetFileAttributesExW(path, GetFileExInfoStandard, &info)) {
+		// Cygwin looks for <path>.lnk when <path> doesn't exist.
+		if(has_lnk_ext(path, szpath) || szpath + 4 > MAX_PATH) return false;
+		memcpy(sShortcut, path, szpath * sizeof(wchar_t));
+		wcscpy(&(sShortcut[szpath]), L".lnk");
+		if(!GetFileAttributesExW(sShortcut, GetFileExInfoStandard, &info)) return false;
+		path = sShortcut;
+		szpath += 4;
+	}
+
+	probe->attrs = info.dwFileAttributes;
+	probe->size.u.LowPart = info.nFileSizeLow;
+	probe->size.u.HighPart = info.nFileSizeHigh;
+	probe->kind = (probe->attrs & FILE_ATTRIBUTE_DIRECTORY) ? PROBE_FOLDER : PROBE_FILE;
+
+	if(probe->attrs & FILE_ATTRIBUTE_REPARSE_POINT) {
+		if(probe_reparse(probe, path)) {
+			probe->kind = PROBE_LINK;
+			probe->posix = probe->flavour == LINK_WSL;
+		}
+		return true;
+	}
+
+	if(probe->kind == PROBE_FOLDER) return true;
+
+	if(probe->attrs & FILE_ATTRIBUTE_SYSTEM) {
+		// Too small to even hold the header? Then don't bother opening it.
+		if(probe->size.QuadPart <= sizeof(cyglink_sig)) return true;
+		szbuf = probe_read(path, buffer);
+		if(probe_cyglink(probe, buffer, szbuf)) probe->kind = PROBE_LINK;
+	} else if((probe->attrs & FILE_ATTRIBUTE_READONLY) && has_lnk_ext(path, szpath)) {
+		if(probe->size.QuadPart < sizeof(shortcut_hdr)) return true;
+		szbuf = probe_read(path, buffer);
+		if(probe_shortcut(probe, buffer, szbuf)) probe->kind = PROBE_LINK;
+	}
+	return true;
+}
@@ -0,0 +1,200 @@
+/**
+ * relay.c - Passes our interpreter's stdout and stderr along, with the
+ *           POSIX paths in them turned back into Windows ones.
+ *
+ * Tracebacks and test failures from a Cygwin interpreter name their files
+ * /cygdrive/c/.. or /home/.., which Windows IDEs and CI log parsers can't
+ * open. With CYGLAUNCH_RELAY=1, whichever of our stdout and stderr isn't a
+ * console (so, whatever's being captured) is handed to our interpreter as
+ * a pipe instead, and what comes out of that goes through relay_feed on
+ * its way to the real thing. (See os_handoff)
+ *
+ * A path is a word starting with a /, up to the next space, quote, colon
+ * (so file.py:12 keeps its line number) or bracket, that our mount table
+ * can convert. Anything else is written straight out of the buffer it was
+ * read into, so output without any paths in it is passed along without
+ * being copied. Everything up to the last complete path goes out as soon
+ * as it's read. A path cut off by the end of a read is held back until
+ * the rest of it turns up, or for RELAY_LATENCY at most.
+ *
+ * Needs our mount table, so it's left out by WITHOUT_MOUNTS, as well as
+ * by WITHOUT_RELAY.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** How much we read at once. */
+#define RELAY_BUFFER	65536
+
+/** The longest path we'll hold back (or convert). Anything longer goes along as it is. */
+#define RELAY_MAX_PATH	1024
+
+/** How long a path cut off by the end of a read is held back for, in ms. */
+#define RELAY_LATENCY	20
+
+/** How long we keep passing output along once our interpreter has exited, (for anything it left running) in ms. */
+#define RELAY_DRAIN		1000
+
+/** Where our output goes. Returns false if it couldn't all be written. */
+typedef bool (*relay_sink)(void* context, const char* data, size_t count);
+
+typedef struct {
+	const mount_table* mt;
+	relay_sink sink;
+	void* context;
+	size_t held;		// Bytes at the start of buffer, held back from the last read.
+	bool boundary;		// Whether a path can start right after the last byte we passed along.
+	bool failed;		// Our sink has failed, so everything's thrown away from here on.
+	char buffer[RELAY_BUFFER];
+} relay_stream;
+
+static void relay_init(relay_stream* rs, const mount_table* mt, relay_sink sink, void* context)
+{
+	rs->mt = mt;
+	rs->sink = sink;
+	rs->context = context;
+	rs->held = 0;
+	rs->boundary = true;
+	rs->failed = false;
+}
+
+/** Whether a path can start right after c. */
+static inline bool relay_is_lead(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '"' || c == '\'' || c == '`' ||
+		c == '(' || c == '[' || c == '<' || c == '=' || c == ',';
+}
+
+/** Whether a path can start with a / followed by c. (// is a UNC path, and never ours to convert) */
+static inline bool relay_is_start(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		c == '_' || c == '.' || c == '~' || (c & 0x80);
+}
+
+/** Whether c ends a path. */
+static inline bool relay_is_end(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '"' || c == '\'' || c == '`' ||
+		c == ':' || c == ';' || c == ',' || c == '(' || c == ')' || c == '[' || c == ']' ||
+		c == '<' || c == '>' || c == '|' || c == '\0';
+}
+
+static inline void relay_write(relay_stream* rs, const char* data, size_t count)
+{
+	if(count && !rs->failed && !rs->sink(rs->context, data, count)) rs->failed = true;
+}
+
+/**
+ * Converts count bytes of path into out, (in UTF-8, like it came in)
+ * returning its length, or 0 if it isn't one of ours. Anything that
+ * doesn't come back as a Windows path that fits is passed through as it
+ * was - our interpreter's output is no reason to take our launch down.
+ */
+static size_t relay_convert(relay_stream* rs, const char* path, size_t count, char* out, size_t szout)
+{
+	wchar_t wide[RELAY_MAX_PATH+1], converted[2 * RELAY_MAX_PATH];
+	size_t n;
+
+	if(!count || count > RELAY_MAX_PATH) return 0;
+	if((n = utf8_decode(path, count, wide, RELAY_MAX_PATH)) == UTF_INVALID) return 0;
+	wide[n] = L'\0';
+	if(!(n = mount_posix_to_win(rs->mt, wide, NULL, converted, 2 * RELAY_MAX_PATH)) || n >= 2 * RELAY_MAX_PATH) return 0;
+	if(!(mount_is_drive(converted) && mount_is_sep(converted[2])) && !(mount_is_sep(converted[0]) && mount_is_sep(converted[1]))) {
+		return 0;
+	}
+	return (n = utf8_encode(converted, n, out, szout)) == UTF_INVALID ? 0 : n;
+}
+
+/**
+ * Passes the first count bytes of our buffer along, converting the paths
+ * in them. Unless final is set, a path running into the end is moved to
+ * the start of our buffer and held back, rather than converted.
+ */
+static void relay_scan(relay_stream* rs, size_t count, bool final)
+{
+	char *end = rs->buffer + count, *from = rs->buffer, *p = rs->buffer, *stop, *last, *held = NULL;
+	char converted[UTF8_MAX(2 * RELAY_MAX_PATH)];
+	size_t n;
+
+	while(p < end && (p = (char*)memchr(p, '/', (size_t)(end - p)))) {
+		if(!(p == rs->buffer ? rs->boundary : relay_is_lead(p[-1]))) {
+			p++;
+			continue;
+		}
+		if(p + 1 == end) {
+			if(!final) held = p;
+			break;
+		}
+		if(!relay_is_start(p[1])) {
+			p++;
+			continue;
+		}
+		for(stop = p + 1; stop < end && !relay_is_end(*stop); stop++);
+		if(stop == end && !final && stop - p <= RELAY_MAX_PATH) {
+			held = p;
+			break;
+		}
+
+		// Full stops are more likely the end of a sentence than of a path.
+		for(last = stop; last > p + 2 && last[-1] == '.'; last--);
+		if(last - p <= RELAY_MAX_PATH && (n = relay_convert(rs, p, (size_t)(last - p), converted, sizeof(converted)))) {
+			relay_write(rs, from, (size_t)(p - from));
+			relay_write(rs, converted, n);
+			from = last;
+		}
+		p = stop;
+	}
+
+	if(held) {
+		relay_write(rs, from, (size_t)(held - from));
+		rs->held = (size_t)(end - held);
+		memmove(rs->buffer, held, rs->held);
+		rs->boundary = true;
+	} else {
+		relay_write(rs, from, (size_t)(end - from));
+		rs->held = 0;
+		if(count) rs->boundary = relay_is_lead(end[-1]);
+	}
+}
+
+/** Where the next read should go, and how much room there is. */
+static inline char* relay_space(relay_stream* rs, size_t* room)
+{
+	*room = RELAY_BUFFER - rs->held;
+	return &(rs->buffer[rs->held]);
+}
+
+/** Passes along count bytes just read into relay_space. */
+static inline void relay_feed(relay_stream* rs, size_t count)
+{
+	relay_scan(rs, rs->held + count, false);
+}
+
+/** Passes along whatever's being held back, at the end of our output or once RELAY_LATENCY is up. */
+static inline void relay_flush(relay_stream* rs)
+{
+	if(rs->held) relay_scan(rs, rs->held, true);
+}
+
+#define relay_holding(rs) ((rs)->held != 0)
+
+/**
+ * A copy of our mount table that outlives our arena, if CYGLAUNCH_RELAY
+ * asks for our output to be relayed, or NULL. Loads the table, if nothing
+ * else has needed it yet.
+ */
+static mount_table* relay_prepare()
+{
+	wchar_t sValue[16] = EMPTYW;
+	mount_table* mt;
+
+	if(!GetEnvironmentVariableW(L"CYGLAUNCH_RELAY", sValue, 16) || wcscmp(sValue, L"1") != 0) return NULL;
+	if(!mounts && !load_mount_table()) return NULL;
+	if(!(mt = (mount_table*)malloc(sizeof(mount_table)))) fatal_api_call(L"relay_prepare");
+	mount_table_copy(mt, mounts);
+	verbose(L"Relaying our interpreter's output..");
+	return mt;
+}
@@ -0,0 +1,276 @@
+/**
+ * resolver.c - Has a resolver that's kept cygwin1.dll loaded convert the
+ *              paths our mount table can't, rather than loading it
+ *              ourselves. (See tools\resolver.c, which runs one)
+ *
+ * Loading cygwin1.dll and running cygwin_dll_init costs a launch more than
+ * everything else it does put together, and a launch that needs it at all
+ * usually only needs it for a handful of paths. A resolver is a service,
+ * one per user and Cygwin install, that's done all of that once and
+ * converts whatever its launchers send it. Once our mount table's had its
+ * go, batch_run sends everything that's left to it in one request, and only
+ * loads cygwin1.dll for whatever the resolver doesn't answer. What the
+ * resolver can't convert fails the same way it would have in cygwin1.dll.
+ *
+ * If there's no resolver, (and if it's busy, we only give it
+ * RESOLVER_CONNECT_TIMEOUT to take our connection) or it doesn't answer,
+ * we load cygwin1.dll as usual and don't try the resolver again. Relative
+ * paths depend on our cwd, which the resolver doesn't share, so those
+ * never go to it. CYGLAUNCH_RESOLVER=0 turns it off.
+ *
+ * Our environment's paths go through the same batch as our arguments, so
+ * they're answered in the same request. Symlinks are read by probe.c,
+ * which doesn't need cygwin1.dll, so there's nothing to ask about those.
+ *
+ * Requests are a resolver_header, then for each path, a byte of flags and
+ * the path, as a UTF-8 string. Replies are a resolver_header, then for
+ * each path, a status byte, (0, or the errno it failed with) and if that's
+ * 0, the result, as a UTF-8 string. A connection takes any number of
+ * requests. On Windows, a resolver is a named pipe only its owner can
+ * write to, but anyone can make one with its name first, so we only talk
+ * to a resolver that runs as us. (Which Windows XP can't tell us, so
+ * there, we always load cygwin1.dll ourselves) On POSIX hosts, (where it
+ * converts with the stand-ins in compat.h, to benchmark it) a UNIX socket
+ * in a folder only its owner can get at.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+#define RESOLVER_MAGIC		0x766c7372L // "rslv"
+
+/** The most a request or reply can be. */
+#define RESOLVER_MAX_SIZE	(4 * 1024 * 1024)
+
+/** How long we wait for a busy resolver to take our connection, and then for its replies, in ms. */
+#define RESOLVER_CONNECT_TIMEOUT	50
+#define RESOLVER_TIMEOUT			2000
+
+/** Request flags */
+#define RESOLVER_LIST		0x01 // A path list, rather than a path.
+
+/** What we fail a path with when cygwin1.dll didn't say why. (Its EINVAL) */
+#define RESOLVER_EINVAL		22
+
+typedef struct {
+	dword magic;
+	dword size;			// Of the whole request or reply.
+	dword count;		// How many paths are in it.
+	dword direction;	// MOUNT_WIN_TO_POSIX or MOUNT_POSIX_TO_WIN
+} resolver_header;
+
+/** Whether a request or reply that's come in looks like one of ours. */
+static inline bool resolver_valid(const resolver_header* header)
+{
+	return header->magic == RESOLVER_MAGIC && header->size >= sizeof(resolver_header) &&
+		header->size <= RESOLVER_MAX_SIZE && header->count <= header->size &&
+		(header->direction == MOUNT_WIN_TO_POSIX || header->direction == MOUNT_POSIX_TO_WIN);
+}
+
+/** Our resolver's name, once we've worked it out, and whether we've given up on it. */
+static wchar_t resolver_name[40] = EMPTYW;
+static bool resolver_unavailable = false;
+
+// Our platform layer's side of it. (See os_win32.c and os_posix.c)
+static char* os_resolver_call(const char* request);
+
+/** Case-insensitive FNV-1a of the first count characters of s, carried on from hash. */
+static dword resolver_hash(dword hash, const wchar_t* s, size_t count)
+{
+	while(count--) {
+		hash ^= (dword)towlower(*(s++));
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * Names our resolver after our Cygwin root and user: cyglaunch-resolver-X,
+ * where X is a hash of both. The resolver works its name out the same way.
+ * Returns false if we don't know our root.
+ */
+static bool resolver_init()
+{
+	wchar_t sUser[256] = EMPTYW;
+	size_t szroot;
+	dword hash;
+
+	if(!cygRootWin || !(szroot = wcslen(cygRootWin))) return false;
+	while(szroot > 3 && mount_is_sep(cygRootWin[szroot - 1])) szroot--;
+	hash = resolver_hash(2166136261UL, cygRootWin, szroot);
+	if(GetEnvironmentVariableW(L"USERNAME", sUser, 256) < 256) hash = resolver_hash(hash, sUser, wcslen(sUser));
+	return SUCCEEDED(StringCchPrintfW(resolver_name, 40, L"cyglaunch-resolver-%08x", (unsigned int)hash));
+}
+
+/**
+ * Appends a byte, and then s as UTF-8, (if it isn't NULL) to a request
+ * or reply, growing it if need be.
+ */
+static bool resolver_append(char** buffer, size_t* size, size_t* capacity, byte lead, const wchar_t* s)
+{
+	size_t szs = s ? simd_length(s) + 1 : 0, n = 0;
+	char* grown;
+
+	if(*size + 1 + UTF8_MAX(szs) > *capacity) {
+		*capacity = (*size + 1 + UTF8_MAX(szs)) * 2;
+		if(*size + 1 + UTF8_MAX(szs) > RESOLVER_MAX_SIZE || !(grown = (char*)realloc(*buffer, *capacity))) return false;
+		*buffer = grown;
+	}
+	if(s && (n = utf8_encode(s, szs, &((*buffer)[*size + 1]), *capacity - *size - 1)) == UTF_INVALID) return false;
+	(*buffer)[*size] = (char)lead;
+	*size += 1 + n;
+	return true;
+}
+
+/** Whether path, (or every path in a list) means the same thing whatever our cwd is. */
+static bool resolver_absolute(const wchar_t* path, bool islist, int direction)
+{
+	const wchar_t* p = path;
+	while(true) {
+		if(direction == MOUNT_POSIX_TO_WIN ? p[0] != L'/' :
+			!(mount_is_drive(p) && mount_is_sep(p[2])) && !(mount_is_sep(p[0]) && mount_is_sep(p[1]))) {
+			return false;
+		}
+		if(!islist || !(p = wcschr(p, direction == MOUNT_POSIX_TO_WIN ? L':' : L';'))) return true;
+		p++;
+	}
+}
+
+/**
+ * Sends whatever batch_run's left for cygwin1.dll to our resolver, if we
+ * have one. Anything it answers is done or failed, and anything it
+ * doesn't is left for cygwin1.dll.
+ */
+static void resolver_run(path_batch* batch)
+{
+	wchar_t sValue[4] = EMPTYW;
+	resolver_header* header;
+	batch_entry* entry;
+	size_t size = sizeof(resolver_header), capacity = 4096, szto, szconv;
+	char *request, *reply = NULL, *p, *end, *nul;
+	int *slots, count = 0, answered = 0, i;
+
+	if(resolver_unavailable) return;
+	if(!*resolver_name &&
+		((GetEnvironmentVariableW(L"CYGLAUNCH_RESOLVER", sValue, 4) && wcscmp(sValue, L"0") == 0) || !resolver_init())) {
+		resolver_unavailable = true;
+		return;
+	}
+
+	if(!(request = (char*)malloc(capacity)) || !(slots = (int*)malloc(batch->count * sizeof(int)))) {
+		free(request);
+		return;
+	}
+	for(i = 0; i < batch->count; i++) {
+		entry = &(batch->entries[i]);
+		if(entry->status != BATCH_DEFERRED || !resolver_absolute(&(batch->block[entry->from]), entry->islist, batch->direction)) {
+			continue;
+		}
+		// Whatever doesn't fit is still cygwin1.dll's.
+		if(!resolver_append(&request, &size, &capacity, entry->islist ? RESOLVER_LIST : 0, &(batch->block[entry->from]))) break;
+		slots[count++] = i;
+	}
+	if(!count) {
+		free(request);
+		free(slots);
+		return;
+	}
+	header = (resolver_header*)request;
+	header->magic = RESOLVER_MAGIC;
+	header->size = (dword)size;
+	header->count = (dword)count;
+	header->direction = (dword)batch->direction;
+
+	trace_begin_n(L"resolver", count);
+	reply = os_resolver_call(request);
+	free(request);
+	if(reply && ((resolver_header*)reply)->count == (dword)count && ((resolver_header*)reply)->direction == (dword)batch->direction) {
+		p = reply + sizeof(resolver_header);
+		end = reply + ((resolver_header*)reply)->size;
+		for(; answered < count && p < end; answered++) {
+			entry = &(batch->entries[slots[answered]]);
+			if(*p) {
+				entry->error = (int)(byte)*(p++);
+				entry->status = BATCH_FAILED;
+			} else {
+				// Widen the result straight into our block, which needs no more units than it has bytes.
+				p++;
+				if(!(nul = (char*)memchr(p, '\0', (size_t)(end - p)))) break;
+				szto = (size_t)(nul - p) + 1;
+				batch_reserve(batch, szto);
+				if((szconv = utf8_decode(p, szto, &(batch->block[batch->used]), szto)) == UTF_INVALID) break;
+				entry->to = batch->used;
+				entry->status = BATCH_DONE;
+				batch->used += szconv;
+				p = nul + 1;
+			}
+			flight(FLIGHT_CONVERT, slots[answered], entry->status == BATCH_FAILED ? entry->error : 0, NULL);
+		}
+	}
+	trace_end(L"resolver");
+	flight(FLIGHT_RESOLVER, count, answered, NULL);
+	if(answered < count) {
+		verbose(L"No answer from our resolver for %d path(s). Loading cygwin1.dll..", count - answered);
+		resolver_unavailable = true;
+	}
+	free(reply);
+	free(slots);
+}
+
+#ifdef RESOLVER_SERVICE
+/**
+ * Answers a request with cygwin1.dll, which has to be loaded already.
+ * Returns the reply, on the heap, or NULL if the request doesn't hold up.
+ * Everything else it needs comes out of our arena, and goes back to it,
+ * so only one thread can be answering at a time.
+ */
+static char* resolver_answer(const char* request)
+{
+	const resolver_header* header = (const resolver_header*)request;
+	const char *p = request + sizeof(resolver_header), *end = request + header->size, *nul;
+	size_t size = sizeof(resolver_header), capacity = 4096, szfrom;
+	resolver_header* out;
+	path_batch batch;
+	batch_entry* entry;
+	char* reply = NULL;
+	wchar_t* from;
+	bool ok = true;
+	dword i;
+	int error;
+
+	batch_init(&batch, (int)header->direction);
+	for(i = 0; ok && i < header->count; i++) {
+		ok = p < end && (nul = (const char*)memchr(p + 1, '\0', (size_t)(end - p - 1))) != NULL;
+		if(!ok) break;
+		szfrom = (size_t)(nul - p);
+		from = walloc(szfrom);
+		if((ok = utf8_decode(p + 1, szfrom, from, szfrom) != UTF_INVALID)) batch_add(&batch, from, wcslen(from), (*p & RESOLVER_LIST) != 0);
+		p = nul + 1;
+	}
+
+	ok = ok && (reply = (char*)malloc(capacity)) != NULL;
+	for(i = 0; ok && i < header->count; i++) {
+		entry = &(batch.entries[i]);
+		if(batch_dll(&batch, entry)) {
+			ok = resolver_append(&reply, &size, &capacity, 0, &(batch.block[entry->to]));
+		} else {
+			// Whatever it was, it has to fit in a byte, and can't look like success.
+			error = entry->error > 0 && entry->error <= 0xff ? entry->error : RESOLVER_EINVAL;
+			ok = resolver_append(&reply, &size, &capacity, (byte)error, NULL);
+		}
+	}
+	batch_free(&batch);
+	arena_release();
+	if(!ok) {
+		free(reply);
+		return NULL;
+	}
+	out = (resolver_header*)reply;
+	out->magic = RESOLVER_MAGIC;
+	out->size = (dword)size;
+	out->count = header->count;
+	out->direction = header->direction;
+	return reply;
+}
+#endif
@@ -0,0 +1,202 @@
+/**
+ * shebang.c - Starts bin\ scripts through their interpreter ourselves.
+ *
+ * pip's console scripts (bin\pip, bin\easy_install, ..) are text files
+ * starting with a #! line. Windows can't start those, and leaving them to
+ * cygwin1.dll costs an extra process, so we read the #! line ourselves,
+ * follow the interpreter's symlink chain with real_path, and start the
+ * interpreter with the script as its first argument, the same way
+ * cygwin1.dll (and Linux) would:
+ *
+ *   #!/usr/bin/python2.7 -E        /usr/bin/python2.7 -E <script> args..
+ *   #!/usr/bin/env python2.7       python2.7, looked up in PATH
+ *   #!/usr/bin/env -S python -E    the same, with the rest split on spaces
+ *
+ * Like cygwin1.dll, everything after the interpreter is passed as a single
+ * argument, unless env's -S asks for it to be split. Anything else env
+ * would have to do itself (options, NAME=value) means env gets started,
+ * with the script's arguments as they are.
+ *
+ * What we find is kept in our cache, whose entries are checked against
+ * the identity of the script and of each file in the interpreter's chain,
+ * and in the launch manifest. Only targets that don't end in .exe are
+ * ever read, so launching an interpreter directly costs nothing extra.
+ *
+ * Can be excluded by defining WITHOUT_SHEBANG.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** Separates the arguments in shebang_result.args. (A #! line can't contain one) */
+#define SHEBANG_SEP			L'\n'
+
+/** The most arguments env -S can split a #! line into. */
+#define SHEBANG_MAX_ARGS	16
+
+typedef struct {
+	const wchar_t* interp;		// Windows path of the interpreter, at the end of its symlink chain.
+	const wchar_t* interpCyg;	// The same, in POSIX format.
+	const wchar_t* args;		// What goes between the interpreter and the script, split by SHEBANG_SEP. Can be empty.
+} shebang_result;
+
+/** Whether path could be a script. Anything ending in .exe is taken at its word. */
+static inline bool shebang_candidate(const wchar_t* path)
+{
+	size_t szpath = wcslen(path);
+	return szpath <= 4 || _wcsicmp(&(path[szpath - 4]), L".exe") != 0;
+}
+
+/**
+ * Read the #! line at the top of path into line, which has to be
+ * MAX_PATH+1 long, without the #! or line ending. (UTF-8, like
+ * cygwin1.dll assumes)
+ */
+static bool shebang_read(const wchar_t* path, wchar_t* line)
+{
+	byte buffer[PROBE_READ_MAX];
+	size_t szbuf, szline, n;
+
+	if((szbuf = probe_read(path, buffer)) < 3 || buffer[0] != '#' || buffer[1] != '!') return false;
+	for(szline = 2; szline < szbuf && buffer[szline] != '\n'; szline++);
+	if(szline == szbuf) return false;
+	if(buffer[szline - 1] == '\r') szline--;
+	if(szline == 2) return false;
+	if((n = utf8_decode((const char*)&(buffer[2]), szline - 2, line, MAX_PATH)) == UTF_INVALID) return false;
+	line[n] = L'\0';
+	return true;
+}
+
+/** Look name up in our interpreter's PATH, which wmain has already set. */
+static wchar_t* shebang_search(const wchar_t* name)
+{
+	wchar_t *sPATH = walloc(MAX_ENV), *dir, *end, *result = walloc(MAX_PATH);
+	size_t szdir, szname = wcslen(name);
+
+	if(!GetEnvironmentVariableW(L"PATH", sPATH, MAX_ENV+1)) return NULL;
+	for(dir = sPATH; *dir; dir = *end ? end + 1 : end) {
+		if(!(end = wcschr(dir, L';'))) end = dir + wcslen(dir);
+		szdir = (size_t)(end - dir);
+		if(!szdir || szdir + szname + 5 > MAX_PATH) continue;
+		memcpy(result, dir, szdir * sizeof(wchar_t));
+		result[szdir] = L'\\';
+		memcpy(&(result[szdir + 1]), name, (szname + 1) * sizeof(wchar_t));
+		// cygwin1.dll tries the .exe too.
+		if(is_file(result)) return result;
+		wcscpy(&(result[szdir + 1 + szname]), L".exe");
+		if(is_file(result)) return result;
+	}
+	return NULL;
+}
+
+/**
+ * Work out what to start script with, if it has a #! line. Returns false
+ * if it doesn't, or if we can't start its interpreter ourselves, in which
+ * case script is launched as it always was.
+ */
+static bool shebang_resolve(const wchar_t* script, shebang_result* shebang)
+{
+	wchar_t line[MAX_PATH+1], canon[MAX_ENV+1], *interp, *arg, *end, *found, *p, *q;
+	bool trailing, split = false;
+	int nargs = 1;
+
+	ZeroMemory(shebang, sizeof(shebang_result));
+	if(!shebang_candidate(script) || !shebang_read(script, line)) return false;
+	verbose(L"Detected #! line..");
+	verbose_step(L"#!%s", line);
+
+	// The interpreter, then everything after it as one argument.
+	for(interp = line; *interp == L' ' || *interp == L'\t'; interp++);
+	for(arg = interp; *arg && *arg != L' ' && *arg != L'\t'; arg++);
+	if(*arg) *(arg++) = L'\0';
+	while(*arg == L' ' || *arg == L'\t') arg++;
+	for(end = arg + wcslen(arg); end > arg && (end[-1] == L' ' || end[-1] == L'\t'); end--) end[-1] = L'\0';
+	if(*interp != L'/') return false;
+
+	// env just looks its first argument up in PATH, which we can do ourselves.
+	if(wcscmp(wcsrchr(interp, L'/') + 1, L"env") == 0) {
+		p = arg;
+		if(p[0] == L'-' && p[1] == L'S' && (!p[2] || p[2] == L' ' || p[2] == L'\t')) {
+			for(p += 2; *p == L' ' || *p == L'\t'; p++);
+			split = true;
+		}
+		for(end = p; *end && *end != L' ' && *end != L'\t'; end++);
+		// Options and NAME=value are left to env.
+		if(*p && *p != L'-' && !wmemchr(p, L'=', end - p) && (split || !*end)) {
+			if(*end) *(end++) = L'\0';
+			while(*end == L' ' || *end == L'\t') end++;
+			if(*p == L'/') {
+				interp = p;
+			} else if(wcschr(p, L'/') || !(shebang->interp = shebang_search(p))) {
+				return false;
+			} else {
+				verbose(L"Found %s in PATH: %s", p, shebang->interp);
+			}
+			// What's left gets split on spaces.
+			for(arg = q = end; *end; end++) {
+				if(*end != L' ' && *end != L'\t') {
+					*(q++) = *end;
+				} else if(q[-1] != SHEBANG_SEP) {
+					*(q++) = SHEBANG_SEP;
+					if(++nargs > SHEBANG_MAX_ARGS) return false;
+				}
+			}
+			*q = L'\0';
+		}
+	}
+
+	if(!shebang->interp) {
+		if(!mount_canon_posix(interp, NULL, canon, MAX_ENV+1, &trailing) || !(found = fix_posix_path(canon))) {
+			return false;
+		}
+		shebang->interp = found;
+	}
+
+	// Same as our own target.
+	realPathCyg = NULL;
+	shebang->interp = real_path((wchar_t*)shebang->interp);
+	if(!(shebang->interpCyg = realPathCyg) && !(shebang->interpCyg = to_cyg_path((wchar_t*)shebang->interp))) {
+		return false;
+	}
+	if(!is_file((wchar_t*)shebang->interp) && (wcslen(shebang->interp) + 4 > MAX_PATH ||
+		!is_file(wcscat(wcscpy(canon, shebang->interp), L".exe")))) {
+		verbose(L"Did not find an interpreter at %s. Leaving it to cygwin..", shebang->interp);
+		return false;
+	}
+	// One level is all cygwin1.dll does, too.
+	if(shebang_candidate(shebang->interp) && shebang_read(shebang->interp, canon)) {
+		verbose(L"Interpreter is a script itself. Leaving it to cygwin..");
+		return false;
+	}
+	shebang->args = xwcsdup(arg);
+	verbose(L"Starting script through %s..", shebang->interpCyg);
+	return true;
+}
+
+/**
+ * Build the arguments for starting our script through its interpreter.
+ * argv[0] is the script, already in POSIX format. Updates argc.
+ */
+static wchar_t** shebang_argv(const shebang_result* shebang, int* argc, wchar_t** argv)
+{
+	wchar_t **result, *args, *p;
+	int nargs = 0, i;
+
+	// The arguments are copied, so they can be split in place.
+	args = xwcsdup(shebang->args ? shebang->args : EMPTYW);
+	if(*args) {
+		for(nargs = 1, p = args; *p; p++) if(*p == SHEBANG_SEP) nargs++;
+	}
+
+	result = waalloc(*argc + nargs + 1);
+	result[0] = xwcsdup(shebang->interpCyg);
+	for(i = 1, p = args; i <= nargs; i++) {
+		result[i] = p;
+		if((p = wcschr(p, SHEBANG_SEP))) *(p++) = L'\0';
+	}
+	for(i = 0; i < *argc; i++) result[nargs + 1 + i] = argv[i];
+	*argc += nargs + 1;
+	flight(FLIGHT_SHEBANG, nargs, 0, NULL);
+	return result;
+}
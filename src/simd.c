@@ -0,0 +1,372 @@
+/**
+ * simd.c - The loops every path conversion runs: finding a string's
+ *          length, finding the next separator, and copying a path while
+ *          flipping its separators around. Also the ASCII runs our UTF-8
+ *          transcoder (See util.c) copies across.
+ *
+ * Each has a plain C version, which is the reference the others have to
+ * agree with, (bench.c checks that they do) an SSE2 version, which every
+ * x86 CPU we run on has, and an AVX2 version for CPUs that report it. The
+ * fastest one the CPU (and OS) supports is picked the first time one's
+ * needed, and simd_use can pick a slower one for comparison.
+ *
+ * They all work on whole code units, whatever size wchar_t happens to be,
+ * so 8 (or 16, with AVX2) UTF-16 units go at once on Windows. Building
+ * with WITHOUT_SIMD, or for anything but x86, leaves just the plain ones.
+ *
+ * Like mounts.c, this only needs the standard C library (and the
+ * compiler's intrinsics), so it can be built by itself.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	include <stddef.h>
+#	include <wchar.h>
+#	ifndef bool
+#		define bool int
+#		define true 1
+#		define false 0
+#	endif
+#endif
+
+#ifndef WITHOUT_SIMD
+#	if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#		define SIMD_X86
+#	endif
+#endif
+
+#ifdef SIMD_X86
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#		define SIMD_AVX2_FN
+#	else
+#		include <cpuid.h>
+#		define SIMD_AVX2_FN __attribute__((target("avx2")))
+#	endif
+#	include <emmintrin.h>
+#	include <immintrin.h>
+#endif
+
+/** Kernel levels, slowest first. */
+#define SIMD_SCALAR	0
+#define SIMD_SSE2	1
+#define SIMD_AVX2	2
+
+typedef struct {
+	const wchar_t* name;
+	size_t (*length)(const wchar_t* s);
+	size_t (*find_sep)(const wchar_t* s, size_t n);
+	size_t (*find)(const wchar_t* s, size_t n, wchar_t c);
+	void (*flip)(wchar_t* out, const wchar_t* in, size_t n, wchar_t from, wchar_t to);
+	size_t (*widen)(wchar_t* out, const char* in, size_t n);
+	size_t (*narrow)(char* out, const wchar_t* in, size_t n);
+} simd_kernel;
+
+/* The reference versions. */
+static size_t simd_length_scalar(const wchar_t* s)
+{
+	const wchar_t* p = s;
+	while(*p) p++;
+	return (size_t)(p - s);
+}
+
+/** Index of the first / or \ in the first n units of s, or n. */
+static size_t simd_find_sep_scalar(const wchar_t* s, size_t n)
+{
+	size_t i;
+	for(i = 0; i < n && s[i] != L'/' && s[i] != L'\\'; i++);
+	return i;
+}
+
+/** Index of the first c in the first n units of s, or n. */
+static size_t simd_find_scalar(const wchar_t* s, size_t n, wchar_t c)
+{
+	size_t i;
+	for(i = 0; i < n && s[i] != c; i++);
+	return i;
+}
+
+/** Copies n units of in to out, with every from turned into a to. */
+static void simd_flip_scalar(wchar_t* out, const wchar_t* in, size_t n, wchar_t from, wchar_t to)
+{
+	size_t i;
+	for(i = 0; i < n; i++) out[i] = in[i] == from ? to : in[i];
+}
+
+/** Widens the ASCII at the start of n bytes of in into out. Returns how many bytes that was. */
+static size_t simd_widen_scalar(wchar_t* out, const char* in, size_t n)
+{
+	size_t i;
+	for(i = 0; i < n && !(in[i] & 0x80); i++) out[i] = (wchar_t)in[i];
+	return i;
+}
+
+/** Narrows the ASCII at the start of n units of in into out. Returns how many units that was. */
+static size_t simd_narrow_scalar(char* out, const wchar_t* in, size_t n)
+{
+	size_t i;
+	for(i = 0; i < n && (unsigned long)in[i] < 0x80; i++) out[i] = (char)in[i];
+	return i;
+}
+
+#ifdef SIMD_X86
+/** Code units in a 16 byte register, and how to compare them. */
+#define SIMD_UNITS (16 / sizeof(wchar_t))
+#if WCHAR_MAX > 0xFFFF
+#	define simd_set1(c)			_mm_set1_epi32((int)(c))
+#	define simd_cmpeq(a, b)		_mm_cmpeq_epi32(a, b)
+#	define simd_set1_256(c)		_mm256_set1_epi32((int)(c))
+#	define simd_cmpeq_256(a, b)	_mm256_cmpeq_epi32(a, b)
+#else
+#	define simd_set1(c)			_mm_set1_epi16((short)(c))
+#	define simd_cmpeq(a, b)		_mm_cmpeq_epi16(a, b)
+#	define simd_set1_256(c)		_mm256_set1_epi16((short)(c))
+#	define simd_cmpeq_256(a, b)	_mm256_cmpeq_epi16(a, b)
+#endif
+
+/** Which unit the lowest set bit of a movemask result belongs to. */
+static inline size_t simd_first(unsigned int mask)
+{
+	#ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanForward(&bit, mask);
+	return (size_t)bit / sizeof(wchar_t);
+	#else
+	return (size_t)__builtin_ctz(mask) / sizeof(wchar_t);
+	#endif
+}
+
+/**
+ * Aligned loads never cross into a page we can't read, so they can look
+ * past the terminator. Everything before the first aligned one is done a
+ * unit at a time.
+ */
+static size_t simd_length_sse2(const wchar_t* s)
+{
+	const wchar_t* p = s;
+	__m128i zero = _mm_setzero_si128();
+	unsigned int mask;
+
+	for(; ((size_t)p & 15) && *p; p++);
+	if(!*p) return (size_t)(p - s);
+	while(!(mask = (unsigned int)_mm_movemask_epi8(simd_cmpeq(_mm_load_si128((const __m128i*)p), zero)))) {
+		p += SIMD_UNITS;
+	}
+	return (size_t)(p - s) + simd_first(mask);
+}
+
+static size_t simd_find_sep_sse2(const wchar_t* s, size_t n)
+{
+	__m128i slash = simd_set1(L'/'), backslash = simd_set1(L'\\'), v;
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + SIMD_UNITS <= n; i += SIMD_UNITS) {
+		v = _mm_loadu_si128((const __m128i*)&(s[i]));
+		if((mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(simd_cmpeq(v, slash), simd_cmpeq(v, backslash))))) {
+			return i + simd_first(mask);
+		}
+	}
+	return i + simd_find_sep_scalar(&(s[i]), n - i);
+}
+
+static size_t simd_find_sse2(const wchar_t* s, size_t n, wchar_t c)
+{
+	__m128i vc = simd_set1(c);
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + SIMD_UNITS <= n; i += SIMD_UNITS) {
+		if((mask = (unsigned int)_mm_movemask_epi8(simd_cmpeq(_mm_loadu_si128((const __m128i*)&(s[i])), vc)))) {
+			return i + simd_first(mask);
+		}
+	}
+	return i + simd_find_scalar(&(s[i]), n - i, c);
+}
+
+static void simd_flip_sse2(wchar_t* out, const wchar_t* in, size_t n, wchar_t from, wchar_t to)
+{
+	__m128i vfrom = simd_set1(from), vto = simd_set1(to), v, eq;
+	size_t i;
+
+	for(i = 0; i + SIMD_UNITS <= n; i += SIMD_UNITS) {
+		v = _mm_loadu_si128((const __m128i*)&(in[i]));
+		eq = simd_cmpeq(v, vfrom);
+		_mm_storeu_si128((__m128i*)&(out[i]), _mm_or_si128(_mm_and_si128(eq, vto), _mm_andnot_si128(eq, v)));
+	}
+	simd_flip_scalar(&(out[i]), &(in[i]), n - i, from, to);
+}
+
+/** 16 bytes at a time, until one of them isn't ASCII. The plain ones finish up. */
+static size_t simd_widen_sse2(wchar_t* out, const char* in, size_t n)
+{
+	__m128i zero = _mm_setzero_si128(), v, lo, hi;
+	size_t i;
+
+	for(i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i*)&(in[i]));
+		if(_mm_movemask_epi8(v)) break;
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		#if WCHAR_MAX > 0xFFFF
+		_mm_storeu_si128((__m128i*)&(out[i]), _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)&(out[i + 4]), _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)&(out[i + 8]), _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i*)&(out[i + 12]), _mm_unpackhi_epi16(hi, zero));
+		#else
+		_mm_storeu_si128((__m128i*)&(out[i]), lo);
+		_mm_storeu_si128((__m128i*)&(out[i + 8]), hi);
+		#endif
+	}
+	return i + simd_widen_scalar(&(out[i]), &(in[i]), n - i);
+}
+
+/**
+ * 16 units at a time. 32-bit units are packed down to 16 bits first,
+ * which saturates anything too big to stay too big.
+ */
+static size_t simd_narrow_sse2(char* out, const wchar_t* in, size_t n)
+{
+	__m128i high = _mm_set1_epi16((short)0xFF80), zero = _mm_setzero_si128(), a, b;
+	size_t i;
+
+	for(i = 0; i + 16 <= n; i += 16) {
+		#if WCHAR_MAX > 0xFFFF
+		a = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)&(in[i])), _mm_loadu_si128((const __m128i*)&(in[i + 4])));
+		b = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)&(in[i + 8])), _mm_loadu_si128((const __m128i*)&(in[i + 12])));
+		#else
+		a = _mm_loadu_si128((const __m128i*)&(in[i]));
+		b = _mm_loadu_si128((const __m128i*)&(in[i + 8]));
+		#endif
+		if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(a, b), high), zero)) != 0xFFFF) break;
+		_mm_storeu_si128((__m128i*)&(out[i]), _mm_packus_epi16(a, b));
+	}
+	return i + simd_narrow_scalar(&(out[i]), &(in[i]), n - i);
+}
+
+/**
+ * The same again, twice as wide. What's left over goes to the SSE2 ones,
+ * which can't run at full speed until the upper halves of our registers
+ * are cleared.
+ */
+SIMD_AVX2_FN static size_t simd_length_avx2(const wchar_t* s)
+{
+	const wchar_t* p = s;
+	__m256i zero = _mm256_setzero_si256();
+	unsigned int mask;
+
+	for(; ((size_t)p & 31) && *p; p++);
+	if(!*p) return (size_t)(p - s);
+	while(!(mask = (unsigned int)_mm256_movemask_epi8(simd_cmpeq_256(_mm256_load_si256((const __m256i*)p), zero)))) {
+		p += 2 * SIMD_UNITS;
+	}
+	return (size_t)(p - s) + simd_first(mask);
+}
+
+SIMD_AVX2_FN static size_t simd_find_sep_avx2(const wchar_t* s, size_t n)
+{
+	__m256i slash = simd_set1_256(L'/'), backslash = simd_set1_256(L'\\'), v;
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + 2 * SIMD_UNITS <= n; i += 2 * SIMD_UNITS) {
+		v = _mm256_loadu_si256((const __m256i*)&(s[i]));
+		if((mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(simd_cmpeq_256(v, slash), simd_cmpeq_256(v, backslash))))) {
+			return i + simd_first(mask);
+		}
+	}
+	_mm256_zeroupper();
+	return i + simd_find_sep_sse2(&(s[i]), n - i);
+}
+
+SIMD_AVX2_FN static size_t simd_find_avx2(const wchar_t* s, size_t n, wchar_t c)
+{
+	__m256i vc = simd_set1_256(c);
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + 2 * SIMD_UNITS <= n; i += 2 * SIMD_UNITS) {
+		if((mask = (unsigned int)_mm256_movemask_epi8(simd_cmpeq_256(_mm256_loadu_si256((const __m256i*)&(s[i])), vc)))) {
+			return i + simd_first(mask);
+		}
+	}
+	_mm256_zeroupper();
+	return i + simd_find_sse2(&(s[i]), n - i, c);
+}
+
+SIMD_AVX2_FN static void simd_flip_avx2(wchar_t* out, const wchar_t* in, size_t n, wchar_t from, wchar_t to)
+{
+	__m256i vfrom = simd_set1_256(from), vto = simd_set1_256(to), v;
+	size_t i;
+
+	for(i = 0; i + 2 * SIMD_UNITS <= n; i += 2 * SIMD_UNITS) {
+		v = _mm256_loadu_si256((const __m256i*)&(in[i]));
+		_mm256_storeu_si256((__m256i*)&(out[i]), _mm256_blendv_epi8(v, vto, simd_cmpeq_256(v, vfrom)));
+	}
+	_mm256_zeroupper();
+	simd_flip_sse2(&(out[i]), &(in[i]), n - i, from, to);
+}
+
+/** Whether the CPU has AVX2, and the OS saves its registers. */
+static bool simd_has_avx2()
+{
+	#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7) return false;
+	__cpuid(info, 1);
+	// OSXSAVE and AVX, then whether the OS saves the YMM registers.
+	if((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & 0x20) != 0;
+	#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+	#endif
+}
+#endif
+
+/** ASCII runs in paths are short, so AVX2 gets the SSE2 widen and narrow. */
+static const simd_kernel simd_kernels[] = {
+	{ L"scalar", simd_length_scalar, simd_find_sep_scalar, simd_find_scalar, simd_flip_scalar,
+		simd_widen_scalar, simd_narrow_scalar },
+	#ifdef SIMD_X86
+	{ L"sse2", simd_length_sse2, simd_find_sep_sse2, simd_find_sse2, simd_flip_sse2,
+		simd_widen_sse2, simd_narrow_sse2 },
+	{ L"avx2", simd_length_avx2, simd_find_sep_avx2, simd_find_avx2, simd_flip_avx2,
+		simd_widen_sse2, simd_narrow_sse2 },
+	#endif
+};
+
+static const simd_kernel* simd = NULL;
+
+/** The best level we can use. */
+static int simd_best()
+{
+	#ifdef SIMD_X86
+	return simd_has_avx2() ? SIMD_AVX2 : SIMD_SSE2;
+	#else
+	return SIMD_SCALAR;
+	#endif
+}
+
+/** Use the kernels for level, or the best we have if that's more than we can use. Returns the level picked. */
+static int simd_use(int level)
+{
+	int best = simd_best();
+	if(level > best) level = best;
+	simd = &(simd_kernels[level]);
+	return level;
+}
+
+static inline const simd_kernel* simd_kernel_get()
+{
+	if(!simd) simd_use(SIMD_AVX2);
+	return simd;
+}
+
+#define simd_length(s)					(simd_kernel_get()->length(s))
+#define simd_find_sep(s, n)				(simd_kernel_get()->find_sep(s, n))
+#define simd_find(s, n, c)				(simd_kernel_get()->find(s, n, c))
+#define simd_flip(out, in, n, from, to)	(simd_kernel_get()->flip(out, in, n, from, to))
+#define simd_widen(out, in, n)			(simd_kernel_get()->widen(out, in, n))
+#define simd_narrow(out, in, n)			(simd_kernel_get()->narrow(out, in, n))
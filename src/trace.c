@@ -0,0 +1,121 @@
+/**
+ * trace.c - Records how long each phase of a launch takes, and writes it
+ *           out as a Chrome trace-event file. (Open it in chrome://tracing
+ *           or Perfetto)
+ *
+ * Unlike -v, tracing is only ever turned on through our environment, since
+ * our arguments belong to our interpreter. Set CYGLAUNCH_TRACE to a folder
+ * to get a cyglaunch-<pid>.json in there per launch, or to a file to have
+ * each launch overwrite it.
+ *
+ * Events go into a fixed-size static table, with their names pointing at
+ * string literals, and are only formatted when they're written out. So
+ * when tracing is off, a trace point is a single flag check: nothing is
+ * formatted, and nothing is allocated. Can be excluded when building by
+ * defining WITHOUT_TRACE.
+ */
+
+#ifndef _PRECOMPILED_H_
+#	error This file contains declarations for main.c and should not be compiled by itself. Instead, compile main.c
+#endif
+
+/** Limits. Past these, we drop whole spans rather than leave them unbalanced. */
+#define TRACE_MAX_EVENTS	1024
+#define TRACE_MAX_DEPTH		32
+
+typedef struct {
+	const wchar_t* name;	// Always a literal, so never copied.
+	LONGLONG ts;			// In QueryPerformanceCounter ticks.
+	int arg;				// Shown as args.n, unless it's -1.
+	char phase;				// 'B'egin or 'E'nd
+} trace_event;
+
+static bool trace_enabled = false;
+static wchar_t sTracePath[MAX_PATH+1] = EMPTYW;
+static trace_event trace_events[TRACE_MAX_EVENTS];
+static int trace_count = 0, trace_dropped = 0, trace_depth = 0;
+static bool trace_kept[TRACE_MAX_DEPTH];
+
+/** The only part of tracing that runs whether or not it's on. */
+static void trace_init()
+{
+	dword szpath = GetEnvironmentVariableW(L"CYGLAUNCH_TRACE", sTracePath, MAX_PATH+1);
+	trace_enabled = szpath > 0 && szpath <= MAX_PATH;
+}
+
+static bool trace_record(const wchar_t* name, char phase, int arg)
+{
+	LARGE_INTEGER now;
+	trace_event* event;
+	bool kept;
+
+	// Can't fail on XP or later, but a zero beats a garbage timestamp if it does.
+	if(!QueryPerformanceCounter(&now)) now.QuadPart = 0;
+	if(phase == 'B') {
+		// Leave room for the ends of everything that's still open.
+		kept = trace_depth < TRACE_MAX_DEPTH && trace_count < TRACE_MAX_EVENTS - TRACE_MAX_DEPTH;
+		if(trace_depth < TRACE_MAX_DEPTH) trace_kept[trace_depth] = kept;
+		trace_depth++;
+		if(!kept) {
+			trace_dropped++;
+			return false;
+		}
+	} else {
+		if(!trace_depth) return false;
+		if(--trace_depth >= TRACE_MAX_DEPTH || !trace_kept[trace_depth]) return false;
+	}
+
+	event = &(trace_events[trace_count++]);
+	event->name = name;
+	event->ts = now.QuadPart;
+	event->arg = arg;
+	event->phase = phase;
+	return true;
+}
+
+#define trace_begin(name) ((void)(trace_enabled && trace_record(name, 'B', -1)))
+#define trace_begin_n(name, n) ((void)(trace_enabled && trace_record(name, 'B', (int)(n))))
+#define trace_end(name) ((void)(trace_enabled && trace_record(name, 'E', -1)))
+
+/**
+ * Write out everything we've recorded. Called right after we've started
+ * our interpreter, so that the spawn is in there too. Tracing is off
+ * afterwards.
+ */
+static void trace_flush()
+{
+	wchar_t sFile[MAX_PATH+1] = EMPTYW;
+	LARGE_INTEGER freq;
+	FILE* fp;
+	int i;
+
+	if(!trace_enabled) return;
+	trace_enabled = false;
+
+	if(is_folder(sTracePath)) {
+		if(FAILED(StringCchPrintfW(sFile, MAX_PATH+1, L"%s\\cyglaunch-%d.json", sTracePath, (int)GetCurrentProcessId()))) return;
+	} else if(FAILED(StringCchCopyW(sFile, MAX_PATH+1, sTracePath))) {
+		return;
+	}
+	if(!(fp = _wfopen(sFile, L"wb"))) {
+		verbose(L"Could not write our trace to %s", sFile);
+		return;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%d},\"traceEvents\":[", trace_dropped);
+	for(i = 0; i < trace_count; i++) {
+		// Microseconds since our first event.
+		fprintf(fp, "%s\n{\"name\":\"%ls\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%lu,\"tid\":0",
+			i ? "," : "",
+			trace_events[i].name,
+			trace_events[i].phase,
+			(double)(trace_events[i].ts - trace_events[0].ts) * 1000000.0 / (double)freq.QuadPart,
+			(unsigned long)GetCurrentProcessId()
+		);
+		if(trace_events[i].arg != -1) fprintf(fp, ",\"args\":{\"n\":%d}", trace_events[i].arg);
+		fputc('}', fp);
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+}
@@ -14,7 +14,8 @@ static void (*fatal)(dword dw, wchar_t* message, ...) = ((void(*)(dword dw, wcha
 #else
 static void fatal(dword dw, wchar_t* message, ...) 
 {
-	void *lpDisplayBuf, *lpMsgBuf;
+	// Static, since we could be here because we ran out of memory.
+	static wchar_t sMsgBuf[1024], sDisplayBuf[4096];
 	
 	if(dw == 0) {
 		// If no return code was specified, we assume that the message
@@ -23,110 +24,309 @@ static void fatal(dword dw, wchar_t* message, ...)
 		dw = GetLastError();
 		
 		FormatMessageW(
-			FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |FORMAT_MESSAGE_IGNORE_INSERTS,
+			FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
 			NULL,
 			dw,
 			MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-			(wchar_t*) &lpMsgBuf,
-			0,
+			sMsgBuf,
+			1024,
 			NULL
 		);
-
-		// Allocate our buffer for the error message.
-		lpDisplayBuf = (void*)LocalAlloc(
-			LMEM_ZEROINIT,
-			(lstrlenW((const wchar_t*)lpMsgBuf) + lstrlenW((const wchar_t*)message) + 47) * sizeof(wchar_t)
-		);
 		StringCchPrintfW(
-			(wchar_t*)lpDisplayBuf,
-			LocalSize(lpDisplayBuf) / sizeof(wchar_t),
+			sDisplayBuf,
+			4096,
 			L"FATAL: %s failed with error %d: %s",
 			message,
 			dw,
-			lpMsgBuf
+			sMsgBuf
 		);
 	} else {
 		// Otherwise, we assume that the error message is a format string.
-		va_list args = NULL;
-		
-		// Allocate buffer for our resulting format string.
-		lpMsgBuf = (void*)LocalAlloc(
-			LMEM_ZEROINIT,
-			(lstrlenW((const wchar_t*)message) + 8) * sizeof(wchar_t)
-		);
-		StringCchPrintfW(
-			(wchar_t*)lpMsgBuf,
-			LocalSize(lpMsgBuf) / sizeof(wchar_t),
-			L"FATAL: %s",
-			message
-		);
+		va_list args;
 		
-		// Might as well use the maximum allowed buffer, since there's no way I know of the
-		// get the size of the resulting buff.
-		lpDisplayBuf = (void*)LocalAlloc(LMEM_ZEROINIT, STRSAFE_MAX_CCH * sizeof(wchar_t));
-		va_start(args, lpMsgBuf);
-		StringCbVPrintfW(
-			(wchar_t*)lpDisplayBuf,
-			LocalSize(lpDisplayBuf) / sizeof(wchar_t),
-			lpMsgBuf,
-			args
-		);
+		StringCchPrintfW(sMsgBuf, 1024, L"FATAL: %s", message);
+		va_start(args, message);
+		StringCchVPrintfW(sDisplayBuf, 4096, sMsgBuf, args);
 		va_end(args);
 	}
+	// How we got here.
+	flight_dump();
 	#ifndef NO_MSGBOX
-	MessageBoxW(GetConsoleWindow(), (const wchar_t*)lpDisplayBuf, L"Fatal Error", MB_OK);
+	MessageBoxW(GetConsoleWindow(), (const wchar_t*)sDisplayBuf, L"Fatal Error", MB_OK);
 	#else
-	wprintf(L"%s\n", lpDisplayBuf);
+	wprintf(L"%s\n", sDisplayBuf);
 	#endif
-	LocalFree(lpMsgBuf);
-	LocalFree(lpDisplayBuf);
 	ExitProcess(dw); 
 }
 #endif
 
 /**
- * Inline helpers for allocating memory for strings/arrays
- * and zero'ing it out.
+ * Our arena. Everything we allocate lives until (at most) the spawn, so
+ * rather than going to the heap for every string, we bump-allocate out of
+ * a few large chunks and hand them all back at once with arena_release.
+ *
+ * Chunks come straight from VirtualAlloc, which hands us zeroed pages, so
+ * xalloc doesn't have to clear anything. xfree only gives back the most
+ * recent allocation (and zeroes it again), which covers the usual
+ * allocate-use-free pattern of verbose() and friends.
  */
-static inline void* xalloc(size_t count, size_t sz)
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN (2 * sizeof(void*))
+#define arena_round(x) (((x) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+typedef struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size;		// Usable bytes in data.
+	size_t used;
+	size_t last;		// Offset of the most recent allocation.
+	byte data[1];
+} arena_chunk;
+
+static arena_chunk* arena = NULL;
+
+/** Allocation statistics, shown in verbose mode. */
+static struct {
+	size_t allocs;		// Number of allocations handed out.
+	size_t bytes;		// Bytes handed out.
+	size_t chunks;		// Number of times we went to the OS.
+	size_t grows;		// Reallocations done in place.
+	size_t reclaimed;	// Allocations given back by xfree.
+} arena_stats = { 0, 0, 0, 0, 0 };
+
+static void* arena_alloc(size_t size)
 {
-	wchar_t* result = NULL;
-	size_t szresult = (count + 1) * sz;
-	if(!(result = (wchar_t*)malloc(szresult))) {
-		fatal_api_call(L"xalloc");
+	arena_chunk* chunk;
+	size_t szchunk;
+	void* result;
+
+	size = arena_round(size ? size : 1);
+	if(!arena || arena->used + size > arena->size) {
+		szchunk = FIELD_OFFSET(arena_chunk, data) + size;
+		szchunk = szchunk < ARENA_CHUNK ? ARENA_CHUNK : (szchunk + 0xFFFF) & ~0xFFFF;
+		if(!(chunk = (arena_chunk*)VirtualAlloc(NULL, szchunk, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE))) {
+			fatal_api_call(L"VirtualAlloc");
+		}
+		chunk->size = szchunk - FIELD_OFFSET(arena_chunk, data);
+		chunk->next = arena;
+		arena = chunk;
+		arena_stats.chunks++;
 	}
-	memset((void*)result, 0, szresult);
+
+	result = &(arena->data[arena->used]);
+	arena->last = arena->used;
+	arena->used += size;
+	arena_stats.allocs++;
+	arena_stats.bytes += size;
 	return result;
 }
 
+/**
+ * Grow (or shrink) an allocation. The most recent allocation grows in
+ * place when there's room; anything else gets copied.
+ */
+static void* arena_realloc(void* m, size_t szold, size_t sznew)
+{
+	void* result;
+	if(m && arena && (byte*)m == &(arena->data[arena->last]) &&
+		arena->last + arena_round(sznew ? sznew : 1) <= arena->size) {
+		if(sznew < szold) memset((byte*)m + sznew, 0, szold - sznew);
+		arena->used = arena->last + arena_round(sznew ? sznew : 1);
+		arena_stats.grows++;
+		return m;
+	}
+	result = arena_alloc(sznew);
+	if(m) memcpy(result, m, szold < sznew ? szold : sznew);
+	return result;
+}
+
+/** Gives everything back. Safe to keep allocating afterwards. */
+static void arena_release()
+{
+	arena_chunk* chunk;
+	while((chunk = arena) != NULL) {
+		arena = chunk->next;
+		VirtualFree(chunk, 0, MEM_RELEASE);
+	}
+}
+
+/**
+ * Inline helpers for allocating memory for strings/arrays. These
+ * always come back zero'd, with room for a terminator.
+ */
+static inline void* xalloc(size_t count, size_t sz)
+{
+	return arena_alloc((count + 1) * sz);
+}
+
 #define walloc(c) (wchar_t*)xalloc((size_t)c, (size_t)sizeof(wchar_t))
 #define waalloc(c) (wchar_t**)xalloc((size_t)c, (size_t)sizeof(wchar_t*))
 
+/** Our version of _wcsdup. */
+static inline wchar_t* xwcsdup(const wchar_t* s)
+{
+	size_t szs = wcslen(s);
+	wchar_t* result = walloc(szs);
+	memcpy(result, s, szs * sizeof(wchar_t));
+	return result;
+}
+
 /**
- * Helper for adding another entry to a wstring array. Arg is a
- * pointer to the actual array pointer so that we can return a pointer
- * to the last writable entry in the array, and still be able to change
- * the address the array is pointing to, in case the memory block has to
- * be moved to resize.
+ * Gives back an allocation, if it was the most recent one. Anything else
+ * stays around until arena_release.
  */
-static inline wchar_t* waadd(wchar_t*** aptr, wchar_t* entry)
+static inline void xfree(void *m)
 {
-	size_t szcount = -1;
-	wchar_t	*result = NULL;
-	wchar_t **ptr;
-	
-	if(!aptr || !(ptr = *aptr)) fatal(1, L"NULL pointer passed to waadd");
-	while(ptr[++szcount] != NULL);
-	ptr[szcount] = _wcsdup(entry);
-	result = ptr[szcount++];
-	if(!(*aptr = (wchar_t**)_recalloc((void*)ptr, szcount, sizeof(wchar_t*)))) {
-		fatal_api_call(L"waadd");
+	if(m == NULL || !arena || (byte*)m != &(arena->data[arena->last])) return;
+	memset(m, 0, arena->used - arena->last);
+	arena->used = arena->last;
+	arena_stats.reclaimed++;
+}
+
+/**
+ * UTF-8 <-> wchar_t. (UTF-16 on Windows) Unlike mbstowcs and friends,
+ * these don't care what locale we're in, and unlike MultiByteToWideChar,
+ * they never swap what they can't convert for a U+FFFD: overlong
+ * sequences, encoded surrogates, anything past U+10FFFF and unpaired
+ * surrogates on the wide side fail the whole conversion instead.
+ *
+ * There's no separate pass to size the result. The caller passes a
+ * buffer big enough for the worst case, (count units when decoding,
+ * UTF8_MAX(count) bytes when encoding) and gets back how much of it was
+ * used. Runs of ASCII are copied across by simd.c.
+ *
+ * count can include a terminator, which is copied like anything else.
+ * Both return UTF_INVALID if src can't be converted, or if it doesn't fit
+ * in dst.
+ */
+#define UTF_INVALID ((size_t)-1)
+#if WCHAR_MAX > 0xFFFF
+#	define UTF8_MAX(n) ((n) * 4)
+#else
+#	define UTF8_MAX(n) ((n) * 3)
+#endif
+
+static size_t utf8_decode(const char* src, size_t count, wchar_t* dst, size_t cchdst)
+{
+	const byte *p = (const byte*)src, *end = p + count;
+	wchar_t *out = dst, *limit = dst + cchdst;
+	unsigned long c;
+	size_t run;
+	int length, i;
+
+	while(p < end) {
+		run = (size_t)(end - p) < (size_t)(limit - out) ? (size_t)(end - p) : (size_t)(limit - out);
+		run = simd_widen(out, (const char*)p, run);
+		p += run;
+		out += run;
+		if(p == end) break;
+		if(out == limit) return UTF_INVALID;
+
+		// C0, C1 and F5 and up can only start overlong or out of range sequences.
+		c = *(p++);
+		if(c < 0xC2 || c > 0xF4) return UTF_INVALID;
+		length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+		if(end - p < length - 1) return UTF_INVALID;
+		c &= 0x7F >> length;
+		for(i = 1; i < length; i++, p++) {
+			if((*p & 0xC0) != 0x80) return UTF_INVALID;
+			c = (c << 6) | (*p & 0x3F);
+		}
+		if((length == 3 && (c < 0x800 || (c >= 0xD800 && c < 0xE000))) ||
+			(length == 4 && (c < 0x10000 || c > 0x10FFFF))) {
+			return UTF_INVALID;
+		}
+		#if WCHAR_MAX <= 0xFFFF
+		if(c >= 0x10000) {
+			if(limit - out < 2) return UTF_INVALID;
+			c -= 0x10000;
+			*(out++) = (wchar_t)(0xD800 + (c >> 10));
+			c = 0xDC00 + (c & 0x3FF);
+		}
+		#endif
+		*(out++) = (wchar_t)c;
 	}
-	ptr = *aptr;
-	ptr[szcount] = NULL;
-	return result;
+	return (size_t)(out - dst);
+}
+
+static size_t utf8_encode(const wchar_t* src, size_t count, char* dst, size_t cbdst)
+{
+	const wchar_t *p = src, *end = src + count;
+	byte *out = (byte*)dst, *limit = out + cbdst;
+	unsigned long c;
+	size_t run;
+	int length;
+
+	while(p < end) {
+		run = (size_t)(end - p) < (size_t)(limit - out) ? (size_t)(end - p) : (size_t)(limit - out);
+		run = simd_narrow((char*)out, p, run);
+		p += run;
+		out += run;
+		if(p == end) break;
+
+		c = (unsigned long)*(p++);
+		if(c >= 0xD800 && c < 0xE000) {
+			#if WCHAR_MAX <= 0xFFFF
+			if(c >= 0xDC00 || p == end || *p < 0xDC00 || *p >= 0xE000) return UTF_INVALID;
+			c = 0x10000 + ((c - 0xD800) << 10) + (unsigned long)(*(p++) - 0xDC00);
+			#else
+			return UTF_INVALID;
+			#endif
+		}
+		length = c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+		if(c > 0x10FFFF || limit - out < length) return UTF_INVALID;
+		if(length == 2) {
+			*(out++) = (byte)(0xC0 | (c >> 6));
+		} else {
+			if(length == 4) {
+				*(out++) = (byte)(0xF0 | (c >> 18));
+				*(out++) = (byte)(0x80 | ((c >> 12) & 0x3F));
+			} else {
+				*(out++) = (byte)(0xE0 | (c >> 12));
+			}
+			*(out++) = (byte)(0x80 | ((c >> 6) & 0x3F));
+		}
+		*(out++) = (byte)(0x80 | (c & 0x3F));
+	}
+	return (size_t)(out - (byte*)dst);
+}
+
+/**
+ * Builder for wstring arrays. Appending is amortized O(1), since we
+ * track the count and double the capacity, rather than rescanning and
+ * reallocating the array on every add. The array is always NULL
+ * terminated, so items can be used as-is.
+ */
+typedef struct {
+	wchar_t** items;
+	size_t count;
+	size_t capacity;
+} wabuilder;
+
+static inline void wab_init(wabuilder* wab, size_t capacity)
+{
+	wab->capacity = capacity ? capacity : 8;
+	wab->items = waalloc(wab->capacity);
+	wab->count = 0;
+}
+
+/** Appends entry (without copying it) and returns it. */
+static inline wchar_t* wab_push(wabuilder* wab, wchar_t* entry)
+{
+	if(wab->count == wab->capacity) {
+		wab->items = (wchar_t**)arena_realloc(
+			wab->items,
+			(wab->capacity + 1) * sizeof(wchar_t*),
+			(wab->capacity * 2 + 1) * sizeof(wchar_t*)
+		);
+		wab->capacity *= 2;
+	}
+	wab->items[wab->count++] = entry;
+	wab->items[wab->count] = NULL;
+	return entry;
 }
 
+#define wab_add(wab, entry) wab_push(wab, xwcsdup(entry))
+
 /**
  * Check if a wchar string array contains a particular entry. Additional
  * arg for whether or not to worry about case sensitivity.
@@ -164,17 +364,6 @@ static inline size_t _wacontains(wchar_t** ptr, wchar_t* entry, bool csensitive)
 #define wacontains(x,y) _wacontains(x,y,true)
 #define waicontains(x,y) _wacontains(x,y,false)
 
-/**
- * Inline helper for safely freeing allocated data.
- * Along with wafree, these functions were grabbed
- * from the cygspawn project:
- *   https://github.com/mturk/cygspawn
- */
-static inline void xfree(void *m)
-{
-	if (m != NULL) free(m);
-}
-
 /** Helper for freeing a wchar string array. */
 static void wafree(wchar_t **array)
 {
@@ -196,7 +385,8 @@ static inline bool exists(wchar_t* path)
  */
 static inline bool is_folder(wchar_t* path)
 {
-	return GetFileAttributesW((const wchar_t*)path) & FILE_ATTRIBUTE_DIRECTORY;
+	dword dwAttrs = GetFileAttributesW((const wchar_t*)path);
+	return dwAttrs != INVALID_FILE_ATTRIBUTES && (dwAttrs & FILE_ATTRIBUTE_DIRECTORY);
 }
 
 /**
@@ -208,15 +398,6 @@ static inline bool is_file(wchar_t* path)
 	return exists(path) && !is_folder(path);
 }
 
-/**
- * Yet another inline helper for determining whether
- * a given path has the SYSTEM attribute flagged on it.
- */
-static inline bool has_system_attr(wchar_t* path)
-{
-	return GetFileAttributesW(path) & FILE_ATTRIBUTE_SYSTEM;
-}
-
 /** Inline helper to get the parent folder and length of a the parent quickly */
 static inline bool get_dirname(wchar_t* sExecutable, size_t lpszExecutable, wchar_t* sParentOut, size_t* lpszParentOut)
 {
@@ -248,27 +429,3 @@ static inline size_t get_file_length(FILE* pFile)
 		return -1;
 	return result;
 }
-
-/** Allocate a buffer for the contents of a file and read the file into it. */
-static inline byte* file_to_buffer(wchar_t* sPath, size_t* size)
-{
-	FILE* fp;
-	byte* buffer = NULL;
-	fp = _wfopen((const wchar_t*)sPath, L"rb");
-	if (fp == NULL) {
-		fatal(1, L"Could not read file: %s", sPath);
-	}
-	
-	*size = get_file_length(fp);
-	if(*size == -1) {
-		fatal(1, L"Could not get size of file: %s", sPath);
-	}
-	
-	if(!(buffer = (byte*)xalloc(*size, 1))) {
-		fatal(1, L"Could not allocate %d bytes of memory for the contents of file: %s", *size, sPath);
-	}
-	ZeroMemory(buffer, *size);
-	fread(buffer, 1, *size, fp);
-	fclose(fp);
-	return buffer;
-}
\ No newline at end of file
@@ -0,0 +1,581 @@
+/**
+ * manifest.c - cyglaunch-manifest. Writes the launch manifest for a
+ *              virtualenv. (See src\manifest.c for what's in it)
+ *
+ * Run it once the launcher has been dropped into the virtualenv's Scripts
+ * folder, and again whenever the virtualenv is moved, a launcher is added,
+ * or Cygwin's python is updated:
+ *
+ *   cyglaunch-manifest [--sync] [--launcher FILE] C:\path\to\venv\Scripts [NAME=flags ..]
+ *
+ * Every *.exe in the Scripts folder gets an entry, worked out exactly the
+ * way the launcher would: its bin\ target, the symlink chain from there,
+ * and the interpreter at the end of it in both formats, or if that's a
+ * script, the interpreter in its #! line. The Cygwin root,
+ * PATH and converted virtualenv root are shared by all of them. Launchers
+ * without a bin\name.exe are pointed at bin\name, which is where pip
+ * puts its scripts. Entries are sorted by name, so the launcher can find
+ * its own with a binary search.
+ *
+ * With --sync, (Meant to be run after every pip install) the launcher at
+ * Scripts\python.exe, or FILE, is hardlinked as Scripts\name.exe for
+ * every executable, symlink or #! script in bin\ that doesn't have a
+ * launcher yet, so they all share one copy on disk and in memory. Copies
+ * of the launcher in Scripts are replaced with hardlinks, and hardlinks
+ * whose bin\ target has gone away are removed. Entries in the old
+ * manifest are kept as they are if nothing they depend on has changed,
+ * so only new and changed scripts are resolved again.
+ *
+ * The launcher's built-in environment variable rules (PYTHONPATH and
+ * friends) are always written out. Each NAME=flags[=value] argument adds
+ * a rule, or replaces the one of the same name, where flags is one or more
+ * of spath, lpath, vroot, unset and prepend, separated by commas. NAME can
+ * be a glob, like PYTHON*, and prepend puts value (a Windows path list) in
+ * front of the variable, so it needs one. Variables go by the first rule
+ * that matches them. With --sync and no rules given, the old manifest's
+ * rules are kept.
+ *
+ * The manifest is written next to the old one and then moved over it, so
+ * a launcher starting at the same time sees one or the other.
+ */
+
+#define LAUNCHER_LIBRARY
+// Everything has to be worked out from scratch, not read back.
+#define WITHOUT_CACHE
+// But every file real_path looks at gets stamped, same as the cache would.
+#include <wchar.h>
+static void tool_hop(const wchar_t* path);
+#define cache_add_dep(x) tool_hop(x)
+#include "../src/main.c"
+
+#include <errno.h>
+
+/** Limits */
+#define TOOL_MAX_ENTRIES	1024
+#define TOOL_MAX_STRINGS	((MANIFEST_MAX_SIZE - sizeof(manifest_header)) / sizeof(wchar_t) / 2)
+#define TOOL_MAX_HOPS		(MANIFEST_MAX_SIZE / 4 / sizeof(manifest_hop))
+
+static manifest_header header;
+static manifest_entry entries[TOOL_MAX_ENTRIES];
+#ifndef WITHOUT_ENVVARS
+static manifest_rule rules[ENV_MAX_RULES];
+#else
+static manifest_rule rules[1];
+#endif
+static manifest_hop hops[TOOL_MAX_HOPS];
+static wchar_t strings[TOOL_MAX_STRINGS];
+
+/** What we're working on. Hops are only recorded while we have an entry to record them for. */
+static manifest_entry* hopEntry = NULL;
+static bool syncing = false, reusable = false;
+static wchar_t sScripts[MAX_PATH+1] = EMPTYW, sParentDir[MAX_PATH+1] = EMPTYW,
+	sCygRoot[MAX_PATH+1] = EMPTYW, sLauncher[MAX_PATH+1] = EMPTYW;
+static int nreused = 0, nlinked = 0;
+
+/** Add a string to our pool, returning its offset. */
+static dword tool_string(const wchar_t* s)
+{
+	size_t szs;
+	dword result = header.nstrings;
+	if(!s || !*s) return 0;
+	szs = wcslen(s) + 1;
+	if(szs > TOOL_MAX_STRINGS - header.nstrings) {
+		fatal(ERROR_FILENAME_EXCED_RANGE, L"Too many paths to fit in a manifest.");
+	}
+	wmemcpy(&(strings[result]), s, szs);
+	header.nstrings += (dword)szs;
+	return result;
+}
+
+/** Stamp a file that hopEntry depends on, if it hasn't been already. */
+static void tool_hop(const wchar_t* path)
+{
+	dword i;
+
+	if(!hopEntry || !path) return;
+	for(i = hopEntry->hop; i < header.nhops; i++) {
+		if(_wcsicmp(&(strings[hops[i].path]), path) == 0) return;
+	}
+	if(header.nhops == TOOL_MAX_HOPS) fatal(1, L"Too many symbolic links to fit in a manifest.");
+	hops[header.nhops].path = tool_string(path);
+	manifest_stamp_path(path, &(hops[header.nhops++].stamp));
+	hopEntry->nhops++;
+}
+
+/** Joins folder and name into out, which has to be MAX_PATH+1 long. */
+static void tool_join(wchar_t* out, const wchar_t* folder, const wchar_t* name)
+{
+	if(FAILED(StringCchPrintfW(out, MAX_PATH+1, L"%s\\%s", folder, name))) {
+		fatal(ERROR_FILENAME_EXCED_RANGE, L"Path too long: %s\\%s", folder, name);
+	}
+}
+
+/** Our paths have to be absolute, since that's how the launcher sees them. */
+static void tool_abspath(const wchar_t* path, wchar_t* out)
+{
+	wchar_t sCwd[MAX_PATH+1] = EMPTYW;
+	size_t szout;
+
+	if(path[0] && path[1] == L':' && path[2] == L'\\') {
+		if(FAILED(StringCchCopyW(out, MAX_PATH+1, path))) fatal(ERROR_FILENAME_EXCED_RANGE, L"Path too long: %s", path);
+	} else {
+		if(!GetCurrentDirectoryW(MAX_PATH+1, sCwd)) fatal_api_call(L"GetCurrentDirectoryW");
+		tool_join(out, sCwd, path);
+	}
+	for(szout = wcslen(out); szout > 3 && out[szout - 1] == L'\\'; szout--) out[szout - 1] = L'\0';
+}
+
+#ifndef WITHOUT_ENVVARS
+/** Parse a NAME=flags[=value] argument into a rule. */
+static void tool_rule(const wchar_t* arg)
+{
+	static const struct { const wchar_t* name; dword flag; } flags[] = {
+		{ L"spath", SPATH }, { L"lpath", LPATH }, { L"vroot", VROOT }, { L"unset", UNSET }, { L"prepend", PREPEND }, { NULL, NONE }
+	};
+	wchar_t sName[MAX_PATH+1] = EMPTYW;
+	const wchar_t *sep = wcschr(arg, L'='), *sValue = NULL, *p, *end, *last;
+	dword value = NONE, i, j;
+
+	if(!sep || sep == arg || (size_t)(sep - arg) > MAX_PATH) {
+		fatal(1, L"Expected NAME=flags[=value], not %s", arg);
+	}
+	wcsncpy(sName, arg, sep - arg);
+	if((sValue = wcschr(sep + 1, L'='))) {
+		last = sValue++;
+	} else {
+		last = sep + 1 + wcslen(sep + 1);
+	}
+	for(p = sep + 1; p < last; p = end < last ? end + 1 : end) {
+		if(!(end = wcschr(p, L',')) || end > last) end = last;
+		for(j = 0; flags[j].name; j++) {
+			if(wcslen(flags[j].name) == (size_t)(end - p) && _wcsnicmp(p, flags[j].name, end - p) == 0) break;
+		}
+		if(!flags[j].name) fatal(1, L"Unknown flag in %s (expected spath, lpath, vroot, unset or prepend)", arg);
+		value |= flags[j].flag;
+	}
+	if(((value & PREPEND) != 0) != (sValue && *sValue)) {
+		fatal(1, L"prepend needs a value, and only prepend takes one: %s", arg);
+	}
+
+	for(i = 0; i < header.nrules; i++) {
+		if(_wcsicmp(&(strings[rules[i].name]), sName) == 0) break;
+	}
+	if(i == header.nrules) {
+		if(header.nrules == ENV_MAX_RULES) fatal(1, L"No more than %d environment variable rules fit in a manifest.", ENV_MAX_RULES);
+		rules[header.nrules++].name = tool_string(sName);
+	}
+	rules[i].flags = value;
+	rules[i].value = tool_string(sValue);
+}
+
+/** The launcher's own rules, then ours. Or with --sync and no rules of our own, the old manifest's. */
+static void tool_rules(int argc, wchar_t** argv)
+{
+	const manifest_rule* oldRules;
+	int i;
+
+	if(argc == 0 && reusable && manifest_view->nrules <= ENV_MAX_RULES) {
+		oldRules = (const manifest_rule*)((const byte*)manifest_view + manifest_view->rules);
+		for(i = 0; i < (int)manifest_view->nrules; i++) {
+			rules[header.nrules].name = tool_string(manifest_string(oldRules[i].name));
+			rules[header.nrules].value = tool_string(manifest_string(oldRules[i].value));
+			rules[header.nrules++].flags = oldRules[i].flags;
+		}
+		return;
+	}
+	for(i = 0; vars_tab[i].name; i++) {
+		rules[header.nrules].name = tool_string(vars_tab[i].name);
+		rules[header.nrules].value = tool_string(vars_tab[i].value);
+		rules[header.nrules++].flags = vars_tab[i].flags;
+	}
+	for(i = 0; i < argc; i++) tool_rule(argv[i]);
+}
+#endif
+
+/** Everything every launcher shares. */
+static void tool_shared(wchar_t* sPATH)
+{
+	wchar_t sFstab[MAX_PATH+1] = EMPTYW, sUser[MAX_PATH+1] = EMPTYW;
+	size_t szParent = 0;
+
+	if(!get_dirname(sScripts, wcslen(sScripts), sParentDir, &szParent)) {
+		fatal(ERROR_PATH_NOT_FOUND, L"Could not get the root folder of the virtual environment at %s", sScripts);
+	}
+	get_cygwin_root(sCygRoot, MAX_PATH+1);
+	build_path_var(sParentDir, sCygRoot, sPATH);
+	// #!/usr/bin/env lines are looked up in the PATH the launcher sets.
+	if(!SetEnvironmentVariableW(L"PATH", sPATH)) fatal_api_call(L"SetEnvironmentVariableW");
+	cygRootWin = sCygRoot;
+	virtRootWin = sParentDir;
+	// Our launchers only load cygwin1.dll once they need it, but we'll be converting our paths either way.
+	if(!setup_path_conversion() || (!path_conv_ready() && !setup_cygwin())) fatal(1, L"Could not load Cygwin's mount table or cygwin1.dll");
+
+	header.parentDir = tool_string(sParentDir);
+	header.cygRoot = tool_string(sCygRoot);
+	header.path = tool_string(sPATH);
+	header.virtRootCyg = tool_string(get_virt_root_cyg());
+	tool_join(sFstab, sCygRoot, L"etc\\fstab");
+	manifest_stamp_path(sFstab, &(header.fstab));
+	// Our user's mounts went into our mount table too. (See load_mount_table)
+	if(GetEnvironmentVariableW(L"USERNAME", sUser, MAX_PATH+1) &&
+		SUCCEEDED(StringCchPrintfW(sFstab, MAX_PATH+1, L"%s\\etc\\fstab.d\\%s", sCygRoot, sUser))) {
+		header.user = tool_string(sUser);
+		manifest_stamp_path(sFstab, &(header.userFstab));
+	}
+
+	// The old entries are only any good if their paths were converted the same way.
+	if(reusable && (_wcsicmp(manifest_string(manifest_view->parentDir), sParentDir) != 0 ||
+		_wcsicmp(manifest_string(manifest_view->cygRoot), sCygRoot) != 0 ||
+		_wcsicmp(manifest_string(manifest_view->user), &(strings[header.user])) != 0 ||
+		memcmp(&(manifest_view->fstab), &(header.fstab), sizeof(manifest_stamp)) != 0 ||
+		memcmp(&(manifest_view->userFstab), &(header.userFstab), sizeof(manifest_stamp)) != 0)) {
+		wprintf(L"The virtual environment, Cygwin root, user or mount table has changed. Resolving everything again.\n");
+		reusable = false;
+	}
+}
+
+/** Which file path is, as far as the file system is concerned. */
+static bool tool_identity(const wchar_t* path, BY_HANDLE_FILE_INFORMATION* info)
+{
+	HANDLE hFile = CreateFileW(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	bool result;
+
+	if(hFile == INVALID_HANDLE_VALUE) return false;
+	result = GetFileInformationByHandle(hFile, info) != FALSE;
+	CloseHandle(hFile);
+	return result;
+}
+
+static inline bool tool_same_file(const BY_HANDLE_FILE_INFORMATION* a, const BY_HANDLE_FILE_INFORMATION* b)
+{
+	return a->dwVolumeSerialNumber == b->dwVolumeSerialNumber &&
+		a->nFileIndexHigh == b->nFileIndexHigh && a->nFileIndexLow == b->nFileIndexLow;
+}
+
+/** Whether two files of the same size have the same contents. */
+static bool tool_same_contents(const wchar_t* a, const wchar_t* b)
+{
+	char bufa[4096], bufb[4096];
+	FILE *fpa = _wfopen(a, L"rb"), *fpb = _wfopen(b, L"rb");
+	size_t sza, szb;
+	bool result = fpa && fpb;
+
+	while(result) {
+		sza = fread(bufa, 1, sizeof(bufa), fpa);
+		szb = fread(bufb, 1, sizeof(bufb), fpb);
+		result = sza == szb && memcmp(bufa, bufb, sza) == 0;
+		if(sza < sizeof(bufa)) break;
+	}
+	if(fpa) fclose(fpa);
+	if(fpb) fclose(fpb);
+	return result;
+}
+
+/** Whether something in bin\ is worth a launcher: an exe, a Cygwin symlink or a #! script. */
+static bool tool_launchable(wchar_t* path, const wchar_t* sName)
+{
+	probe_result probe;
+	char magic[2];
+	size_t szname = wcslen(sName);
+	FILE* fp;
+	bool result;
+
+	if(szname > 4 && _wcsicmp(&(sName[szname - 4]), L".exe") == 0) return true;
+	if(probe_path(path, &probe) && probe.kind == PROBE_LINK) return true;
+	if(!(fp = _wfopen(path, L"rb"))) return false;
+	result = fread(magic, 1, 2, fp) == 2 && magic[0] == '#' && magic[1] == '!';
+	fclose(fp);
+	return result;
+}
+
+/** Hardlink the launcher as sPath. If replace is set, whatever's there is swapped out in one go. */
+static bool tool_link(const wchar_t* sPath, bool replace)
+{
+	wchar_t sTemp[MAX_PATH+1] = EMPTYW;
+
+	if(!replace) return CreateHardLinkW(sPath, sLauncher, NULL) != FALSE;
+	if(FAILED(StringCchPrintfW(sTemp, MAX_PATH+1, L"%s.%d", sPath, (int)GetCurrentProcessId()))) return false;
+	if(!CreateHardLinkW(sTemp, sLauncher, NULL)) return false;
+	if(!MoveFileExW(sTemp, sPath, MOVEFILE_REPLACE_EXISTING)) {
+		// Most likely running.
+		DeleteFileW(sTemp);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Give everything in bin\ that doesn't have a launcher yet a hardlink to
+ * ours, and turn any copies of ours into hardlinks.
+ */
+static void tool_sync_links()
+{
+	wchar_t sBin[MAX_PATH+1] = EMPTYW, sPattern[MAX_PATH+1] = EMPTYW,
+		sPath[MAX_PATH+1] = EMPTYW, sName[MAX_PATH+1] = EMPTYW;
+	BY_HANDLE_FILE_INFORMATION launcher, info;
+	WIN32_FIND_DATAW data;
+	HANDLE hFind;
+	size_t szname;
+
+	if(!tool_identity(sLauncher, &launcher)) fatal(ERROR_FILE_NOT_FOUND, L"Did not find the launcher at %s", sLauncher);
+
+	// New scripts.
+	tool_join(sBin, sParentDir, L"bin");
+	tool_join(sPattern, sBin, L"*");
+	if((hFind = FindFirstFileW(sPattern, &data)) != INVALID_HANDLE_VALUE) {
+		do {
+			if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+			tool_join(sPath, sBin, data.cFileName);
+			if(!tool_launchable(sPath, data.cFileName)) continue;
+			szname = wcslen(data.cFileName);
+			if(szname > 4 && _wcsicmp(&(data.cFileName[szname - 4]), L".exe") == 0) szname -= 4;
+			if(szname + 4 > MAX_PATH) continue;
+			wcsncpy(sName, data.cFileName, szname);
+			wcscpy(&(sName[szname]), L".exe");
+			tool_join(sPath, sScripts, sName);
+			if(exists(sPath)) continue;
+			if(tool_link(sPath, false)) {
+				wprintf(L"Linked %s\n", sName);
+				nlinked++;
+			} else {
+				wprintf(L"Could not link %s (error %d)\n", sPath, (int)GetLastError());
+			}
+		} while(FindNextFileW(hFind, &data));
+		FindClose(hFind);
+	}
+
+	// Copies of ourselves.
+	tool_join(sPattern, sScripts, L"*.exe");
+	if((hFind = FindFirstFileW(sPattern, &data)) != INVALID_HANDLE_VALUE) {
+		do {
+			if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+			tool_join(sPath, sScripts, data.cFileName);
+			if(!tool_identity(sPath, &info) || tool_same_file(&info, &launcher)) continue;
+			if(info.nFileSizeHigh != launcher.nFileSizeHigh || info.nFileSizeLow != launcher.nFileSizeLow ||
+				!tool_same_contents(sPath, sLauncher)) {
+				continue;
+			}
+			if(tool_link(sPath, true)) {
+				wprintf(L"Replaced %s with a hardlink\n", data.cFileName);
+				nlinked++;
+			} else {
+				wprintf(L"Could not replace %s with a hardlink (error %d)\n", sPath, (int)GetLastError());
+			}
+		} while(FindNextFileW(hFind, &data));
+		FindClose(hFind);
+	}
+}
+
+/** What Scripts\sName launches, the same way the launcher works it out. */
+static bool tool_target(const wchar_t* sName, wchar_t* sTarget)
+{
+	wchar_t sExecutable[MAX_PATH+1] = EMPTYW, sDir[MAX_PATH+1] = EMPTYW;
+
+	tool_join(sExecutable, sScripts, sName);
+	find_target(sExecutable, wcslen(sExecutable), sDir, sTarget);
+	return exists(sTarget);
+}
+
+/** Add an entry for Scripts\sName, if there's anything in bin\ for it. */
+static void tool_entry(const wchar_t* sName)
+{
+	wchar_t sTarget[MAX_PATH+1] = EMPTYW, sPath[MAX_PATH+1] = EMPTYW, *sReal, *sRealCyg;
+	BY_HANDLE_FILE_INFORMATION launcher, info;
+	const manifest_entry* old;
+	const manifest_hop* oldHops;
+	manifest_entry* entry;
+	dword i;
+	#ifndef WITHOUT_SHEBANG
+	shebang_result shebang;
+	#endif
+
+	if(header.nentries == TOOL_MAX_ENTRIES) fatal(1, L"More than %d launchers in %s", TOOL_MAX_ENTRIES, sScripts);
+	if(!tool_target(sName, sTarget)) {
+		// Only ever remove our own hardlinks, and never the launcher itself.
+		tool_join(sPath, sScripts, sName);
+		if(syncing && _wcsicmp(sPath, sLauncher) != 0 && tool_identity(sLauncher, &launcher) &&
+			tool_identity(sPath, &info) && tool_same_file(&info, &launcher) && DeleteFileW(sPath)) {
+			wprintf(L"Removed %s, since there's no %s\n", sName, sTarget);
+		} else {
+			wprintf(L"Skipping %s, since there's no %s\n", sName, sTarget);
+		}
+		return;
+	}
+
+	entry = &(entries[header.nentries++]);
+	entry->name = tool_string(sName);
+	entry->target = tool_string(sTarget);
+	entry->hop = header.nhops;
+
+	// Nothing's changed since last time.
+	if(reusable && (old = manifest_find(sName)) && _wcsicmp(manifest_string(old->target), sTarget) == 0 &&
+		manifest_entry_current(old)) {
+		entry->realTarget = tool_string(manifest_string(old->realTarget));
+		entry->realTargetCyg = tool_string(manifest_string(old->realTargetCyg));
+		entry->interp = tool_string(manifest_string(old->interp));
+		entry->interpCyg = tool_string(manifest_string(old->interpCyg));
+		entry->interpArgs = tool_string(manifest_string(old->interpArgs));
+		if(old->nhops > TOOL_MAX_HOPS - header.nhops) fatal(1, L"Too many symbolic links to fit in a manifest.");
+		for(i = 0, oldHops = manifest_hops(old); i < old->nhops; i++) {
+			hops[header.nhops].path = tool_string(manifest_string(oldHops[i].path));
+			hops[header.nhops++].stamp = oldHops[i].stamp;
+		}
+		entry->nhops = old->nhops;
+		nreused++;
+		return;
+	}
+
+	// Follow the chain the same way exec_cmd would, stamping every hop.
+	hopEntry = entry;
+	realPathCyg = NULL;
+	sReal = real_path(sTarget);
+	if(!(sRealCyg = realPathCyg)) sRealCyg = to_cyg_path(sReal);
+
+	if(sRealCyg) {
+		entry->realTarget = tool_string(sReal);
+		entry->realTargetCyg = tool_string(sRealCyg);
+		#ifndef WITHOUT_SHEBANG
+		if(shebang_resolve(sReal, &shebang)) {
+			hopEntry = NULL;
+			entry->interp = tool_string(shebang.interp);
+			entry->interpCyg = tool_string(shebang.interpCyg);
+			entry->interpArgs = tool_string(shebang.args);
+			wprintf(L"%s -> %s (through %s)\n", sName, sRealCyg, shebang.interpCyg);
+			return;
+		}
+		#endif
+	}
+	hopEntry = NULL;
+	wprintf(L"%s -> %s\n", sName, sRealCyg ? sRealCyg : sTarget);
+}
+
+/** Same order manifest_find searches in. */
+static int tool_compare(const void* a, const void* b)
+{
+	return _wcsicmp(&(strings[((const manifest_entry*)a)->name]), &(strings[((const manifest_entry*)b)->name]));
+}
+
+/** Write everything out to Scripts\.cyglaunch.manifest. */
+static void tool_write()
+{
+	wchar_t sPath[MAX_PATH+1] = EMPTYW, sTemp[MAX_PATH+1] = EMPTYW;
+	FILE* fp;
+	bool ok;
+
+	tool_join(sPath, sScripts, MANIFEST_FILENAME);
+	if(FAILED(StringCchPrintfW(sTemp, MAX_PATH+1, L"%s.%d", sPath, (int)GetCurrentProcessId()))) {
+		fatal(ERROR_FILENAME_EXCED_RANGE, L"Path too long: %s", sPath);
+	}
+
+	qsort(entries, header.nentries, sizeof(manifest_entry), tool_compare);
+	header.magic = MANIFEST_MAGIC;
+	header.version = MANIFEST_VERSION;
+	header.layout = MANIFEST_LAYOUT;
+	header.entries = sizeof(manifest_header);
+	header.rules = header.entries + header.nentries * sizeof(manifest_entry);
+	header.hops = header.rules + header.nrules * sizeof(manifest_rule);
+	header.strings = header.hops + header.nhops * sizeof(manifest_hop);
+	header.size = header.strings + header.nstrings * sizeof(wchar_t);
+
+	if(!(fp = _wfopen(sTemp, L"wb"))) fatal(errno, L"Could not write to %s", sTemp);
+	ok = fwrite(&header, sizeof(manifest_header), 1, fp) == 1 &&
+		(!header.nentries || fwrite(entries, sizeof(manifest_entry), header.nentries, fp) == header.nentries) &&
+		(!header.nrules || fwrite(rules, sizeof(manifest_rule), header.nrules, fp) == header.nrules) &&
+		(!header.nhops || fwrite(hops, sizeof(manifest_hop), header.nhops, fp) == header.nhops) &&
+		fwrite(strings, sizeof(wchar_t), header.nstrings, fp) == header.nstrings;
+	if(fclose(fp) != 0 || !ok) {
+		DeleteFileW(sTemp);
+		fatal(errno, L"Could not write to %s", sTemp);
+	}
+
+	// Windows won't replace a file that's still mapped.
+	manifest_close();
+	if(!MoveFileExW(sTemp, sPath, MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileW(sTemp);
+		fatal_api_call(L"MoveFileExW");
+	}
+	wprintf(L"Wrote %s (%d launcher(s), %d unchanged, %d linked, %d rule(s), %d bytes)\n",
+		sPath, (int)header.nentries, nreused, nlinked, (int)header.nrules, (int)header.size);
+}
+
+static int tool_main(int argc, wchar_t** argv)
+{
+	wchar_t sPattern[MAX_PATH+1] = EMPTYW, sPath[MAX_PATH+1] = EMPTYW, *sPATH;
+	WIN32_FIND_DATAW data;
+	HANDLE hFind;
+	int i;
+
+	for(i = 1; i < argc && argv[i][0] == L'-'; i++) {
+		if(wcscmp(argv[i], L"--sync") == 0) {
+			syncing = true;
+		} else if(wcscmp(argv[i], L"--launcher") == 0 && i + 1 < argc) {
+			tool_abspath(argv[++i], sLauncher);
+		} else {
+			break;
+		}
+	}
+	if(i >= argc || argv[i][0] == L'-') {
+		wprintf(L"Usage: cyglaunch-manifest [--sync] [--launcher FILE] <venv\\Scripts folder> [NAME=spath|lpath|vroot|unset,.. ..]\n");
+		return 1;
+	}
+	tool_abspath(argv[i++], sScripts);
+	if(!is_folder(sScripts)) fatal(ERROR_PATH_NOT_FOUND, L"Did not find an existing folder at %s", sScripts);
+	if(!*sLauncher) tool_join(sLauncher, sScripts, L"python.exe");
+
+	// Offset 0 is always the empty string.
+	header.nstrings = 1;
+	strings[0] = L'\0';
+
+	if(syncing) {
+		tool_join(sPath, sScripts, MANIFEST_FILENAME);
+		reusable = manifest_map(sPath);
+	}
+
+	sPATH = walloc(MAX_ENV);
+	tool_shared(sPATH);
+	#ifndef WITHOUT_ENVVARS
+	tool_rules(argc - i, &(argv[i]));
+	#else
+	if(i < argc) fatal(1, L"Built without environment variable support, so there are no rules to add to.");
+	#endif
+	if(syncing) tool_sync_links();
+
+	tool_join(sPattern, sScripts, L"*.exe");
+	if((hFind = FindFirstFileW(sPattern, &data)) == INVALID_HANDLE_VALUE) {
+		fatal(ERROR_FILE_NOT_FOUND, L"No launchers in %s", sScripts);
+	}
+	do {
+		if(!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) tool_entry(data.cFileName);
+	} while(FindNextFileW(hFind, &data));
+	FindClose(hFind);
+	if(!header.nentries) fatal(ERROR_FILE_NOT_FOUND, L"None of the launchers in %s have anything in bin\\ to launch.", sScripts);
+
+	tool_write();
+	return 0;
+}
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	return tool_main(argc, argv);
+}
+#else
+int main(int argc, char* argv[])
+{
+	wchar_t** wargv = (wchar_t**)calloc((size_t)argc + 1, sizeof(wchar_t*));
+	size_t szarg;
+	int i;
+
+	// Our arguments are taken to be UTF-8, whatever the locale says.
+	for(i = 0; wargv && i < argc; i++) {
+		szarg = strlen(argv[i]) + 1;
+		if(!(wargv[i] = (wchar_t*)calloc(szarg, sizeof(wchar_t))) ||
+			utf8_decode(argv[i], szarg, wargv[i], szarg) == UTF_INVALID) {
+			fatal(EILSEQ, L"Could not convert argument %d", i);
+		}
+	}
+	if(!wargv) fatal(ENOMEM, L"Out of memory");
+	return tool_main(argc, wargv);
+}
+#endif
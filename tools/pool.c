@@ -0,0 +1,127 @@
+/**
+ * pool.c - cyglaunch-pool. Keeps a few of a virtualenv's interpreters
+ *          started and waiting, for launchers with CYGLAUNCH_POOL set to
+ *          hand their launches to. (See src\pool.c)
+ *
+ *   cyglaunch-pool [--size N] [--idle SECONDS] [--scope venv|env] [--launcher FILE] C:\path\to\venv\Scripts
+ *
+ * Interpreters are started through the launcher, (Scripts\python.exe, or
+ * FILE) the same way any other launch would be, so they get the same PATH
+ * and environment fix-ups. N of them (4 by default) are kept waiting, and
+ * each one that takes a launch is replaced as it does. Once there've been
+ * no launches for SECONDS, (600 by default) and nothing's running, the
+ * pool shuts down, and its waiting interpreters with it. (As it does on
+ * Ctrl+C)
+ *
+ * Start it in the background (start /b, or &) from the same environment
+ * the launches will come from. With --scope env, it serves launchers with
+ * CYGLAUNCH_POOL=env and the same PYTHON* variables as it has, and with
+ * --scope venv, (the default) launchers with CYGLAUNCH_POOL=venv (or 1)
+ * and anything in them. One pool can run per virtualenv and scope.
+ */
+
+#define LAUNCHER_LIBRARY
+#define POOL_BROKER
+// Nothing we do is worth remembering.
+#define WITHOUT_CACHE
+#include "../src/main.c"
+
+#ifdef WITHOUT_POOL
+#	error cyglaunch-pool needs pool.c. Build it without WITHOUT_POOL.
+#endif
+
+#ifdef _WIN32
+#	define TOOL_SEP			L'\\'
+#	define TOOL_LAUNCHER	L"python.exe"
+#else
+#	include <errno.h>
+#	include <limits.h>
+#	define TOOL_SEP			L'/'
+#	define TOOL_LAUNCHER	L"python"
+#endif
+
+/** Our paths have to be absolute, since that's how launchers see them. */
+static void tool_abspath(const wchar_t* path, wchar_t* out)
+{
+	size_t szout;
+	#ifdef _WIN32
+	dword dwFull = GetFullPathNameW(path, MAX_PATH+1, out, NULL);
+	if(!dwFull || dwFull > MAX_PATH) fatal(ERROR_FILENAME_EXCED_RANGE, L"Could not find %s", path);
+	#else
+	char *narrow = os_narrow(path), sResolved[PATH_MAX];
+	if(!realpath(narrow, sResolved) || utf8_decode(sResolved, strlen(sResolved) + 1, out, MAX_PATH+1) == UTF_INVALID) {
+		fatal(ENOENT, L"Could not find %s", path);
+	}
+	free(narrow);
+	#endif
+	for(szout = wcslen(out); szout > 3 && out[szout - 1] == TOOL_SEP; szout--) out[szout - 1] = L'\0';
+}
+
+static int tool_main(int argc, wchar_t** argv)
+{
+	wchar_t sScripts[MAX_PATH+1] = EMPTYW, sParentDir[MAX_PATH+1] = EMPTYW, sLauncher[MAX_PATH+1] = EMPTYW, *sep;
+	const wchar_t* scope = L"venv";
+	pool_settings settings;
+	int i;
+
+	settings.size = 4;
+	settings.idle = 600 * 1000;
+	settings.failures = 0;
+	for(i = 1; i + 1 < argc && argv[i][0] == L'-'; i++) {
+		if(wcscmp(argv[i], L"--size") == 0) {
+			settings.size = _wtoi(argv[++i]);
+		} else if(wcscmp(argv[i], L"--idle") == 0) {
+			settings.idle = (dword)_wtoi(argv[++i]) * 1000;
+		} else if(wcscmp(argv[i], L"--scope") == 0) {
+			scope = argv[++i];
+		} else if(wcscmp(argv[i], L"--launcher") == 0) {
+			tool_abspath(argv[++i], sLauncher);
+		} else {
+			break;
+		}
+	}
+	if(i + 1 != argc || argv[i][0] == L'-' || settings.size < 1 || settings.size > POOL_MAX_SIZE || !settings.idle ||
+		(wcscmp(scope, L"venv") != 0 && wcscmp(scope, L"env") != 0)) {
+		wprintf(L"Usage: cyglaunch-pool [--size 1-%d] [--idle SECONDS] [--scope venv|env] [--launcher FILE] <venv\\Scripts folder>\n", POOL_MAX_SIZE);
+		return 1;
+	}
+	tool_abspath(argv[i], sScripts);
+	if(!is_folder(sScripts)) fatal(ERROR_PATH_NOT_FOUND, L"Did not find an existing folder at %s", sScripts);
+	if(!*sLauncher && FAILED(StringCchPrintfW(sLauncher, MAX_PATH+1, L"%s%c%s", sScripts, TOOL_SEP, TOOL_LAUNCHER))) {
+		fatal(ERROR_FILENAME_EXCED_RANGE, L"Path too long: %s", sScripts);
+	}
+	if(!is_file(sLauncher)) fatal(ERROR_FILE_NOT_FOUND, L"Did not find a launcher at %s", sLauncher);
+
+	// Our pool's named the way our launchers name it, after our virtualenv's root.
+	wcscpy(sParentDir, sScripts);
+	if((sep = wcsrchr(sParentDir, TOOL_SEP)) && sep > sParentDir) *sep = L'\0';
+	if(!SetEnvironmentVariableW(L"CYGLAUNCH_POOL", scope)) fatal_api_call(L"SetEnvironmentVariableW");
+	pool_init(sParentDir);
+	settings.launcher = sLauncher;
+	return os_pool_serve(&settings);
+}
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	return tool_main(argc, argv);
+}
+#else
+int main(int argc, char* argv[])
+{
+	wchar_t** wargv = (wchar_t**)calloc((size_t)argc + 1, sizeof(wchar_t*));
+	size_t szarg;
+	int i;
+
+	// Our arguments are taken to be UTF-8, whatever the locale says.
+	for(i = 0; wargv && i < argc; i++) {
+		szarg = strlen(argv[i]) + 1;
+		if(!(wargv[i] = (wchar_t*)calloc(szarg, sizeof(wchar_t))) ||
+			utf8_decode(argv[i], szarg, wargv[i], szarg) == UTF_INVALID) {
+			fatal(EILSEQ, L"Could not convert argument %d", i);
+		}
+	}
+	if(!wargv) fatal(ENOMEM, L"Out of memory");
+	return tool_main(argc, wargv);
+}
+#endif
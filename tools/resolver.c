@@ -0,0 +1,87 @@
+/**
+ * resolver.c - cyglaunch-resolver. Keeps cygwin1.dll loaded and
+ *              initialized, and converts paths for launchers that'd
+ *              otherwise have to load it themselves. (See src\resolver.c)
+ *
+ *   cyglaunch-resolver [--idle SECONDS] [C:\path\to\cygwin]
+ *
+ * Serves launchers of the Cygwin install at the given root, (or the one
+ * they find in the registry) run by the same user. Once no launcher has
+ * been connected for SECONDS, it shuts down. By default, it runs until
+ * it's stopped. (With Ctrl+C, or when its user logs off)
+ *
+ * Start it in the background (start /b, or from a logon script) as the
+ * user whose launchers it's for. One resolver can run per user and
+ * Cygwin install.
+ */
+
+#define LAUNCHER_LIBRARY
+#define RESOLVER_SERVICE
+// Nothing we do is worth remembering.
+#define WITHOUT_CACHE
+#include "../src/main.c"
+
+#ifdef WITHOUT_RESOLVER
+#	error cyglaunch-resolver needs resolver.c. Build it as a 32-bit application, without WITHOUT_RESOLVER.
+#endif
+
+#ifndef _WIN32
+#	include <errno.h>
+#endif
+
+static int tool_main(int argc, wchar_t** argv)
+{
+	wchar_t sRoot[MAX_PATH+1] = EMPTYW, sPATH[MAX_ENV+1] = EMPTYW;
+	size_t szbin;
+	dword idle = 0;
+	int i;
+
+	for(i = 1; i + 1 < argc && wcscmp(argv[i], L"--idle") == 0; i += 2) idle = (dword)_wtoi(argv[i + 1]) * 1000;
+	if(i + 1 < argc || (i < argc && argv[i][0] == L'-')) {
+		wprintf(L"Usage: cyglaunch-resolver [--idle SECONDS] [<cygwin root folder>]\n");
+		return 1;
+	}
+	if(i < argc) {
+		if(FAILED(StringCchCopyW(sRoot, MAX_PATH+1, argv[i]))) fatal(ERROR_FILENAME_EXCED_RANGE, L"Path too long: %s", argv[i]);
+		if(!is_folder(sRoot)) fatal(ERROR_PATH_NOT_FOUND, L"Did not find an existing folder at %s", sRoot);
+	} else {
+		get_cygwin_root(sRoot, MAX_PATH+1);
+	}
+	cygRootWin = sRoot;
+	if(!resolver_init()) fatal(ERROR_PATH_NOT_FOUND, L"Could not work out a name for a resolver of %s", sRoot);
+
+	// cygwin1.dll lives in our root's bin folder, which is where it has to be loaded from.
+	if(FAILED(StringCchPrintfW(sPATH, MAX_ENV+1, L"%s\\bin;", sRoot))) fatal(ERROR_FILENAME_EXCED_RANGE, L"Path too long: %s", sRoot);
+	szbin = wcslen(sPATH);
+	GetEnvironmentVariableW(L"PATH", &(sPATH[szbin]), (dword)(MAX_ENV+1 - szbin));
+	if(!SetEnvironmentVariableW(L"PATH", sPATH)) fatal_api_call(L"SetEnvironmentVariableW");
+	if(!setup_cygwin()) fatal(ERROR_FILE_NOT_FOUND, L"Could not load %s from %s\\bin", CYGWIN_DLL, sRoot);
+	// Nothing we've allocated so far is needed again, and our requests start from an empty arena.
+	arena_release();
+	return os_resolver_serve(idle);
+}
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	return tool_main(argc, argv);
+}
+#else
+int main(int argc, char* argv[])
+{
+	wchar_t** wargv = (wchar_t**)calloc((size_t)argc + 1, sizeof(wchar_t*));
+	size_t szarg;
+	int i;
+
+	// Our arguments are taken to be UTF-8, whatever the locale says.
+	for(i = 0; wargv && i < argc; i++) {
+		szarg = strlen(argv[i]) + 1;
+		if(!(wargv[i] = (wchar_t*)calloc(szarg, sizeof(wchar_t))) ||
+			utf8_decode(argv[i], szarg, wargv[i], szarg) == UTF_INVALID) {
+			fatal(EILSEQ, L"Could not convert argument %d", i);
+		}
+	}
+	if(!wargv) fatal(ENOMEM, L"Out of memory");
+	return tool_main(argc, wargv);
+}
+#endif